@@ -53,7 +53,7 @@ bool AnyHit(Ray r, float maxDist)
 			continue;
 		}
 
-		ivec2 index = ivec2(n >> 12, n & 0x00000FFF);
+		ivec2 index = TexelCoord(n, nodeTexWidthLog2);
 		ivec3 LRLeaf = texelFetch(BVH, index, 0).xyz;
 
 		int leftIndex = int(LRLeaf.x);
@@ -64,12 +64,12 @@ bool AnyHit(Ray r, float maxDist)
 		{
 			for (int i = 0; i < rightIndex; i++) // Loop through indices
 			{
-				ivec2 index = ivec2((leftIndex + i) % vertIndicesSize, (leftIndex + i) / vertIndicesSize);
+				ivec2 index = TexelCoord(leftIndex + i, indicesTexWidthLog2);
 				ivec3 vert_indices = texelFetch(vertexIndicesTex, index, 0).xyz;
 
-				vec3 v0 = texelFetch(verticesTex, ivec2(vert_indices.x >> 12, vert_indices.x & 0x00000FFF), 0).xyz;
-				vec3 v1 = texelFetch(verticesTex, ivec2(vert_indices.y >> 12, vert_indices.y & 0x00000FFF), 0).xyz;
-				vec3 v2 = texelFetch(verticesTex, ivec2(vert_indices.z >> 12, vert_indices.z & 0x00000FFF), 0).xyz;
+				vec3 v0 = texelFetch(verticesTex, TexelCoord(vert_indices.x, triDataTexWidthLog2), 0).xyz;
+				vec3 v1 = texelFetch(verticesTex, TexelCoord(vert_indices.y, triDataTexWidthLog2), 0).xyz;
+				vec3 v2 = texelFetch(verticesTex, TexelCoord(vert_indices.z, triDataTexWidthLog2), 0).xyz;
 
 				vec3 e0 = v1 - v0;
 				vec3 e1 = v2 - v0;
@@ -111,8 +111,8 @@ bool AnyHit(Ray r, float maxDist)
 		}
 		else
 		{
-			ivec2 lc = ivec2(leftIndex >> 12, leftIndex & 0x00000FFF);
-			ivec2 rc = ivec2(rightIndex >> 12, rightIndex & 0x00000FFF);
+			ivec2 lc = TexelCoord(leftIndex, nodeTexWidthLog2);
+			ivec2 rc = TexelCoord(rightIndex, nodeTexWidthLog2);
 
 			leftHit = AABBIntersect(texelFetch(BBoxMin, lc, 0).xyz, texelFetch(BBoxMax, lc, 0).xyz, r_trans);
 			rightHit = AABBIntersect(texelFetch(BBoxMin, rc, 0).xyz, texelFetch(BBoxMax, rc, 0).xyz, r_trans);
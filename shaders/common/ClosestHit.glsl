@@ -104,7 +104,7 @@ float ClosestHit(Ray r, inout State state, inout LightSampleRec lightSampleRec)
 			continue;
 		}
 
-		ivec2 index = ivec2(n >> 12, n & 0x00000FFF);
+		ivec2 index = TexelCoord(n, nodeTexWidthLog2);
 		ivec3 LRLeaf = texelFetch(BVH, index, 0).xyz;
 
 		int leftIndex = int(LRLeaf.x);
@@ -115,12 +115,12 @@ float ClosestHit(Ray r, inout State state, inout LightSampleRec lightSampleRec)
 		{
 			for (int i = 0; i < rightIndex; i++) // Loop through indices
 			{
-				ivec2 index = ivec2((leftIndex + i) % vertIndicesSize, (leftIndex + i) / vertIndicesSize);
+				ivec2 index = TexelCoord(leftIndex + i, indicesTexWidthLog2);
 				ivec3 vert_indices = texelFetch(vertexIndicesTex, index, 0).xyz;
 
-				vec4 v0 = texelFetch(verticesTex, ivec2(vert_indices.x >> 12, vert_indices.x & 0x00000FFF), 0).xyzw;
-				vec4 v1 = texelFetch(verticesTex, ivec2(vert_indices.y >> 12, vert_indices.y & 0x00000FFF), 0).xyzw;
-				vec4 v2 = texelFetch(verticesTex, ivec2(vert_indices.z >> 12, vert_indices.z & 0x00000FFF), 0).xyzw;
+				vec4 v0 = texelFetch(verticesTex, TexelCoord(vert_indices.x, triDataTexWidthLog2), 0).xyzw;
+				vec4 v1 = texelFetch(verticesTex, TexelCoord(vert_indices.y, triDataTexWidthLog2), 0).xyzw;
+				vec4 v2 = texelFetch(verticesTex, TexelCoord(vert_indices.z, triDataTexWidthLog2), 0).xyzw;
 
 				vec3 e0 = v1.xyz - v0.xyz;
 				vec3 e1 = v2.xyz - v0.xyz;
@@ -172,8 +172,8 @@ float ClosestHit(Ray r, inout State state, inout LightSampleRec lightSampleRec)
 		}
 		else
 		{
-			ivec2 lc = ivec2(leftIndex >> 12, leftIndex & 0x00000FFF);
-			ivec2 rc = ivec2(rightIndex >> 12, rightIndex & 0x00000FFF);
+			ivec2 lc = TexelCoord(leftIndex, nodeTexWidthLog2);
+			ivec2 rc = TexelCoord(rightIndex, nodeTexWidthLog2);
 
 			leftHit = AABBIntersect(texelFetch(BBoxMin, lc, 0).xyz, texelFetch(BBoxMax, lc, 0).xyz, r_trans);
 			rightHit = AABBIntersect(texelFetch(BBoxMin, rc, 0).xyz, texelFetch(BBoxMax, rc, 0).xyz, r_trans);
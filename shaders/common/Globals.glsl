@@ -25,4 +25,12 @@ float rand()
 {
 	seed -= vec2(randomVector.x * randomVector.y);
 	return fract(sin(dot(seed, vec2(12.9898, 78.233))) * 43758.5453);
+}
+
+//-----------------------------------------------------------------------
+ivec2 TexelCoord(int index, int widthLog2)
+//-----------------------------------------------------------------------
+{
+	// Data textures store element index row by row with a power of two width
+	return ivec2(index & ((1 << widthLog2) - 1), index >> widthLog2);
 }
\ No newline at end of file
@@ -22,9 +22,9 @@
 void GetNormalsAndTexCoord(inout State state, inout Ray r)
 //-----------------------------------------------------------------------
 {
-	vec4 n1 = texelFetch(normalsTex, ivec2(state.triID.x >> 12, state.triID.x & 0x00000FFF), 0).xyzw;
-	vec4 n2 = texelFetch(normalsTex, ivec2(state.triID.y >> 12, state.triID.y & 0x00000FFF), 0).xyzw;
-	vec4 n3 = texelFetch(normalsTex, ivec2(state.triID.z >> 12, state.triID.z & 0x00000FFF), 0).xyzw;
+	vec4 n1 = texelFetch(normalsTex, TexelCoord(state.triID.x, triDataTexWidthLog2), 0).xyzw;
+	vec4 n2 = texelFetch(normalsTex, TexelCoord(state.triID.y, triDataTexWidthLog2), 0).xyzw;
+	vec4 n3 = texelFetch(normalsTex, TexelCoord(state.triID.z, triDataTexWidthLog2), 0).xyzw;
 
 	vec2 t1 = vec2(tempTexCoords.x, n1.w);
 	vec2 t2 = vec2(tempTexCoords.y, n2.w);
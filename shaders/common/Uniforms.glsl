@@ -29,4 +29,6 @@ uniform float hdrMultiplier;
 uniform int numOfLights;
 uniform int maxDepth;
 uniform int topBVHIndex;
-uniform int vertIndicesSize;
\ No newline at end of file
+uniform int nodeTexWidthLog2;
+uniform int indicesTexWidthLog2;
+uniform int triDataTexWidthLog2;
\ No newline at end of file
@@ -1,6 +1,8 @@
 #include <time.h>
 #include <math.h>
 #include <string>
+#include <chrono>
+#include <algorithm>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
@@ -13,6 +15,7 @@
 #include "core/Scene.h"
 #include "core/Renderer.h"
 #include "core/TiledRenderer.h"
+#include "core/CpuRenderer.h"
 
 #include "parser/SceneLoader.h"
 #include "parser/GLBLoader.h"
@@ -42,28 +45,33 @@ std::vector<std::string> sceneNames;
 std::vector<std::string> envFiles;
 std::vector<std::string> envNames;
 
-void LoadScene(const std::string& file)
+// Replaces the current scene, which is kept when file cannot be loaded
+bool LoadScene(const std::string& file)
 {
-	if (scene) 
-	{
-		delete scene;
-		scene = nullptr;
-	}
-	scene = new Scene();
-	
 	std::string ext = file.substr(file.find_last_of(".") + 1);
-
-	bool useGLB = false;
-	if (ext == "glb")
+	if (ext != "glb" && ext != "scene")
 	{
-		useGLB = true;
-		LoadSceneFromGLTF(file.c_str(), scene);
+		printf("Unsupported scene file %s, expected .scene or .glb\n", file.c_str());
+		return false;
 	}
-	else if (ext == "scene")
+
+	// GLB files carry no options, they build their BVHs with the current ones
+	Scene* loadedScene = new Scene();
+	loadedScene->renderOptions = renderOptions;
+	RenderOptions loadedOptions = renderOptions;
+
+	bool useGLB = ext == "glb";
+	bool loaded = useGLB ? LoadSceneFromGLTF(file.c_str(), loadedScene) : LoadSceneFromFile(file.c_str(), loadedScene, loadedOptions);
+	if (!loaded)
 	{
-		LoadSceneFromFile(file.c_str(), scene, renderOptions);
+		delete loadedScene;
+		return false;
 	}
 
+	delete scene;
+	scene = loadedScene;
+	renderOptions = loadedOptions;
+
 	if (scene->hdrData == nullptr)
 	{
 		scene->AddHDR(assetsDir + "HDR/vignaioli_night_1k.hdr");
@@ -81,6 +89,8 @@ void LoadScene(const std::string& file)
 	}
 
 	scene->renderOptions = renderOptions;
+
+	return true;
 }
 
 bool InitRenderer()
@@ -92,9 +102,8 @@ bool InitRenderer()
 	}
     
     renderer = new TiledRenderer(scene, shaderDir);
-    renderer->Init();
     
-    return true;
+    return renderer->Init();
 }
 
 void Render(float deltaTime)
@@ -220,11 +229,12 @@ void OnGUI(float deltaTime)
 	for (int i = 0; i < sceneNames.size(); ++i) {
 		sceneItems.push_back(sceneNames[i].c_str());
 	}
-	if (ImGui::Combo("Scene", &sampleSceneIndex, sceneItems.data(), sceneItems.size()))
+	if (ImGui::Combo("Scene", &sampleSceneIndex, sceneItems.data(), sceneItems.size()) && LoadScene(sceneFiles[sampleSceneIndex]))
 	{
-		LoadScene(sceneFiles[sampleSceneIndex]);
 		glfwSetWindowSize(glfwWindow, scene->renderOptions.windowSize.x, scene->renderOptions.windowSize.y);
-		InitRenderer();
+		if (!InitRenderer()) {
+			glfwSetWindowShouldClose(glfwWindow, GLFW_TRUE);
+		}
 	}
 
 	std::vector<const char*> envItems;
@@ -269,6 +279,7 @@ void OnGUI(float deltaTime)
 	if (ImGui::CollapsingHeader("Objects"))
 	{
 		bool objectPropChanged = false;
+		bool transformChanged  = false;
 
 		std::vector<std::string> listboxItems;
 		for (int i = 0; i < scene->meshInstances.size(); i++) 
@@ -318,14 +329,22 @@ void OnGUI(float deltaTime)
 			if (memcmp(&trans, &scene->meshInstances[selectedInstance].transform, sizeof(float) * 16))
 			{
 				scene->meshInstances[selectedInstance].transform = trans;
-				objectPropChanged = true;
+				transformChanged = true;
 			}
 		}
 
-		if (objectPropChanged) 
+		if (transformChanged)
 		{
-			scene->RebuildInstancesData();
+			scene->UpdateInstances(std::vector<int>(1, selectedInstance));
 		}
+		else if (objectPropChanged)
+		{
+			// Material edits leave the top level BVH as it is, they only need the upload
+			scene->instancesModified = true;
+		}
+
+		const TLASUpdateStats& stats = scene->tlasUpdateStats;
+		ImGui::Text("TLAS update: %.3f ms, %d nodes, %d rotations, SAH x%.2f%s", stats.milliseconds, stats.numDirtyNodes, stats.numRotations, stats.sahRatio, stats.rebuilt ? ", rebuilt" : "");
 	}
 
 	ImGui::End();
@@ -367,6 +386,46 @@ void Usage()
 	printf("Main options:\n");
 	printf("  -h | -?               show help.\n");
 	printf("  -i <input>            input file name.\n");
+	printf("  -o <output>           render on the CPU without a window and write a png.\n");
+	printf("  -spp <samples>        samples per pixel of -o, 64 by default.\n");
+	printf("  -wavefront            trace -o one bounce of all paths at a time with sorted rays.\n");
+	printf("  -compressed           lay the BVHs out as quantized 4-wide nodes, needs -o.\n");
+}
+
+// Renders the scene with the CPU renderer without creating a window or GL context
+int RenderHeadless(const std::string& output, int samples, bool wavefront)
+{
+	CpuRenderer* cpuRenderer = new CpuRenderer(scene);
+	cpuRenderer->SetIntegrator(wavefront ? CpuRenderer::kWavefront : CpuRenderer::kPerPixel);
+
+	renderer = cpuRenderer;
+	if (!renderer->Init())
+	{
+		delete renderer;
+		delete scene;
+		return 1;
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < samples; ++i)
+	{
+		scene->Update(0.0f);
+		renderer->Update(0.0f);
+		renderer->Render();
+
+		printf("\rSample %d/%d", renderer->GetSampleCount(), samples);
+		fflush(stdout);
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	printf("\nRendered %d samples in %.2f s, %.2f Mrays/s\n", samples, seconds, cpuRenderer->GetRayCount() / seconds * 1e-6);
+
+	bool saved = cpuRenderer->SaveImage(output);
+
+	delete renderer;
+	delete scene;
+
+	return saved ? 0 : 1;
 }
 
 bool InitOpenGLResources()
@@ -448,9 +507,8 @@ bool Cleanup()
 bool InitScene()
 {
 	sampleSceneIndex = 0;
-	LoadScene(sceneFiles[sampleSceneIndex]);
 
-	return true;
+	return !sceneFiles.empty() && LoadScene(sceneFiles[sampleSceneIndex]);
 }
 
 void GetDirFiles(const std::string& path, std::vector<std::string>& files)
@@ -519,13 +577,55 @@ int main(int argc, char** argv)
 	shaderDir = dirPath + "shaders/";
 	hdrResDir = assetsDir + "HDR/";
 
+	std::string inputFile;
+	std::string outputFile;
+	int samples = 64;
+	bool wavefront = false;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "-h" || arg == "-?")
+		{
+			Usage();
+			return 0;
+		}
+		else if (arg == "-i" && i + 1 < argc) {
+			inputFile = argv[++i];
+		}
+		else if (arg == "-o" && i + 1 < argc) {
+			outputFile = argv[++i];
+		}
+		else if (arg == "-spp" && i + 1 < argc) {
+			samples = std::max(atoi(argv[++i]), 1);
+		}
+		else if (arg == "-wavefront") {
+			wavefront = true;
+		}
+		else if (arg == "-compressed") {
+			renderOptions.compressedBvh = true;
+		}
+	}
+
 	if (!InitSceneFiles()) {
 		return 1;
 	}
 
-	if (!InitScene()) {
+	if (!inputFile.empty())
+	{
+		if (!LoadScene(inputFile))
+		{
+			printf("Error: Could not load %s\n", inputFile.c_str());
+			return 1;
+		}
+	}
+	else if (!InitScene()) {
 		return 1;
 	}
+
+	if (!outputFile.empty()) {
+		return RenderHeadless(outputFile, samples, wavefront);
+	}
     
 	if (!InitOpenGLResources()) {
 		return 1;
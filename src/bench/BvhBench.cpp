@@ -0,0 +1,2372 @@
+/*
+	BVH build benchmarks, run from the repo root:
+
+	BvhBench build [-threads N] [-replicate K] file.obj ...
+		Builds a SAH Bvh over all triangles with 1..N threads and prints the speedup curve,
+		checking that the node arena and the primitive indices match the serial build.
+		-replicate tiles the input K times to reach production sized meshes.
+
+	BvhBench binning [-repeats R] file.obj ...
+		Times SAH binning + split search of the legacy per-axis scalar code against
+		the SahHistogram kernel at 64 bins, per mesh, on node sized ranges.
+
+	BvhBench builders [-threads N] [-replicate K] [-repeats R] [-leafsize L] [-isectcost C] file.obj ...
+		Builds the same triangles with every builder on an N thread pool and prints
+		build time, SAH cost, tree height, nodes and references, checking that each tree references every
+		triangle once (at least once for the spatial split "sbvh").
+		-leafsize and -isectcost set the maximum primitives per leaf and the intersection cost.
+
+	BvhBench treelets [-threads N] [-replicate K] [-leafsize L] [-isectcost C] [-treelet T] file.obj ...
+		Builds with every builder, then runs the treelet optimizer with treelets of T leaves
+		(default 7) and prints the SAH cost before and after with the optimizer runtime.
+
+	BvhBench wide [-leafsize L] [-isectcost C] [-rays R] file.obj ...
+		Collapses a SAH Bvh into 4 and 8 wide nodes and the 8 bit quantized bvh4q, prints nodes,
+		memory against the binary layout of BvhTranslator, lane occupancy and SAH cost, then
+		traces R closest hit rays through each layout on one thread.
+
+	BvhBench tlas [-instances N] [-rays R] file.obj ...
+		Scatters N instances of the meshes with random rotations and log uniform scales, so
+		a few large instances overlap many small ones, then traces R random closest hit rays
+		through the median split TLAS, the SAH TLAS and the SAH TLAS over re-braided instances.
+		Prints TLAS and BLAS node visits, BLAS entries and triangle tests per ray.
+
+	BvhBench esc [-threads N] [-replicate K] [-repeats R] [-leafsize L] [-isectcost C] [-rays R] [-rotate D] file.obj ...
+		Compares the early split clipping builder, by edge length, by volume ratio and by volume
+		without triangle clipping, against the SAH and the spatial split builder: build time, SAH
+		cost, references, split triangles, and node visits, triangle tests and rays per second of
+		R random closest hit rays. -rotate turns the meshes D degrees about y so axis aligned
+		walls and floors become diagonal.
+
+	BvhBench layout [-replicate K] [-repeats R] [-leafsize L] [-isectcost C] [-rays R] file.obj ...
+		Reorders the nodes of a SAH Bvh into every Bvh::NodeLayout and traces R coherent primary
+		and R random closest hit rays through each on one thread. Prints cache lines read, misses
+		of a simulated 32 KB L1 and 1 MB L2 cache per ray, and rays per second.
+
+	BvhBench flatten [-threads N] [-meshes M] [-repeats R] [-leafsize L] file.obj ...
+		Cycles the meshes through a scene of M meshes (default 400), one instance each, and
+		times BvhTranslator::Process on 1, 2, 4 .. N threads, checking that the output is
+		identical to the single threaded one.
+
+	BvhBench scale [-tris T] [-leafsize L] [-threads N]
+		Flattens a synthetic scene of T triangles (default 52M) in 4M triangle meshes through
+		BvhTranslator, prints the data texture sizes and walks the result with the shader
+		addressing, checking that every node and triangle reference is reached exactly once.
+
+	BvhBench ooc [-tris T] [-bucket B] [-scratch dir] [-leafsize L] [-threads N] [file.obj ...]
+		Streams T synthetic triangles (or the files) to a raw triangle file in the scratch
+		directory (default ooc-scratch) and builds OutOfCoreBvh from it with buckets of at most
+		B triangles (default 4M). Prints buckets, refinements, bytes written, times and peak
+		resident memory. Up to 16M triangles the tree is validated and its SAH cost compared
+		against the in memory SAH build.
+
+	BvhBench packets [-repeats R] [-fallback F] file.scene
+		Traces the pinhole camera rays of the scene at its resolution, then shadow rays from their
+		hits towards points on the lights, through the flattened scene BVH on one thread. Single
+		rays are timed against BvhTraverser packets of 4 (2x2 pixels), 8 (4x2) and 16 (4x4), which
+		trace the rest of a subtree one ray at a time once F or fewer lanes are active. The shadow
+		rays are also traced as one OcclusionBatch. Then single rays and packets of 8 are timed
+		again against the leaf ordered triangle blocks of Scene::CreateTriangleBlocks, next to the
+		memory of both triangle layouts, the blocks with the padding of partly filled leaves and
+		the first block of every leaf. Finally the scene is loaded again with the compressed BVH
+		of CompressedBvhTranslator, whose memory is printed next to that of the binary nodes, and
+		single rays and packets of 8 are timed through it. Prints Mrays/s and checks every packet,
+		batch, block and compressed result against the single ray one.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <limits>
+#include <random>
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+#include "core/Mesh.h"
+#include "bvh/Bvh.h"
+#include "bvh/SplitBvh.h"
+#include "bvh/EarlySplitBvh.h"
+#include "bvh/LinearBvh.h"
+#include "bvh/PlocBvh.h"
+#include "bvh/SahBinning.h"
+#include "bvh/Rebraid.h"
+#include "bvh/WideBvh.h"
+#include "bvh/CompressedBvh.h"
+#include "bvh/BvhTranslator.h"
+#include "bvh/CompressedBvhTranslator.h"
+#include "bvh/OutOfCoreBvh.h"
+#include "bvh/MappedFile.h"
+#include "core/Scene.h"
+#include "core/BvhTraverser.h"
+#include "parser/SceneLoader.h"
+#include "job/TaskThreadPool.h"
+
+using namespace GLSLPT;
+
+struct BenchOptions
+{
+	int numThreads = std::max((int)std::thread::hardware_concurrency(), 1);
+	int replicate  = 1;
+	int repeats    = 3;
+	int leafSize   = 1;
+	float intersectionCost = 1.0f;
+	int numInstances = 10000;
+	int numRays = 200000;
+	int treeletSize = 7;
+	long long numTriangles = 52000000;
+	float rotation = 0.0f;
+	int numMeshes = 400;
+	int bucketTriangles = 1 << 22;
+	int fallbackLanes = -1;
+	std::string scratchDirectory = "ooc-scratch";
+	std::vector<std::string> files;
+};
+
+static double Seconds(std::chrono::high_resolution_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// Three vertices per triangle of all files, rotated options.rotation degrees about y
+// and tiled options.replicate times along x
+static bool LoadTriangles(const BenchOptions& options, std::vector<Vector3>& vertices)
+{
+	std::vector<Vector3> tris;
+	Bounds3D total;
+	float cosAngle = cosf(options.rotation * 3.14159265f / 180.0f);
+	float sinAngle = sinf(options.rotation * 3.14159265f / 180.0f);
+
+	for (int i = 0; i < options.files.size(); ++i)
+	{
+		Mesh mesh;
+		if (!mesh.LoadFromFile(options.files[i])) {
+			return false;
+		}
+
+		for (int v = 0; v < mesh.verticesUVX.size() / 3 * 3; ++v)
+		{
+			// Rotated about y
+			Vector3 p(mesh.verticesUVX[v]);
+			tris.push_back(Vector3(p.x * cosAngle + p.z * sinAngle, p.y, p.z * cosAngle - p.x * sinAngle));
+			total.Expand(tris.back());
+		}
+	}
+
+	// Tile copies side by side along x
+	Vector3 offset(total.Extents().x * 1.05f, 0.0f, 0.0f);
+	vertices.reserve(tris.size() * options.replicate);
+	for (int k = 0; k < options.replicate; ++k)
+	{
+		for (int v = 0; v < tris.size(); ++v) {
+			vertices.push_back(tris[v] + offset * (float)k);
+		}
+	}
+
+	printf("%d triangles\n", (int)vertices.size() / 3);
+
+	return vertices.size() > 0;
+}
+
+static bool LoadTriangleBounds(const BenchOptions& options, std::vector<Bounds3D>& bounds)
+{
+	std::vector<Vector3> vertices;
+	if (!LoadTriangles(options, vertices)) {
+		return false;
+	}
+
+	bounds.resize(vertices.size() / 3);
+	for (int t = 0; t < bounds.size(); ++t)
+	{
+		bounds[t].Expand(vertices[t * 3 + 0]);
+		bounds[t].Expand(vertices[t * 3 + 1]);
+		bounds[t].Expand(vertices[t * 3 + 2]);
+	}
+
+	return true;
+}
+
+// Same arena order, links, leaf ranges and bounds
+static bool SameNodes(const std::vector<RadeonRays::Bvh::Node>& a, const std::vector<RadeonRays::Bvh::Node>& b)
+{
+	if (a.size() != b.size()) {
+		return false;
+	}
+
+	for (size_t i = 0; i < a.size(); ++i)
+	{
+		// lc and rc share their storage with startidx and numprims
+		if (a[i].type != b[i].type || a[i].index != b[i].index || a[i].lc != b[i].lc || a[i].rc != b[i].rc ||
+			!(a[i].bounds.min == b[i].bounds.min) || !(a[i].bounds.max == b[i].bounds.max)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static int BenchBuild(const BenchOptions& options)
+{
+	std::vector<Bounds3D> bounds;
+	if (!LoadTriangleBounds(options, bounds)) {
+		return 1;
+	}
+
+	std::vector<int> reference;
+	std::vector<RadeonRays::Bvh::Node> referenceNodes;
+	double serialTime = 0.0;
+
+	printf("%8s %10s %8s %10s\n", "threads", "time(ms)", "speedup", "identical");
+
+	for (int numThreads = 1; numThreads <= options.numThreads; numThreads = numThreads < options.numThreads ? std::min(numThreads * 2, options.numThreads) : numThreads + 1)
+	{
+		// One thread means building on the calling thread without a pool
+		TaskThreadPool* pool = nullptr;
+		if (numThreads > 1)
+		{
+			pool = new TaskThreadPool();
+			pool->Create(numThreads);
+		}
+
+		double best = 1e30;
+		bool identical = true;
+
+		for (int r = 0; r < options.repeats; ++r)
+		{
+			RadeonRays::Bvh bvh(2.0f, 64, true);
+			bvh.SetTaskPool(pool);
+
+			auto start = std::chrono::high_resolution_clock::now();
+			bvh.Build(&bounds[0], (int)bounds.size());
+			best = std::min(best, Seconds(start));
+
+			std::vector<int> indices(bvh.GetIndices(), bvh.GetIndices() + bvh.GetNumIndices());
+			std::vector<RadeonRays::Bvh::Node> nodes(bvh.GetNodes(), bvh.GetNodes() + bvh.GetNumNodes());
+			if (reference.empty())
+			{
+				reference      = indices;
+				referenceNodes = nodes;
+			}
+			identical &= indices == reference && SameNodes(nodes, referenceNodes);
+		}
+
+		if (numThreads == 1) {
+			serialTime = best;
+		}
+
+		printf("%8d %10.2f %8.2f %10s\n", numThreads, best * 1000.0, serialTime / best, identical ? "yes" : "NO");
+
+		delete pool;
+	}
+
+	return 0;
+}
+
+// Pre kernel FindSahSplit: three std::vector<Bin> per node and scalar Bounds3D::Expand per axis
+static bool LegacyFindSahSplit(int numBins, float traversalCost, const Bounds3D& nodeBounds, const Bounds3D& centroidBounds, int startidx, int numprims, 
+							   const Bounds3D* bounds, const Vector3* centroids, const int* primindices, int& bestDim, int& bestBin)
+{
+	struct Bin
+	{
+		Bounds3D bounds;
+		int count;
+	};
+
+	int splitidx = -1;
+	float sah = std::numeric_limits<float>::max();
+	Vector3 centroidExtents = centroidBounds.Extents();
+
+	std::vector<Bin> bins[3];
+	bins[0].resize(numBins);
+	bins[1].resize(numBins);
+	bins[2].resize(numBins);
+
+	float invarea = 1.f / nodeBounds.Area();
+	Vector3 rootmin = centroidBounds.min;
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float rootminc = rootmin[axis];
+		float centroidRNG = centroidExtents[axis];
+		float invcentroidRNG = 1.f / centroidRNG;
+
+		if (centroidRNG == 0.f) {
+			continue;
+		}
+
+		for (int i = 0; i < numBins; ++i)
+		{
+			bins[axis][i].count = 0;
+			bins[axis][i].bounds = Bounds3D();
+		}
+
+		for (int i = startidx; i < startidx + numprims; ++i)
+		{
+			int idx = primindices[i];
+			int binidx = (int)std::min<float>(static_cast<float>(numBins) * ((centroids[idx][axis] - rootminc) * invcentroidRNG), static_cast<float>(numBins - 1));
+
+			++bins[axis][binidx].count;
+			bins[axis][binidx].bounds.Expand(bounds[idx]);
+		}
+
+		std::vector<Bounds3D> rightbounds(numBins - 1);
+
+		Bounds3D rightbox;
+		for (int i = numBins - 1; i > 0; --i)
+		{
+			rightbox.Expand(bins[axis][i].bounds);
+			rightbounds[i - 1] = rightbox;
+		}
+
+		Bounds3D leftbox;
+		int leftcount = 0;
+		int rightcount = numprims;
+
+		for (int i = 0; i < numBins - 1; ++i)
+		{
+			leftbox.Expand(bins[axis][i].bounds);
+			leftcount  += bins[axis][i].count;
+			rightcount -= bins[axis][i].count;
+
+			float sahtmp = traversalCost + (leftcount * leftbox.Area() + rightcount * rightbounds[i].Area()) * invarea;
+			if (sahtmp < sah)
+			{
+				bestDim = axis;
+				splitidx = i;
+				sah = sahtmp;
+			}
+		}
+	}
+
+	bestBin = splitidx;
+	return splitidx != -1;
+}
+
+static int BenchBinning(const BenchOptions& options)
+{
+	const int kNumBins = 64;
+	const int kRangeSizes[] = { 0, 4096, 256, 16 };
+
+	printf("%-32s %8s %14s %14s %8s %6s\n", "mesh", "range", "legacy(ns/p)", "kernel(ns/p)", "speedup", "same");
+
+	for (int f = 0; f < options.files.size(); ++f)
+	{
+		BenchOptions single = options;
+		single.files.assign(1, options.files[f]);
+
+		std::vector<Bounds3D> bounds;
+		if (!LoadTriangleBounds(single, bounds)) {
+			return 1;
+		}
+
+		int numprims = (int)bounds.size();
+
+		std::vector<Vector3> centroids(numprims);
+		for (int i = 0; i < numprims; ++i) {
+			centroids[i] = bounds[i].Center();
+		}
+
+		RadeonRays::BinningPrimitives prims;
+		prims.Init(&bounds[0], numprims);
+
+		// Use the leaf order of a built tree so that ranges look like real nodes
+		RadeonRays::Bvh bvh(2.0f, kNumBins, true);
+		bvh.Build(&bounds[0], numprims);
+		std::vector<int> primindices(bvh.GetIndices(), bvh.GetIndices() + bvh.GetNumIndices());
+
+		for (int r = 0; r < sizeof(kRangeSizes) / sizeof(kRangeSizes[0]); ++r)
+		{
+			int rangeSize = kRangeSizes[r] == 0 ? numprims : std::min(kRangeSizes[r], numprims);
+
+			struct Range
+			{
+				int start;
+				int count;
+				Bounds3D bounds;
+				Bounds3D centroidBounds;
+			};
+
+			std::vector<Range> ranges;
+			for (int start = 0; start + rangeSize <= numprims; start += rangeSize)
+			{
+				Range range = { start, rangeSize, Bounds3D(), Bounds3D() };
+				for (int i = start; i < start + rangeSize; ++i)
+				{
+					range.bounds.Expand(bounds[primindices[i]]);
+					range.centroidBounds.Expand(centroids[primindices[i]]);
+				}
+				ranges.push_back(range);
+			}
+
+			double legacyTime = 1e30;
+			double kernelTime = 1e30;
+			bool same = true;
+
+			for (int repeat = 0; repeat < options.repeats; ++repeat)
+			{
+				std::vector<int> legacyResult(ranges.size() * 2, -1);
+				std::vector<int> kernelResult(ranges.size() * 2, -1);
+
+				auto start = std::chrono::high_resolution_clock::now();
+				for (int i = 0; i < ranges.size(); ++i)
+				{
+					const Range& range = ranges[i];
+					LegacyFindSahSplit(kNumBins, 2.0f, range.bounds, range.centroidBounds, range.start, range.count, &bounds[0], &centroids[0], &primindices[0], legacyResult[i * 2], legacyResult[i * 2 + 1]);
+				}
+				legacyTime = std::min(legacyTime, Seconds(start));
+
+				start = std::chrono::high_resolution_clock::now();
+				for (int i = 0; i < ranges.size(); ++i)
+				{
+					const Range& range = ranges[i];
+					float sah = 0.f;
+
+					RadeonRays::SahHistogram& histogram = RadeonRays::SahHistogram::ThreadLocal();
+					histogram.Reset(kNumBins);
+					histogram.Bin(prims, &primindices[0], range.start, range.start + range.count, range.centroidBounds);
+					histogram.FindSplit(range.centroidBounds, 1.f / range.bounds.Area(), 2.0f, kernelResult[i * 2], kernelResult[i * 2 + 1], sah);
+				}
+				kernelTime = std::min(kernelTime, Seconds(start));
+
+				// Only the chosen bin matters when no split exists
+				for (int i = 0; i < ranges.size(); ++i) {
+					same &= legacyResult[i * 2 + 1] == kernelResult[i * 2 + 1] && (legacyResult[i * 2 + 1] == -1 || legacyResult[i * 2] == kernelResult[i * 2]);
+				}
+			}
+
+			double binned = (double)ranges.size() * rangeSize;
+			std::string name = options.files[f].substr(options.files[f].find_last_of("/\\") + 1);
+
+			printf("%-32s %8d %14.2f %14.2f %8.2f %6s\n", name.c_str(), rangeSize, legacyTime * 1e9 / binned, kernelTime * 1e9 / binned, legacyTime / kernelTime, same ? "yes" : "NO");
+		}
+	}
+
+	return 0;
+}
+
+// Exact containment, Bounds3D::Contains goes through center and radius and rounds
+static bool Encloses(const Bounds3D& outer, const Bounds3D& inner)
+{
+	return outer.min.x <= inner.min.x && outer.min.y <= inner.min.y && outer.min.z <= inner.min.z &&
+		   outer.max.x >= inner.max.x && outer.max.y >= inner.max.y && outer.max.z >= inner.max.z;
+}
+
+// Every primitive referenced once, every leaf inside its parents and every arena node used once.
+// Spatial splits clip references, then primitives only need to be referenced at least once.
+static bool ValidateTree(const RadeonRays::Bvh& bvh, const Bounds3D* bounds, int numbounds, bool spatialSplits)
+{
+	const int* indices = bvh.GetIndices();
+	std::vector<int> refs(numbounds, 0);
+	int numnodes = 0;
+	std::vector<std::pair<const RadeonRays::Bvh::Node*, Bounds3D>> stack;
+	stack.push_back(std::make_pair(bvh.GetRoot(), bvh.GetRoot()->bounds));
+
+	while (!stack.empty())
+	{
+		const RadeonRays::Bvh::Node* node = stack.back().first;
+		Bounds3D parent = stack.back().second;
+		stack.pop_back();
+		++numnodes;
+
+		if (!Encloses(parent, node->bounds)) {
+			return false;
+		}
+
+		if (node->type == RadeonRays::Bvh::kLeaf)
+		{
+			for (int i = 0; i < node->numprims; ++i)
+			{
+				int index = indices[node->startidx + i];
+				if (!spatialSplits && !Encloses(node->bounds, bounds[index])) {
+					return false;
+				}
+				refs[index] += 1;
+			}
+		}
+		else
+		{
+			stack.push_back(std::make_pair(&bvh.GetNodes()[node->lc], node->bounds));
+			stack.push_back(std::make_pair(&bvh.GetNodes()[node->rc], node->bounds));
+		}
+	}
+
+	for (int i = 0; i < numbounds; ++i)
+	{
+		if (refs[i] < 1 || (!spatialSplits && refs[i] != 1)) {
+			return false;
+		}
+	}
+
+	return numnodes == bvh.GetNumNodes();
+}
+
+// SAH cost of the tree relative to the root area, with the traversal cost
+// the mesh builders use and the given intersection cost per primitive
+static float SahCost(const RadeonRays::Bvh& bvh, float traversalCost, float intersectionCost)
+{
+	float cost = 0.0f;
+	float invRootArea = 1.0f / bvh.GetRoot()->bounds.Area();
+
+	std::vector<const RadeonRays::Bvh::Node*> stack;
+	stack.push_back(bvh.GetRoot());
+
+	while (!stack.empty())
+	{
+		const RadeonRays::Bvh::Node* node = stack.back();
+		stack.pop_back();
+
+		float area = node->bounds.Area() * invRootArea;
+
+		if (node->type == RadeonRays::Bvh::kLeaf) {
+			cost += area * intersectionCost * node->numprims;
+		}
+		else
+		{
+			cost += area * traversalCost;
+			stack.push_back(&bvh.GetNodes()[node->lc]);
+			stack.push_back(&bvh.GetNodes()[node->rc]);
+		}
+	}
+
+	return cost;
+}
+
+static const char* kBuilderNames[] = { "split", "sbvh", "sah", "lbvh", "ploc" };
+static const int kNumBuilders = sizeof(kBuilderNames) / sizeof(kBuilderNames[0]);
+
+static RadeonRays::Bvh* CreateBuilder(int builder)
+{
+	if (builder == 0) {
+		return new RadeonRays::SplitBvh(2.0f, 64, 0, 0.001f, 2.5f);
+	}
+	else if (builder == 1) {
+		return new RadeonRays::SplitBvh(2.0f, 64, 48, 0.00001f, 1.0f);
+	}
+	else if (builder == 2) {
+		return new RadeonRays::Bvh(2.0f, 64, true);
+	}
+	else if (builder == 3) {
+		return new RadeonRays::LinearBvh(2.0f);
+	}
+
+	return new RadeonRays::PlocBvh(2.0f);
+}
+
+static int BenchBuilders(const BenchOptions& options)
+{
+	std::vector<Bounds3D> bounds;
+	if (!LoadTriangleBounds(options, bounds)) {
+		return 1;
+	}
+
+	TaskThreadPool* pool = nullptr;
+	if (options.numThreads > 1)
+	{
+		pool = new TaskThreadPool();
+		pool->Create(options.numThreads);
+	}
+
+	printf("%8s %10s %10s %8s %10s %10s %8s\n", "builder", "time(ms)", "sah cost", "height", "nodes", "refs", "valid");
+
+	for (int b = 0; b < kNumBuilders; ++b)
+	{
+		double best = 1e30;
+		float cost = 0.0f;
+		int height = 0;
+		int numnodes = 0;
+		int numrefs = 0;
+		bool valid = true;
+
+		for (int r = 0; r < options.repeats; ++r)
+		{
+			RadeonRays::Bvh* bvh = CreateBuilder(b);
+			bvh->SetTaskPool(pool);
+			bvh->SetMaxLeafSize(options.leafSize);
+			bvh->SetIntersectionCost(options.intersectionCost);
+
+			auto start = std::chrono::high_resolution_clock::now();
+			bvh->Build(&bounds[0], (int)bounds.size());
+			best = std::min(best, Seconds(start));
+
+			cost   = SahCost(*bvh, 2.0f, options.intersectionCost);
+			height = bvh->GetHeight();
+			numnodes = bvh->GetNumNodes();
+			numrefs = (int)bvh->GetNumIndices();
+			valid &= ValidateTree(*bvh, &bounds[0], (int)bounds.size(), b == 1);
+
+			delete bvh;
+		}
+
+		printf("%8s %10.2f %10.2f %8d %10d %10d %8s\n", kBuilderNames[b], best * 1000.0, cost, height, numnodes, numrefs, valid ? "yes" : "NO");
+	}
+
+	delete pool;
+
+	return 0;
+}
+
+static int BenchTreelets(const BenchOptions& options)
+{
+	std::vector<Bounds3D> bounds;
+	if (!LoadTriangleBounds(options, bounds)) {
+		return 1;
+	}
+
+	TaskThreadPool* pool = nullptr;
+	if (options.numThreads > 1)
+	{
+		pool = new TaskThreadPool();
+		pool->Create(options.numThreads);
+	}
+
+	printf("%8s %10s %10s %10s %10s %8s %10s %8s\n", "builder", "build(ms)", "sah cost", "opt(ms)", "opt sah", "gain", "treelets", "valid");
+
+	for (int b = 0; b < kNumBuilders; ++b)
+	{
+		RadeonRays::Bvh* bvh = CreateBuilder(b);
+		bvh->SetTaskPool(pool);
+		bvh->SetMaxLeafSize(options.leafSize);
+		bvh->SetIntersectionCost(options.intersectionCost);
+
+		auto start = std::chrono::high_resolution_clock::now();
+		bvh->Build(&bounds[0], (int)bounds.size());
+		double buildTime = Seconds(start);
+
+		RadeonRays::Bvh::OptimizeStats stats = bvh->OptimizeTreelets(options.treeletSize);
+		bool valid = ValidateTree(*bvh, &bounds[0], (int)bounds.size(), b == 1);
+
+		printf("%8s %10.2f %10.2f %10.2f %10.2f %7.1f%% %10d %8s\n", kBuilderNames[b], buildTime * 1000.0, stats.sahBefore, stats.milliseconds,
+			   stats.sahAfter, 100.0f * (1.0f - stats.sahAfter / stats.sahBefore), stats.numRestructured, valid ? "yes" : "NO");
+
+		delete bvh;
+	}
+
+	delete pool;
+
+	return 0;
+}
+
+static Vector3 TransformPoint(const Matrix4x4& m, const Vector3& p)
+{
+	return Vector3(p.x * m.m[0][0] + p.y * m.m[1][0] + p.z * m.m[2][0] + m.m[3][0],
+				   p.x * m.m[0][1] + p.y * m.m[1][1] + p.z * m.m[2][1] + m.m[3][1],
+				   p.x * m.m[0][2] + p.y * m.m[1][2] + p.z * m.m[2][2] + m.m[3][2]);
+}
+
+static Vector3 TransformDirection(const Matrix4x4& m, const Vector3& d)
+{
+	return Vector3(d.x * m.m[0][0] + d.y * m.m[1][0] + d.z * m.m[2][0],
+				   d.x * m.m[0][1] + d.y * m.m[1][1] + d.z * m.m[2][1],
+				   d.x * m.m[0][2] + d.y * m.m[1][2] + d.z * m.m[2][2]);
+}
+
+// Slab test, the entry distance is returned in tnear
+static bool IntersectBox(const Bounds3D& bbox, const Vector3& origin, const Vector3& invDir, float tmax, float& tnear)
+{
+	float t0 = 0.0f;
+	float t1 = tmax;
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float ta = (bbox.min[axis] - origin[axis]) * invDir[axis];
+		float tb = (bbox.max[axis] - origin[axis]) * invDir[axis];
+		t0 = std::max(t0, std::min(ta, tb));
+		t1 = std::min(t1, std::max(ta, tb));
+	}
+
+	tnear = t0;
+	return t0 <= t1;
+}
+
+// Moller-Trumbore
+static bool IntersectTriangle(const Vector3& v0, const Vector3& v1, const Vector3& v2, const Vector3& origin, const Vector3& dir, float& t)
+{
+	Vector3 e1 = v1 - v0;
+	Vector3 e2 = v2 - v0;
+	Vector3 p  = Vector3::CrossProduct(dir, e2);
+	float det  = Vector3::DotProduct(e1, p);
+
+	if (fabs(det) < 1e-12f) {
+		return false;
+	}
+
+	float invDet = 1.0f / det;
+	Vector3 s = origin - v0;
+	float u = Vector3::DotProduct(s, p) * invDet;
+	if (u < 0.0f || u > 1.0f) {
+		return false;
+	}
+
+	Vector3 q = Vector3::CrossProduct(s, e1);
+	float v = Vector3::DotProduct(dir, q) * invDet;
+	if (v < 0.0f || u + v > 1.0f) {
+		return false;
+	}
+
+	float hit = Vector3::DotProduct(e2, q) * invDet;
+	if (hit <= 0.0f || hit >= t) {
+		return false;
+	}
+
+	t = hit;
+	return true;
+}
+
+struct TraversalStats
+{
+	long long tlasNodes = 0;
+	long long blasNodes = 0;
+	long long blasEntries = 0;
+	long long triangleTests = 0;
+	long long hits = 0;
+	double hitDistance = 0.0;
+};
+
+// Two level closest hit traversal laid out like the shader: a TLAS leaf enters the BLAS
+// subtree of its ref without a box test, with the ray moved into the space of the instance.
+// Children are tested when their parent is popped and pushed far first.
+static void TraceInstances(const RadeonRays::Bvh& tlas, const std::vector<RadeonRays::InstanceRef>& refs, const std::vector<Mesh*>& meshes,
+						   const std::vector<MeshInstance>& instances, const std::vector<Matrix4x4>& inverses, const Vector3& origin, const Vector3& dir, TraversalStats& stats)
+{
+	const RadeonRays::Bvh::Node* tlasNodes = tlas.GetNodes();
+	Vector3 invDir(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+
+	float closest = std::numeric_limits<float>::max();
+	float tnear;
+
+	std::vector<int> stack;
+	std::vector<int> blasStack;
+
+	if (!IntersectBox(tlasNodes[0].bounds, origin, invDir, closest, tnear)) {
+		return;
+	}
+	stack.push_back(0);
+
+	while (!stack.empty())
+	{
+		const RadeonRays::Bvh::Node& node = tlasNodes[stack.back()];
+		stack.pop_back();
+		stats.tlasNodes++;
+
+		if (node.type == RadeonRays::Bvh::kLeaf)
+		{
+			const RadeonRays::InstanceRef& ref = refs[tlas.GetIndices()[node.startidx]];
+			const Mesh* mesh = meshes[instances[ref.instanceIndex].meshID];
+			const RadeonRays::Bvh::Node* blasNodes = mesh->bvh->GetNodes();
+			const int* triangles = mesh->bvh->GetIndices();
+
+			Vector3 localOrigin = TransformPoint(inverses[ref.instanceIndex], origin);
+			Vector3 localDir    = TransformDirection(inverses[ref.instanceIndex], dir);
+			Vector3 localInvDir(1.0f / localDir.x, 1.0f / localDir.y, 1.0f / localDir.z);
+
+			stats.blasEntries++;
+			blasStack.assign(1, ref.blasNode);
+
+			while (!blasStack.empty())
+			{
+				const RadeonRays::Bvh::Node& blasNode = blasNodes[blasStack.back()];
+				blasStack.pop_back();
+				stats.blasNodes++;
+
+				if (blasNode.type == RadeonRays::Bvh::kLeaf)
+				{
+					for (int i = 0; i < blasNode.numprims; ++i)
+					{
+						int t = triangles[blasNode.startidx + i];
+						stats.triangleTests++;
+						IntersectTriangle(Vector3(mesh->verticesUVX[t * 3 + 0]), Vector3(mesh->verticesUVX[t * 3 + 1]), Vector3(mesh->verticesUVX[t * 3 + 2]),
+										  localOrigin, localDir, closest);
+					}
+					continue;
+				}
+
+				float tl, tr;
+				bool hitl = IntersectBox(blasNodes[blasNode.lc].bounds, localOrigin, localInvDir, closest, tl);
+				bool hitr = IntersectBox(blasNodes[blasNode.rc].bounds, localOrigin, localInvDir, closest, tr);
+
+				if (hitl && hitr && tl < tr)
+				{
+					blasStack.push_back(blasNode.rc);
+					blasStack.push_back(blasNode.lc);
+				}
+				else if (hitl && hitr)
+				{
+					blasStack.push_back(blasNode.lc);
+					blasStack.push_back(blasNode.rc);
+				}
+				else if (hitl) {
+					blasStack.push_back(blasNode.lc);
+				}
+				else if (hitr) {
+					blasStack.push_back(blasNode.rc);
+				}
+			}
+			continue;
+		}
+
+		float tl, tr;
+		bool hitl = IntersectBox(tlasNodes[node.lc].bounds, origin, invDir, closest, tl);
+		bool hitr = IntersectBox(tlasNodes[node.rc].bounds, origin, invDir, closest, tr);
+
+		if (hitl && hitr && tl < tr)
+		{
+			stack.push_back(node.rc);
+			stack.push_back(node.lc);
+		}
+		else if (hitl && hitr)
+		{
+			stack.push_back(node.lc);
+			stack.push_back(node.rc);
+		}
+		else if (hitl) {
+			stack.push_back(node.lc);
+		}
+		else if (hitr) {
+			stack.push_back(node.rc);
+		}
+	}
+
+	if (closest < std::numeric_limits<float>::max())
+	{
+		stats.hits++;
+		stats.hitDistance += closest;
+	}
+}
+
+static int BenchTlas(const BenchOptions& options)
+{
+	std::vector<Mesh*> meshes;
+	for (int i = 0; i < options.files.size(); ++i)
+	{
+		Mesh* mesh = new Mesh();
+		if (!mesh->LoadFromFile(options.files[i])) {
+			return 1;
+		}
+		mesh->BuildBVH();
+		meshes.push_back(mesh);
+	}
+
+	if (meshes.empty()) {
+		return 1;
+	}
+
+	// Instances with unit sized meshes in a cube holding about one per 64 units, scales
+	// spread log uniformly over [0.5, 20] so the largest cover dozens of small ones
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+	float side = 4.0f * cbrtf((float)options.numInstances);
+	std::vector<MeshInstance> instances;
+	std::vector<Matrix4x4> inverses;
+
+	for (int i = 0; i < options.numInstances; ++i)
+	{
+		int meshID  = (int)(uniform(rng) * meshes.size()) % (int)meshes.size();
+		float angle = uniform(rng) * 2.0f * 3.14159265f;
+		float scale = 0.5f * powf(40.0f, uniform(rng)) / std::max(meshes[meshID]->bvh->Bounds().Extents().Size(), 1e-6f);
+		Vector3 position(uniform(rng) * side, uniform(rng) * side, uniform(rng) * side);
+
+		Matrix4x4 transform(Vector3(cosf(angle), 0.0f, -sinf(angle)) * scale, Vector3(0.0f, scale, 0.0f), Vector3(sinf(angle), 0.0f, cosf(angle)) * scale, position);
+
+		instances.push_back(MeshInstance(meshID, transform, 0, "instance"));
+		inverses.push_back(transform.Inverse());
+	}
+
+	// Rays from anywhere inside the scene in uniform directions
+	std::vector<Vector3> origins(options.numRays);
+	std::vector<Vector3> directions(options.numRays);
+	for (int i = 0; i < options.numRays; ++i)
+	{
+		float z   = 1.0f - 2.0f * uniform(rng);
+		float r   = sqrtf(std::max(0.0f, 1.0f - z * z));
+		float phi = 2.0f * 3.14159265f * uniform(rng);
+		origins[i]    = Vector3(uniform(rng) * side, uniform(rng) * side, uniform(rng) * side);
+		directions[i] = Vector3(r * cosf(phi), r * sinf(phi), z);
+	}
+
+	const char* names[] = { "median", "sah", "braid2", "braid4" };
+	const float budgets[] = { 1.0f, 1.0f, 2.0f, 4.0f };
+
+	printf("%d instances of %d meshes, %d rays\n", options.numInstances, (int)meshes.size(), options.numRays);
+	printf("%8s %10s %8s %10s %10s %10s %10s %10s %8s %12s\n", "tlas", "build(ms)", "refs",
+		   "tlas/ray", "blas/ray", "enter/ray", "tris/ray", "steps/ray", "hits", "mean t");
+
+	for (int b = 0; b < sizeof(names) / sizeof(names[0]); ++b)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+
+		std::vector<RadeonRays::InstanceRef> refs;
+		std::vector<Bounds3D> bounds;
+		RadeonRays::RebraidInstances(meshes, instances, (int)(budgets[b] * options.numInstances), refs, bounds);
+
+		RadeonRays::Bvh tlas(10.0f, 64, b > 0);
+		tlas.Build(&bounds[0], (int)bounds.size());
+
+		double buildTime = Seconds(start);
+
+		TraversalStats stats;
+		for (int i = 0; i < options.numRays; ++i) {
+			TraceInstances(tlas, refs, meshes, instances, inverses, origins[i], directions[i], stats);
+		}
+
+		double invRays = 1.0 / options.numRays;
+		printf("%8s %10.2f %8d %10.2f %10.2f %10.2f %10.2f %10.2f %8lld %12.6f\n", names[b], buildTime * 1000.0, (int)refs.size(),
+			   stats.tlasNodes * invRays, stats.blasNodes * invRays, stats.blasEntries * invRays, stats.triangleTests * invRays,
+			   (stats.tlasNodes + stats.blasNodes) * invRays, stats.hits, stats.hits > 0 ? stats.hitDistance / stats.hits : 0.0);
+	}
+
+	for (int i = 0; i < meshes.size(); ++i) {
+		delete meshes[i];
+	}
+
+	return 0;
+}
+
+struct RayStats
+{
+	long long nodes = 0;
+	long long triangleTests = 0;
+	long long hits = 0;
+	double hitDistance = 0.0;
+};
+
+static void IntersectLeaf(const std::vector<Vector3>& vertices, const int* indices, int startidx, int numprims, const Vector3& origin, const Vector3& dir, float& closest, RayStats& stats)
+{
+	for (int i = startidx; i < startidx + numprims; ++i)
+	{
+		int t = indices[i];
+		stats.triangleTests++;
+		IntersectTriangle(vertices[t * 3 + 0], vertices[t * 3 + 1], vertices[t * 3 + 2], origin, dir, closest);
+	}
+}
+
+static void FinishRay(float closest, RayStats& stats)
+{
+	if (closest < std::numeric_limits<float>::max())
+	{
+		stats.hits++;
+		stats.hitDistance += closest;
+	}
+}
+
+// Closest hit through the binary tree, children are tested when their parent is popped.
+// touch is called with the arena index of every node read.
+template <typename Touch>
+static void TraceBinary(const RadeonRays::Bvh& bvh, const std::vector<Vector3>& vertices, const Vector3& origin, const Vector3& dir, RayStats& stats, Touch touch)
+{
+	const RadeonRays::Bvh::Node* nodes = bvh.GetNodes();
+	Vector3 invDir(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+	float closest = std::numeric_limits<float>::max();
+	float tnear;
+
+	int stack[128];
+	int top = 0;
+
+	touch(0);
+	if (IntersectBox(nodes[0].bounds, origin, invDir, closest, tnear)) {
+		stack[top++] = 0;
+	}
+
+	while (top > 0)
+	{
+		int nodeidx = stack[--top];
+		const RadeonRays::Bvh::Node& node = nodes[nodeidx];
+		touch(nodeidx);
+		stats.nodes++;
+
+		if (node.type == RadeonRays::Bvh::kLeaf)
+		{
+			IntersectLeaf(vertices, bvh.GetIndices(), node.startidx, node.numprims, origin, dir, closest, stats);
+			continue;
+		}
+
+		float tl, tr;
+		touch(node.lc);
+		touch(node.rc);
+		bool hitl = IntersectBox(nodes[node.lc].bounds, origin, invDir, closest, tl);
+		bool hitr = IntersectBox(nodes[node.rc].bounds, origin, invDir, closest, tr);
+
+		if (hitl && hitr)
+		{
+			stack[top++] = tl < tr ? node.rc : node.lc;
+			stack[top++] = tl < tr ? node.lc : node.rc;
+		}
+		else if (hitl || hitr) {
+			stack[top++] = hitl ? node.lc : node.rc;
+		}
+	}
+
+	FinishRay(closest, stats);
+}
+
+static void TraceBinary(const RadeonRays::Bvh& bvh, const std::vector<Vector3>& vertices, const Vector3& origin, const Vector3& dir, RayStats& stats)
+{
+	TraceBinary(bvh, vertices, origin, dir, stats, [](int) {});
+}
+
+// Closest hit through a wide tree: one slab test per node, leaf lanes are intersected
+// right away and internal lanes pushed far to near
+template <int Width, typename Tree>
+static void TraceWide(const Tree& bvh, const std::vector<Vector3>& vertices, const Vector3& origin, const Vector3& dir, RayStats& stats)
+{
+	typedef typename Tree::Node WideNode;
+
+	const WideNode* nodes = bvh.GetNodes();
+	Vector3 invDir(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+	float closest = std::numeric_limits<float>::max();
+	float tnear[Width];
+
+	int stack[256];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		const WideNode& node = nodes[stack[--top]];
+		stats.nodes++;
+
+		int mask = Tree::IntersectChildren(node, origin, invDir, closest, tnear);
+
+		int internal[Width];
+		int numInternal = 0;
+
+		for (int lane = 0; lane < Width; ++lane)
+		{
+			if (!(mask & (1 << lane))) {
+				continue;
+			}
+
+			if (node.numprims[lane] > 0) {
+				IntersectLeaf(vertices, bvh.GetIndices(), node.child[lane], node.numprims[lane], origin, dir, closest, stats);
+			}
+			else
+			{
+				// Insertion sort, farthest first
+				int i = numInternal++;
+				while (i > 0 && tnear[internal[i - 1]] < tnear[lane])
+				{
+					internal[i] = internal[i - 1];
+					--i;
+				}
+				internal[i] = lane;
+			}
+		}
+
+		for (int i = 0; i < numInternal; ++i)
+		{
+			if (tnear[internal[i]] < closest) {
+				stack[top++] = node.child[internal[i]];
+			}
+		}
+	}
+
+	FinishRay(closest, stats);
+}
+
+static void PrintLayout(const char* name, int numnodes, size_t bytes, size_t binaryBytes, float occupancy, float sah, double seconds, const RayStats& stats, int numRays)
+{
+	printf("%8s %10d %10.1f %8.2f %8.2f %10.2f %10.2f %10.2f %10.2f %8lld %12.6f\n", name, numnodes, bytes / 1024.0, (double)bytes / binaryBytes, occupancy, sah,
+		   (double)stats.nodes / numRays, (double)stats.triangleTests / numRays, numRays / seconds * 1e-6, stats.hits, stats.hits > 0 ? stats.hitDistance / stats.hits : 0.0);
+}
+
+static int BenchWide(const BenchOptions& options)
+{
+	std::vector<Vector3> vertices;
+	if (!LoadTriangles(options, vertices)) {
+		return 1;
+	}
+
+	std::vector<Bounds3D> bounds(vertices.size() / 3);
+	for (int t = 0; t < bounds.size(); ++t)
+	{
+		bounds[t].Expand(vertices[t * 3 + 0]);
+		bounds[t].Expand(vertices[t * 3 + 1]);
+		bounds[t].Expand(vertices[t * 3 + 2]);
+	}
+
+	RadeonRays::Bvh bvh(2.0f, 64, true);
+	bvh.SetMaxLeafSize(options.leafSize);
+	bvh.SetIntersectionCost(options.intersectionCost);
+	bvh.Build(&bounds[0], (int)bounds.size());
+
+	RadeonRays::Bvh4 bvh4;
+	RadeonRays::Bvh8 bvh8;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	bvh4.Build(bvh);
+	double collapse4 = Seconds(start);
+
+	start = std::chrono::high_resolution_clock::now();
+	bvh8.Build(bvh);
+	double collapse8 = Seconds(start);
+
+	RadeonRays::CompressedBvh bvh4q;
+	start = std::chrono::high_resolution_clock::now();
+	bvh4q.Build(bvh4);
+	double quantize = Seconds(start);
+
+	printf("collapse to bvh4 %.2f ms, to bvh8 %.2f ms, quantize bvh4 %.2f ms\n", collapse4 * 1000.0, collapse8 * 1000.0, quantize * 1000.0);
+
+	// Rays from around the mesh towards points inside its bounds
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+	const Bounds3D& box = bvh.Bounds();
+	Vector3 center  = box.Center();
+	Vector3 extents = box.Extents();
+
+	std::vector<Vector3> origins(options.numRays);
+	std::vector<Vector3> directions(options.numRays);
+	for (int i = 0; i < options.numRays; ++i)
+	{
+		Vector3 from = center + Vector3(uniform(rng) - 0.5f, uniform(rng) - 0.5f, uniform(rng) - 0.5f) * extents * 2.0f;
+		Vector3 to   = box.min + Vector3(uniform(rng), uniform(rng), uniform(rng)) * extents;
+		origins[i]    = from;
+		directions[i] = to - from;
+		directions[i].Normalize();
+	}
+
+	// Binary layout as flattened by BvhTranslator, links and both bounds per node
+	size_t binaryBytes = bvh.GetNumNodes() * (sizeof(RadeonRays::BvhTranslator::Node) + 2 * sizeof(Vector3)) + bvh.GetNumIndices() * sizeof(int);
+	float traversalCost = 2.0f / options.intersectionCost;
+
+	printf("%8s %10s %10s %8s %8s %10s %10s %10s %10s %8s %12s\n", "layout", "nodes", "memory(KB)", "memory", "lanes", "sah cost",
+		   "nodes/ray", "tris/ray", "Mrays/s", "hits", "mean t");
+
+	RayStats binaryStats;
+	start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < options.numRays; ++i) {
+		TraceBinary(bvh, vertices, origins[i], directions[i], binaryStats);
+	}
+	PrintLayout("binary", bvh.GetNumNodes(), binaryBytes, binaryBytes, 2.0f, bvh.GetSahCost(), Seconds(start), binaryStats, options.numRays);
+
+	RayStats stats4;
+	start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < options.numRays; ++i) {
+		TraceWide<4>(bvh4, vertices, origins[i], directions[i], stats4);
+	}
+	PrintLayout("bvh4", bvh4.GetNumNodes(), bvh4.GetMemorySize(), binaryBytes, bvh4.GetLaneOccupancy(), bvh4.GetSahCost(traversalCost), Seconds(start), stats4, options.numRays);
+
+	RayStats stats8;
+	start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < options.numRays; ++i) {
+		TraceWide<8>(bvh8, vertices, origins[i], directions[i], stats8);
+	}
+	PrintLayout("bvh8", bvh8.GetNumNodes(), bvh8.GetMemorySize(), binaryBytes, bvh8.GetLaneOccupancy(), bvh8.GetSahCost(traversalCost), Seconds(start), stats8, options.numRays);
+
+	RayStats statsQ;
+	start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < options.numRays; ++i) {
+		TraceWide<4>(bvh4q, vertices, origins[i], directions[i], statsQ);
+	}
+	PrintLayout("bvh4q", bvh4q.GetNumNodes(), bvh4q.GetMemorySize(), binaryBytes, bvh4.GetLaneOccupancy(), bvh4q.GetSahCost(traversalCost), Seconds(start), statsQ, options.numRays);
+
+	// Quantized boxes must enclose the exact ones, report how much area they add
+	bool conservative = true;
+	double exactArea = 0.0;
+	double quantizedArea = 0.0;
+	for (int i = 0; i < bvh4.GetNumNodes(); ++i)
+	{
+		const RadeonRays::Bvh4::Node& exact = bvh4.GetNodes()[i];
+		for (int lane = 0; lane < 4; ++lane)
+		{
+			if (exact.numprims[lane] < 0) {
+				continue;
+			}
+
+			Bounds3D box(Vector3(exact.minx[lane], exact.miny[lane], exact.minz[lane]), Vector3(exact.maxx[lane], exact.maxy[lane], exact.maxz[lane]));
+			Bounds3D decoded = RadeonRays::CompressedBvh::DecodeBounds(bvh4q.GetNodes()[i], lane);
+			conservative &= Encloses(decoded, box);
+			exactArea += box.Area();
+			quantizedArea += decoded.Area();
+		}
+	}
+	printf("quantized boxes %s, %.2f%% more child area\n", conservative ? "conservative" : "NOT CONSERVATIVE", 100.0 * (quantizedArea / exactArea - 1.0));
+
+	return 0;
+}
+
+// Rays from around the box towards points inside it
+static void GenerateRandomRays(const Bounds3D& box, int numRays, std::vector<Vector3>& origins, std::vector<Vector3>& directions)
+{
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+	Vector3 center  = box.Center();
+	Vector3 extents = box.Extents();
+
+	origins.resize(numRays);
+	directions.resize(numRays);
+	for (int i = 0; i < numRays; ++i)
+	{
+		Vector3 from = center + Vector3(uniform(rng) - 0.5f, uniform(rng) - 0.5f, uniform(rng) - 0.5f) * extents * 2.0f;
+		Vector3 to   = box.min + Vector3(uniform(rng), uniform(rng), uniform(rng)) * extents;
+		origins[i]    = from;
+		directions[i] = to - from;
+		directions[i].Normalize();
+	}
+}
+
+static int BenchEarlySplit(const BenchOptions& options)
+{
+	std::vector<Vector3> vertices;
+	if (!LoadTriangles(options, vertices)) {
+		return 1;
+	}
+
+	std::vector<Bounds3D> bounds(vertices.size() / 3);
+	for (int t = 0; t < bounds.size(); ++t)
+	{
+		bounds[t].Expand(vertices[t * 3 + 0]);
+		bounds[t].Expand(vertices[t * 3 + 1]);
+		bounds[t].Expand(vertices[t * 3 + 2]);
+	}
+
+	TaskThreadPool* pool = nullptr;
+	if (options.numThreads > 1)
+	{
+		pool = new TaskThreadPool();
+		pool->Create(options.numThreads);
+	}
+
+	Bounds3D sceneBounds;
+	for (int t = 0; t < bounds.size(); ++t) {
+		sceneBounds.Expand(bounds[t]);
+	}
+
+	std::vector<Vector3> origins;
+	std::vector<Vector3> directions;
+	GenerateRandomRays(sceneBounds, options.numRays, origins, directions);
+
+	const char* names[] = { "sah", "esc-edge", "esc-vol", "esc-box", "sbvh" };
+	const int numBuilders = sizeof(names) / sizeof(names[0]);
+
+	printf("%8s %10s %10s %10s %10s %8s %10s %10s %10s %8s %8s\n", "builder", "time(ms)", "sah cost", "refs", "split", "valid",
+		   "nodes/ray", "tests/ray", "Mrays/s", "hits", "same");
+
+	long long referenceHits = -1;
+	bool identical = true;
+
+	for (int b = 0; b < numBuilders; ++b)
+	{
+		double best = 1e30;
+		std::unique_ptr<RadeonRays::Bvh> bvh;
+		// Only the early split builders report the triangles they split
+		char numSplit[16] = "-";
+
+		for (int r = 0; r < options.repeats; ++r)
+		{
+			RadeonRays::EarlySplitBvh* esc = nullptr;
+			if (b == 0) {
+				bvh.reset(new RadeonRays::Bvh(2.0f, 64, true));
+			}
+			else if (b == 4) {
+				bvh.reset(new RadeonRays::SplitBvh(2.0f, 64, 48, 0.00001f, 1.0f));
+			}
+			else
+			{
+				esc = new RadeonRays::EarlySplitBvh(2.0f, 64, b == 1 ? RadeonRays::EarlySplitBvh::kEdgeLength : RadeonRays::EarlySplitBvh::kVolumeRatio, b == 1 ? 2.0f : 4.0f);
+				if (b != 3) {
+					esc->SetTriangles(&vertices[0].x, 3);
+				}
+				bvh.reset(esc);
+			}
+
+			bvh->SetTaskPool(pool);
+			bvh->SetMaxLeafSize(options.leafSize);
+			bvh->SetIntersectionCost(options.intersectionCost);
+
+			auto start = std::chrono::high_resolution_clock::now();
+			bvh->Build(&bounds[0], (int)bounds.size());
+			best = std::min(best, Seconds(start));
+
+			if (esc) {
+				snprintf(numSplit, sizeof(numSplit), "%d", esc->GetNumSplitPrimitives());
+			}
+		}
+
+		bool valid = ValidateTree(*bvh, &bounds[0], (int)bounds.size(), b != 0);
+
+		RayStats stats;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < options.numRays; ++i) {
+			TraceBinary(*bvh, vertices, origins[i], directions[i], stats);
+		}
+		double seconds = Seconds(start);
+
+		if (referenceHits < 0) {
+			referenceHits = stats.hits;
+		}
+		identical &= stats.hits == referenceHits;
+
+		printf("%8s %10.2f %10.2f %10d %10s %8s %10.2f %10.2f %10.2f %8lld %8s\n", names[b], best * 1000.0, SahCost(*bvh, 2.0f, options.intersectionCost),
+			   (int)bvh->GetNumIndices(), numSplit, valid ? "yes" : "NO", (double)stats.nodes / options.numRays, (double)stats.triangleTests / options.numRays,
+			   options.numRays / seconds * 1e-6, stats.hits, stats.hits == referenceHits ? "yes" : "NO");
+	}
+
+	delete pool;
+
+	return identical ? 0 : 1;
+}
+
+// Set associative LRU cache of 64 byte lines, counts the misses of a sequence of reads
+class CacheModel
+{
+public:
+	CacheModel(int sizeBytes, int ways)
+		: m_NumSets(sizeBytes / 64 / ways)
+		, m_Ways(ways)
+		, m_Tags(m_NumSets * ways, -1)
+		, m_Stamps(m_NumSets * ways, 0)
+		, m_Clock(0)
+		, misses(0)
+	{
+
+	}
+
+	// Returns true on a hit
+	bool Access(long long line)
+	{
+		long long* tags = &m_Tags[(line % m_NumSets) * m_Ways];
+		long long* stamps = &m_Stamps[(line % m_NumSets) * m_Ways];
+		int victim = 0;
+		++m_Clock;
+
+		for (int i = 0; i < m_Ways; ++i)
+		{
+			if (tags[i] == line)
+			{
+				stamps[i] = m_Clock;
+				return true;
+			}
+			victim = stamps[i] < stamps[victim] ? i : victim;
+		}
+
+		tags[victim] = line;
+		stamps[victim] = m_Clock;
+		misses++;
+		return false;
+	}
+
+private:
+	int m_NumSets;
+	int m_Ways;
+	std::vector<long long> m_Tags;
+	std::vector<long long> m_Stamps;
+	long long m_Clock;
+
+public:
+	long long misses;
+};
+
+static int BenchLayout(const BenchOptions& options)
+{
+	std::vector<Vector3> vertices;
+	if (!LoadTriangles(options, vertices)) {
+		return 1;
+	}
+
+	std::vector<Bounds3D> bounds(vertices.size() / 3);
+	for (int t = 0; t < bounds.size(); ++t)
+	{
+		bounds[t].Expand(vertices[t * 3 + 0]);
+		bounds[t].Expand(vertices[t * 3 + 1]);
+		bounds[t].Expand(vertices[t * 3 + 2]);
+	}
+
+	RadeonRays::Bvh bvh(2.0f, 64, true);
+	bvh.SetMaxLeafSize(options.leafSize);
+	bvh.SetIntersectionCost(options.intersectionCost);
+	bvh.Build(&bounds[0], (int)bounds.size());
+
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+	const Bounds3D& box = bvh.Bounds();
+	Vector3 center  = box.Center();
+	Vector3 extents = box.Extents();
+
+	// Coherent primary rays of a pinhole camera in scanline order, and incoherent rays
+	// from around the mesh towards points inside its bounds
+	std::vector<Vector3> origins[2];
+	std::vector<Vector3> directions[2];
+	const char* rayNames[] = { "primary", "random" };
+
+	int resolution = std::max((int)sqrtf((float)options.numRays), 1);
+	Vector3 eye = center + Vector3(0.3f, 0.2f, 1.0f) * extents.Size();
+	Vector3 forward = center - eye;
+	forward.Normalize();
+	Vector3 right = Vector3::CrossProduct(forward, Vector3(0.0f, 1.0f, 0.0f));
+	right.Normalize();
+	Vector3 up = Vector3::CrossProduct(right, forward);
+
+	for (int y = 0; y < resolution; ++y)
+	{
+		for (int x = 0; x < resolution; ++x)
+		{
+			Vector3 dir = forward + right * (0.8f * ((x + 0.5f) / resolution - 0.5f)) + up * (0.8f * ((y + 0.5f) / resolution - 0.5f));
+			dir.Normalize();
+			origins[0].push_back(eye);
+			directions[0].push_back(dir);
+		}
+	}
+
+	for (int i = 0; i < origins[0].size(); ++i)
+	{
+		Vector3 from = center + Vector3(uniform(rng) - 0.5f, uniform(rng) - 0.5f, uniform(rng) - 0.5f) * extents * 2.0f;
+		Vector3 to   = box.min + Vector3(uniform(rng), uniform(rng), uniform(rng)) * extents;
+		Vector3 dir  = to - from;
+		dir.Normalize();
+		origins[1].push_back(from);
+		directions[1].push_back(dir);
+	}
+
+	int numRays = (int)origins[0].size();
+	printf("%d nodes, %.1f KB of nodes, %d rays per set\n", bvh.GetNumNodes(), bvh.GetNumNodes() * sizeof(RadeonRays::Bvh::Node) / 1024.0, numRays);
+	printf("%8s %8s %11s %10s %10s %10s %10s %8s\n", "layout", "rays", "reorder(ms)", "lines/ray", "L1 miss", "L2 miss", "Mrays/s", "hits");
+
+	const char* layoutNames[] = { "build", "dfs", "hot", "bfs", "veb" };
+	const RadeonRays::Bvh::NodeLayout layouts[] = { RadeonRays::Bvh::kBuildOrder, RadeonRays::Bvh::kDepthFirst, RadeonRays::Bvh::kHotChildFirst,
+													RadeonRays::Bvh::kBreadthFirstTop, RadeonRays::Bvh::kVanEmdeBoas };
+	long long referenceHits[2] = { -1, -1 };
+	bool identical = true;
+
+	for (int l = 0; l < sizeof(layouts) / sizeof(layouts[0]); ++l)
+	{
+		// Every layout is a function of the topology alone, so they are applied one after the other
+		auto start = std::chrono::high_resolution_clock::now();
+		bvh.ReorderNodes(layouts[l]);
+		double reorderTime = Seconds(start);
+
+		for (int r = 0; r < 2; ++r)
+		{
+			// Nodes start on a cache line, 32 KB 8 way L1 and 1 MB 16 way L2
+			CacheModel l1(32 * 1024, 8);
+			CacheModel l2(1024 * 1024, 16);
+			long long lines = 0;
+
+			RayStats cacheStats;
+			for (int i = 0; i < numRays; ++i)
+			{
+				TraceBinary(bvh, vertices, origins[r][i], directions[r][i], cacheStats, [&](int node)
+				{
+					long long first = (long long)node * sizeof(RadeonRays::Bvh::Node) / 64;
+					long long last  = ((long long)(node + 1) * sizeof(RadeonRays::Bvh::Node) - 1) / 64;
+					for (long long line = first; line <= last; ++line)
+					{
+						lines++;
+						if (!l1.Access(line)) {
+							l2.Access(line);
+						}
+					}
+				});
+			}
+
+			double best = 1e30;
+			RayStats stats;
+			for (int repeat = 0; repeat < options.repeats; ++repeat)
+			{
+				stats = RayStats();
+				start = std::chrono::high_resolution_clock::now();
+				for (int i = 0; i < numRays; ++i) {
+					TraceBinary(bvh, vertices, origins[r][i], directions[r][i], stats);
+				}
+				best = std::min(best, Seconds(start));
+			}
+
+			if (referenceHits[r] < 0) {
+				referenceHits[r] = stats.hits;
+			}
+			identical &= stats.hits == referenceHits[r] && cacheStats.hits == stats.hits;
+
+			printf("%8s %8s %11.2f %10.2f %10.2f %10.2f %10.2f %8lld\n", layoutNames[l], rayNames[r], reorderTime * 1000.0, (double)lines / numRays,
+				   (double)l1.misses / numRays, (double)l2.misses / numRays, numRays / best * 1e-6, stats.hits);
+		}
+	}
+
+	printf("hits %s across layouts\n", identical ? "identical" : "DIFFER");
+
+	return identical ? 0 : 1;
+}
+
+static int BenchFlatten(const BenchOptions& options)
+{
+	std::vector<Mesh*> loaded;
+	for (int i = 0; i < options.files.size(); ++i)
+	{
+		Mesh* mesh = new Mesh();
+		if (!mesh->LoadFromFile(options.files[i])) {
+			return 1;
+		}
+		mesh->SetLeafParams(options.leafSize, options.intersectionCost);
+		mesh->BuildBVH();
+		loaded.push_back(mesh);
+	}
+
+	if (loaded.empty()) {
+		return 1;
+	}
+
+	// The translator flattens every mesh entry into its own range, so the loaded meshes are cycled
+	// through the scene meshes with one instance each on a grid
+	std::vector<Mesh*> meshes;
+	std::vector<MeshInstance> instances;
+	std::vector<RadeonRays::InstanceRef> refs;
+	std::vector<Bounds3D> instanceBounds;
+
+	int gridSide = (int)ceilf(sqrtf((float)options.numMeshes));
+	long long numNodes = 0;
+
+	for (int i = 0; i < options.numMeshes; ++i)
+	{
+		Mesh* mesh = loaded[i % loaded.size()];
+		float spacing = mesh->bvh->Bounds().Extents().Size() * 1.5f;
+
+		Matrix4x4 transform;
+		transform.m[3][0] = (float)(i % gridSide) * spacing;
+		transform.m[3][2] = (float)(i / gridSide) * spacing;
+
+		meshes.push_back(mesh);
+		instances.push_back(MeshInstance(i, transform, 0, "mesh"));
+		refs.push_back(RadeonRays::InstanceRef{ i, 0 });
+		instanceBounds.push_back(RadeonRays::TransformBounds(mesh->bvh->Bounds(), transform));
+		numNodes += mesh->bvh->GetNumNodes();
+	}
+
+	RadeonRays::Bvh tlas(10.0f, 64, true);
+	tlas.Build(&instanceBounds[0], (int)instanceBounds.size());
+
+	printf("%d meshes, %lld blas nodes\n", options.numMeshes, numNodes);
+	printf("%8s %10s %8s %10s\n", "threads", "time(ms)", "speedup", "identical");
+
+	RadeonRays::BvhTranslator reference;
+	double serial = 0.0;
+
+	for (int threads = 1; threads <= options.numThreads; threads *= 2)
+	{
+		TaskThreadPool* pool = nullptr;
+		if (threads > 1)
+		{
+			pool = new TaskThreadPool();
+			pool->Create(threads);
+		}
+
+		RadeonRays::BvhTranslator* translator = threads == 1 ? &reference : new RadeonRays::BvhTranslator();
+		translator->SetTaskPool(pool);
+
+		double best = 1e30;
+		for (int r = 0; r < options.repeats; ++r)
+		{
+			auto start = std::chrono::high_resolution_clock::now();
+			translator->Process(&tlas, meshes, instances, refs, (int)refs.size());
+			best = std::min(best, Seconds(start));
+		}
+
+		if (threads == 1) {
+			serial = best;
+		}
+
+		bool identical = translator->nodes.size() == reference.nodes.size() &&
+			memcmp(&translator->nodes[0], &reference.nodes[0], reference.nodes.size() * sizeof(RadeonRays::BvhTranslator::Node)) == 0 &&
+			memcmp(&translator->bboxmin[0], &reference.bboxmin[0], reference.bboxmin.size() * sizeof(Vector3)) == 0 &&
+			memcmp(&translator->bboxmax[0], &reference.bboxmax[0], reference.bboxmax.size() * sizeof(Vector3)) == 0;
+
+		printf("%8d %10.2f %8.2f %10s\n", threads, best * 1000.0, serial / best, identical ? "yes" : "NO");
+
+		if (translator != &reference) {
+			delete translator;
+		}
+		delete pool;
+	}
+
+	for (int i = 0; i < loaded.size(); ++i) {
+		delete loaded[i];
+	}
+
+	return 0;
+}
+
+// Texel of a linear element index as the shaders compute it, back to the element it reads
+static size_t FetchIndex(const RadeonRays::TextureLayout& layout, int index, bool& inside)
+{
+	int x = index & (layout.width - 1);
+	int y = index >> layout.widthLog2;
+	inside &= index >= 0 && y < layout.height;
+	return (size_t)y * layout.width + x;
+}
+
+static int BenchScale(const BenchOptions& options)
+{
+	// Synthetic meshes of tiny triangles on a jittered grid, one instance each side by side
+	const int chunkTris = 4 * 1024 * 1024;
+	long long numTris = options.numTriangles;
+	int numChunks = (int)((numTris + chunkTris - 1) / chunkTris);
+
+	TaskThreadPool* pool = nullptr;
+	if (options.numThreads > 1)
+	{
+		pool = new TaskThreadPool();
+		pool->Create(options.numThreads);
+	}
+
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+	// Full chunks share one mesh, every mesh entry still gets its own node and triangle range
+	auto start = std::chrono::high_resolution_clock::now();
+	Mesh* chunkMeshes[2] = { nullptr, nullptr };
+	int chunkSizes[2] = { chunkTris, (int)(numTris - (long long)(numChunks - 1) * chunkTris) };
+
+	for (int c = 0; c < 2; ++c)
+	{
+		if (c == 1 && chunkSizes[1] == chunkTris) {
+			chunkMeshes[1] = chunkMeshes[0];
+			continue;
+		}
+
+		int side = (int)sqrtf((float)chunkSizes[c]) + 1;
+		std::vector<Bounds3D> bounds(chunkSizes[c]);
+		for (int t = 0; t < chunkSizes[c]; ++t)
+		{
+			Vector3 p((float)(t % side) + uniform(rng) * 0.5f, (float)(t / side) + uniform(rng) * 0.5f, uniform(rng));
+			bounds[t] = Bounds3D(p, p + Vector3(0.5f, 0.5f, 0.1f));
+		}
+
+		Mesh* mesh = new Mesh();
+		mesh->SetBvhType(LINEAR_BVH);
+		mesh->bvh->SetTaskPool(pool);
+		mesh->bvh->SetMaxLeafSize(options.leafSize);
+		mesh->bvh->Build(&bounds[0], (int)bounds.size());
+		chunkMeshes[c] = mesh;
+	}
+
+	std::vector<Mesh*> meshes;
+	std::vector<MeshInstance> instances;
+	std::vector<RadeonRays::InstanceRef> refs;
+	std::vector<Bounds3D> instanceBounds;
+
+	for (int i = 0; i < numChunks; ++i)
+	{
+		Mesh* mesh = chunkMeshes[i == numChunks - 1 ? 1 : 0];
+		Matrix4x4 transform;
+		transform.m[3][0] = (float)i * (mesh->bvh->Bounds().Extents().x + 1.0f);
+
+		meshes.push_back(mesh);
+		instances.push_back(MeshInstance(i, transform, 0, "chunk"));
+		refs.push_back(RadeonRays::InstanceRef{ i, 0 });
+		instanceBounds.push_back(RadeonRays::TransformBounds(mesh->bvh->Bounds(), transform));
+	}
+
+	RadeonRays::Bvh tlas(10.0f, 64, true);
+	tlas.Build(&instanceBounds[0], (int)instanceBounds.size());
+	double buildTime = Seconds(start);
+
+	start = std::chrono::high_resolution_clock::now();
+	RadeonRays::BvhTranslator translator;
+	if (!translator.Process(&tlas, meshes, instances, refs, (int)refs.size())) {
+		return 1;
+	}
+	double translateTime = Seconds(start);
+
+	const RadeonRays::TextureLayout& nodeLayout = translator.nodeTexLayout;
+	long long numNodes  = translator.topLevelIndex + tlas.GetNumNodes();
+	long long numIndices = 0;
+	for (int i = 0; i < meshes.size(); ++i) {
+		numIndices += meshes[i]->bvh->GetNumIndices();
+	}
+
+	// Scene::FlattenGeometry stores three de-indexed vertices per triangle reference
+	RadeonRays::TextureLayout indicesLayout = RadeonRays::TextureLayout::ForCount((size_t)numIndices);
+	RadeonRays::TextureLayout triDataLayout = RadeonRays::TextureLayout::ForCount((size_t)numTris * 3);
+
+	printf("%lld triangles in %d meshes, built in %.2f s, flattened in %.2f s\n", numTris, numChunks, buildTime, translateTime);
+	printf("%10s %14s %12s\n", "texture", "elements", "size");
+	printf("%10s %14lld %6dx%-6d\n", "nodes", numNodes, nodeLayout.width, nodeLayout.height);
+	printf("%10s %14lld %6dx%-6d\n", "indices", numIndices, indicesLayout.width, indicesLayout.height);
+	printf("%10s %14lld %6dx%-6d\n", "vertices", numTris * 3, triDataLayout.width, triDataLayout.height);
+
+	// Walk the flattened tree the way the shaders do, every triangle reference must be reached once
+	std::vector<uint8> referenced((size_t)numIndices, 0);
+	std::vector<int> stack(1, translator.topLevelIndex);
+	bool inside = true;
+	long long visited = 0;
+	long long duplicates = 0;
+
+	while (!stack.empty())
+	{
+		int index = stack.back();
+		stack.pop_back();
+
+		size_t element = FetchIndex(nodeLayout, index, inside);
+		if (!inside || element >= translator.nodes.size()) {
+			break;
+		}
+
+		const RadeonRays::BvhTranslator::Node& node = translator.nodes[element];
+		++visited;
+
+		if (node.leaf > 0)
+		{
+			for (int i = 0; i < node.rightIndex; ++i)
+			{
+				size_t ref = FetchIndex(indicesLayout, node.leftIndex + i, inside);
+				if (ref >= referenced.size())
+				{
+					inside = false;
+					continue;
+				}
+
+				duplicates += referenced[ref]++ != 0;
+			}
+		}
+		else if (node.leaf < 0)
+		{
+			stack.push_back(node.leftIndex);
+		}
+		else
+		{
+			stack.push_back(node.leftIndex);
+			stack.push_back(node.rightIndex);
+		}
+	}
+
+	long long missing = std::count(referenced.begin(), referenced.end(), 0);
+	bool valid = inside && missing == 0 && duplicates == 0 && visited == numNodes;
+
+	// The former 12 bit packing kept 4096 texels per axis, element i landed at (i % width, i / width) with width = sqrt + 1
+	int legacyWidth = (int)(sqrt((double)numNodes) + 1);
+	long long aliased = 0;
+	for (long long i = 0; i < numNodes; ++i)
+	{
+		long long x = i % legacyWidth, y = i / legacyWidth;
+		aliased += (x >= 4096 || y >= 4096);
+	}
+
+	printf("visited %lld of %lld nodes, %lld missing and %lld duplicate triangle references: %s\n", visited, numNodes, missing, duplicates, valid ? "valid" : "INVALID");
+	printf("12 bit packed addressing would have corrupted %lld nodes\n", aliased);
+
+	delete chunkMeshes[0];
+	if (chunkMeshes[1] != chunkMeshes[0]) {
+		delete chunkMeshes[1];
+	}
+	delete pool;
+
+	return valid ? 0 : 1;
+}
+
+// Synthetic triangles of the ooc mode, small triangles in clusters of a few thousand
+// scattered through a cube, generated in order so they never have to be resident
+class SyntheticTriangles
+{
+public:
+	SyntheticTriangles()
+		: m_Rng(4321)
+		, m_Uniform(0.0f, 1.0f)
+		, m_Remaining(0)
+	{
+
+	}
+
+	void Next(float* positions)
+	{
+		if (m_Remaining == 0)
+		{
+			m_Center = Vector3(m_Uniform(m_Rng), m_Uniform(m_Rng), m_Uniform(m_Rng)) * 1000.0f;
+			m_Radius = 1.0f + m_Uniform(m_Rng) * 20.0f;
+			m_Remaining = 1000 + (int)(m_Uniform(m_Rng) * 4000.0f);
+		}
+		--m_Remaining;
+
+		Vector3 p = m_Center + Vector3(m_Uniform(m_Rng) - 0.5f, m_Uniform(m_Rng) - 0.5f, m_Uniform(m_Rng) - 0.5f) * m_Radius;
+		for (int v = 0; v < 3; ++v)
+		{
+			Vector3 q = p + Vector3(m_Uniform(m_Rng), m_Uniform(m_Rng), m_Uniform(m_Rng)) * (m_Radius * 0.02f);
+			positions[v * 3 + 0] = q.x;
+			positions[v * 3 + 1] = q.y;
+			positions[v * 3 + 2] = q.z;
+		}
+	}
+
+private:
+	std::mt19937 m_Rng;
+	std::uniform_real_distribution<float> m_Uniform;
+	Vector3 m_Center;
+	float m_Radius;
+	int m_Remaining;
+};
+
+static double PeakResidentMegabytes()
+{
+#if defined(_WIN32)
+	return 0.0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+static int BenchOutOfCore(const BenchOptions& options)
+{
+	std::string directory = options.scratchDirectory + "/";
+	RadeonRays::MakeDirectory(options.scratchDirectory);
+
+	// The input file is written in chunks, only file input is loaded whole
+	std::string inputPath = directory + "input.tri";
+	FILE* input = fopen(inputPath.c_str(), "wb");
+	if (!input)
+	{
+		printf("Unable to write %s\n", inputPath.c_str());
+		return 1;
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+	long long numTris = 0;
+	std::vector<float> chunk;
+
+	if (!options.files.empty())
+	{
+		std::vector<Vector3> vertices;
+		if (!LoadTriangles(options, vertices))
+		{
+			fclose(input);
+			remove(inputPath.c_str());
+			return 1;
+		}
+
+		for (const Vector3& v : vertices)
+		{
+			chunk.push_back(v.x);
+			chunk.push_back(v.y);
+			chunk.push_back(v.z);
+		}
+		numTris = (long long)vertices.size() / 3;
+		fwrite(&chunk[0], sizeof(float), chunk.size(), input);
+	}
+	else
+	{
+		SyntheticTriangles synthetic;
+		const int chunkTris = 65536;
+		chunk.resize(chunkTris * 9);
+
+		for (numTris = 0; numTris < options.numTriangles; )
+		{
+			int count = (int)std::min<long long>(chunkTris, options.numTriangles - numTris);
+			for (int t = 0; t < count; ++t) {
+				synthetic.Next(&chunk[t * 9]);
+			}
+			fwrite(&chunk[0], sizeof(float), (size_t)count * 9, input);
+			numTris += count;
+		}
+	}
+
+	bool written = fclose(input) == 0;
+	std::vector<float>().swap(chunk);
+	printf("%lld triangles written to %s in %.2f s\n", numTris, inputPath.c_str(), Seconds(start));
+
+	TaskThreadPool* pool = nullptr;
+	if (options.numThreads > 1)
+	{
+		pool = new TaskThreadPool();
+		pool->Create(options.numThreads);
+	}
+
+	RadeonRays::OutOfCoreBvh bvh(2.0f, directory, options.bucketTriangles);
+	bvh.SetMaxLeafSize(options.leafSize);
+	bvh.SetTaskPool(pool);
+
+	bool built = false;
+	{
+		RadeonRays::RawTriangleFile source(inputPath);
+		if (written && source.IsOpen()) {
+			built = bvh.Build(source);
+		}
+	}
+
+	if (!built)
+	{
+		printf("Out of core build failed\n");
+		remove(inputPath.c_str());
+		delete pool;
+		return 1;
+	}
+
+	const RadeonRays::OutOfCoreBvh::BuildStats& stats = bvh.GetBuildStats();
+	printf("%d buckets, largest %d triangles, %d refinements, %.1f MB written\n", stats.numBuckets, stats.largestBucket, stats.numRefinements, stats.bytesWritten / (1024.0 * 1024.0));
+	printf("partition %.0f ms, build %.0f ms, %d nodes, height %d, peak resident %.1f MB\n", stats.partitionMilliseconds, stats.buildMilliseconds, bvh.GetNumNodes(), bvh.GetHeight(), PeakResidentMegabytes());
+
+	// The in memory reference needs the triangle bounds resident
+	bool valid = true;
+	if (numTris <= 16 * 1024 * 1024)
+	{
+		std::vector<Bounds3D> bounds((size_t)numTris);
+		RadeonRays::RawTriangleFile source(inputPath);
+		std::vector<float> positions(65536 * 9);
+		for (long long first = 0; first < numTris; first += 65536)
+		{
+			int count = (int)std::min<long long>(65536, numTris - first);
+			source.Read((size_t)first, count, &positions[0]);
+
+			for (int t = 0; t < count; ++t)
+			{
+				for (int v = 0; v < 3; ++v)
+				{
+					const float* p = &positions[(t * 3 + v) * 3];
+					bounds[first + t].Expand(Vector3(p[0], p[1], p[2]));
+				}
+			}
+		}
+
+		valid = ValidateTree(bvh, &bounds[0], (int)bounds.size(), false);
+
+		RadeonRays::Bvh reference(2.0f, 64, true);
+		reference.SetMaxLeafSize(options.leafSize);
+		reference.SetTaskPool(pool);
+		start = std::chrono::high_resolution_clock::now();
+		reference.Build(&bounds[0], (int)bounds.size());
+		double referenceTime = Seconds(start);
+
+		printf("SAH cost %.2f, in memory SAH build %.2f in %.0f ms, tree %s\n", SahCost(bvh, 2.0f, options.intersectionCost),
+			SahCost(reference, 2.0f, options.intersectionCost), referenceTime * 1000.0, valid ? "valid" : "INVALID");
+	}
+
+	remove(inputPath.c_str());
+	delete pool;
+
+	return valid ? 0 : 1;
+}
+
+// Rays of the packets mode, packet p of width Size holds rays p * Size .. p * Size + Size - 1
+struct PacketRays
+{
+	std::vector<Vector3> origins;
+	std::vector<Vector3> directions;
+	std::vector<float> tmax;
+	std::vector<char> valid;
+};
+
+// Closest hit distances or tmax on a miss, or 1 for occluded rays and 0 for unoccluded ones
+static double TraceSingleRays(const BvhTraverser& traverser, const PacketRays& rays, bool occlusion, int repeats, std::vector<float>& results)
+{
+	int numRays = (int)rays.origins.size();
+
+	double best = 1e30;
+	for (int repeat = 0; repeat < repeats; ++repeat)
+	{
+		results.assign(numRays, 0.0f);
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < numRays; ++i)
+		{
+			if (!rays.valid[i]) {
+				continue;
+			}
+
+			if (occlusion)
+			{
+				results[i] = traverser.Occluded(rays.origins[i], rays.directions[i], rays.tmax[i]) ? 1.0f : 0.0f;
+			}
+			else
+			{
+				BvhTraverser::Hit hit;
+				results[i] = traverser.Intersect(rays.origins[i], rays.directions[i], rays.tmax[i], hit) ? hit.t : rays.tmax[i];
+			}
+		}
+		best = std::min(best, Seconds(start));
+	}
+
+	return best;
+}
+
+// Closest hit distances, or 1 for occluded rays and 0 for unoccluded ones
+template <int Size>
+static double TracePackets(const BvhTraverser& traverser, const PacketRays& rays, bool occlusion, int repeats, std::vector<float>& results)
+{
+	int numRays = (int)rays.origins.size();
+	results.assign(numRays, 0.0f);
+
+	double best = 1e30;
+	for (int repeat = 0; repeat < repeats; ++repeat)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int first = 0; first < numRays; first += Size)
+		{
+			RayPacket<Size> packet;
+			for (int lane = 0; lane < Size; ++lane)
+			{
+				if (rays.valid[first + lane]) {
+					packet.SetRay(lane, rays.origins[first + lane], rays.directions[first + lane], rays.tmax[first + lane]);
+				}
+			}
+
+			if (occlusion)
+			{
+				uint32 occluded = traverser.Occluded(packet);
+				for (int lane = 0; lane < Size; ++lane) {
+					results[first + lane] = (occluded >> lane) & 1 ? 1.0f : 0.0f;
+				}
+			}
+			else
+			{
+				traverser.Intersect(packet);
+				for (int lane = 0; lane < Size; ++lane) {
+					results[first + lane] = packet.active & (1u << lane) ? packet.tmax[lane] : 0.0f;
+				}
+			}
+		}
+		best = std::min(best, Seconds(start));
+	}
+
+	return best;
+}
+
+static int BenchPackets(const BenchOptions& options)
+{
+	if (options.files.empty()) {
+		return 1;
+	}
+
+	Scene* scene = new Scene();
+	RenderOptions renderOptions;
+	if (!LoadSceneFromFile(options.files[0], scene, renderOptions)) {
+		return 1;
+	}
+
+	BvhTraverser traverser(scene);
+	traverser.UpdateTransforms();
+	if (options.fallbackLanes >= 0) {
+		traverser.SetFallbackLanes(options.fallbackLanes);
+	}
+
+	// Pixel centers of the camera in 4x4 blocks with Morton order inside, so every 4, 8 and 16
+	// consecutive rays cover 2x2, 4x2 and 4x4 pixels. The resolution is rounded up to whole blocks.
+	int width  = ((int)renderOptions.windowSize.x + 3) & ~3;
+	int height = ((int)renderOptions.windowSize.y + 3) & ~3;
+
+	Camera* camera = scene->camera;
+	Vector3 eye     = camera->GetPosition();
+	Vector3 right   = camera->GetLeft();
+	Vector3 up      = camera->GetUp();
+	Vector3 forward = camera->GetForward();
+	float scale = tanf(camera->GetFov() * 0.5f);
+
+	PacketRays primary;
+	for (int by = 0; by < height; by += 4)
+	{
+		for (int bx = 0; bx < width; bx += 4)
+		{
+			for (int i = 0; i < 16; ++i)
+			{
+				int x = bx + (i & 1) + ((i >> 1) & 2);
+				int y = by + ((i >> 1) & 1) + ((i >> 2) & 2);
+
+				float dx = (2.0f * (x + 0.5f) / width - 1.0f) * scale;
+				float dy = (2.0f * (y + 0.5f) / height - 1.0f) * scale * height / width;
+
+				Vector3 dir = right * dx + up * dy + forward;
+				dir.Normalize();
+
+				primary.origins.push_back(eye);
+				primary.directions.push_back(dir);
+				primary.tmax.push_back(1e6f);
+				primary.valid.push_back(1);
+			}
+		}
+	}
+
+	int numRays = (int)primary.origins.size();
+
+	std::vector<float> reference[2];
+	double singleTime[2];
+
+	singleTime[0] = TraceSingleRays(traverser, primary, false, options.repeats, reference[0]);
+
+	// Shadow rays from the hits towards a point on a light, or the sky above without lights
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+	PacketRays shadow;
+	int numShadowRays = 0;
+	for (int i = 0; i < numRays; ++i)
+	{
+		Vector3 hitPoint = primary.origins[i] + primary.directions[i] * reference[0][i];
+
+		Vector3 target = hitPoint + Vector3(0.3f, 1.0f, 0.2f) * 1e4f;
+		if (!scene->lights.empty())
+		{
+			const Light& light = scene->lights[i % scene->lights.size()];
+			target = light.type == 0.0f ? light.position + light.u * uniform(rng) + light.v * uniform(rng) : light.position;
+		}
+
+		Vector3 dir = target - hitPoint;
+		float dist  = dir.Size();
+		dir = dir / dist;
+
+		bool valid = reference[0][i] < primary.tmax[i] && dist > 0.01f;
+		numShadowRays += valid;
+
+		// Pulled off the surface along the ray so the surface itself is not hit
+		shadow.origins.push_back(hitPoint + dir * 0.001f);
+		shadow.directions.push_back(dir);
+		shadow.tmax.push_back(dist - 0.002f);
+		shadow.valid.push_back(valid);
+	}
+
+	singleTime[1] = TraceSingleRays(traverser, shadow, true, options.repeats, reference[1]);
+
+	int numOccluded = 0;
+	for (int i = 0; i < numRays; ++i) {
+		numOccluded += reference[1][i] > 0.0f;
+	}
+
+	printf("%d x %d pixels, %d primary rays, %d shadow rays (%d occluded), %d nodes, fallback at %d lanes\n", width, height, numRays, numShadowRays, numOccluded,
+		   (int)scene->bvhTranslator.nodes.size(), traverser.GetFallbackLanes());
+	printf("%8s %8s %10s %8s %10s\n", "rays", "width", "Mrays/s", "speedup", "mismatch");
+
+	const PacketRays* sets[] = { &primary, &shadow };
+	const char* setNames[] = { "primary", "shadow" };
+	int rayCounts[] = { numRays, numShadowRays };
+	bool valid = true;
+	double packetTime[2] = { 1e30, 1e30 };
+
+	for (int set = 0; set < 2; ++set)
+	{
+		printf("%8s %8s %10.2f %8.2f %10d\n", setNames[set], "single", rayCounts[set] / singleTime[set] * 1e-6, 1.0, 0);
+
+		for (int width = 4; width <= 16; width *= 2)
+		{
+			std::vector<float> results;
+			double seconds = width == 4 ? TracePackets<4>(traverser, *sets[set], set == 1, options.repeats, results) :
+							 width == 8 ? TracePackets<8>(traverser, *sets[set], set == 1, options.repeats, results) :
+										  TracePackets<16>(traverser, *sets[set], set == 1, options.repeats, results);
+
+			// Closest hits may differ in the last bits, the packet kernel multiplies by 1 / det
+			int mismatches = 0;
+			for (int i = 0; i < numRays; ++i)
+			{
+				if (sets[set]->valid[i] && fabsf(results[i] - reference[set][i]) > 1e-4f * std::max(reference[set][i], 1.0f)) {
+					mismatches++;
+				}
+			}
+			valid &= mismatches == 0;
+
+			if (width == 8) {
+				packetTime[set] = seconds;
+			}
+
+			printf("%8s %8d %10.2f %8.2f %10d\n", setNames[set], width, rayCounts[set] / seconds * 1e-6, singleTime[set] / seconds, mismatches);
+		}
+	}
+
+	// All shadow rays as one occlusion batch, grouped by the instance leaves they enter
+	OcclusionBatch batch;
+	double batchTime = 1e30;
+	for (int repeat = 0; repeat < options.repeats; ++repeat)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		batch.Clear();
+		for (int i = 0; i < numRays; ++i)
+		{
+			if (shadow.valid[i]) {
+				batch.Add(shadow.origins[i], shadow.directions[i], shadow.tmax[i]);
+			}
+		}
+		traverser.Occluded(batch, nullptr);
+		batchTime = std::min(batchTime, Seconds(start));
+	}
+
+	int batchMismatches = 0;
+	for (int i = 0, query = 0; i < numRays; ++i)
+	{
+		if (shadow.valid[i] && batch.IsOccluded(query++) != (reference[1][i] > 0.0f)) {
+			batchMismatches++;
+		}
+	}
+	valid &= batchMismatches == 0;
+
+	printf("%8s %8s %10.2f %8.2f %10d\n", "shadow", "batch", numShadowRays / batchTime * 1e-6, singleTime[1] / batchTime, batchMismatches);
+
+	// The same rays against the triangle blocks, speedups relative to the indexed triangles above
+	traverser.UpdateTriangleBlocks();
+
+	size_t indexedBytes = scene->vertIndices.size() * sizeof(Indices) + scene->verticesUVX.size() * sizeof(Vector4);
+	size_t blockBytes   = traverser.GetTriangleBlocks().size() * sizeof(TriangleBlock) + traverser.GetLeafBlocks().size() * sizeof(int);
+	printf("%d triangles, indexed %.2f MB, blocks %.2f MB\n", (int)scene->vertIndices.size(), indexedBytes / (1024.0 * 1024.0), blockBytes / (1024.0 * 1024.0));
+
+	for (int set = 0; set < 2; ++set)
+	{
+		for (int packet = 0; packet < 2; ++packet)
+		{
+			std::vector<float> results;
+			double seconds = packet == 0 ? TraceSingleRays(traverser, *sets[set], set == 1, options.repeats, results) :
+										  TracePackets<8>(traverser, *sets[set], set == 1, options.repeats, results);
+
+			int mismatches = 0;
+			for (int i = 0; i < numRays; ++i)
+			{
+				if (sets[set]->valid[i] && fabsf(results[i] - reference[set][i]) > 1e-4f * std::max(reference[set][i], 1.0f)) {
+					mismatches++;
+				}
+			}
+			valid &= mismatches == 0;
+
+			double indexedTime = packet == 0 ? singleTime[set] : packetTime[set];
+			printf("%8s %8s %10.2f %8.2f %10d\n", setNames[set], packet == 0 ? "block1" : "block8", rayCounts[set] / seconds * 1e-6, indexedTime / seconds, mismatches);
+		}
+	}
+
+	// The binary texels include the top level reserved for re-braiding and the texture padding
+	const RadeonRays::BvhTranslator& translator = scene->bvhTranslator;
+	size_t binaryBytes = translator.nodes.size() * sizeof(RadeonRays::BvhTranslator::Node) + (translator.bboxmin.size() + translator.bboxmax.size()) * sizeof(Vector3);
+
+	// The whole scene as quantized 4-wide nodes, speedups relative to the binary nodes with indexed
+	// triangles. The binary scene goes first, its idle workers would share the cores otherwise.
+	delete scene;
+
+	Scene* compressedScene = new Scene();
+	RenderOptions compressedOptions;
+	compressedOptions.compressedBvh = true;
+	if (!LoadSceneFromFile(options.files[0], compressedScene, compressedOptions))
+	{
+		delete compressedScene;
+		return 1;
+	}
+
+	BvhTraverser compressedTraverser(compressedScene);
+	compressedTraverser.UpdateTransforms();
+
+	const RadeonRays::CompressedBvhTranslator& compressed = compressedScene->compressedBvhTranslator;
+	printf("scene bvh: binary %.2f MB (%.2f MB of nodes in use), compressed %.2f MB (%.1f%%)\n", binaryBytes / (1024.0 * 1024.0),
+		   compressed.GetBinaryMemorySize() / (1024.0 * 1024.0), compressed.GetMemorySize() / (1024.0 * 1024.0),
+		   100.0 * compressed.GetMemorySize() / compressed.GetBinaryMemorySize());
+
+	for (int set = 0; set < 2; ++set)
+	{
+		for (int packet = 0; packet < 2; ++packet)
+		{
+			std::vector<float> results;
+			double seconds = packet == 0 ? TraceSingleRays(compressedTraverser, *sets[set], set == 1, options.repeats, results) :
+										  TracePackets<8>(compressedTraverser, *sets[set], set == 1, options.repeats, results);
+
+			int mismatches = 0;
+			for (int i = 0; i < numRays; ++i)
+			{
+				if (sets[set]->valid[i] && fabsf(results[i] - reference[set][i]) > 1e-4f * std::max(reference[set][i], 1.0f)) {
+					mismatches++;
+				}
+			}
+			valid &= mismatches == 0;
+
+			double indexedTime = packet == 0 ? singleTime[set] : packetTime[set];
+			printf("%8s %8s %10.2f %8.2f %10d\n", setNames[set], packet == 0 ? "wide1" : "wide8", rayCounts[set] / seconds * 1e-6, indexedTime / seconds, mismatches);
+		}
+	}
+
+	delete compressedScene;
+
+	return valid ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		printf("usage: BvhBench build|binning|builders|treelets|wide|tlas|esc|layout|flatten|scale|ooc|packets [-threads N] [-replicate K] [-repeats R] [-leafsize L] [-isectcost C] [-treelet T] [-instances N] [-rays R] [-rotate D] [-meshes M] [-tris T] [-bucket B] [-scratch dir] [-fallback F] file.obj|file.scene ...\n");
+		return 1;
+	}
+
+	BenchOptions options;
+	std::string mode = argv[1];
+
+	for (int i = 2; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+			options.numThreads = std::max(atoi(argv[++i]), 1);
+		}
+		else if (strcmp(argv[i], "-replicate") == 0 && i + 1 < argc) {
+			options.replicate = std::max(atoi(argv[++i]), 1);
+		}
+		else if (strcmp(argv[i], "-repeats") == 0 && i + 1 < argc) {
+			options.repeats = std::max(atoi(argv[++i]), 1);
+		}
+		else if (strcmp(argv[i], "-leafsize") == 0 && i + 1 < argc) {
+			options.leafSize = std::max(atoi(argv[++i]), 1);
+		}
+		else if (strcmp(argv[i], "-isectcost") == 0 && i + 1 < argc) {
+			options.intersectionCost = std::max((float)atof(argv[++i]), 0.001f);
+		}
+		else if (strcmp(argv[i], "-treelet") == 0 && i + 1 < argc) {
+			options.treeletSize = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-instances") == 0 && i + 1 < argc) {
+			options.numInstances = std::max(atoi(argv[++i]), 1);
+		}
+		else if (strcmp(argv[i], "-rays") == 0 && i + 1 < argc) {
+			options.numRays = std::max(atoi(argv[++i]), 1);
+		}
+		else if (strcmp(argv[i], "-meshes") == 0 && i + 1 < argc) {
+			options.numMeshes = std::max(atoi(argv[++i]), 1);
+		}
+		else if (strcmp(argv[i], "-rotate") == 0 && i + 1 < argc) {
+			options.rotation = (float)atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-tris") == 0 && i + 1 < argc) {
+			options.numTriangles = std::max(atoll(argv[++i]), 1LL);
+		}
+		else if (strcmp(argv[i], "-bucket") == 0 && i + 1 < argc) {
+			options.bucketTriangles = std::max(atoi(argv[++i]), 1);
+		}
+		else if (strcmp(argv[i], "-scratch") == 0 && i + 1 < argc) {
+			options.scratchDirectory = argv[++i];
+		}
+		else if (strcmp(argv[i], "-fallback") == 0 && i + 1 < argc) {
+			options.fallbackLanes = std::max(atoi(argv[++i]), 0);
+		}
+		else {
+			options.files.push_back(argv[i]);
+		}
+	}
+
+	if (mode == "build") {
+		return BenchBuild(options);
+	}
+	else if (mode == "binning") {
+		return BenchBinning(options);
+	}
+	else if (mode == "builders") {
+		return BenchBuilders(options);
+	}
+	else if (mode == "treelets") {
+		return BenchTreelets(options);
+	}
+	else if (mode == "wide") {
+		return BenchWide(options);
+	}
+	else if (mode == "tlas") {
+		return BenchTlas(options);
+	}
+	else if (mode == "esc") {
+		return BenchEarlySplit(options);
+	}
+	else if (mode == "layout") {
+		return BenchLayout(options);
+	}
+	else if (mode == "flatten") {
+		return BenchFlatten(options);
+	}
+	else if (mode == "scale") {
+		return BenchScale(options);
+	}
+	else if (mode == "packets") {
+		return BenchPackets(options);
+	}
+	else if (mode == "ooc") {
+		return BenchOutOfCore(options);
+	}
+
+	printf("Unknown mode %s\n", mode.c_str());
+	return 1;
+}
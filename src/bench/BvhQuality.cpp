@@ -0,0 +1,247 @@
+/*
+	BVH quality report for nightly runs, from the repo root:
+
+	BvhQuality [-bvh split|sah|lbvh|ploc|esc] [-leafsize L] [-isectcost C] [-treelet T] [-layout build|dfs|hot|bfs|veb]
+			   [-threads N] [-noepo] [-o report.json] file.obj ...
+		Builds the BVH of every mesh with the builder and parameters of the scene file keywords,
+		places one instance of each at the origin under a SAH top level BVH, flattens them through
+		BvhTranslator and writes a JSON report to stdout or the -o file: per mesh tree SAH cost,
+		end-point overlap, leaf size and depth histograms, empty and degenerate nodes and memory
+		per level, the same for the top level tree, and the node texture of the flattened output.
+		-noepo skips the end-point overlap, which clips every triangle against the nodes it overlaps.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+#include "core/Mesh.h"
+#include "bvh/Bvh.h"
+#include "bvh/BvhAnalyzer.h"
+#include "bvh/BvhTranslator.h"
+#include "job/TaskThreadPool.h"
+
+using namespace GLSLPT;
+
+struct QualityOptions
+{
+	int numThreads = std::max((int)std::thread::hardware_concurrency(), 1);
+	std::string bvhName = "split";
+	BvhType bvhType = SPLIT_BVH;
+	int leafSize = 4;
+	float intersectionCost = 1.0f;
+	int treeletSize = 0;
+	std::string layoutName = "build";
+	RadeonRays::Bvh::NodeLayout nodeLayout = RadeonRays::Bvh::kBuildOrder;
+	bool epo = true;
+	std::string output;
+	std::vector<std::string> files;
+};
+
+static double Milliseconds(std::chrono::high_resolution_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+static std::string JsonString(const std::string& value)
+{
+	std::string json = "\"";
+	for (char c : value)
+	{
+		if (c == '"' || c == '\\') {
+			json += '\\';
+		}
+		json += c;
+	}
+	return json + "\"";
+}
+
+static bool ParseBvhType(const char* name, BvhType& type)
+{
+	const char* names[] = { "split", "sah", "lbvh", "ploc", "esc" };
+	const BvhType types[] = { SPLIT_BVH, SAH_BVH, LINEAR_BVH, PLOC_BVH, EARLY_SPLIT_BVH };
+
+	for (int i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+	{
+		if (strcmp(name, names[i]) == 0)
+		{
+			type = types[i];
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool ParseNodeLayout(const char* name, RadeonRays::Bvh::NodeLayout& layout)
+{
+	const char* names[] = { "build", "dfs", "hot", "bfs", "veb" };
+	const RadeonRays::Bvh::NodeLayout layouts[] = { RadeonRays::Bvh::kBuildOrder, RadeonRays::Bvh::kDepthFirst, RadeonRays::Bvh::kHotChildFirst,
+													RadeonRays::Bvh::kBreadthFirstTop, RadeonRays::Bvh::kVanEmdeBoas };
+
+	for (int i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+	{
+		if (strcmp(name, names[i]) == 0)
+		{
+			layout = layouts[i];
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int main(int argc, char** argv)
+{
+	QualityOptions options;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-bvh") == 0 && i + 1 < argc)
+		{
+			options.bvhName = argv[++i];
+			if (!ParseBvhType(argv[i], options.bvhType))
+			{
+				printf("Unknown bvh type %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-layout") == 0 && i + 1 < argc)
+		{
+			options.layoutName = argv[++i];
+			if (!ParseNodeLayout(argv[i], options.nodeLayout))
+			{
+				printf("Unknown node layout %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+			options.numThreads = std::max(atoi(argv[++i]), 1);
+		}
+		else if (strcmp(argv[i], "-leafsize") == 0 && i + 1 < argc) {
+			options.leafSize = std::max(atoi(argv[++i]), 1);
+		}
+		else if (strcmp(argv[i], "-isectcost") == 0 && i + 1 < argc) {
+			options.intersectionCost = std::max((float)atof(argv[++i]), 0.001f);
+		}
+		else if (strcmp(argv[i], "-treelet") == 0 && i + 1 < argc) {
+			options.treeletSize = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-noepo") == 0) {
+			options.epo = false;
+		}
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			options.output = argv[++i];
+		}
+		else {
+			options.files.push_back(argv[i]);
+		}
+	}
+
+	if (options.files.empty())
+	{
+		printf("usage: BvhQuality [-bvh split|sah|lbvh|ploc|esc] [-leafsize L] [-isectcost C] [-treelet T] [-layout build|dfs|hot|bfs|veb] [-threads N] [-noepo] [-o report.json] file.obj ...\n");
+		return 1;
+	}
+
+	TaskThreadPool* pool = nullptr;
+	if (options.numThreads > 1)
+	{
+		pool = new TaskThreadPool();
+		pool->Create(options.numThreads);
+	}
+
+	RadeonRays::BvhAnalyzer analyzer;
+	analyzer.SetTaskPool(pool);
+
+	std::vector<Mesh*> meshes;
+	std::vector<MeshInstance> instances;
+	std::vector<RadeonRays::InstanceRef> refs;
+	std::vector<Bounds3D> instanceBounds;
+	std::vector<std::string> meshReports;
+
+	for (int i = 0; i < options.files.size(); ++i)
+	{
+		Mesh* mesh = new Mesh();
+		if (!mesh->LoadFromFile(options.files[i])) {
+			return 1;
+		}
+
+		mesh->SetBvhType(options.bvhType);
+		mesh->SetLeafParams(options.leafSize, options.intersectionCost);
+		mesh->SetTreeletOptimization(options.treeletSize);
+		mesh->SetNodeLayout(options.nodeLayout);
+		mesh->bvh->SetTaskPool(pool);
+
+		auto start = std::chrono::high_resolution_clock::now();
+		mesh->BuildBVH();
+		double buildTime = Milliseconds(start);
+
+		analyzer.SetTriangles(options.epo && !mesh->verticesUVX.empty() ? &mesh->verticesUVX[0].x : nullptr, 4);
+
+		start = std::chrono::high_resolution_clock::now();
+		RadeonRays::BvhReport report = analyzer.Analyze(*mesh->bvh);
+		double analyzeTime = Milliseconds(start);
+
+		char header[256];
+		snprintf(header, sizeof(header), "      \"triangles\": %d,\n      \"buildMilliseconds\": %.3f,\n      \"analyzeMilliseconds\": %.3f,\n",
+				 (int)mesh->verticesUVX.size() / 3, buildTime, analyzeTime);
+
+		meshReports.push_back("    {\n      \"file\": " + JsonString(options.files[i]) + ",\n" + header + "      \"tree\": " + report.ToJson(6) + "\n    }");
+
+		instances.push_back(MeshInstance(i, Matrix4x4(), 0, mesh->name));
+		refs.push_back(RadeonRays::InstanceRef{ i, 0 });
+		instanceBounds.push_back(mesh->bvh->Bounds());
+		meshes.push_back(mesh);
+	}
+
+	RadeonRays::Bvh tlas(10.0f, 64, true);
+	tlas.Build(&instanceBounds[0], (int)instanceBounds.size());
+
+	RadeonRays::BvhTranslator translator;
+	translator.SetTaskPool(pool);
+	translator.Process(&tlas, meshes, instances, refs, (int)refs.size());
+
+	analyzer.SetTriangles(nullptr, 0);
+	RadeonRays::BvhReport tlasReport = analyzer.Analyze(tlas);
+	RadeonRays::FlattenedBvhReport flattenedReport = analyzer.Analyze(translator);
+
+	char params[512];
+	snprintf(params, sizeof(params), "  \"bvh\": %s,\n  \"leafSize\": %d,\n  \"intersectionCost\": %g,\n  \"treeletSize\": %d,\n  \"layout\": %s,\n",
+			 JsonString(options.bvhName).c_str(), options.leafSize, options.intersectionCost, options.treeletSize, JsonString(options.layoutName).c_str());
+
+	std::string json = std::string("{\n") + params + "  \"meshes\": [\n";
+	for (int i = 0; i < meshReports.size(); ++i) {
+		json += meshReports[i] + (i + 1 < meshReports.size() ? ",\n" : "\n");
+	}
+	json += "  ],\n  \"tlas\": " + tlasReport.ToJson(2) + ",\n  \"flattened\": " + flattenedReport.ToJson(2) + "\n}\n";
+
+	if (options.output.empty()) {
+		fputs(json.c_str(), stdout);
+	}
+	else
+	{
+		FILE* file = fopen(options.output.c_str(), "wb");
+		if (!file || fwrite(json.data(), 1, json.size(), file) != json.size())
+		{
+			printf("Could not write %s\n", options.output.c_str());
+			if (file) {
+				fclose(file);
+			}
+			return 1;
+		}
+		fclose(file);
+	}
+
+	for (int i = 0; i < meshes.size(); ++i) {
+		delete meshes[i];
+	}
+	delete pool;
+
+	return 0;
+}
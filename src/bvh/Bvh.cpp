@@ -21,15 +21,31 @@ THE SOFTWARE.
 ********************************************************************/
 #include <vector>
 #include <algorithm>
+#include <cassert>
 #include <limits>
 #include <numeric>
+#include <chrono>
 
 #include "Bvh.h"
+#include "BvhCache.h"
+#include "SahBinning.h"
 #include "math/Vector3.h"
+#include "job/TaskGroup.h"
 
 namespace RadeonRays
 {
-    static const int kMaxPrimitivesPerLeaf = 1;
+    // Both children need at least this many primitives before one of them is sent to the pool
+    static const int kMinPrimitivesPerTask = 4096;
+    // Nodes this large are binned and partitioned in chunks
+    static const int kMinPrimitivesForParallelSplit = 65536;
+    // Primitives per binning/partitioning chunk
+    static const int kPrimitivesPerChunk = 16384;
+    // Largest treelet, the optimizer keeps 2^n subsets per treelet
+    static const int kMaxTreeletSize = 10;
+    // Leaves climbing the tree per task of the treelet optimizer
+    static const int kTreeletLeavesPerChunk = 2048;
+    // Levels kept breadth first by the kBreadthFirstTop layout, 127 nodes
+    static const int kBreadthFirstLevels = 7;
 
     static bool IsNaN(float v)
     {
@@ -38,6 +54,9 @@ namespace RadeonRays
 
     void Bvh::Build(const Bounds3D* bounds, int numbounds)
     {
+        m_Bounds = Bounds3D();
+        m_Height = 0;
+
         for (int i = 0; i < numbounds; ++i)
         {
             // Calc bbox
@@ -45,6 +64,919 @@ namespace RadeonRays
         }
 
         BuildImpl(bounds, numbounds);
+
+        ResetRefitState();
+    }
+
+    void Bvh::ResetRefitState()
+    {
+        m_Parents.clear();
+        m_RefitLeaves.clear();
+        m_PrimitiveLeaves.clear();
+        m_UpdatePending.clear();
+        m_RefitVisits.reset();
+        m_RefitSahRatio = 1.0f;
+    }
+
+    void Bvh::HashBuildParams(ContentHash& hash) const
+    {
+        hash.Add(m_TraversalCost);
+        hash.Add(m_IntersectionCost);
+        hash.Add(m_MaxPrimitivesPerLeaf);
+        hash.Add(m_NumBins);
+        hash.Add(m_Usesah ? 1 : 0);
+    }
+
+    bool Bvh::Refit(const Bounds3D* bounds, int numbounds)
+    {
+        if (m_Nodes.empty())
+        {
+            Build(bounds, numbounds);
+            return false;
+        }
+
+        int numnodes = (int)m_Nodes.size();
+
+        InitRefitState();
+
+        TaskGroup::ParallelFor(m_TaskPool, numnodes, kPrimitivesPerChunk, [&](int32 begin, int32 end)
+        {
+            for (int i = begin; i < end; ++i) {
+                m_RefitVisits[i] = 0;
+            }
+        });
+
+        // Leaves are refitted in parallel, the second child to arrive at a node merges both.
+        // Every chunk sums the area weighted costs of the nodes it finished.
+        float traversalCost = NormalizedTraversalCost();
+        int numleaves = (int)m_RefitLeaves.size();
+        std::vector<double> chunkCosts((numleaves + kPrimitivesPerChunk - 1) / kPrimitivesPerChunk, 0.0);
+
+        TaskGroup::ParallelFor(m_TaskPool, numleaves, kPrimitivesPerChunk, [&](int32 begin, int32 end)
+        {
+            double cost = 0.0;
+
+            for (int i = begin; i < end; ++i)
+            {
+                int idx = m_RefitLeaves[i];
+                Node& leaf = m_Nodes[idx];
+
+                Bounds3D leafbounds;
+                for (int j = leaf.startidx; j < leaf.startidx + leaf.numprims; ++j) {
+                    leafbounds.Expand(bounds[m_PackedIndices[j]]);
+                }
+
+                leaf.bounds = leafbounds;
+                cost += leaf.numprims * leafbounds.Area();
+
+                int parent = m_Parents[idx];
+                while (parent != -1 && m_RefitVisits[parent].fetch_add(1) == 1)
+                {
+                    Node& node  = m_Nodes[parent];
+                    node.bounds = Bounds3D::Union(m_Nodes[node.lc].bounds, m_Nodes[node.rc].bounds);
+                    cost += traversalCost * node.bounds.Area();
+                    parent = m_Parents[parent];
+                }
+            }
+
+            chunkCosts[begin / kPrimitivesPerChunk] = cost;
+        });
+
+        m_SahCostSum = std::accumulate(chunkCosts.begin(), chunkCosts.end(), 0.0);
+
+        return !RebuildIfDegraded(bounds, numbounds);
+    }
+
+    Bvh::UpdateStats Bvh::UpdatePrimitives(const Bounds3D* bounds, int numbounds, const std::vector<int>& primitives, std::vector<int>& dirtyNodes)
+    {
+        UpdateStats stats = { 0, false };
+
+        if (!m_Nodes.empty())
+        {
+            InitRefitState();
+        }
+
+        // Primitives referenced by several leaves are left to a full refit
+        if (m_Nodes.empty() || m_HasDuplicateRefs)
+        {
+            stats.rebuilt = !Refit(bounds, numbounds);
+
+            for (int i = 0; i < (int)m_Nodes.size(); ++i) {
+                dirtyNodes.push_back(i);
+            }
+
+            return stats;
+        }
+
+        float traversalCost = NormalizedTraversalCost();
+        size_t firstDirty = dirtyNodes.size();
+        std::vector<int> worklist;
+
+        // Refit the leaves and count for every ancestor how many of its children changed,
+        // leaves are marked with -1 so primitives sharing one are refitted once
+        for (int prim : primitives)
+        {
+            int leafidx = m_PrimitiveLeaves[prim];
+            if (m_UpdatePending[leafidx] < 0) {
+                continue;
+            }
+
+            m_UpdatePending[leafidx] = -1;
+
+            Node& leaf = m_Nodes[leafidx];
+            Bounds3D leafbounds;
+            for (int i = leaf.startidx; i < leaf.startidx + leaf.numprims; ++i) {
+                leafbounds.Expand(bounds[m_PackedIndices[i]]);
+            }
+
+            m_SahCostSum += leaf.numprims * (leafbounds.Area() - leaf.bounds.Area());
+            leaf.bounds = leafbounds;
+
+            worklist.push_back(leafidx);
+            dirtyNodes.push_back(leafidx);
+
+            // Ancestors already counted from another leaf have their own ancestors counted too
+            for (int parent = m_Parents[leafidx]; parent != -1; parent = m_Parents[parent])
+            {
+                if (m_UpdatePending[parent]++ > 0) {
+                    break;
+                }
+            }
+        }
+
+        // A node is refitted once all its changed children are done, every changed node
+        // below it is final by then, so rotating its subtree cannot move pending nodes
+        while (!worklist.empty())
+        {
+            int idx = worklist.back();
+            worklist.pop_back();
+
+            int parent = m_Parents[idx];
+            if (parent == -1 || --m_UpdatePending[parent] > 0) {
+                continue;
+            }
+
+            Node& node = m_Nodes[parent];
+            Bounds3D nodebounds = Bounds3D::Union(m_Nodes[node.lc].bounds, m_Nodes[node.rc].bounds);
+
+            m_SahCostSum += traversalCost * (nodebounds.Area() - node.bounds.Area());
+            node.bounds = nodebounds;
+            dirtyNodes.push_back(parent);
+
+            if (RotateNode(parent, dirtyNodes)) {
+                ++stats.numRotations;
+            }
+
+            worklist.push_back(parent);
+        }
+
+        for (size_t i = firstDirty; i < dirtyNodes.size(); ++i) {
+            m_UpdatePending[dirtyNodes[i]] = 0;
+        }
+
+        if (RebuildIfDegraded(bounds, numbounds))
+        {
+            stats.rebuilt = true;
+
+            dirtyNodes.resize(firstDirty);
+            for (int i = 0; i < (int)m_Nodes.size(); ++i) {
+                dirtyNodes.push_back(i);
+            }
+        }
+
+        return stats;
+    }
+
+    bool Bvh::RotateNode(int nodeidx, std::vector<int>& dirtyNodes)
+    {
+        auto child = [this](int idx, int slot) -> int&
+        {
+            return slot == 0 ? m_Nodes[idx].lc : m_Nodes[idx].rc;
+        };
+
+        auto area = [this](int a, int b) -> float
+        {
+            return Bounds3D::Union(m_Nodes[a].bounds, m_Nodes[b].bounds).Area();
+        };
+
+        const int children[2] = { m_Nodes[nodeidx].lc, m_Nodes[nodeidx].rc };
+
+        // Only the bounds of the children change, ignore rotations gaining less than this
+        float bestDelta = -1e-4f * m_Nodes[nodeidx].bounds.Area();
+        int bestFrom = -1;
+        int bestFromSlot = 0;
+        int bestTo = -1;
+        int bestToSlot = 0;
+
+        // Swap a child of the node with a grandchild below its sibling
+        for (int c = 0; c < 2; ++c)
+        {
+            int sibling = children[1 - c];
+            if (m_Nodes[sibling].type != kInternal) {
+                continue;
+            }
+
+            for (int g = 0; g < 2; ++g)
+            {
+                float delta = area(children[c], child(sibling, 1 - g)) - m_Nodes[sibling].bounds.Area();
+                if (delta < bestDelta)
+                {
+                    bestDelta    = delta;
+                    bestFrom     = nodeidx;
+                    bestFromSlot = c;
+                    bestTo       = sibling;
+                    bestToSlot   = g;
+                }
+            }
+        }
+
+        // Swap the left grandchild of the left child with a grandchild of the right child
+        int left  = children[0];
+        int right = children[1];
+        if (m_Nodes[left].type == kInternal && m_Nodes[right].type == kInternal)
+        {
+            float childArea = m_Nodes[left].bounds.Area() + m_Nodes[right].bounds.Area();
+
+            for (int g = 0; g < 2; ++g)
+            {
+                float delta = area(child(right, g), m_Nodes[left].rc) + area(m_Nodes[left].lc, child(right, 1 - g)) - childArea;
+                if (delta < bestDelta)
+                {
+                    bestDelta    = delta;
+                    bestFrom     = left;
+                    bestFromSlot = 0;
+                    bestTo       = right;
+                    bestToSlot   = g;
+                }
+            }
+        }
+
+        if (bestFrom == -1) {
+            return false;
+        }
+
+        int& from = child(bestFrom, bestFromSlot);
+        int& to   = child(bestTo, bestToSlot);
+        std::swap(from, to);
+        m_Parents[from] = bestFrom;
+        m_Parents[to]   = bestTo;
+
+        // Refit the internal nodes that received a new child, the rotated node keeps its bounds
+        float traversalCost = NormalizedTraversalCost();
+        int changed[2] = { bestTo, bestFrom == nodeidx ? -1 : bestFrom };
+
+        for (int idx : changed)
+        {
+            if (idx == -1) {
+                continue;
+            }
+
+            Node& node = m_Nodes[idx];
+            Bounds3D nodebounds = Bounds3D::Union(m_Nodes[node.lc].bounds, m_Nodes[node.rc].bounds);
+
+            m_SahCostSum += traversalCost * (nodebounds.Area() - node.bounds.Area());
+            node.bounds = nodebounds;
+            dirtyNodes.push_back(idx);
+        }
+
+        dirtyNodes.push_back(nodeidx);
+        return true;
+    }
+
+    void Bvh::InitRefitState()
+    {
+        // Parent links and leaves do not change until the next build
+        if (!m_Parents.empty()) {
+            return;
+        }
+
+        int numnodes = (int)m_Nodes.size();
+        m_Parents.assign(numnodes, -1);
+        m_UpdatePending.assign(numnodes, 0);
+
+        int numprims = m_PackedIndices.empty() ? 0 : *std::max_element(m_PackedIndices.begin(), m_PackedIndices.end()) + 1;
+        m_PrimitiveLeaves.assign(numprims, -1);
+        m_HasDuplicateRefs = false;
+
+        for (int i = 0; i < numnodes; ++i)
+        {
+            const Node& node = m_Nodes[i];
+            if (node.type == kInternal)
+            {
+                m_Parents[node.lc] = i;
+                m_Parents[node.rc] = i;
+            }
+            else
+            {
+                m_RefitLeaves.push_back(i);
+
+                for (int j = node.startidx; j < node.startidx + node.numprims; ++j)
+                {
+                    int& leaf = m_PrimitiveLeaves[m_PackedIndices[j]];
+                    m_HasDuplicateRefs |= leaf != -1;
+                    leaf = i;
+                }
+            }
+        }
+
+        m_RefitVisits.reset(new std::atomic<int>[numnodes]);
+        m_BuildSahCost = GetSahCost();
+        m_SahCostSum   = (double)m_BuildSahCost * m_Nodes[0].bounds.Area();
+    }
+
+    bool Bvh::RebuildIfDegraded(const Bounds3D* bounds, int numbounds)
+    {
+        m_Bounds = m_Nodes[0].bounds;
+
+        float rootarea = m_Bounds.Area();
+        float cost = rootarea > 0.0f ? (float)(m_SahCostSum / rootarea) : 0.0f;
+
+        m_RefitSahRatio = m_BuildSahCost > 0.0f ? cost / m_BuildSahCost : 1.0f;
+
+        if (m_RefitThreshold > 0.0f && m_RefitSahRatio > m_RefitThreshold)
+        {
+            Build(bounds, numbounds);
+            return true;
+        }
+
+        return false;
+    }
+
+    float Bvh::GetSahCost() const
+    {
+        if (m_Nodes.empty()) {
+            return 0.0f;
+        }
+
+        float traversalCost = NormalizedTraversalCost();
+        float cost = 0.0f;
+
+        for (const Node& node : m_Nodes) {
+            cost += node.bounds.Area() * (node.type == kLeaf ? node.numprims : traversalCost);
+        }
+
+        float rootarea = m_Nodes[0].bounds.Area();
+        return rootarea > 0.0f ? cost / rootarea : 0.0f;
+    }
+
+    // Per task buffers of the treelet optimizer, indexed by leaf subsets
+    struct Bvh::TreeletScratch
+    {
+        TreeletScratch()
+            : bounds(1 << kMaxTreeletSize)
+            , cost(1 << kMaxTreeletSize)
+            , split(1 << kMaxTreeletSize)
+        {
+
+        }
+
+        std::vector<Bounds3D> bounds;
+        std::vector<float> cost;
+        std::vector<int> split;
+        std::vector<int> leaves;
+        std::vector<int> internals;
+        std::vector<int> stack;
+    };
+
+    Bvh::OptimizeStats Bvh::OptimizeTreelets(int treeletSize, int numPasses)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        OptimizeStats stats = { GetSahCost(), 0.0f, 0, 0.0 };
+        treeletSize = std::min(std::max(treeletSize, 3), kMaxTreeletSize);
+
+        // Smaller trees have no treelet with three leaves
+        if (m_Nodes.size() >= 5)
+        {
+            InitRefitState();
+
+            int numnodes  = (int)m_Nodes.size();
+            int numleaves = (int)m_RefitLeaves.size();
+            std::vector<float> cost(numnodes);
+
+            for (int pass = 0; pass < numPasses; ++pass)
+            {
+                for (int i = 0; i < numnodes; ++i) {
+                    m_RefitVisits[i] = 0;
+                }
+
+                // Leaves climb like in a refit, the second child to arrive restructures the treelet
+                // of the parent. Treelets only reach into finished subtrees, and the parent link of
+                // a treelet root does not change, so tasks never touch the same nodes.
+                std::atomic<int> restructured(0);
+
+                TaskGroup::ParallelFor(m_TaskPool, numleaves, kTreeletLeavesPerChunk, [&](int32 begin, int32 end)
+                {
+                    TreeletScratch scratch;
+                    int count = 0;
+
+                    for (int i = begin; i < end; ++i)
+                    {
+                        int idx = m_RefitLeaves[i];
+                        cost[idx] = m_Nodes[idx].numprims * m_Nodes[idx].bounds.Area();
+
+                        int parent = m_Parents[idx];
+                        while (parent != -1 && m_RefitVisits[parent].fetch_add(1) == 1)
+                        {
+                            count += RestructureTreelet(parent, treeletSize, cost, scratch) ? 1 : 0;
+                            parent = m_Parents[parent];
+                        }
+                    }
+
+                    restructured += count;
+                });
+
+                stats.numRestructured += restructured;
+                if (restructured == 0) {
+                    break;
+                }
+            }
+
+            UpdateTreeInfo();
+
+            // Later refits compare against the optimized tree
+            m_BuildSahCost  = GetSahCost();
+            m_SahCostSum    = (double)m_BuildSahCost * m_Nodes[0].bounds.Area();
+            m_RefitSahRatio = 1.0f;
+        }
+
+        stats.sahAfter = GetSahCost();
+        stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+        return stats;
+    }
+
+    bool Bvh::RestructureTreelet(int nodeidx, int treeletSize, std::vector<float>& cost, TreeletScratch& scratch)
+    {
+        float traversalCost = NormalizedTraversalCost();
+        Node& root = m_Nodes[nodeidx];
+        float currentCost = traversalCost * root.bounds.Area() + cost[root.lc] + cost[root.rc];
+
+        // Grow the treelet from the children of the root, opening the largest internal leaf each time
+        std::vector<int>& leaves = scratch.leaves;
+        std::vector<int>& internals = scratch.internals;
+        leaves.assign(1, root.lc);
+        leaves.push_back(root.rc);
+        internals.clear();
+
+        while ((int)leaves.size() < treeletSize)
+        {
+            int largest = -1;
+            float largestArea = -1.0f;
+
+            for (int i = 0; i < (int)leaves.size(); ++i)
+            {
+                const Node& node = m_Nodes[leaves[i]];
+                if (node.type == kInternal && node.bounds.Area() > largestArea)
+                {
+                    largest = i;
+                    largestArea = node.bounds.Area();
+                }
+            }
+
+            if (largest == -1) {
+                break;
+            }
+
+            int opened = leaves[largest];
+            internals.push_back(opened);
+            leaves[largest] = m_Nodes[opened].lc;
+            leaves.push_back(m_Nodes[opened].rc);
+        }
+
+        int numleaves = (int)leaves.size();
+        if (numleaves < 3)
+        {
+            cost[nodeidx] = currentCost;
+            return false;
+        }
+
+        // Optimal cost of every leaf subset, subsets are visited after all of their own subsets.
+        // A subset is split into the part holding its lowest leaf and the rest.
+        int fullset = (1 << numleaves) - 1;
+
+        for (int set = 1; set <= fullset; ++set)
+        {
+            int lowest = set & -set;
+
+            if (set == lowest)
+            {
+                int leaf = 0;
+                while ((1 << leaf) != set) {
+                    ++leaf;
+                }
+
+                scratch.bounds[set] = m_Nodes[leaves[leaf]].bounds;
+                scratch.cost[set]   = cost[leaves[leaf]];
+                continue;
+            }
+
+            int rest = set ^ lowest;
+            scratch.bounds[set] = Bounds3D::Union(scratch.bounds[lowest], scratch.bounds[rest]);
+
+            float best = std::numeric_limits<float>::max();
+            int bestLeft = lowest;
+
+            for (int part = (rest - 1) & rest; ; part = (part - 1) & rest)
+            {
+                int left = part | lowest;
+                float partCost = scratch.cost[left] + scratch.cost[set ^ left];
+
+                if (partCost < best)
+                {
+                    best = partCost;
+                    bestLeft = left;
+                }
+
+                if (part == 0) {
+                    break;
+                }
+            }
+
+            scratch.cost[set]  = traversalCost * scratch.bounds[set].Area() + best;
+            scratch.split[set] = bestLeft;
+        }
+
+        // Keep the current topology unless the gain is above rounding noise
+        if (scratch.cost[fullset] >= currentCost * (1.0f - 1e-5f))
+        {
+            cost[nodeidx] = currentCost;
+            return false;
+        }
+
+        // Relink the internal nodes of the treelet top-down along the chosen splits,
+        // the stack holds pairs of a leaf subset and the node that receives it
+        std::vector<int>& stack = scratch.stack;
+        stack.assign(1, fullset);
+        stack.push_back(nodeidx);
+        int nextInternal = 0;
+
+        while (!stack.empty())
+        {
+            int idx = stack.back();
+            stack.pop_back();
+            int set = stack.back();
+            stack.pop_back();
+
+            int sides[2] = { scratch.split[set], set ^ scratch.split[set] };
+            int children[2];
+
+            for (int c = 0; c < 2; ++c)
+            {
+                if ((sides[c] & (sides[c] - 1)) == 0)
+                {
+                    int leaf = 0;
+                    while ((1 << leaf) != sides[c]) {
+                        ++leaf;
+                    }
+                    children[c] = leaves[leaf];
+                }
+                else
+                {
+                    children[c] = internals[nextInternal++];
+                    stack.push_back(sides[c]);
+                    stack.push_back(children[c]);
+                }
+
+                m_Parents[children[c]] = idx;
+            }
+
+            Node& node  = m_Nodes[idx];
+            node.type   = kInternal;
+            node.lc     = children[0];
+            node.rc     = children[1];
+            node.bounds = scratch.bounds[set];
+            cost[idx]   = scratch.cost[set];
+        }
+
+        return true;
+    }
+
+    void Bvh::UpdateHeight(int level)
+    {
+        int height = m_Height;
+        while (height < level && !m_Height.compare_exchange_weak(height, level))
+        {
+
+        }
+    }
+
+    void Bvh::DepthFirstOrder(int node, bool hotFirst, std::vector<int>& order) const
+    {
+        std::vector<int> stack(1, node);
+
+        while (!stack.empty())
+        {
+            int nodeidx = stack.back();
+            stack.pop_back();
+            order.push_back(nodeidx);
+
+            const Node& current = m_Nodes[nodeidx];
+            if (current.type == kLeaf) {
+                continue;
+            }
+
+            // The child popped first is visited first
+            bool swap = hotFirst && m_Nodes[current.rc].bounds.Area() > m_Nodes[current.lc].bounds.Area();
+            stack.push_back(swap ? current.lc : current.rc);
+            stack.push_back(swap ? current.rc : current.lc);
+        }
+    }
+
+    void Bvh::VanEmdeBoasOrder(int node, int levels, std::vector<int>& order, std::vector<int>& frontier) const
+    {
+        const Node& current = m_Nodes[node];
+
+        if (levels == 1 || current.type == kLeaf)
+        {
+            order.push_back(node);
+            if (current.type == kInternal)
+            {
+                frontier.push_back(current.lc);
+                frontier.push_back(current.rc);
+            }
+            return;
+        }
+
+        // Top tree first, then every bottom tree hanging off it
+        int topLevels = levels / 2;
+        std::vector<int> bottomRoots;
+        VanEmdeBoasOrder(node, topLevels, order, bottomRoots);
+
+        for (int i = 0; i < (int)bottomRoots.size(); ++i) {
+            VanEmdeBoasOrder(bottomRoots[i], levels - topLevels, order, frontier);
+        }
+    }
+
+    void Bvh::ReorderNodes(NodeLayout layout)
+    {
+        if (layout == kBuildOrder || m_Nodes.empty()) {
+            return;
+        }
+
+        int numnodes = (int)m_Nodes.size();
+        std::vector<int> order;
+        order.reserve(numnodes);
+
+        if (layout == kDepthFirst || layout == kHotChildFirst)
+        {
+            DepthFirstOrder(0, layout == kHotChildFirst, order);
+        }
+        else if (layout == kBreadthFirstTop)
+        {
+            std::vector<int> level(1, 0);
+            for (int depth = 0; depth < kBreadthFirstLevels && !level.empty(); ++depth)
+            {
+                std::vector<int> next;
+                for (int i = 0; i < (int)level.size(); ++i)
+                {
+                    const Node& node = m_Nodes[level[i]];
+                    order.push_back(level[i]);
+
+                    if (node.type == kInternal)
+                    {
+                        next.push_back(node.lc);
+                        next.push_back(node.rc);
+                    }
+                }
+                level.swap(next);
+            }
+
+            for (int i = 0; i < (int)level.size(); ++i) {
+                DepthFirstOrder(level[i], true, order);
+            }
+        }
+        else
+        {
+            // Height in levels, the arena may be in any order so it is measured here
+            std::vector<int> depth(numnodes, 0);
+            std::vector<int> stack(1, 0);
+            int levels = 1;
+
+            while (!stack.empty())
+            {
+                int nodeidx = stack.back();
+                stack.pop_back();
+                levels = std::max(levels, depth[nodeidx] + 1);
+
+                const Node& node = m_Nodes[nodeidx];
+                if (node.type == kInternal)
+                {
+                    depth[node.lc] = depth[node.rc] = depth[nodeidx] + 1;
+                    stack.push_back(node.lc);
+                    stack.push_back(node.rc);
+                }
+            }
+
+            std::vector<int> frontier;
+            VanEmdeBoasOrder(0, levels, order, frontier);
+            assert(frontier.empty());
+        }
+
+        ApplyNodeOrder(order);
+
+        // Parents and leaves are arena indices
+        ResetRefitState();
+    }
+
+    void Bvh::SerialBuildOrder(std::vector<int>& order) const
+    {
+        // The serial build pops the left child first and allocates the children of a node as a pair
+        std::vector<int> stack(1, 0);
+        order.push_back(0);
+
+        while (!stack.empty())
+        {
+            const Node& current = m_Nodes[stack.back()];
+            stack.pop_back();
+
+            if (current.type == kInternal)
+            {
+                order.push_back(current.lc);
+                order.push_back(current.rc);
+                stack.push_back(current.rc);
+                stack.push_back(current.lc);
+            }
+        }
+    }
+
+    void Bvh::ApplyNodeOrder(const std::vector<int>& order)
+    {
+        int numnodes = (int)m_Nodes.size();
+        assert((int)order.size() == numnodes && order[0] == 0);
+
+        std::vector<int> newIndex(numnodes);
+        for (int i = 0; i < numnodes; ++i) {
+            newIndex[order[i]] = i;
+        }
+
+        std::vector<Node> nodes(numnodes);
+        for (int i = 0; i < numnodes; ++i)
+        {
+            nodes[i] = m_Nodes[order[i]];
+            if (nodes[i].type == kInternal)
+            {
+                nodes[i].lc = newIndex[nodes[i].lc];
+                nodes[i].rc = newIndex[nodes[i].rc];
+            }
+        }
+
+        m_Nodes.swap(nodes);
+    }
+
+    void Bvh::UpdateTreeInfo()
+    {
+        struct StackEntry
+        {
+            int node;
+            int level;
+            int index;
+        };
+
+        m_Height = 0;
+
+        std::vector<StackEntry> stack;
+        stack.push_back({ 0, 0, 1 });
+
+        while (!stack.empty())
+        {
+            StackEntry entry = stack.back();
+            stack.pop_back();
+
+            Node& node = m_Nodes[entry.node];
+            node.index = entry.index;
+            UpdateHeight(entry.level);
+
+            if (node.type == kInternal)
+            {
+                stack.push_back({ node.rc, entry.level + 1, (entry.index << 1) + 1 });
+                stack.push_back({ node.lc, entry.level + 1, (entry.index << 1) });
+            }
+        }
+    }
+
+    void Bvh::CollapseLeaves()
+    {
+        if (m_MaxPrimitivesPerLeaf < 2 || m_Nodes.empty()) {
+            return;
+        }
+
+        int numnodes = (int)m_Nodes.size();
+        float traversalCost = NormalizedTraversalCost();
+
+        // Parents come before children in preorder, so walking it backwards sees children first
+        std::vector<int> preorder;
+        preorder.reserve(numnodes);
+
+        std::vector<int> stack;
+        stack.push_back(0);
+        while (!stack.empty())
+        {
+            int idx = stack.back();
+            stack.pop_back();
+            preorder.push_back(idx);
+
+            if (m_Nodes[idx].type == kInternal)
+            {
+                stack.push_back(m_Nodes[idx].rc);
+                stack.push_back(m_Nodes[idx].lc);
+            }
+        }
+
+        // Subtree SAH cost scaled by the node area, primitive counts and the collapse decision
+        std::vector<float> cost(numnodes);
+        std::vector<int> numprims(numnodes);
+        std::vector<char> collapse(numnodes, 0);
+
+        for (int i = numnodes - 1; i >= 0; --i)
+        {
+            int idx = preorder[i];
+            const Node& node = m_Nodes[idx];
+            float area = node.bounds.Area();
+
+            if (node.type == kLeaf)
+            {
+                numprims[idx] = node.numprims;
+                cost[idx]     = node.numprims * area;
+                continue;
+            }
+
+            numprims[idx] = numprims[node.lc] + numprims[node.rc];
+            cost[idx]     = traversalCost * area + cost[node.lc] + cost[node.rc];
+
+            float leafcost = numprims[idx] * area;
+            if (numprims[idx] <= m_MaxPrimitivesPerLeaf && leafcost <= cost[idx])
+            {
+                cost[idx]     = leafcost;
+                collapse[idx] = 1;
+            }
+        }
+
+        // Rebuild the arena from the root, children as pairs and leaf primitives gathered in order
+        std::vector<Node> nodes;
+        std::vector<int> indices;
+        nodes.reserve(numnodes);
+        indices.reserve(m_PackedIndices.size());
+
+        struct Entry
+        {
+            int src;
+            int dst;
+        };
+
+        nodes.push_back(m_Nodes[0]);
+
+        std::vector<Entry> work;
+        work.push_back({ 0, 0 });
+
+        while (!work.empty())
+        {
+            Entry entry = work.back();
+            work.pop_back();
+
+            const Node& src = m_Nodes[entry.src];
+
+            if (src.type == kLeaf || collapse[entry.src])
+            {
+                Node& dst = nodes[entry.dst];
+                dst.type     = kLeaf;
+                dst.startidx = (int)indices.size();
+                dst.numprims = numprims[entry.src];
+
+                // Gather the leaves below in left to right order
+                stack.push_back(entry.src);
+                while (!stack.empty())
+                {
+                    const Node& node = m_Nodes[stack.back()];
+                    stack.pop_back();
+
+                    if (node.type == kLeaf) {
+                        indices.insert(indices.end(), m_PackedIndices.begin() + node.startidx, m_PackedIndices.begin() + node.startidx + node.numprims);
+                    }
+                    else
+                    {
+                        stack.push_back(node.rc);
+                        stack.push_back(node.lc);
+                    }
+                }
+            }
+            else
+            {
+                int lc = (int)nodes.size();
+                nodes.push_back(m_Nodes[src.lc]);
+                nodes.push_back(m_Nodes[src.rc]);
+
+                nodes[entry.dst].lc = lc;
+                nodes[entry.dst].rc = lc + 1;
+
+                work.push_back({ src.rc, lc + 1 });
+                work.push_back({ src.lc, lc });
+            }
+        }
+
+        m_Nodes.swap(nodes);
+        m_PackedIndices.swap(indices);
+        m_Nodecnt = (int)m_Nodes.size();
     }
 
     void Bvh::InitNodeAllocator(size_t maxnum)
@@ -53,30 +985,66 @@ namespace RadeonRays
         m_Nodes.resize(maxnum);
     }
 
-    Bvh::Node* Bvh::AllocateNode()
+    int Bvh::AllocateNodes(int count)
     {
-        return &m_Nodes[m_Nodecnt++];
+        int first = m_Nodecnt.fetch_add(count);
+        assert(first + count <= (int)m_Nodes.size());
+        return first;
     }
 
-    void Bvh::BuildNode(const SplitRequest& req, const Bounds3D* bounds, const Vector3* centroids, int* primindices)
+    void Bvh::BuildSubtree(const SplitRequest& root, const Bounds3D* bounds, int* primindices)
     {
-        m_Height = std::max(m_Height, req.level);
+        TaskGroup group(m_TaskPool);
 
-        Node* node   = AllocateNode();
-        node->bounds = req.bounds;
-        node->index  = req.index;
+        std::vector<SplitRequest> stack;
+        stack.push_back(root);
 
-        // Create leaf node if we have enough prims
-        if (req.numprims < 2)
+        while (!stack.empty())
         {
-            node->type = kLeaf;
-            node->startidx = static_cast<int>(m_PackedIndices.size());
-            node->numprims = req.numprims;
+            SplitRequest req = stack.back();
+            stack.pop_back();
 
-            for (auto i = 0; i < req.numprims; ++i)
-            {
-				m_PackedIndices.push_back(primindices[req.startidx + i]);
+            SplitRequest leftrequest;
+            SplitRequest rightrequest;
+            if (!BuildNode(req, bounds, primindices, leftrequest, rightrequest)) {
+                continue;
+            }
+
+            // Children own disjoint primindices ranges and nodes, so big ones can be built concurrently
+            if (m_TaskPool && leftrequest.numprims >= kMinPrimitivesPerTask && rightrequest.numprims >= kMinPrimitivesPerTask) {
+                group.Run([this, rightrequest, bounds, primindices]() { BuildSubtree(rightrequest, bounds, primindices); });
             }
+            else {
+                stack.push_back(rightrequest);
+            }
+
+            stack.push_back(leftrequest);
+        }
+
+        group.Wait();
+    }
+
+    bool Bvh::BuildNode(const SplitRequest& req, const Bounds3D* bounds, int* primindices, SplitRequest& leftrequest, SplitRequest& rightrequest)
+    {
+        UpdateHeight(req.level);
+
+        Node& node  = m_Nodes[req.nodeidx];
+        node.bounds = req.bounds;
+        node.index  = req.index;
+
+        // Leaves are laid out in the same order as primindices, so they index it directly
+        auto makeLeaf = [&]()
+        {
+            node.type     = kLeaf;
+            node.startidx = req.startidx;
+            node.numprims = req.numprims;
+        };
+
+        // Create leaf node if we have enough prims
+        if (req.numprims < 2 || (!m_Usesah && req.numprims <= m_MaxPrimitivesPerLeaf))
+        {
+            makeLeaf();
+            return false;
         }
         else
         {
@@ -86,33 +1054,24 @@ namespace RadeonRays
 
             if (m_Usesah)
             {
-                SahSplit ss = FindSahSplit(req, bounds, centroids, primindices);
+                SahSplit ss = FindSahSplit(req, primindices);
+
+                // Leaf cost is numprims intersections, ss.sah is in the same units.
+                // Without a split candidate the centroids coincide and any split would overlap fully.
+                if (req.numprims <= m_MaxPrimitivesPerLeaf && (IsNaN(ss.split) || req.numprims <= ss.sah))
+                {
+                    makeLeaf();
+                    return false;
+                }
 
                 if (!IsNaN(ss.split))
                 {
                     axis   = ss.dim;
                     border = ss.split;
-
-                    if (req.numprims < ss.sah && req.numprims < kMaxPrimitivesPerLeaf)
-                    {
-                        node->type     = kLeaf;
-                        node->startidx = static_cast<int>(m_PackedIndices.size());
-                        node->numprims = req.numprims;
-
-                        for (auto i = 0; i < req.numprims; ++i)
-                        {
-							m_PackedIndices.push_back(primindices[req.startidx + i]);
-                        }
-
-						if (req.ptr) {
-							*req.ptr = node;
-						}
-                        return;
-                    }
                 }
             }
 
-            node->type = kInternal;
+            node.type = kInternal;
 
             // Start partitioning and updating extents for children at the same time
 			Bounds3D leftbounds;
@@ -123,7 +1082,11 @@ namespace RadeonRays
             int splitidx  = req.startidx;
             bool near2far = (req.numprims + req.startidx) & 0x1;
 
-            if (req.centroidBounds.Extents()[axis] > 0.f)
+            if (req.centroidBounds.Extents()[axis] > 0.f && req.numprims >= kMinPrimitivesForParallelSplit)
+            {
+                splitidx = PartitionParallel(req, axis, border, near2far, bounds, primindices, leftbounds, rightbounds, leftCentroidBounds, rightCentroidBounds);
+            }
+            else if (req.centroidBounds.Extents()[axis] > 0.f)
             {
                 auto first = req.startidx;
                 auto last  = req.startidx + req.numprims;
@@ -132,10 +1095,10 @@ namespace RadeonRays
                 {
                     while (true)
                     {
-                        while ((first != last) && centroids[primindices[first]][axis] < border)
+                        while ((first != last) && m_Prims.Centroid(primindices[first], axis) < border)
                         {
                             leftbounds.Expand(bounds[primindices[first]]);
-                            leftCentroidBounds.Expand(centroids[primindices[first]]);
+                            leftCentroidBounds.Expand(m_Prims.Centroid(primindices[first]));
                             ++first;
                         }
 
@@ -144,12 +1107,12 @@ namespace RadeonRays
 						}
 
                         rightbounds.Expand(bounds[primindices[first]]);
-                        rightCentroidBounds.Expand(centroids[primindices[first]]);
+                        rightCentroidBounds.Expand(m_Prims.Centroid(primindices[first]));
 
-                        while ((first != last) && centroids[primindices[last]][axis] >= border)
+                        while ((first != last) && m_Prims.Centroid(primindices[last], axis) >= border)
                         {
                             rightbounds.Expand(bounds[primindices[last]]);
-                            rightCentroidBounds.Expand(centroids[primindices[last]]);
+                            rightCentroidBounds.Expand(m_Prims.Centroid(primindices[last]));
                             --last;
                         }
 
@@ -158,7 +1121,7 @@ namespace RadeonRays
 						}
 
                         leftbounds.Expand(bounds[primindices[last]]);
-                        leftCentroidBounds.Expand(centroids[primindices[last]]);
+                        leftCentroidBounds.Expand(m_Prims.Centroid(primindices[last]));
 
                         std::swap(primindices[first++], primindices[last]);
                     }
@@ -167,10 +1130,10 @@ namespace RadeonRays
                 {
                     while (true)
                     {
-                        while ((first != last) && centroids[primindices[first]][axis] >= border)
+                        while ((first != last) && m_Prims.Centroid(primindices[first], axis) >= border)
                         {
                             leftbounds.Expand(bounds[primindices[first]]);
-                            leftCentroidBounds.Expand(centroids[primindices[first]]);
+                            leftCentroidBounds.Expand(m_Prims.Centroid(primindices[first]));
                             ++first;
                         }
 
@@ -179,12 +1142,12 @@ namespace RadeonRays
 						}
 
                         rightbounds.Expand(bounds[primindices[first]]);
-                        rightCentroidBounds.Expand(centroids[primindices[first]]);
+                        rightCentroidBounds.Expand(m_Prims.Centroid(primindices[first]));
 
-                        while ((first != last) && centroids[primindices[last]][axis] < border)
+                        while ((first != last) && m_Prims.Centroid(primindices[last], axis) < border)
                         {
                             rightbounds.Expand(bounds[primindices[last]]);
-                            rightCentroidBounds.Expand(centroids[primindices[last]]);
+                            rightCentroidBounds.Expand(m_Prims.Centroid(primindices[last]));
                             --last;
                         }
 
@@ -193,7 +1156,7 @@ namespace RadeonRays
 						}
 
                         leftbounds.Expand(bounds[primindices[last]]);
-                        leftCentroidBounds.Expand(centroids[primindices[last]]);
+                        leftCentroidBounds.Expand(m_Prims.Centroid(primindices[last]));
 
                         std::swap(primindices[first++], primindices[last]);
                     }
@@ -206,46 +1169,44 @@ namespace RadeonRays
             {
                 splitidx = req.startidx + (req.numprims >> 1);
 
+                // The partition above already grew the side that took every primitive
+                leftbounds  = Bounds3D();
+                rightbounds = Bounds3D();
+                leftCentroidBounds  = Bounds3D();
+                rightCentroidBounds = Bounds3D();
+
                 for (int i = req.startidx; i < splitidx; ++i)
                 {
                     leftbounds.Expand(bounds[primindices[i]]);
-                    leftCentroidBounds.Expand(centroids[primindices[i]]);
+                    leftCentroidBounds.Expand(m_Prims.Centroid(primindices[i]));
                 }
 
                 for (int i = splitidx; i < req.startidx + req.numprims; ++i)
                 {
                     rightbounds.Expand(bounds[primindices[i]]);
-                    rightCentroidBounds.Expand(centroids[primindices[i]]);
+                    rightCentroidBounds.Expand(m_Prims.Centroid(primindices[i]));
                 }
             }
 
+            // Children are allocated as a pair
+            node.lc = AllocateNodes(2);
+            node.rc = node.lc + 1;
+
             // Left request
-            SplitRequest leftrequest  = { req.startidx, splitidx - req.startidx, &node->lc, leftbounds, leftCentroidBounds, req.level + 1, (req.index << 1) };
+            leftrequest  = { req.startidx, splitidx - req.startidx, node.lc, leftbounds, leftCentroidBounds, req.level + 1, (req.index << 1) };
             
 			// Right request
-            SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightCentroidBounds, req.level + 1, (req.index << 1) + 1 };
+            rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), node.rc, rightbounds, rightCentroidBounds, req.level + 1, (req.index << 1) + 1 };
 
-			// Put those to stack
-			BuildNode(leftrequest, bounds, centroids, primindices);
-			BuildNode(rightrequest, bounds, centroids, primindices);
+            return true;
         }
-
-        // Set parent ptr if any
-		if (req.ptr) {
-			*req.ptr = node;
-		}
     }
 
-    Bvh::SahSplit Bvh::FindSahSplit(const SplitRequest& req, const Bounds3D* bounds, const Vector3* centroids, int* primindices) const
+    Bvh::SahSplit Bvh::FindSahSplit(const SplitRequest& req, int* primindices) const
     {
         // SAH implementation
         // calc centroids histogram
         // int const kNumBins = 128;
-        // moving split bin index
-        int splitidx = -1;
-        // Set SAH to maximum float value as a start
-        float sah = std::numeric_limits<float>::max();
-
         SahSplit split;
         split.dim   = 0;
         split.split = std::numeric_limits<float>::quiet_NaN();
@@ -260,94 +1221,51 @@ namespace RadeonRays
             return split;
         }
 
-        // Bin has bbox and occurence count
-        struct Bin
-        {
-			Bounds3D bounds;
-            int count;
-        };
-
-        // Keep bins for each dimension
-        std::vector<Bin> bins[3];
-        bins[0].resize(m_NumBins);
-        bins[1].resize(m_NumBins);
-        bins[2].resize(m_NumBins);
-
         // Precompute inverse parent area
         float invarea = 1.f / req.bounds.Area();
-        // Precompute min point
-        Vector3 rootmin = req.centroidBounds.min;
-
-        // Evaluate all dimensions
-        for (int axis = 0; axis < 3; ++axis)
-        {
-            float rootminc = rootmin[axis];
-            // Range for histogram
-            float centroidRNG = centroidExtents[axis];
-            float invcentroidRNG = 1.f / centroidRNG;
 
-            // If the box is degenerate in that dimension skip it
-			if (centroidRNG == 0.f) {
-				continue;
-			}
+        int dim    = 0;
+        int binidx = -1;
+        float sah  = 0.f;
 
-            // Initialize bins
-            for (int i = 0; i < m_NumBins; ++i)
-            {
-                bins[axis][i].count = 0;
-                bins[axis][i].bounds = Bounds3D();
-            }
+        if (m_TaskPool && req.numprims >= kMinPrimitivesForParallelSplit)
+        {
+            // Every chunk fills its own histogram, merged in chunk order afterwards
+            int numchunks = (req.numprims + kPrimitivesPerChunk - 1) / kPrimitivesPerChunk;
+            std::vector<SahHistogram> histograms(numchunks);
 
-            // Calc primitive refs histogram
-            for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
+            TaskGroup::ParallelFor(m_TaskPool, numchunks, 1, [&](int begin, int end)
             {
-                int idx = primindices[i];
-                int binidx = (int)std::min<float>(static_cast<float>(m_NumBins) * ((centroids[idx][axis] - rootminc) * invcentroidRNG), static_cast<float>(m_NumBins - 1));
-
-                ++bins[axis][binidx].count;
-                bins[axis][binidx].bounds.Expand(bounds[idx]);
-            }
+                for (int chunk = begin; chunk < end; ++chunk)
+                {
+                    int first = req.startidx + chunk * kPrimitivesPerChunk;
+                    int last  = std::min(first + kPrimitivesPerChunk, req.startidx + req.numprims);
 
-            std::vector<Bounds3D> rightbounds(m_NumBins - 1);
+                    histograms[chunk].Reset(m_NumBins);
+                    histograms[chunk].Bin(m_Prims, primindices, first, last, req.centroidBounds);
+                }
+            });
 
-            // Start with 1-bin right box
-			Bounds3D rightbox;
-            for (int i = m_NumBins - 1; i > 0; --i)
-            {
-                rightbox.Expand(bins[axis][i].bounds);
-                rightbounds[i - 1] = rightbox;
+            for (int chunk = 1; chunk < numchunks; ++chunk) {
+                histograms[0].Merge(histograms[chunk]);
             }
 
-			Bounds3D leftbox;
-            int leftcount = 0;
-            int rightcount = req.numprims;
-
-            // Start best SAH search
-            // i is current split candidate (split between i and i + 1)
-            float sahtmp = 0.f;
-            for (int i = 0; i < m_NumBins - 1; ++i)
-            {
-                leftbox.Expand(bins[axis][i].bounds);
-                leftcount  += bins[axis][i].count;
-                rightcount -= bins[axis][i].count;
-
-                // Compute SAH
-                sahtmp = m_TraversalCost + (leftcount * leftbox.Area() + rightcount * rightbounds[i].Area()) * invarea;
-
-                // Check if it is better than what we found so far
-                if (sahtmp < sah)
-                {
-                    split.dim = axis;
-                    splitidx = i;
-                    split.sah = sah = sahtmp;
-                }
-            }
+            histograms[0].FindSplit(req.centroidBounds, invarea, NormalizedTraversalCost(), dim, binidx, sah);
+        }
+        else
+        {
+            SahHistogram& histogram = SahHistogram::ThreadLocal();
+            histogram.Reset(m_NumBins);
+            histogram.Bin(m_Prims, primindices, req.startidx, req.startidx + req.numprims, req.centroidBounds);
+            histogram.FindSplit(req.centroidBounds, invarea, NormalizedTraversalCost(), dim, binidx, sah);
         }
 
         // Choose split plane
-        if (splitidx != -1)
+        if (binidx != -1)
         {
-            split.split = rootmin[split.dim] + (splitidx + 1) * (centroidExtents[split.dim] / m_NumBins);
+            split.dim   = dim;
+            split.sah   = sah;
+            split.split = req.centroidBounds.min[dim] + (binidx + 1) * (centroidExtents[dim] / m_NumBins);
         }
 
         return split;
@@ -359,25 +1277,156 @@ namespace RadeonRays
         InitNodeAllocator(2 * numbounds - 1);
 
         // Cache some stuff to have faster partitioning
-        std::vector<Vector3> centroids(numbounds);
+        m_Prims.Init(bounds, numbounds);
         m_Indices.resize(numbounds);
         std::iota(m_Indices.begin(), m_Indices.end(), 0);
 
         // Calc bbox
 		Bounds3D centroidBounds;
-        for (size_t i = 0; i < static_cast<size_t>(numbounds); ++i)
+        for (int i = 0; i < numbounds; ++i)
+        {
+            centroidBounds.Expand(m_Prims.Centroid(i));
+        }
+
+        if (numbounds >= kMinPrimitivesForParallelSplit) {
+            m_PartitionScratch.resize(numbounds);
+        }
+
+        SplitRequest init = { 0, numbounds, AllocateNodes(1), m_Bounds, centroidBounds, 0, 1 };
+
+        BuildSubtree(init, bounds, &m_Indices[0]);
+
+        // The arena is sized for single primitive leaves, drop what bigger leaves left unused
+        m_Nodes.resize(m_Nodecnt);
+
+        // Pooled subtrees take their child slots in the order the tasks run, the serial order
+        // keeps the arena the same at every thread count
+        if (m_TaskPool)
+        {
+            std::vector<int> order;
+            order.reserve(m_Nodes.size());
+            SerialBuildOrder(order);
+            ApplyNodeOrder(order);
+        }
+
+        // Leaves point straight into the partitioned index array
+        m_PackedIndices.swap(m_Indices);
+        m_Indices.clear();
+        m_PartitionScratch.clear();
+        m_PartitionScratch.shrink_to_fit();
+        m_Prims.Clear();
+    }
+
+    int Bvh::PartitionParallel(const SplitRequest& req, int axis, float border, bool near2far, const Bounds3D* bounds, int* primindices,
+                               Bounds3D& leftbounds, Bounds3D& rightbounds, Bounds3D& leftCentroidBounds, Bounds3D& rightCentroidBounds)
+    {
+        // Stable partition: the result does not depend on the chunking,
+        // so the tree is the same whatever number of threads builds it
+        struct Chunk
+        {
+            int numleft;
+            int leftoffset;
+            int rightoffset;
+            Bounds3D leftbounds;
+            Bounds3D rightbounds;
+            Bounds3D leftCentroidBounds;
+            Bounds3D rightCentroidBounds;
+        };
+
+        int numchunks = (req.numprims + kPrimitivesPerChunk - 1) / kPrimitivesPerChunk;
+        std::vector<Chunk> chunks(numchunks);
+
+        auto isLeft = [&](int idx) -> bool
+        {
+            return near2far ? m_Prims.Centroid(idx, axis) < border : m_Prims.Centroid(idx, axis) >= border;
+        };
+
+        // Count and bound both sides per chunk
+        TaskGroup::ParallelFor(m_TaskPool, numchunks, 1, [&](int begin, int end)
+        {
+            for (int c = begin; c < end; ++c)
+            {
+                Chunk& chunk = chunks[c];
+                chunk.numleft = 0;
+
+                int first = req.startidx + c * kPrimitivesPerChunk;
+                int last  = std::min(first + kPrimitivesPerChunk, req.startidx + req.numprims);
+
+                for (int i = first; i < last; ++i)
+                {
+                    int idx = primindices[i];
+                    if (isLeft(idx))
+                    {
+                        chunk.leftbounds.Expand(bounds[idx]);
+                        chunk.leftCentroidBounds.Expand(m_Prims.Centroid(idx));
+                        ++chunk.numleft;
+                    }
+                    else
+                    {
+                        chunk.rightbounds.Expand(bounds[idx]);
+                        chunk.rightCentroidBounds.Expand(m_Prims.Centroid(idx));
+                    }
+                }
+            }
+        });
+
+        // Prefix sums give every chunk its output slots
+        int numleft = 0;
+        for (int c = 0; c < numchunks; ++c) {
+            numleft += chunks[c].numleft;
+        }
+
+        int leftoffset  = req.startidx;
+        int rightoffset = req.startidx + numleft;
+        for (int c = 0; c < numchunks; ++c)
         {
-            Vector3 c = bounds[i].Center();
-            centroidBounds.Expand(c);
-            centroids[i] = c;
+            Chunk& chunk = chunks[c];
+            int numprims = std::min(kPrimitivesPerChunk, req.numprims - c * kPrimitivesPerChunk);
+
+            chunk.leftoffset  = leftoffset;
+            chunk.rightoffset = rightoffset;
+            leftoffset  += chunk.numleft;
+            rightoffset += numprims - chunk.numleft;
+
+            leftbounds.Expand(chunk.leftbounds);
+            rightbounds.Expand(chunk.rightbounds);
+            leftCentroidBounds.Expand(chunk.leftCentroidBounds);
+            rightCentroidBounds.Expand(chunk.rightCentroidBounds);
         }
 
-        SplitRequest init = { 0, numbounds, nullptr, m_Bounds, centroidBounds, 0, 1 };
+        // Scatter to the scratch array and copy back
+        int* scratch = &m_PartitionScratch[0];
+        TaskGroup::ParallelFor(m_TaskPool, numchunks, 1, [&](int begin, int end)
+        {
+            for (int c = begin; c < end; ++c)
+            {
+                int left  = chunks[c].leftoffset;
+                int right = chunks[c].rightoffset;
+
+                int first = req.startidx + c * kPrimitivesPerChunk;
+                int last  = std::min(first + kPrimitivesPerChunk, req.startidx + req.numprims);
 
-        BuildNode(init, bounds, &centroids[0], &m_Indices[0]);
+                for (int i = first; i < last; ++i)
+                {
+                    int idx = primindices[i];
+                    if (isLeft(idx)) {
+                        scratch[left++] = idx;
+                    }
+                    else {
+                        scratch[right++] = idx;
+                    }
+                }
+            }
+        });
+
+        TaskGroup::ParallelFor(m_TaskPool, numchunks, 1, [&](int begin, int end)
+        {
+            int first = req.startidx + begin * kPrimitivesPerChunk;
+            int last  = std::min(req.startidx + end * kPrimitivesPerChunk, req.startidx + req.numprims);
+            std::copy(scratch + first, scratch + last, primindices + first);
+        });
 
-        // Set root_ pointer
-        m_Root = &m_Nodes[0];
+        return req.startidx + numleft;
     }
 
 }
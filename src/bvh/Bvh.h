@@ -25,20 +25,35 @@ THE SOFTWARE.
 #define BVH_H
 
 #include <vector>
+#include <atomic>
+#include <memory>
 
 #include "math/Bounds3D.h"
+#include "SahBinning.h"
+
+class TaskThreadPool;
 
 namespace RadeonRays
 {
+    class ContentHash;
+
     class Bvh
     {
     public:
         Bvh(float traversalCost, int numBins = 64, bool usesah = false)
-            : m_Root(nullptr)
+            : m_Nodecnt(0)
             , m_Usesah(usesah)
             , m_Height(0)
             , m_TraversalCost(traversalCost)
+            , m_IntersectionCost(1.0f)
+            , m_MaxPrimitivesPerLeaf(1)
             , m_NumBins(numBins)
+            , m_TaskPool(nullptr)
+            , m_BuildSahCost(0.0f)
+            , m_RefitSahRatio(1.0f)
+            , m_SahCostSum(0.0)
+            , m_HasDuplicateRefs(false)
+            , m_RefitThreshold(1.5f)
         {
             
         }
@@ -52,6 +67,106 @@ namespace RadeonRays
 		// bounds is an array of bounding boxes
 		void Build(const Bounds3D* bounds, int numbounds);
 
+		// Recomputes the node bounds bottom-up from moved primitives, keeping the topology.
+		// bounds must describe the same primitives as the last Build. When the SAH cost grows
+		// past the refit threshold the tree is built again instead and false is returned,
+		// the node and index layout can then differ from the previous one.
+		bool Refit(const Bounds3D* bounds, int numbounds);
+
+		// Result of an incremental update
+		struct UpdateStats
+		{
+			// Local rotations applied along the refitted paths
+			int numRotations;
+			// The SAH ratio exceeded the refit threshold and the tree was built again
+			bool rebuilt;
+		};
+
+		// Refits only the leaves holding the given primitives and their ancestors, rotating
+		// subtrees along those paths where that lowers the SAH cost. bounds must describe the
+		// same primitives as the last Build. Appends the arena index of every node whose bounds
+		// or children changed to dirtyNodes, all nodes when the tree was rebuilt.
+		UpdateStats UpdatePrimitives(const Bounds3D* bounds, int numbounds, const std::vector<int>& primitives, std::vector<int>& dirtyNodes);
+
+		// Ratio of the SAH cost after the last refit to the cost of the built tree,
+		// both relative to their root area
+		float GetRefitSahRatio() const
+		{
+			return m_RefitSahRatio;
+		}
+
+		// Refit rebuilds once the SAH ratio exceeds this, 0 always refits
+		void SetRefitThreshold(float threshold)
+		{
+			m_RefitThreshold = threshold;
+		}
+
+		// SAH cost relative to the root area, in units of one primitive intersection
+		float GetSahCost() const;
+
+		// Result of a treelet optimization
+		struct OptimizeStats
+		{
+			float sahBefore;
+			float sahAfter;
+			// Treelets whose topology was replaced, over all passes
+			int numRestructured;
+			double milliseconds;
+		};
+
+		// Lowers the SAH cost of the built tree by replacing every treelet of up to treeletSize
+		// (3 to 10) leaves with its optimal topology, bottom-up and in parallel on the task pool.
+		// Leaves and primitive indices are kept, only internal nodes are relinked.
+		OptimizeStats OptimizeTreelets(int treeletSize = 7, int numPasses = 3);
+
+		// Order of the node arena, the root always stays first
+		enum NodeLayout
+		{
+			// Order the builder produced
+			kBuildOrder,
+			// Depth first pre-order, left child first
+			kDepthFirst,
+			// Depth first pre-order, the child with the larger surface area and so the higher
+			// hit probability first, so the likely path runs through consecutive nodes
+			kHotChildFirst,
+			// The top levels breadth first in one block, the subtrees below them hot child first
+			kBreadthFirstTop,
+			// van Emde Boas order, the tree is split at half its height and the top tree and
+			// every bottom tree are laid out recursively, cache friendly for any line size
+			kVanEmdeBoas
+		};
+
+		// Moves the nodes of the built tree to the given order, links are updated and
+		// leaves keep their primitive ranges
+		void ReorderNodes(NodeLayout layout);
+
+		// Adds every parameter that changes the built tree to a cache key
+		virtual void HashBuildParams(ContentHash& hash) const;
+
+		// Large subtrees are built as tasks on this pool, nullptr builds on the calling thread
+		void SetTaskPool(TaskThreadPool* taskPool)
+		{
+			m_TaskPool = taskPool;
+		}
+
+		TaskThreadPool* GetTaskPool() const
+		{
+			return m_TaskPool;
+		}
+
+		// Leaves hold up to this many primitives, SAH builders only fill them when
+		// that is cheaper than splitting
+		void SetMaxLeafSize(int maxPrimitivesPerLeaf)
+		{
+			m_MaxPrimitivesPerLeaf = maxPrimitivesPerLeaf > 1 ? maxPrimitivesPerLeaf : 1;
+		}
+
+		// Cost of one primitive intersection, in the units of the traversal cost
+		void SetIntersectionCost(float intersectionCost)
+		{
+			m_IntersectionCost = intersectionCost;
+		}
+
         // World space bounding box
 		const Bounds3D& Bounds() const
 		{
@@ -78,8 +193,6 @@ namespace RadeonRays
 			return m_PackedIndices.size();
 		}
 
-	protected:
-
 		// Enum for node type
 		enum NodeType
 		{
@@ -99,11 +212,11 @@ namespace RadeonRays
 
 			union
 			{
-				// For internal nodes: left and right children
+				// For internal nodes: arena indices of left and right children
 				struct
 				{
-					Node* lc;
-					Node* rc;
+					int lc;
+					int rc;
 				};
 
 				// For leaves: starting primitive index and number of primitives
@@ -115,14 +228,32 @@ namespace RadeonRays
 			};
 		};
 
+		// Node arena, the root is always the first node
+		const Node* GetNodes() const
+		{
+			return &m_Nodes[0];
+		}
+
+		int GetNumNodes() const
+		{
+			return (int)m_Nodes.size();
+		}
+
+		const Node* GetRoot() const
+		{
+			return &m_Nodes[0];
+		}
+
+	protected:
+
 		struct SplitRequest
 		{
 			// Starting index of a request
 			int startidx;
 			// Number of primitives
 			int numprims;
-			// Root node
-			Node** ptr;
+			// Arena index of the node to fill
+			int nodeidx;
 			// Bounding box
 			Bounds3D bounds;
 			// Centroid bounds
@@ -146,35 +277,116 @@ namespace RadeonRays
         // Build function
         virtual void BuildImpl(const Bounds3D* bounds, int numbounds);
 
-        // Node allocation
-        virtual Node* AllocateNode();
+        // Sizes the arena for maxnum nodes, it is not reallocated while building
+        void InitNodeAllocator(size_t maxnum);
+
+        // Thread safe, returns the arena index of the first of count consecutive nodes
+        int AllocateNodes(int count);
+
+        // Builds a subtree with an explicit stack, large right children are handed to the pool
+        void BuildSubtree(const SplitRequest& root, const Bounds3D* bounds, int* primindices);
+
+        // Fills the node of req, returns true and the child requests when it was split
+        bool BuildNode(const SplitRequest& req, const Bounds3D* bounds, int* primindices, SplitRequest& leftrequest, SplitRequest& rightrequest);
+
+        SahSplit FindSahSplit(const SplitRequest& req, int* primindices) const;
+
+        int PartitionParallel(const SplitRequest& req, int axis, float border, bool near2far, const Bounds3D* bounds, int* primindices,
+                              Bounds3D& leftbounds, Bounds3D& rightbounds, Bounds3D& leftCentroidBounds, Bounds3D& rightCentroidBounds);
+
+        // Thread safe max of the tree height
+        void UpdateHeight(int level);
+
+        // Traversal cost relative to one primitive intersection, SAH costs are in those units
+        float NormalizedTraversalCost() const
+        {
+            return m_TraversalCost / m_IntersectionCost;
+        }
+
+        // Bottom-up SAH pass turning small subtrees into leaves of up to m_MaxPrimitivesPerLeaf
+        // primitives, for builders that can only make single primitive leaves.
+        // Rewrites the arena and m_PackedIndices in depth first order.
+        void CollapseLeaves();
+
+        // Gathers parents and leaves on the first refit or update after a build
+        void InitRefitState();
+
+        // Drops the refit state of the previous topology
+        void ResetRefitState();
+
+        // Updates the refit SAH ratio and builds again past the threshold, returns true if it did
+        bool RebuildIfDegraded(const Bounds3D* bounds, int numbounds);
+
+        // Applies the best child / grandchild swap below the node if it lowers the SAH cost
+        bool RotateNode(int nodeidx, std::vector<int>& dirtyNodes);
+
+        struct TreeletScratch;
+
+        // Replaces the treelet rooted at nodeidx with its optimal topology if that is cheaper.
+        // Stores the area weighted SAH cost of the subtree of nodeidx in cost.
+        bool RestructureTreelet(int nodeidx, int treeletSize, std::vector<float>& cost, TreeletScratch& scratch);
+
+        // Appends the subtree of node in van Emde Boas order, cut off after levels levels.
+        // Children below the cut are appended to frontier.
+        void VanEmdeBoasOrder(int node, int levels, std::vector<int>& order, std::vector<int>& frontier) const;
+
+        // Appends every node in the order the serial top-down build allocates them
+        void SerialBuildOrder(std::vector<int>& order) const;
 
-        virtual void InitNodeAllocator(size_t maxnum);
+        // Moves node order[i] to arena index i and relinks the children
+        void ApplyNodeOrder(const std::vector<int>& order);
 
-        void BuildNode(const SplitRequest& req, const Bounds3D* bounds, const Vector3* centroids, int* primindices);
+        // Appends the subtree of node in depth first pre-order, larger child first when hotFirst is set
+        void DepthFirstOrder(int node, bool hotFirst, std::vector<int>& order) const;
 
-        SahSplit FindSahSplit(const SplitRequest& req, const Bounds3D* bounds, const Vector3* centroids, int* primindices) const;
+        // Walks the finished tree to set the height and complete tree node indices,
+        // for builders that do not create nodes top-down
+        void UpdateTreeInfo();
 
-        // Bvh nodes
+        // Node arena, internal nodes link their children by index
         std::vector<Node> m_Nodes;
         // Identifiers of leaf primitives
         std::vector<int> m_Indices;
-        // Node allocator counter, atomic for thread safety
-		int m_Nodecnt;
+        // Nodes allocated from the arena, atomic for thread safety
+		std::atomic<int> m_Nodecnt;
         // Identifiers of leaf primitives
         std::vector<int> m_PackedIndices;
         // Bounding box containing all primitives
 		Bounds3D m_Bounds;
-        // Root node
-        Node* m_Root;
         // SAH flag
         bool m_Usesah;
         // Tree height
-        int m_Height;
+        std::atomic<int> m_Height;
         // Node traversal cost
         float m_TraversalCost;
+        // Primitive intersection cost
+        float m_IntersectionCost;
+        // Maximum number of primitives in a leaf
+        int m_MaxPrimitivesPerLeaf;
         // Number of spatial bins to use for SAH
         int m_NumBins;
+        // Optional pool for parallel builds
+        TaskThreadPool* m_TaskPool;
+        // Scratch space for parallel partitioning
+        std::vector<int> m_PartitionScratch;
+        // Primitive bounds and centroids in binning layout, alive during the build
+        BinningPrimitives m_Prims;
+        // Refit topology, gathered on the first refit after a build
+        std::vector<int> m_Parents;
+        std::vector<int> m_RefitLeaves;
+        std::unique_ptr<std::atomic<int>[]> m_RefitVisits;
+        // Leaf of every primitive and changed children per node during an update
+        std::vector<int> m_PrimitiveLeaves;
+        std::vector<int> m_UpdatePending;
+        // SAH cost of the built tree and of the last refit relative to it
+        float m_BuildSahCost;
+        float m_RefitSahRatio;
+        // Area weighted SAH sum of the current tree, kept up to date by updates
+        double m_SahCostSum;
+        // Spatial splits reference primitives from several leaves
+        bool m_HasDuplicateRefs;
+        // SAH ratio past which a refit rebuilds
+        float m_RefitThreshold;
 
     private:
 
@@ -183,6 +395,8 @@ namespace RadeonRays
         Bvh& operator = (const Bvh& bvh) = delete;
 
 		friend class BvhTranslator;
+		friend class BvhCache;
+		friend class BvhAnalyzer;
     };
 }
 
@@ -0,0 +1,467 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#include <stdio.h>
+#include <cmath>
+#include <algorithm>
+
+#include "BvhAnalyzer.h"
+#include "BvhTranslator.h"
+#include "Clipping.h"
+#include "job/TaskGroup.h"
+
+namespace RadeonRays
+{
+    // Primitives per task of the EPO pass
+    static const int kEpoPrimsPerTask = 1024;
+
+    static bool IsDegenerate(const Vector3& min, const Vector3& max)
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            // Also true for NaN
+            if (!(min[axis] <= max[axis])) {
+                return true;
+            }
+        }
+
+        return Bounds3D(min, max).Area() <= 0.0f;
+    }
+
+    // Exact containment, Bounds3D::Contains goes through center and radius and rounds
+    static bool Encloses(const Bounds3D& outer, const Bounds3D& inner)
+    {
+        return outer.min.x <= inner.min.x && outer.min.y <= inner.min.y && outer.min.z <= inner.min.z &&
+               outer.max.x >= inner.max.x && outer.max.y >= inner.max.y && outer.max.z >= inner.max.z;
+    }
+
+    static bool Overlaps(const Bounds3D& a, const Bounds3D& b)
+    {
+        return a.min.x <= b.max.x && a.min.y <= b.max.y && a.min.z <= b.max.z &&
+               a.max.x >= b.min.x && a.max.y >= b.min.y && a.max.z >= b.min.z;
+    }
+
+    static void AddLevelNode(std::vector<BvhLevelStats>& levels, int depth, bool leaf, size_t bytes)
+    {
+        if (depth >= (int)levels.size()) {
+            levels.resize(depth + 1);
+        }
+
+        levels[depth].numNodes++;
+        levels[depth].numLeaves += leaf ? 1 : 0;
+        levels[depth].bytes += bytes;
+    }
+
+    static void AddToHistogram(std::vector<int>& histogram, int bucket)
+    {
+        if (bucket >= (int)histogram.size()) {
+            histogram.resize(bucket + 1, 0);
+        }
+
+        histogram[bucket]++;
+    }
+
+    // Members of one JSON object, written one per line
+    class JsonObject
+    {
+    public:
+        explicit JsonObject(int indent)
+            : m_Indent(indent)
+        {
+
+        }
+
+        void Add(const char* name, long long value)
+        {
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), "%lld", value);
+            AddRaw(name, buffer);
+        }
+
+        // Non-finite and negative values are written as null
+        void Add(const char* name, float value)
+        {
+            char buffer[32];
+            if (std::isfinite(value) && value >= 0.0f) {
+                snprintf(buffer, sizeof(buffer), "%.6g", value);
+            }
+            else {
+                snprintf(buffer, sizeof(buffer), "null");
+            }
+            AddRaw(name, buffer);
+        }
+
+        void Add(const char* name, const std::vector<int>& values)
+        {
+            std::string array = "[";
+            for (size_t i = 0; i < values.size(); ++i) {
+                array += (i > 0 ? ", " : "") + std::to_string(values[i]);
+            }
+            AddRaw(name, array + "]");
+        }
+
+        void Add(const char* name, const std::vector<BvhLevelStats>& levels)
+        {
+            std::string pad(m_Indent + 4, ' ');
+            std::string array = "[";
+            for (size_t i = 0; i < levels.size(); ++i)
+            {
+                char buffer[128];
+                snprintf(buffer, sizeof(buffer), "{ \"nodes\": %d, \"leaves\": %d, \"bytes\": %zu }", levels[i].numNodes, levels[i].numLeaves, levels[i].bytes);
+                array += (i > 0 ? ",\n" : "\n") + pad + buffer;
+            }
+            AddRaw(name, array + (levels.empty() ? "]" : "\n" + std::string(m_Indent + 2, ' ') + "]"));
+        }
+
+        void AddRaw(const char* name, const std::string& value)
+        {
+            m_Members.push_back(std::string(m_Indent + 2, ' ') + "\"" + name + "\": " + value);
+        }
+
+        std::string ToString() const
+        {
+            std::string json = "{\n";
+            for (size_t i = 0; i < m_Members.size(); ++i) {
+                json += m_Members[i] + (i + 1 < m_Members.size() ? ",\n" : "\n");
+            }
+            return json + std::string(m_Indent, ' ') + "}";
+        }
+
+    private:
+        int m_Indent;
+        std::vector<std::string> m_Members;
+    };
+
+    std::string BvhReport::ToJson(int indent) const
+    {
+        JsonObject json(indent);
+        json.Add("nodes", (long long)numNodes);
+        json.Add("leaves", (long long)numLeaves);
+        json.Add("indices", (long long)numIndices);
+        json.Add("primitives", (long long)numPrimitives);
+        json.Add("maxDepth", (long long)maxDepth);
+        json.Add("sahCost", sahCost);
+        json.Add("epo", epo);
+        json.Add("emptyLeaves", (long long)numEmptyLeaves);
+        json.Add("degenerateNodes", (long long)numDegenerateNodes);
+        json.Add("escapingNodes", (long long)numEscapingNodes);
+        json.Add("bytes", (long long)bytes);
+        json.Add("leafSizeHistogram", leafSizeHistogram);
+        json.Add("leafDepthHistogram", leafDepthHistogram);
+        json.Add("levels", levels);
+        return json.ToString();
+    }
+
+    std::string FlattenedBvhReport::ToJson(int indent) const
+    {
+        JsonObject json(indent);
+        json.Add("nodes", (long long)numNodes);
+        json.Add("instanceLeaves", (long long)numInstanceLeaves);
+        json.Add("leaves", (long long)numLeaves);
+        json.Add("emptyLeaves", (long long)numEmptyLeaves);
+        json.Add("degenerateNodes", (long long)numDegenerateNodes);
+        json.Add("unusedTexels", (long long)numUnusedTexels);
+        json.Add("textureWidth", (long long)textureWidth);
+        json.Add("textureHeight", (long long)textureHeight);
+        json.Add("bytesPerNode", (long long)bytesPerNode);
+        json.Add("bytes", (long long)bytes);
+        json.Add("textureBytes", (long long)textureBytes);
+        json.Add("leafSizeHistogram", leafSizeHistogram);
+        json.Add("levels", levels);
+        return json.ToString();
+    }
+
+    BvhReport BvhAnalyzer::Analyze(const Bvh& bvh) const
+    {
+        BvhReport report;
+
+        int numNodes = bvh.GetNumNodes();
+        if (numNodes == 0) {
+            return report;
+        }
+
+        const Bvh::Node* nodes = bvh.GetNodes();
+        const int* indices = bvh.GetIndices();
+
+        report.numNodes   = numNodes;
+        report.numIndices = (int)bvh.GetNumIndices();
+        report.sahCost    = bvh.GetSahCost();
+        report.bytes      = numNodes * sizeof(Bvh::Node) + report.numIndices * sizeof(int);
+
+        int maxIndex = -1;
+        for (int i = 0; i < report.numIndices; ++i) {
+            maxIndex = std::max(maxIndex, indices[i]);
+        }
+
+        std::vector<bool> referenced(maxIndex + 1, false);
+
+        // Node and its depth, the root is checked against its own bounds
+        std::vector<std::pair<int, int>> stack;
+        stack.push_back(std::make_pair(0, 0));
+
+        while (!stack.empty())
+        {
+            int nodeidx = stack.back().first;
+            int depth   = stack.back().second;
+            stack.pop_back();
+
+            const Bvh::Node& node = nodes[nodeidx];
+            bool leaf = node.type == Bvh::kLeaf;
+
+            AddLevelNode(report.levels, depth, leaf, sizeof(Bvh::Node));
+            report.numDegenerateNodes += IsDegenerate(node.bounds.min, node.bounds.max) ? 1 : 0;
+
+            if (leaf)
+            {
+                report.numLeaves++;
+                report.numEmptyLeaves += node.numprims == 0 ? 1 : 0;
+                report.maxDepth = std::max(report.maxDepth, depth);
+                AddToHistogram(report.leafSizeHistogram, node.numprims);
+                AddToHistogram(report.leafDepthHistogram, depth);
+
+                for (int i = node.startidx; i < node.startidx + node.numprims; ++i) {
+                    referenced[indices[i]] = true;
+                }
+            }
+            else
+            {
+                for (int child : { node.lc, node.rc })
+                {
+                    report.numEscapingNodes += Encloses(node.bounds, nodes[child].bounds) ? 0 : 1;
+                    stack.push_back(std::make_pair(child, depth + 1));
+                }
+            }
+        }
+
+        report.numPrimitives = (int)std::count(referenced.begin(), referenced.end(), true);
+
+        if (m_Positions) {
+            report.epo = ComputeEpo(bvh, maxIndex + 1);
+        }
+
+        return report;
+    }
+
+    float BvhAnalyzer::ComputeEpo(const Bvh& bvh, int numPrimitives) const
+    {
+        const Bvh::Node* nodes = bvh.GetNodes();
+        const int* indices = bvh.GetIndices();
+        int numNodes = bvh.GetNumNodes();
+        float traversalCost = bvh.NormalizedTraversalCost();
+
+        // Leaves are numbered in depth first order, so every subtree covers a range of leaf numbers
+        std::vector<int> order;
+        std::vector<int> firstLeaf(numNodes);
+        std::vector<int> lastLeaf(numNodes);
+        std::vector<int> stack(1, 0);
+        int numLeaves = 0;
+
+        while (!stack.empty())
+        {
+            int nodeidx = stack.back();
+            stack.pop_back();
+            order.push_back(nodeidx);
+
+            if (nodes[nodeidx].type == Bvh::kLeaf)
+            {
+                firstLeaf[nodeidx] = lastLeaf[nodeidx] = numLeaves++;
+            }
+            else
+            {
+                stack.push_back(nodes[nodeidx].rc);
+                stack.push_back(nodes[nodeidx].lc);
+            }
+        }
+
+        for (int i = (int)order.size() - 1; i >= 0; --i)
+        {
+            const Bvh::Node& node = nodes[order[i]];
+            if (node.type != Bvh::kLeaf)
+            {
+                firstLeaf[order[i]] = firstLeaf[node.lc];
+                lastLeaf[order[i]]  = lastLeaf[node.rc];
+            }
+        }
+
+        // Leaf numbers referencing every primitive, more than one after spatial splits
+        std::vector<int> primLeafStart(numPrimitives + 1, 0);
+        std::vector<int> primLeaves;
+
+        for (int nodeidx : order)
+        {
+            const Bvh::Node& node = nodes[nodeidx];
+            if (node.type == Bvh::kLeaf)
+            {
+                for (int i = node.startidx; i < node.startidx + node.numprims; ++i) {
+                    primLeafStart[indices[i] + 1]++;
+                }
+            }
+        }
+
+        for (int p = 0; p < numPrimitives; ++p) {
+            primLeafStart[p + 1] += primLeafStart[p];
+        }
+
+        primLeaves.resize(primLeafStart[numPrimitives]);
+        std::vector<int> cursor(primLeafStart.begin(), primLeafStart.end() - 1);
+
+        for (int nodeidx : order)
+        {
+            const Bvh::Node& node = nodes[nodeidx];
+            if (node.type == Bvh::kLeaf)
+            {
+                for (int i = node.startidx; i < node.startidx + node.numprims; ++i) {
+                    primLeaves[cursor[indices[i]]++] = firstLeaf[nodeidx];
+                }
+            }
+        }
+
+        std::vector<double> overlap(numPrimitives, 0.0);
+        std::vector<double> area(numPrimitives, 0.0);
+
+        TaskGroup::ParallelFor(m_TaskPool, numPrimitives, kEpoPrimsPerTask, [&](int32 begin, int32 end)
+        {
+            std::vector<int> stack;
+            Vector3 clipped[kMaxClippedVertices];
+
+            for (int p = begin; p < end; ++p)
+            {
+                Vector3 triangle[3];
+                Bounds3D triangleBounds;
+                for (int v = 0; v < 3; ++v)
+                {
+                    const float* position = m_Positions + ((size_t)p * 3 + v) * m_Stride;
+                    triangle[v] = Vector3(position[0], position[1], position[2]);
+                    triangleBounds.Expand(triangle[v]);
+                }
+
+                area[p] = PolygonArea(triangle, 3);
+                if (!(area[p] > 0.0)) {
+                    continue;
+                }
+
+                stack.assign(1, 0);
+
+                while (!stack.empty())
+                {
+                    int nodeidx = stack.back();
+                    stack.pop_back();
+
+                    const Bvh::Node& node = nodes[nodeidx];
+                    if (!Overlaps(node.bounds, triangleBounds)) {
+                        continue;
+                    }
+
+                    bool inSubtree = false;
+                    for (int i = primLeafStart[p]; i < primLeafStart[p + 1]; ++i) {
+                        inSubtree |= primLeaves[i] >= firstLeaf[nodeidx] && primLeaves[i] <= lastLeaf[nodeidx];
+                    }
+
+                    if (!inSubtree)
+                    {
+                        // Children are inside the node, so nothing of the triangle is inside them either
+                        float inside = PolygonArea(clipped, ClipPolygonToBox(triangle, 3, node.bounds, clipped));
+                        if (!(inside > 0.0f)) {
+                            continue;
+                        }
+
+                        overlap[p] += inside * (node.type == Bvh::kLeaf ? (float)node.numprims : traversalCost);
+                    }
+
+                    if (node.type != Bvh::kLeaf)
+                    {
+                        stack.push_back(node.lc);
+                        stack.push_back(node.rc);
+                    }
+                }
+            }
+        });
+
+        double totalOverlap = 0.0;
+        double totalArea = 0.0;
+        for (int p = 0; p < numPrimitives; ++p)
+        {
+            totalOverlap += overlap[p];
+            totalArea += area[p];
+        }
+
+        return totalArea > 0.0 ? (float)(totalOverlap / totalArea) : 0.0f;
+    }
+
+    FlattenedBvhReport BvhAnalyzer::Analyze(const BvhTranslator& translator) const
+    {
+        FlattenedBvhReport report;
+
+        // Texels, the arrays are sized to the whole texture
+        int numTexels = (int)translator.nodes.size();
+        if (numTexels == 0) {
+            return report;
+        }
+
+        report.textureWidth  = translator.nodeTexLayout.width;
+        report.textureHeight = translator.nodeTexLayout.height;
+        report.bytesPerNode  = sizeof(BvhTranslator::Node) + 2 * sizeof(Vector3);
+        report.textureBytes  = translator.nodeTexLayout.GetSize() * report.bytesPerNode;
+
+        // Breadth first from the top level root, instance leaves continue into their mesh tree
+        std::vector<int> depth(numTexels, -1);
+        std::vector<int> queue(1, translator.topLevelIndex);
+        depth[translator.topLevelIndex] = 0;
+
+        for (size_t head = 0; head < queue.size(); ++head)
+        {
+            int index = queue[head];
+            const BvhTranslator::Node& node = translator.nodes[index];
+
+            AddLevelNode(report.levels, depth[index], node.leaf > 0, report.bytesPerNode);
+            report.numDegenerateNodes += IsDegenerate(translator.bboxmin[index], translator.bboxmax[index]) ? 1 : 0;
+
+            if (node.leaf > 0)
+            {
+                report.numLeaves++;
+                report.numEmptyLeaves += node.rightIndex == 0 ? 1 : 0;
+                AddToHistogram(report.leafSizeHistogram, node.rightIndex);
+            }
+            else if (node.leaf < 0) {
+                report.numInstanceLeaves++;
+            }
+
+            int children[2] = { node.leftIndex, node.rightIndex };
+            int numChildren = node.leaf == 0 ? 2 : (node.leaf < 0 ? 1 : 0);
+
+            for (int c = 0; c < numChildren; ++c)
+            {
+                if (depth[children[c]] < 0)
+                {
+                    depth[children[c]] = depth[index] + 1;
+                    queue.push_back(children[c]);
+                }
+            }
+        }
+
+        report.numNodes = (int)queue.size();
+        report.numUnusedTexels = numTexels - report.numNodes;
+        report.bytes = report.numNodes * report.bytesPerNode;
+
+        return report;
+    }
+}
@@ -0,0 +1,152 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#pragma once
+
+#ifndef BVH_ANALYZER_H
+#define BVH_ANALYZER_H
+
+#include <string>
+#include <vector>
+
+#include "Bvh.h"
+
+class TaskThreadPool;
+
+namespace RadeonRays
+{
+    class BvhTranslator;
+
+    // Nodes of one tree level and the memory they take
+    struct BvhLevelStats
+    {
+        int numNodes = 0;
+        int numLeaves = 0;
+        size_t bytes = 0;
+    };
+
+    /// Quality report of a built tree
+    struct BvhReport
+    {
+        int numNodes = 0;
+        int numLeaves = 0;
+        int numIndices = 0;
+        // Distinct primitives referenced by the leaves
+        int numPrimitives = 0;
+        // Depth of the deepest leaf, the root is at depth 0
+        int maxDepth = 0;
+        // SAH cost relative to the root area, in units of one primitive intersection
+        float sahCost = 0.0f;
+        // End-point overlap (Aila et al. 2013): cost weighted area of the primitive parts inside nodes
+        // whose subtree does not reference them, relative to the total primitive area.
+        // Negative when it was not computed.
+        float epo = -1.0f;
+        // Leaves without primitives
+        int numEmptyLeaves = 0;
+        // Nodes with NaN, inverted or zero area bounds
+        int numDegenerateNodes = 0;
+        // Nodes reaching outside the bounds of their parent
+        int numEscapingNodes = 0;
+        // Node arena and leaf indices
+        size_t bytes = 0;
+        // Leaves by number of primitives
+        std::vector<int> leafSizeHistogram;
+        // Leaves by depth
+        std::vector<int> leafDepthHistogram;
+        std::vector<BvhLevelStats> levels;
+
+        // JSON object, nested lines are indented by indent spaces
+        std::string ToJson(int indent = 0) const;
+    };
+
+    /// Report of the flattened nodes of BvhTranslator, top level and mesh trees together.
+    /// Covers the nodes reached from the top level root.
+    struct FlattenedBvhReport
+    {
+        int numNodes = 0;
+        // Top level leaves entering a mesh tree
+        int numInstanceLeaves = 0;
+        // Mesh tree leaves
+        int numLeaves = 0;
+        int numEmptyLeaves = 0;
+        int numDegenerateNodes = 0;
+        // Texels without a reachable node: padding of the last row, the top level reserve
+        // for updates and meshes without instances
+        int numUnusedTexels = 0;
+        int textureWidth = 0;
+        int textureHeight = 0;
+        // Texel of the node, bounds min and bounds max textures
+        size_t bytesPerNode = 0;
+        // Reachable nodes and the whole node textures
+        size_t bytes = 0;
+        size_t textureBytes = 0;
+        // Mesh tree leaves by number of triangles
+        std::vector<int> leafSizeHistogram;
+        // Levels from the top level root into the mesh trees, a node shared by several instances
+        // counts at the shallowest level it is reached
+        std::vector<BvhLevelStats> levels;
+
+        std::string ToJson(int indent = 0) const;
+    };
+
+    /// Computes BvhReport and FlattenedBvhReport, to compare builders and track quality
+    /// regressions across changes
+    class BvhAnalyzer
+    {
+    public:
+        BvhAnalyzer()
+            : m_TaskPool(nullptr)
+            , m_Positions(nullptr)
+            , m_Stride(0)
+        {
+
+        }
+
+        // EPO is computed on this pool, nullptr computes it on the calling thread
+        void SetTaskPool(TaskThreadPool* pool)
+        {
+            m_TaskPool = pool;
+        }
+
+        // Vertex positions of the primitives the next Analyze reads, three vertices per primitive
+        // with stride floats between them. EPO needs them and is skipped for nullptr.
+        void SetTriangles(const float* positions, int stride)
+        {
+            m_Positions = positions;
+            m_Stride    = stride;
+        }
+
+        BvhReport Analyze(const Bvh& bvh) const;
+
+        FlattenedBvhReport Analyze(const BvhTranslator& translator) const;
+
+    private:
+        // End-point overlap of a tree whose leaves reference numPrimitives primitives
+        float ComputeEpo(const Bvh& bvh, int numPrimitives) const;
+
+        TaskThreadPool* m_TaskPool;
+        const float* m_Positions;
+        int m_Stride;
+    };
+}
+
+#endif // BVH_ANALYZER_H
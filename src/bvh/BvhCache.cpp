@@ -0,0 +1,284 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <vector>
+
+#if defined(_WIN32)
+    #include <windows.h>
+#endif
+
+#include "BvhCache.h"
+#include "Bvh.h"
+#include "MappedFile.h"
+
+namespace RadeonRays
+{
+    namespace
+    {
+        const char kMagic[4] = { 'B', 'V', 'H', 'C' };
+
+        // Followed by numNodes nodes and numIndices primitive indices
+        struct EntryHeader
+        {
+            char magic[4];
+            uint32 version;
+            uint64 key;
+            // ContentHash of the nodes and indices
+            uint64 checksum;
+            // Guards against node layout changes between compilers or platforms
+            uint32 nodeSize;
+            int numPrimitives;
+            int numNodes;
+            int numIndices;
+            int height;
+            float bounds[6];
+            uint32 padding;
+        };
+
+        static_assert(sizeof(EntryHeader) % 8 == 0, "nodes must stay aligned after the header");
+        static_assert(sizeof(Bvh::Node) % 4 == 0, "nodes are hashed in 32 bit words");
+
+        inline uint64 Rotl(uint64 x, int r)
+        {
+            return (x << r) | (x >> (64 - r));
+        }
+
+        uint64 PayloadChecksum(const Bvh::Node* nodes, int numNodes, const int* indices, int numIndices)
+        {
+            ContentHash hash;
+            hash.Add(nodes, numNodes * sizeof(Bvh::Node));
+            hash.Add(indices, numIndices * sizeof(int));
+            return hash.Get();
+        }
+
+        // Every link and leaf range stays inside the entry and every node but the root has
+        // exactly one parent, so traversal of a restored tree always terminates
+        bool ValidateTree(const Bvh::Node* nodes, int numNodes, const int* indices, int numIndices, int numPrimitives)
+        {
+            std::vector<uint8> referenced(numNodes, 0);
+
+            for (int i = 0; i < numNodes; ++i)
+            {
+                const Bvh::Node& node = nodes[i];
+                if (node.type == Bvh::kInternal)
+                {
+                    if (node.lc <= 0 || node.lc >= numNodes || node.rc <= 0 || node.rc >= numNodes) {
+                        return false;
+                    }
+
+                    if (referenced[node.lc]++ || referenced[node.rc]++) {
+                        return false;
+                    }
+                }
+                else if (node.type == Bvh::kLeaf)
+                {
+                    if (node.startidx < 0 || node.numprims < 0 || node.startidx > numIndices - node.numprims) {
+                        return false;
+                    }
+                }
+                else
+                {
+                    return false;
+                }
+            }
+
+            for (int i = 0; i < numIndices; ++i)
+            {
+                if (indices[i] < 0 || indices[i] >= numPrimitives) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+    }
+
+    void ContentHash::Add(const void* data, size_t size)
+    {
+        const uint8* bytes = (const uint8*)data;
+        size_t numWords = size / 4;
+
+        uint64 hash = m_Hash;
+        for (size_t i = 0; i < numWords; ++i)
+        {
+            uint32 word;
+            memcpy(&word, bytes + i * 4, sizeof(word));
+
+            hash ^= word * 0x87c37b91114253d5ULL;
+            hash  = Rotl(hash, 27) * 0x4cf5ad432745937fULL + 0x52dce729;
+        }
+
+        m_Hash = hash;
+    }
+
+    uint64 ContentHash::Get() const
+    {
+        uint64 hash = m_Hash;
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ULL;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    BvhCache::BvhCache(const std::string& directory)
+        : m_Directory(directory)
+    {
+        if (!m_Directory.empty() && m_Directory.back() != '/' && m_Directory.back() != '\\') {
+            m_Directory += '/';
+        }
+    }
+
+    std::string BvhCache::GetEntryPath(uint64 key) const
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.bvh", key);
+        return m_Directory + name;
+    }
+
+    bool BvhCache::Load(uint64 key, int numPrimitives, Bvh& bvh) const
+    {
+        std::string path = GetEntryPath(key);
+        MappedFile file(path);
+        if (!file.GetData()) {
+            return false;
+        }
+
+        EntryHeader header;
+        if (file.GetSize() < sizeof(EntryHeader)) {
+            printf("BVH cache entry %s is truncated, rebuilding\n", path.c_str());
+            return false;
+        }
+        memcpy(&header, file.GetData(), sizeof(EntryHeader));
+
+        if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion || header.nodeSize != sizeof(Bvh::Node)) {
+            printf("BVH cache entry %s was written by another version, rebuilding\n", path.c_str());
+            return false;
+        }
+
+        if (header.key != key || header.numPrimitives != numPrimitives) {
+            printf("BVH cache entry %s belongs to other geometry, rebuilding\n", path.c_str());
+            return false;
+        }
+
+        size_t nodesSize   = (size_t)header.numNodes * sizeof(Bvh::Node);
+        size_t indicesSize = (size_t)header.numIndices * sizeof(int);
+        if (header.numNodes <= 0 || header.numIndices < 0 || file.GetSize() != sizeof(EntryHeader) + nodesSize + indicesSize) {
+            printf("BVH cache entry %s is truncated, rebuilding\n", path.c_str());
+            return false;
+        }
+
+        // The mapping is page aligned and the header keeps nodes and indices aligned
+        const Bvh::Node* nodes = (const Bvh::Node*)(file.GetData() + sizeof(EntryHeader));
+        const int* indices     = (const int*)(file.GetData() + sizeof(EntryHeader) + nodesSize);
+
+        if (PayloadChecksum(nodes, header.numNodes, indices, header.numIndices) != header.checksum ||
+            !ValidateTree(nodes, header.numNodes, indices, header.numIndices, numPrimitives))
+        {
+            printf("BVH cache entry %s is corrupted, rebuilding\n", path.c_str());
+            return false;
+        }
+
+        bvh.m_Nodes.resize(header.numNodes);
+        memcpy(&bvh.m_Nodes[0], nodes, nodesSize);
+        bvh.m_PackedIndices.assign(indices, indices + header.numIndices);
+        bvh.m_Nodecnt    = header.numNodes;
+        bvh.m_Height     = header.height;
+        bvh.m_Bounds.min = Vector3(header.bounds[0], header.bounds[1], header.bounds[2]);
+        bvh.m_Bounds.max = Vector3(header.bounds[3], header.bounds[4], header.bounds[5]);
+        bvh.ResetRefitState();
+
+        return true;
+    }
+
+    bool BvhCache::Store(uint64 key, int numPrimitives, const Bvh& bvh) const
+    {
+        if (bvh.m_Nodes.empty()) {
+            return false;
+        }
+
+        if (!m_Directory.empty())
+        {
+            // Only the last level is created
+            MakeDirectory(m_Directory.substr(0, m_Directory.size() - 1));
+        }
+
+        EntryHeader header;
+        memset(&header, 0, sizeof(EntryHeader));
+        memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version       = kVersion;
+        header.key           = key;
+        header.nodeSize      = sizeof(Bvh::Node);
+        header.numPrimitives = numPrimitives;
+        header.numNodes      = (int)bvh.m_Nodes.size();
+        header.numIndices    = (int)bvh.m_PackedIndices.size();
+        header.height        = bvh.m_Height;
+        header.bounds[0]     = bvh.m_Bounds.min.x;
+        header.bounds[1]     = bvh.m_Bounds.min.y;
+        header.bounds[2]     = bvh.m_Bounds.min.z;
+        header.bounds[3]     = bvh.m_Bounds.max.x;
+        header.bounds[4]     = bvh.m_Bounds.max.y;
+        header.bounds[5]     = bvh.m_Bounds.max.z;
+
+        const int* indices = bvh.m_PackedIndices.empty() ? nullptr : &bvh.m_PackedIndices[0];
+        header.checksum = PayloadChecksum(&bvh.m_Nodes[0], header.numNodes, indices, header.numIndices);
+
+        // Written next to the entry and renamed over it, so concurrent jobs never map a partial file
+        std::string path = GetEntryPath(key);
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), ".%llx.tmp", (uint64)std::chrono::high_resolution_clock::now().time_since_epoch().count());
+        std::string tempPath = path + suffix;
+
+        FILE* file = fopen(tempPath.c_str(), "wb");
+        if (!file)
+        {
+            printf("Unable to write BVH cache entry %s\n", path.c_str());
+            return false;
+        }
+
+        bool written = fwrite(&header, sizeof(EntryHeader), 1, file) == 1;
+        written &= fwrite(&bvh.m_Nodes[0], sizeof(Bvh::Node), bvh.m_Nodes.size(), file) == bvh.m_Nodes.size();
+        if (indices) {
+            written &= fwrite(indices, sizeof(int), bvh.m_PackedIndices.size(), file) == bvh.m_PackedIndices.size();
+        }
+        written &= fclose(file) == 0;
+
+#if defined(_WIN32)
+        written = written && MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+        written = written && rename(tempPath.c_str(), path.c_str()) == 0;
+#endif
+
+        if (!written)
+        {
+            remove(tempPath.c_str());
+            printf("Unable to write BVH cache entry %s\n", path.c_str());
+            return false;
+        }
+
+        return true;
+    }
+}
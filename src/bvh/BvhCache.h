@@ -0,0 +1,97 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+#pragma once
+
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include <string>
+
+#include "math/Math.h"
+
+namespace RadeonRays
+{
+    class Bvh;
+
+    /// 64 bit hash for cache keys and entry checksums. Data is consumed in 32 bit words,
+    /// so sizes passed to Add must be multiples of 4.
+    class ContentHash
+    {
+    public:
+        ContentHash(uint64 seed = 0)
+            : m_Hash(seed ^ 0x9e3779b97f4a7c15ULL)
+        {
+
+        }
+
+        void Add(const void* data, size_t size);
+
+        void Add(int value)
+        {
+            Add(&value, sizeof(value));
+        }
+
+        void Add(float value)
+        {
+            Add(&value, sizeof(value));
+        }
+
+        // Finalized hash of everything added so far
+        uint64 Get() const;
+
+    private:
+        uint64 m_Hash;
+    };
+
+    /// Directory of built trees, one versioned binary file per key. Entries are memory mapped
+    /// and validated on load, stale or corrupted ones are rejected so the caller builds again
+    /// and overwrites them.
+    class BvhCache
+    {
+    public:
+        // Bumped whenever the entry layout or the meaning of the stored nodes changes
+        static const uint32 kVersion = 1;
+
+        BvhCache(const std::string& directory);
+
+        // Restores nodes and primitive indices of the entry for key into bvh. numPrimitives
+        // is the number of bounds the tree would be built from. Returns false when there is
+        // no usable entry, bvh is left untouched then.
+        bool Load(uint64 key, int numPrimitives, Bvh& bvh) const;
+
+        // Writes the built tree as the entry for key, replacing an existing one atomically
+        bool Store(uint64 key, int numPrimitives, const Bvh& bvh) const;
+
+        // File of the entry for key
+        std::string GetEntryPath(uint64 key) const;
+
+        const std::string& GetDirectory() const
+        {
+            return m_Directory;
+        }
+
+    private:
+        std::string m_Directory;
+    };
+}
+
+#endif // BVH_CACHE_H
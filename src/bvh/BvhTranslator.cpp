@@ -28,130 +28,237 @@ THE SOFTWARE.
 #include "BvhTranslator.h"
 
 #include <cassert>
+#include <cstdio>
 #include <stack>
 #include <iostream>
+#include <algorithm>
+#include <climits>
 
 #include "math/Bounds3D.h"
+#include "job/TaskGroup.h"
 
 namespace RadeonRays
 {
-	int BvhTranslator::ProcessBLASNodes(const Bvh::Node* node)
+	TextureLayout TextureLayout::ForCount(size_t count)
 	{
-		Bounds3D bbox = node->bounds;
+		TextureLayout layout;
+		while ((size_t)layout.width * layout.width < count)
+		{
+			layout.widthLog2++;
+			layout.width = 1 << layout.widthLog2;
+		}
 
-		bboxmin[curNode] = bbox.min;
-		bboxmax[curNode] = bbox.max;
-		nodes[curNode].leaf = 0;
+		layout.height = std::max((int)((count + layout.width - 1) >> layout.widthLog2), 1);
+		return layout;
+	}
 
-		int index = curNode;
+	// Arena nodes flattened by one task, large meshes are split into several
+	static const int kNodesPerTask = 16384;
 
-		if (node->type == RadeonRays::Bvh::NodeType::kLeaf)
-		{
-			nodes[curNode].leftIndex  = curTriIndex + node->startidx;
-			nodes[curNode].rightIndex = node->numprims;
-			nodes[curNode].leaf = 1;
-		}
-		else
+	void BvhTranslator::ProcessBLASNodes(const Bvh* bvh, int rootIndex, int triIndex, int begin, int end)
+	{
+		// Arena order is kept, so child indices only need the offset of the mesh
+		const Bvh::Node* bvhNodes = bvh->GetNodes();
+
+		for (int i = begin; i < end; ++i)
 		{
-			curNode++;
-			nodes[index].leftIndex = ProcessBLASNodes(node->lc);
-			nodes[index].leftIndex = ((nodes[index].leftIndex % nodeTexWidth) << 12) | (nodes[index].leftIndex / nodeTexWidth);
-			curNode++;
-			nodes[index].rightIndex = ProcessBLASNodes(node->rc);
-			nodes[index].rightIndex = ((nodes[index].rightIndex % nodeTexWidth) << 12) | (nodes[index].rightIndex / nodeTexWidth);
-		}
+			const Bvh::Node& node = bvhNodes[i];
+			int index = rootIndex + i;
 
-		return index;
+			bboxmin[index] = node.bounds.min;
+			bboxmax[index] = node.bounds.max;
+
+			if (node.type == RadeonRays::Bvh::NodeType::kLeaf)
+			{
+				nodes[index].leftIndex  = triIndex + node.startidx;
+				nodes[index].rightIndex = node.numprims;
+				nodes[index].leaf = 1;
+			}
+			else
+			{
+				nodes[index].leftIndex  = rootIndex + node.lc;
+				nodes[index].rightIndex = rootIndex + node.rc;
+				nodes[index].leaf = 0;
+			}
+		}
 	}
 
-	int BvhTranslator::ProcessTLASNodes(const Bvh::Node* node)
+	void BvhTranslator::ProcessTLASNodes(const Bvh* bvh, int rootIndex)
 	{
-		Bounds3D bbox = node->bounds;
+		int numNodes = bvh->GetNumNodes();
+
+		for (int i = 0; i < numNodes; ++i) {
+			ProcessTLASNode(bvh, rootIndex, i);
+		}
+	}
 
-		bboxmin[curNode] = bbox.min;
-		bboxmax[curNode] = bbox.max;
-		nodes[curNode].leaf = 0;
+	void BvhTranslator::ProcessTLASNode(const Bvh* bvh, int rootIndex, int nodeIndex)
+	{
+		const Bvh::Node& node = bvh->GetNodes()[nodeIndex];
+		int index = rootIndex + nodeIndex;
 
-		int index = curNode;
+		bboxmin[index] = node.bounds.min;
+		bboxmax[index] = node.bounds.max;
 
-		if (node->type == RadeonRays::Bvh::NodeType::kLeaf)
+		if (node.type == RadeonRays::Bvh::NodeType::kLeaf)
 		{
-			int instanceIndex = TLBvh->m_PackedIndices[node->startidx];
+			// Leaves point at a single BLAS subtree, so the TLAS must be built with one ref per leaf
+			assert(node.numprims == 1);
+			const InstanceRef& ref = instanceRefs[bvh->m_PackedIndices[node.startidx]];
+			int instanceIndex = ref.instanceIndex;
 			int meshIndex  = meshInstances[instanceIndex].meshID;
 			int materialID = meshInstances[instanceIndex].materialID;
 
-			nodes[curNode].leftIndex  = (bvhRootStartIndices[meshIndex] % nodeTexWidth) << 12 | (bvhRootStartIndices[meshIndex] / nodeTexWidth);
-			nodes[curNode].rightIndex = materialID;
-			nodes[curNode].leaf = -instanceIndex - 1;
+			nodes[index].leftIndex  = bvhRootStartIndices[meshIndex] + ref.blasNode;
+			nodes[index].rightIndex = materialID;
+			nodes[index].leaf = -instanceIndex - 1;
 		}
 		else
 		{
-			curNode++;
-			nodes[index].leftIndex = ProcessTLASNodes(node->lc);
-			nodes[index].leftIndex = ((nodes[index].leftIndex % nodeTexWidth) << 12) | (nodes[index].leftIndex / nodeTexWidth);
-			curNode++;
-			nodes[index].rightIndex = ProcessTLASNodes(node->rc);
-			nodes[index].rightIndex = ((nodes[index].rightIndex % nodeTexWidth) << 12) | (nodes[index].rightIndex / nodeTexWidth);
+			nodes[index].leftIndex  = rootIndex + node.lc;
+			nodes[index].rightIndex = rootIndex + node.rc;
+			nodes[index].leaf = 0;
 		}
-		return index;
 	}
 	
-	void BvhTranslator::ProcessBLAS()
+	bool BvhTranslator::ProcessBLAS()
 	{
-		int nodeCnt = 0;
+		// Every mesh owns the node and triangle ranges following those of the previous meshes
+		size_t nodeCnt = 0;
+		size_t triCnt  = 0;
+
+		bvhRootStartIndices.resize(meshes.size());
+		bvhTriStartIndices.resize(meshes.size());
+
+		for (int i = 0; i < meshes.size(); ++i)
+		{
+			bvhRootStartIndices[i] = (int)nodeCnt;
+			bvhTriStartIndices[i]  = (int)triCnt;
 
-		for (int i = 0; i < meshes.size(); ++i) {
-			nodeCnt += meshes[i]->bvh->m_Nodecnt;
+			nodeCnt += meshes[i]->bvh->GetNumNodes();
+			triCnt  += meshes[i]->bvh->GetNumIndices();
 		}
 		
-		topLevelIndex = nodeCnt;
+		topLevelIndex = (int)nodeCnt;
 
 		// reserve space for top level nodes
-		nodeCnt += 2 * meshInstances.size();
-		nodeTexWidth = (int)(sqrt(nodeCnt) + 1);
+		nodeCnt += 2 * (size_t)maxInstanceRefs;
 
-		// Resize to power of 2
-		bboxmin.resize(nodeTexWidth * nodeTexWidth);
-		bboxmax.resize(nodeTexWidth * nodeTexWidth);
-		nodes.resize(nodeTexWidth * nodeTexWidth);
+		// Links are 32 bit texel values
+		if (nodeCnt > INT_MAX || triCnt > INT_MAX)
+		{
+			printf("Error: Scene has %zu BVH nodes and %zu triangles, at most %d of each can be addressed\n", nodeCnt, triCnt, INT_MAX);
+			return false;
+		}
+
+		nodeTexLayout = TextureLayout::ForCount(nodeCnt);
 
-		int bvhRootIndex = 0;
-		curTriIndex = 0;
+		bboxmin.resize(nodeTexLayout.GetSize());
+		bboxmax.resize(nodeTexLayout.GetSize());
+		nodes.resize(nodeTexLayout.GetSize());
 
-		for (int i = 0; i < meshes.size(); i++)
+		struct Task
 		{
-			GLSLPT::Mesh *mesh = meshes[i];
-			curNode = bvhRootIndex;
-
-			bvhRootStartIndices.push_back(bvhRootIndex);
-			bvhRootIndex += mesh->bvh->m_Nodecnt;
-			
-			ProcessBLASNodes(mesh->bvh->m_Root);
-			curTriIndex += mesh->bvh->GetNumIndices();
+			int mesh;
+			int begin;
+			int end;
+		};
+
+		std::vector<Task> tasks;
+		for (int i = 0; i < meshes.size(); ++i)
+		{
+			int numNodes = meshes[i]->bvh->GetNumNodes();
+			for (int begin = 0; begin < numNodes; begin += kNodesPerTask) {
+				tasks.push_back(Task{ i, begin, std::min(begin + kNodesPerTask, numNodes) });
+			}
 		}
+
+		// Tasks write disjoint slots, so the output does not depend on the schedule
+		TaskGroup::ParallelFor(taskPool, (int)tasks.size(), 1, [&](int32 begin, int32 end)
+		{
+			for (int i = begin; i < end; ++i)
+			{
+				const Task& task = tasks[i];
+				ProcessBLASNodes(meshes[task.mesh]->bvh, bvhRootStartIndices[task.mesh], bvhTriStartIndices[task.mesh], task.begin, task.end);
+			}
+		});
+
+		return true;
 	}
 
 	void BvhTranslator::ProcessTLAS()
 	{
-		curNode = topLevelIndex;
-		topLevelIndexPackedXY = ((topLevelIndex % nodeTexWidth) << 12) | (topLevelIndex / nodeTexWidth);
-		ProcessTLASNodes(TLBvh->m_Root);
+		ProcessTLASNodes(TLBvh, topLevelIndex);
 	}
 
-	void BvhTranslator::UpdateTLAS(const Bvh* topLevelBvh, const std::vector<GLSLPT::MeshInstance>& sceneInstances)
+	void BvhTranslator::UpdateTLAS(const Bvh* topLevelBvh, const std::vector<GLSLPT::MeshInstance>& sceneInstances, const std::vector<InstanceRef>& refs)
 	{
+		assert(refs.size() <= maxInstanceRefs);
 		TLBvh = topLevelBvh;
-		curNode = topLevelIndex;
 		meshInstances = sceneInstances;
-		ProcessTLASNodes(TLBvh->m_Root);
+		instanceRefs = refs;
+		ProcessTLASNodes(TLBvh, topLevelIndex);
+
+		NodeRange range = { topLevelIndex, topLevelIndex + TLBvh->GetNumNodes() };
+		dirtyNodes.push_back(range);
+		dirtyBounds.push_back(range);
+	}
+
+	void BvhTranslator::UpdateTLASNodes(const std::vector<int>& tlasNodes)
+	{
+		for (int i = 0; i < tlasNodes.size(); ++i)
+		{
+			ProcessTLASNode(TLBvh, topLevelIndex, tlasNodes[i]);
+
+			NodeRange range = { topLevelIndex + tlasNodes[i], topLevelIndex + tlasNodes[i] + 1 };
+			dirtyNodes.push_back(range);
+			dirtyBounds.push_back(range);
+		}
 	}
 
-	void BvhTranslator::Process(const Bvh* topLevelBvh, const std::vector<GLSLPT::Mesh*>& sceneMeshes, const std::vector<GLSLPT::MeshInstance>& sceneInstances)
+	bool BvhTranslator::Process(const Bvh* topLevelBvh, const std::vector<GLSLPT::Mesh*>& sceneMeshes, const std::vector<GLSLPT::MeshInstance>& sceneInstances,
+								const std::vector<InstanceRef>& refs, int maxRefs)
 	{
+		assert(refs.size() <= maxRefs);
 		TLBvh = topLevelBvh;
 		meshes = sceneMeshes;
 		meshInstances = sceneInstances;
-		ProcessBLAS();
+		instanceRefs = refs;
+		maxInstanceRefs = maxRefs;
+
+		if (!ProcessBLAS())
+		{
+			nodes.clear();
+			bboxmin.clear();
+			bboxmax.clear();
+			dirtyNodes.clear();
+			dirtyBounds.clear();
+			return false;
+		}
+
 		ProcessTLAS();
+
+		dirtyNodes.assign(1, NodeRange{ 0, (int)nodes.size() });
+		dirtyBounds.assign(1, NodeRange{ 0, (int)nodes.size() });
+
+		return true;
+	}
+
+	void BvhTranslator::RefitBLAS(int meshIndex)
+	{
+		const Bvh* bvh = meshes[meshIndex]->bvh;
+		const Bvh::Node* arena = bvh->GetNodes();
+
+		int rootIndex = bvhRootStartIndices[meshIndex];
+		int numNodes  = bvh->GetNumNodes();
+		assert(rootIndex + numNodes <= topLevelIndex);
+
+		for (int i = 0; i < numNodes; ++i)
+		{
+			bboxmin[rootIndex + i] = arena[i].bounds.min;
+			bboxmax[rootIndex + i] = arena[i].bounds.max;
+		}
+
+		dirtyBounds.push_back(NodeRange{ rootIndex, rootIndex + numNodes });
 	}
 }
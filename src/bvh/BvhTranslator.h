@@ -33,12 +33,32 @@ THE SOFTWARE.
 #include <map>
 
 #include "Bvh.h"
+#include "Rebraid.h"
 #include "core/Mesh.h"
 
 namespace RadeonRays
 {
-    /// This class translates pointer based BVH representation into
-    /// index based one suitable for feeding to GPU or any other accelerator
+    /// Size of a 2D data texture holding elements addressed by a linear index.
+    /// The width is a power of two, element i is at texel (i & (width - 1), i >> widthLog2),
+    /// so the shaders address it with a mask and a shift. The height is the number of rows
+    /// the elements need and never exceeds the width.
+    struct TextureLayout
+    {
+        int widthLog2 = 0;
+        int width = 1;
+        int height = 1;
+
+        // Smallest layout holding count elements
+        static TextureLayout ForCount(size_t count);
+
+        size_t GetSize() const
+        {
+            return (size_t)width * height;
+        }
+    };
+
+    /// This class translates the node arenas of the BVHs into one
+    /// index based layout suitable for feeding to GPU or any other accelerator
     //
     class BvhTranslator
     {
@@ -54,30 +74,61 @@ namespace RadeonRays
 			int leaf;
 		};
 
-		void ProcessBLAS();
+		// Half open range of flattened nodes
+		struct NodeRange
+		{
+			int begin;
+			int end;
+		};
+
+		// False when the nodes or triangles cannot be addressed by 32 bit texel links
+		bool ProcessBLAS();
 		void ProcessTLAS();
-		void UpdateTLAS(const Bvh* topLevelBvh, const std::vector<GLSLPT::MeshInstance>& instances);
-		void Process(const Bvh* topLevelBvh, const std::vector<GLSLPT::Mesh*>& meshes, const std::vector<GLSLPT::MeshInstance>& instances);
+		// The top level BVH is built over refs, at most maxRefs of them as passed to Process
+		void UpdateTLAS(const Bvh* topLevelBvh, const std::vector<GLSLPT::MeshInstance>& instances, const std::vector<InstanceRef>& refs);
+		// Rewrites the given arena nodes of the top level BVH passed last, after an incremental update
+		void UpdateTLASNodes(const std::vector<int>& tlasNodes);
+		// False when the scene is too large for the flattened layout, nothing is usable then
+		bool Process(const Bvh* topLevelBvh, const std::vector<GLSLPT::Mesh*>& meshes, const std::vector<GLSLPT::MeshInstance>& instances,
+					 const std::vector<InstanceRef>& refs, int maxRefs);
+
+		// Meshes are flattened as tasks on this pool, nullptr flattens on the calling thread
+		void SetTaskPool(TaskThreadPool* pool)
+		{
+			taskPool = pool;
+		}
+
+		// Rewrites the bounds of a refitted mesh BVH, its topology must not have changed since Process
+		void RefitBLAS(int meshIndex);
 		
 	private:
-		int ProcessBLASNodes(const Bvh::Node* root);
-		int ProcessTLASNodes(const Bvh::Node* root);
+		// Copies arena nodes [begin, end) of bvh to the nodes starting at rootIndex,
+		// leaves reference the triangles starting at triIndex
+		void ProcessBLASNodes(const Bvh* bvh, int rootIndex, int triIndex, int begin, int end);
+		void ProcessTLASNodes(const Bvh* bvh, int rootIndex);
+		void ProcessTLASNode(const Bvh* bvh, int rootIndex, int nodeIndex);
 
 	public:
 		std::vector<Vector3> bboxmin;
 		std::vector<Vector3> bboxmax;
 		std::vector<Node> nodes;
-		int nodeTexWidth;
-		int topLevelIndexPackedXY = 0;
+		// Node links, leaf triangle ranges and topLevelIndex are linear indices into this layout
+		TextureLayout nodeTexLayout;
 		int topLevelIndex = 0;
+		// Nodes whose links or bounds changed since the last upload, the whole arena after Process
+		std::vector<NodeRange> dirtyNodes;
+		std::vector<NodeRange> dirtyBounds;
 
     private:
-		int curNode = 0;
-		int curTriIndex = 0;
 		const Bvh* TLBvh;
+		TaskThreadPool* taskPool = nullptr;
+		// First node and first triangle reference of every mesh
 		std::vector<int> bvhRootStartIndices;
+		std::vector<int> bvhTriStartIndices;
 		std::vector<GLSLPT::MeshInstance> meshInstances;
 		std::vector<GLSLPT::Mesh*> meshes;
+		std::vector<InstanceRef> instanceRefs;
+		int maxInstanceRefs = 0;
     };
 }
 
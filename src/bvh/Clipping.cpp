@@ -0,0 +1,90 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#include "Clipping.h"
+
+namespace RadeonRays
+{
+    int ClipPolygon(const Vector3* in, int numVertices, int axis, float split, bool below, Vector3* out)
+    {
+        int count = 0;
+
+        for (int i = 0; i < numVertices; ++i)
+        {
+            const Vector3& a = in[i];
+            const Vector3& b = in[(i + 1) % numVertices];
+            bool insideA = below ? a[axis] <= split : a[axis] >= split;
+            bool insideB = below ? b[axis] <= split : b[axis] >= split;
+
+            if (insideA && count < kMaxClippedVertices) {
+                out[count++] = a;
+            }
+
+            if (insideA != insideB && count < kMaxClippedVertices)
+            {
+                // Snap to the plane so the pieces on both sides share the crossing
+                Vector3 p = a + (b - a) * ((split - a[axis]) / (b[axis] - a[axis]));
+                p[axis] = split;
+                out[count++] = p;
+            }
+        }
+
+        return count;
+    }
+
+    int ClipPolygonToBox(const Vector3* in, int numVertices, const Bounds3D& box, Vector3* out)
+    {
+        Vector3 scratch[kMaxClippedVertices];
+        const Vector3* src = in;
+
+        // Alternates between scratch and out so the last plane writes to out
+        for (int plane = 0; plane < 6 && numVertices > 0; ++plane)
+        {
+            Vector3* dst = plane % 2 == 0 ? scratch : out;
+            int axis = plane / 2;
+            bool below = plane % 2 == 1;
+            numVertices = ClipPolygon(src, numVertices, axis, below ? box.max[axis] : box.min[axis], below, dst);
+            src = dst;
+        }
+
+        if (src != out)
+        {
+            for (int i = 0; i < numVertices; ++i) {
+                out[i] = src[i];
+            }
+        }
+
+        return numVertices;
+    }
+
+    float PolygonArea(const Vector3* vertices, int numVertices)
+    {
+        Vector3 sum(0.0f, 0.0f, 0.0f);
+
+        // Fan around the first vertex, every triangle has the same orientation
+        for (int i = 1; i + 1 < numVertices; ++i) {
+            sum += Vector3::CrossProduct(vertices[i] - vertices[0], vertices[i + 1] - vertices[0]);
+        }
+
+        return 0.5f * sum.Size();
+    }
+}
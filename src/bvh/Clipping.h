@@ -0,0 +1,47 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#pragma once
+
+#ifndef CLIPPING_H
+#define CLIPPING_H
+
+#include "math/Bounds3D.h"
+
+namespace RadeonRays
+{
+    // Vertices of a triangle clipped to a box, with slack for rounding
+    static const int kMaxClippedVertices = 16;
+
+    // Sutherland-Hodgman clip of a convex polygon against the plane axis = split, keeps the side
+    // below the plane when below is set. Writes at most kMaxClippedVertices vertices to out and
+    // returns their number, crossings are snapped to the plane.
+    int ClipPolygon(const Vector3* in, int numVertices, int axis, float split, bool below, Vector3* out);
+
+    // Clips a convex polygon of at most kMaxClippedVertices vertices to the six planes of box
+    int ClipPolygonToBox(const Vector3* in, int numVertices, const Bounds3D& box, Vector3* out);
+
+    // Area of a planar convex polygon
+    float PolygonArea(const Vector3* vertices, int numVertices);
+}
+
+#endif // CLIPPING_H
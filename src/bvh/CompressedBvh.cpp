@@ -0,0 +1,140 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#include <cassert>
+#include <cmath>
+
+#include "CompressedBvh.h"
+
+namespace RadeonRays
+{
+    // Largest grid coordinate
+    static const int kQuantizedMax = 255;
+
+    void CompressedBvh::Build(const Bvh4& bvh)
+    {
+        int numnodes = bvh.GetNumNodes();
+
+        m_Indices.assign(bvh.GetIndices(), bvh.GetIndices() + bvh.GetNumIndices());
+        m_Bounds = bvh.Bounds();
+        m_Nodes.resize(numnodes);
+
+        for (int i = 0; i < numnodes; ++i)
+        {
+            const Bvh4::Node& src = bvh.GetNodes()[i];
+            Node& dst = m_Nodes[i];
+            memset(&dst, 0, sizeof(Node));
+
+            Bounds3D lanes[4];
+            Bounds3D nodeBounds;
+
+            for (int lane = 0; lane < 4; ++lane)
+            {
+                if (src.numprims[lane] < 0) {
+                    continue;
+                }
+
+                lanes[lane] = Bounds3D(Vector3(src.minx[lane], src.miny[lane], src.minz[lane]), Vector3(src.maxx[lane], src.maxy[lane], src.maxz[lane]));
+                nodeBounds.Expand(lanes[lane]);
+                dst.validMask |= 1 << lane;
+            }
+
+            // Smallest power of two cell for which 255 cells reach the max corner
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                float lo = nodeBounds.min[axis];
+                float hi = nodeBounds.max[axis];
+                float extent = hi - lo;
+
+                int exponent = extent > 0.0f ? (int)std::ceil(std::log2(extent / kQuantizedMax)) : -126;
+                exponent = std::min(std::max(exponent, -126), 127);
+
+                while (exponent < 127 && lo + kQuantizedMax * Scale((int8)exponent) < hi) {
+                    ++exponent;
+                }
+
+                dst.origin[axis]   = lo;
+                dst.exponent[axis] = (int8)exponent;
+            }
+
+            uint8* qmin[3] = { dst.qminx, dst.qminy, dst.qminz };
+            uint8* qmax[3] = { dst.qmaxx, dst.qmaxy, dst.qmaxz };
+
+            for (int lane = 0; lane < 4; ++lane)
+            {
+                if (!(dst.validMask & (1 << lane)))
+                {
+                    dst.child[lane] = -1;
+                    continue;
+                }
+
+                // Round outwards, then step until the decoded value is on the safe side
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    float origin = dst.origin[axis];
+                    float scale  = Scale(dst.exponent[axis]);
+
+                    int lo = (int)std::floor((lanes[lane].min[axis] - origin) / scale);
+                    lo = std::min(std::max(lo, 0), kQuantizedMax);
+                    while (lo > 0 && origin + (float)lo * scale > lanes[lane].min[axis]) {
+                        --lo;
+                    }
+
+                    int hi = (int)std::ceil((lanes[lane].max[axis] - origin) / scale);
+                    hi = std::min(std::max(hi, 0), kQuantizedMax);
+                    while (hi < kQuantizedMax && origin + (float)hi * scale < lanes[lane].max[axis]) {
+                        ++hi;
+                    }
+
+                    qmin[axis][lane] = (uint8)lo;
+                    qmax[axis][lane] = (uint8)hi;
+                }
+
+                assert(src.numprims[lane] <= kMaxLeafSize);
+                dst.child[lane]    = src.child[lane];
+                dst.numprims[lane] = (uint8)src.numprims[lane];
+            }
+        }
+    }
+
+    float CompressedBvh::GetSahCost(float traversalCost) const
+    {
+        float rootarea = m_Bounds.Area();
+        if (m_Nodes.empty() || rootarea <= 0.0f) {
+            return 0.0f;
+        }
+
+        float cost = traversalCost * rootarea;
+
+        for (const Node& node : m_Nodes)
+        {
+            for (int lane = 0; lane < 4; ++lane)
+            {
+                if (node.validMask & (1 << lane)) {
+                    cost += DecodeBounds(node, lane).Area() * (node.numprims[lane] > 0 ? node.numprims[lane] : traversalCost);
+                }
+            }
+        }
+
+        return cost / rootarea;
+    }
+}
@@ -0,0 +1,211 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#pragma once
+
+#ifndef COMPRESSED_BVH_H
+#define COMPRESSED_BVH_H
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#include "WideBvh.h"
+#include "math/Math.h"
+
+namespace RadeonRays
+{
+    /// Bvh4 with child bounds quantized to 8 bits on a power of two grid anchored at the
+    /// node bounds, so a whole node fits in one 64 byte cache line. Decoded child boxes
+    /// always enclose the original ones. CompressedBvhTranslator lays out the trees of a
+    /// scene in this format for the CPU renderer.
+    class CompressedBvh
+    {
+    public:
+        struct Node
+        {
+            // Grid origin, the min corner of the node bounds
+            float origin[3];
+            // Grid cell size is 2^exponent per axis
+            int8 exponent[3];
+            // One bit per used lane
+            uint8 validMask;
+            // Child bounds in grid cells, lo = origin + q * 2^exponent
+            uint8 qminx[4];
+            uint8 qminy[4];
+            uint8 qminz[4];
+            uint8 qmaxx[4];
+            uint8 qmaxy[4];
+            uint8 qmaxz[4];
+            // Node index of internal children, first entry in the indices of leaves
+            int child[4];
+            // Primitives of leaf children, 0 for internal children
+            uint8 numprims[4];
+            uint8 padding[4];
+        };
+
+        // Leaves are limited by the 8 bit primitive count
+        static const int kMaxLeafSize = 255;
+
+        // Quantizes the nodes of a collapsed tree, node indices stay the same
+        void Build(const Bvh4& bvh);
+
+        // Cell size of an exponent
+        static float Scale(int8 exponent)
+        {
+            uint32 bits = (uint32)(exponent + 127) << 23;
+            float scale;
+            memcpy(&scale, &bits, sizeof(float));
+            return scale;
+        }
+
+        // Decodes one child box, the same arithmetic as IntersectChildren
+        static Bounds3D DecodeBounds(const Node& node, int lane);
+
+        // Slab tests the ray against every child of node with the boxes decoded on the fly.
+        // Returns a mask with one bit per lane hit within [0, tmax] and writes the entry
+        // distances of all lanes to tnear.
+        static int IntersectChildren(const Node& node, const Vector3& origin, const Vector3& invDir, float tmax, float* tnear);
+
+        const Node* GetNodes() const
+        {
+            return &m_Nodes[0];
+        }
+
+        int GetNumNodes() const
+        {
+            return (int)m_Nodes.size();
+        }
+
+        const int* GetIndices() const
+        {
+            return &m_Indices[0];
+        }
+
+        size_t GetNumIndices() const
+        {
+            return m_Indices.size();
+        }
+
+        const Bounds3D& Bounds() const
+        {
+            return m_Bounds;
+        }
+
+        // Bytes used by the nodes and the primitive indices
+        size_t GetMemorySize() const
+        {
+            return m_Nodes.size() * sizeof(Node) + m_Indices.size() * sizeof(int);
+        }
+
+        // SAH cost of the decoded boxes relative to the root area, traversalCost is paid once per node
+        float GetSahCost(float traversalCost) const;
+
+    private:
+        std::vector<Node> m_Nodes;
+        std::vector<int> m_Indices;
+        Bounds3D m_Bounds;
+    };
+
+    static_assert(sizeof(CompressedBvh::Node) == 64, "CompressedBvh::Node must fill one cache line");
+
+    inline Bounds3D CompressedBvh::DecodeBounds(const Node& node, int lane)
+    {
+        float sx = Scale(node.exponent[0]);
+        float sy = Scale(node.exponent[1]);
+        float sz = Scale(node.exponent[2]);
+
+        return Bounds3D(Vector3(node.origin[0] + node.qminx[lane] * sx, node.origin[1] + node.qminy[lane] * sy, node.origin[2] + node.qminz[lane] * sz),
+                        Vector3(node.origin[0] + node.qmaxx[lane] * sx, node.origin[1] + node.qmaxy[lane] * sy, node.origin[2] + node.qmaxz[lane] * sz));
+    }
+
+#if WIDE_BVH_SSE
+    // Four quantized coordinates to floats
+    static inline __m128 DecodeLanes(const uint8* q, __m128 origin, __m128 scale)
+    {
+        int32 packed;
+        memcpy(&packed, q, sizeof(packed));
+
+        __m128i zero  = _mm_setzero_si128();
+        __m128i bytes = _mm_cvtsi32_si128(packed);
+        __m128i ints  = _mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero);
+
+        return _mm_add_ps(origin, _mm_mul_ps(_mm_cvtepi32_ps(ints), scale));
+    }
+#endif
+
+    inline int CompressedBvh::IntersectChildren(const Node& node, const Vector3& origin, const Vector3& invDir, float tmax, float* tnear)
+    {
+#if WIDE_BVH_SSE
+        __m128 ox = _mm_set1_ps(node.origin[0]);
+        __m128 oy = _mm_set1_ps(node.origin[1]);
+        __m128 oz = _mm_set1_ps(node.origin[2]);
+        __m128 sx = _mm_set1_ps(Scale(node.exponent[0]));
+        __m128 sy = _mm_set1_ps(Scale(node.exponent[1]));
+        __m128 sz = _mm_set1_ps(Scale(node.exponent[2]));
+
+        __m128 rx = _mm_set1_ps(origin.x);
+        __m128 ry = _mm_set1_ps(origin.y);
+        __m128 rz = _mm_set1_ps(origin.z);
+        __m128 ix = _mm_set1_ps(invDir.x);
+        __m128 iy = _mm_set1_ps(invDir.y);
+        __m128 iz = _mm_set1_ps(invDir.z);
+
+        __m128 t0x = _mm_mul_ps(_mm_sub_ps(DecodeLanes(node.qminx, ox, sx), rx), ix);
+        __m128 t1x = _mm_mul_ps(_mm_sub_ps(DecodeLanes(node.qmaxx, ox, sx), rx), ix);
+        __m128 t0y = _mm_mul_ps(_mm_sub_ps(DecodeLanes(node.qminy, oy, sy), ry), iy);
+        __m128 t1y = _mm_mul_ps(_mm_sub_ps(DecodeLanes(node.qmaxy, oy, sy), ry), iy);
+        __m128 t0z = _mm_mul_ps(_mm_sub_ps(DecodeLanes(node.qminz, oz, sz), rz), iz);
+        __m128 t1z = _mm_mul_ps(_mm_sub_ps(DecodeLanes(node.qmaxz, oz, sz), rz), iz);
+
+        __m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)), _mm_max_ps(_mm_min_ps(t0z, t1z), _mm_setzero_ps()));
+        __m128 tfar = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)), _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_set1_ps(tmax)));
+
+        _mm_storeu_ps(tnear, tmin);
+        return _mm_movemask_ps(_mm_cmple_ps(tmin, tfar)) & node.validMask;
+#else
+        int mask = 0;
+
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            Bounds3D bounds = DecodeBounds(node, lane);
+
+            float t0x = (bounds.min.x - origin.x) * invDir.x;
+            float t1x = (bounds.max.x - origin.x) * invDir.x;
+            float t0y = (bounds.min.y - origin.y) * invDir.y;
+            float t1y = (bounds.max.y - origin.y) * invDir.y;
+            float t0z = (bounds.min.z - origin.z) * invDir.z;
+            float t1z = (bounds.max.z - origin.z) * invDir.z;
+
+            float tmin = std::max(std::max(std::min(t0x, t1x), std::min(t0y, t1y)), std::max(std::min(t0z, t1z), 0.0f));
+            float tfar = std::min(std::min(std::max(t0x, t1x), std::max(t0y, t1y)), std::min(std::max(t0z, t1z), tmax));
+
+            tnear[lane] = tmin;
+            mask |= (tmin <= tfar ? 1 : 0) << lane;
+        }
+
+        return mask & node.validMask;
+#endif
+    }
+}
+
+#endif // COMPRESSED_BVH_H
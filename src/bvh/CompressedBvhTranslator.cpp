@@ -0,0 +1,199 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#include <cstdio>
+#include <climits>
+
+#include "CompressedBvhTranslator.h"
+#include "job/TaskGroup.h"
+
+namespace RadeonRays
+{
+    bool CompressedBvhTranslator::Process(const Bvh* topLevelBvh, const std::vector<GLSLPT::Mesh*>& sceneMeshes, const std::vector<GLSLPT::MeshInstance>& sceneInstances,
+                                          const std::vector<InstanceRef>& refs)
+    {
+        TLBvh = topLevelBvh;
+        meshes = sceneMeshes;
+        meshInstances = sceneInstances;
+        instanceRefs = refs;
+        nodes.clear();
+        instances.clear();
+
+        int numMeshes = (int)meshes.size();
+        std::vector<CompressedBvh> trees(numMeshes);
+        std::vector<char> fits(numMeshes, 1);
+
+        TaskGroup::ParallelFor(taskPool, numMeshes, 1, [&](int32 begin, int32 end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                Bvh4 wide;
+                wide.Build(*meshes[i]->bvh);
+
+                for (int n = 0; n < wide.GetNumNodes() && fits[i]; ++n)
+                {
+                    for (int lane = 0; lane < 4; ++lane)
+                    {
+                        if (wide.GetNodes()[n].numprims[lane] > CompressedBvh::kMaxLeafSize) {
+                            fits[i] = 0;
+                        }
+                    }
+                }
+
+                if (fits[i]) {
+                    trees[i].Build(wide);
+                }
+            }
+        });
+
+        // Every mesh owns the node and triangle ranges following those of the previous meshes
+        size_t nodeCnt = 0;
+        size_t triCnt  = 0;
+
+        meshRootIndices.resize(numMeshes);
+        meshRootLanes.resize(numMeshes);
+        meshTriIndices.resize(numMeshes);
+        numMeshBinaryNodes = 0;
+
+        for (int i = 0; i < numMeshes; ++i)
+        {
+            if (!fits[i])
+            {
+                printf("Error: Mesh %s has leaves of more than %d triangles, the compressed BVH cannot hold them\n", meshes[i]->name.c_str(), CompressedBvh::kMaxLeafSize);
+                return false;
+            }
+
+            meshRootIndices[i] = (int)nodeCnt;
+            meshRootLanes[i]   = trees[i].GetNodes()[0].validMask;
+            meshTriIndices[i]  = (int)triCnt;
+
+            nodeCnt += trees[i].GetNumNodes();
+            triCnt  += trees[i].GetNumIndices();
+            numMeshBinaryNodes += meshes[i]->bvh->GetNumNodes();
+        }
+
+        // The top level has fewer wide nodes than refs
+        if (nodeCnt + instanceRefs.size() > INT_MAX || triCnt > INT_MAX)
+        {
+            printf("Error: Scene has %zu BVH nodes and %zu triangles, at most %d of each can be addressed\n", nodeCnt, triCnt, INT_MAX);
+            return false;
+        }
+
+        topLevelIndex = (int)nodeCnt;
+        nodes.resize(nodeCnt);
+
+        // Internal lanes move by the first node of their mesh, leaf lanes by its first triangle
+        TaskGroup::ParallelFor(taskPool, numMeshes, 1, [&](int32 begin, int32 end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                const CompressedBvh::Node* src = trees[i].GetNodes();
+                CompressedBvh::Node* dst = &nodes[meshRootIndices[i]];
+
+                for (int n = 0; n < trees[i].GetNumNodes(); ++n)
+                {
+                    dst[n] = src[n];
+                    for (int lane = 0; lane < 4; ++lane)
+                    {
+                        if (!(dst[n].validMask & (1 << lane))) {
+                            continue;
+                        }
+                        dst[n].child[lane] += dst[n].numprims[lane] ? meshTriIndices[i] : meshRootIndices[i];
+                    }
+                }
+
+                trees[i] = CompressedBvh();
+            }
+        });
+
+        ProcessTLAS();
+        return true;
+    }
+
+    void CompressedBvhTranslator::UpdateTLAS(const Bvh* topLevelBvh, const std::vector<GLSLPT::MeshInstance>& sceneInstances, const std::vector<InstanceRef>& refs)
+    {
+        TLBvh = topLevelBvh;
+        meshInstances = sceneInstances;
+        instanceRefs = refs;
+        ProcessTLAS();
+    }
+
+    void CompressedBvhTranslator::ProcessTLAS()
+    {
+        // Refs below a mesh root need the wide node their binary node was collapsed into,
+        // the mesh is collapsed again the first time one of them shows up
+        std::vector<std::vector<Bvh4::Entry>> entries(meshes.size());
+
+        // Top level leaves keep the packed order of the refs
+        const int* packed = TLBvh->GetIndices();
+        instances.resize(TLBvh->GetNumIndices());
+
+        for (size_t i = 0; i < instances.size(); ++i)
+        {
+            const InstanceRef& ref = instanceRefs[packed[i]];
+            const GLSLPT::MeshInstance& meshInstance = meshInstances[ref.instanceIndex];
+            int mesh = meshInstance.meshID;
+
+            Instance& instance  = instances[i];
+            instance.instance   = ref.instanceIndex;
+            instance.materialID = meshInstance.materialID;
+
+            if (ref.blasNode == 0)
+            {
+                instance.node  = meshRootIndices[mesh];
+                instance.lanes = meshRootLanes[mesh];
+                continue;
+            }
+
+            if (entries[mesh].empty())
+            {
+                Bvh4 wide;
+                wide.Build(*meshes[mesh]->bvh, &entries[mesh]);
+            }
+
+            const Bvh4::Entry& entry = entries[mesh][ref.blasNode];
+            instance.node  = meshRootIndices[mesh] + entry.node;
+            instance.lanes = entry.lanes;
+        }
+
+        Bvh4 wide;
+        wide.Build(*TLBvh);
+        CompressedBvh top;
+        top.Build(wide);
+
+        // Leaf lanes hold one ref each and index instances directly
+        nodes.resize(topLevelIndex);
+        nodes.insert(nodes.end(), top.GetNodes(), top.GetNodes() + top.GetNumNodes());
+
+        for (size_t n = topLevelIndex; n < nodes.size(); ++n)
+        {
+            for (int lane = 0; lane < 4; ++lane)
+            {
+                if ((nodes[n].validMask & (1 << lane)) && nodes[n].numprims[lane] == 0) {
+                    nodes[n].child[lane] += topLevelIndex;
+                }
+            }
+        }
+
+        numBinaryNodes = numMeshBinaryNodes + TLBvh->GetNumNodes();
+    }
+}
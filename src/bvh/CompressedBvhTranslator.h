@@ -0,0 +1,106 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#pragma once
+
+#ifndef COMPRESSED_BVH_TRANSLATOR_H
+#define COMPRESSED_BVH_TRANSLATOR_H
+
+#include <vector>
+
+#include "CompressedBvh.h"
+#include "Rebraid.h"
+#include "core/Mesh.h"
+
+namespace RadeonRays
+{
+    /// Lays out the BVHs of a scene as CompressedBvh nodes for CPU traversal, the alternative
+    /// to the binary nodes of BvhTranslator. The quantized Bvh4 of every mesh comes first,
+    /// followed by the one of the top level BVH at topLevelIndex. Mesh leaves reference
+    /// triangles in the order of BvhTranslator, so they index the same Scene::vertIndices.
+    /// Top level leaves reference instances, each entering its mesh tree at the node and
+    /// lanes that hold the subtree of its ref, so re-braided refs start below the mesh root.
+    class CompressedBvhTranslator
+    {
+    public:
+        // A top level primitive, traced from the lanes of node in the space of instance
+        struct Instance
+        {
+            int node;
+            int lanes;
+            int instance;
+            int materialID;
+        };
+
+        // False when the scene cannot be laid out: a leaf holds more than
+        // CompressedBvh::kMaxLeafSize triangles or a link does not fit in 32 bits
+        bool Process(const Bvh* topLevelBvh, const std::vector<GLSLPT::Mesh*>& meshes, const std::vector<GLSLPT::MeshInstance>& instances,
+                     const std::vector<InstanceRef>& refs);
+
+        // Lays out the top level again after the instances, their refs or the top level BVH
+        // changed. The mesh trees must not have changed since Process.
+        void UpdateTLAS(const Bvh* topLevelBvh, const std::vector<GLSLPT::MeshInstance>& instances, const std::vector<InstanceRef>& refs);
+
+        // Meshes are quantized as tasks on this pool, nullptr quantizes on the calling thread
+        void SetTaskPool(TaskThreadPool* pool)
+        {
+            taskPool = pool;
+        }
+
+        // Bytes of the nodes and instances
+        size_t GetMemorySize() const
+        {
+            return nodes.size() * sizeof(CompressedBvh::Node) + instances.size() * sizeof(Instance);
+        }
+
+        // Bytes of the same trees as BvhTranslator nodes, links and both bounds per binary
+        // node without the padding of its textures
+        size_t GetBinaryMemorySize() const
+        {
+            return numBinaryNodes * (3 * sizeof(int) + 2 * sizeof(Vector3));
+        }
+
+    private:
+        void ProcessTLAS();
+
+    public:
+        std::vector<CompressedBvh::Node> nodes;
+        // Top level leaves index these
+        std::vector<Instance> instances;
+        int topLevelIndex = 0;
+
+    private:
+        const Bvh* TLBvh = nullptr;
+        TaskThreadPool* taskPool = nullptr;
+        std::vector<GLSLPT::Mesh*> meshes;
+        std::vector<GLSLPT::MeshInstance> meshInstances;
+        std::vector<InstanceRef> instanceRefs;
+        // First node, lanes of the root and first triangle reference of every mesh
+        std::vector<int> meshRootIndices;
+        std::vector<int> meshRootLanes;
+        std::vector<int> meshTriIndices;
+        size_t numMeshBinaryNodes = 0;
+        size_t numBinaryNodes = 0;
+    };
+}
+
+#endif // COMPRESSED_BVH_TRANSLATOR_H
@@ -0,0 +1,211 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#include <algorithm>
+#include <limits>
+
+#include "EarlySplitBvh.h"
+#include "BvhCache.h"
+#include "Clipping.h"
+#include "job/TaskGroup.h"
+
+namespace RadeonRays
+{
+    // A primitive is split into at most 2^kMaxSplitDepth pieces
+    static const int kMaxSplitDepth = 6;
+    // Primitives per task of the parallel split passes
+    static const int kPrimsPerTask = 4096;
+    // Times the threshold is raised to fit the extra references budget before splitting is given up
+    static const int kMaxBudgetPasses = 16;
+
+    void EarlySplitBvh::HashBuildParams(ContentHash& hash) const
+    {
+        Bvh::HashBuildParams(hash);
+        hash.Add((int)m_Heuristic);
+        hash.Add(m_Threshold);
+        hash.Add(m_ExtraRefsBudget);
+        hash.Add(m_Positions ? 1 : 0);
+    }
+
+    float EarlySplitBvh::Measure(const Bounds3D& box) const
+    {
+        Vector3 ext = box.Extents();
+
+        if (m_Heuristic == kEdgeLength) {
+            return std::max(ext.x, std::max(ext.y, ext.z));
+        }
+
+        return ext.x * ext.y * ext.z;
+    }
+
+    int EarlySplitBvh::SplitPrimitive(const Bounds3D& box, const Vector3* polygon, int numVertices, int depth, float limit, Bounds3D* pieces) const
+    {
+        if (depth == kMaxSplitDepth || Measure(box) <= limit)
+        {
+            if (pieces) {
+                pieces[0] = box;
+            }
+            return 1;
+        }
+
+        int axis = box.Maxdim();
+        float split = (box.min[axis] + box.max[axis]) * 0.5f;
+
+        Bounds3D halves[2] = { box, box };
+        halves[0].max[axis] = split;
+        halves[1].min[axis] = split;
+
+        Vector3 clipped[2][kMaxClippedVertices];
+        int numClipped[2] = { 0, 0 };
+
+        if (m_Positions)
+        {
+            for (int side = 0; side < 2; ++side)
+            {
+                numClipped[side] = ClipPolygon(polygon, numVertices, axis, split, side == 0, clipped[side]);
+
+                Bounds3D clippedBounds;
+                for (int i = 0; i < numClipped[side]; ++i) {
+                    clippedBounds.Expand(clipped[side][i]);
+                }
+
+                Bounds3D::Intersection(clippedBounds, halves[side], halves[side]);
+            }
+        }
+
+        int count = 0;
+        for (int side = 0; side < 2; ++side)
+        {
+            // Nothing of the triangle on this side
+            if (m_Positions && numClipped[side] == 0) {
+                continue;
+            }
+
+            count += SplitPrimitive(halves[side], clipped[side], numClipped[side], depth + 1, limit, pieces ? pieces + count : nullptr);
+        }
+
+        return count;
+    }
+
+    void EarlySplitBvh::BuildImpl(const Bounds3D* bounds, int numbounds)
+    {
+        double measureSum = 0.0;
+        for (int i = 0; i < numbounds; ++i) {
+            measureSum += Measure(bounds[i]);
+        }
+
+        float limit = numbounds > 0 ? (float)(m_Threshold * measureSum / numbounds) : 0.0f;
+        // Halving a box halves its longest edge but can take an eighth of its volume
+        float growth = m_Heuristic == kVolumeRatio ? 8.0f : 2.0f;
+        int maxRefs = numbounds + (int)(numbounds * m_ExtraRefsBudget);
+
+        auto splitRange = [&](int begin, int end, float limit, int* counts, Bounds3D* pieces, int* offsets)
+        {
+            Vector3 triangle[3];
+            int numVertices = 0;
+
+            for (int i = begin; i < end; ++i)
+            {
+                if (m_Positions)
+                {
+                    for (int v = 0; v < 3; ++v)
+                    {
+                        const float* p = m_Positions + ((size_t)i * 3 + v) * m_Stride;
+                        triangle[v] = Vector3(p[0], p[1], p[2]);
+                    }
+                    numVertices = 3;
+                }
+
+                int count = SplitPrimitive(bounds[i], triangle, numVertices, 0, limit, pieces ? pieces + offsets[i] : nullptr);
+                if (counts) {
+                    counts[i + 1] = count;
+                }
+            }
+        };
+
+        // Count the pieces of every primitive, raising the threshold until they fit the budget.
+        // offsets[i] is the first reference of primitive i once the counts are summed up.
+        std::vector<int> offsets(numbounds + 1, 0);
+
+        for (int pass = 0; ; ++pass)
+        {
+            TaskGroup::ParallelFor(m_TaskPool, numbounds, kPrimsPerTask, [&](int32 begin, int32 end)
+            {
+                splitRange(begin, end, limit, &offsets[0], nullptr, nullptr);
+            });
+
+            m_NumSplitPrimitives = 0;
+            for (int i = 0; i < numbounds; ++i)
+            {
+                m_NumSplitPrimitives += offsets[i + 1] > 1 ? 1 : 0;
+                offsets[i + 1] += offsets[i];
+            }
+
+            if (offsets[numbounds] <= maxRefs) {
+                break;
+            }
+
+            // Without any split the references always fit
+            limit = pass + 1 < kMaxBudgetPasses ? limit * growth : std::numeric_limits<float>::max();
+        }
+
+        int numrefs = offsets[numbounds];
+        std::vector<Bounds3D> refBounds(numrefs);
+        std::vector<int> refPrims(numrefs);
+
+        TaskGroup::ParallelFor(m_TaskPool, numbounds, kPrimsPerTask, [&](int32 begin, int32 end)
+        {
+            splitRange(begin, end, limit, nullptr, &refBounds[0], &offsets[0]);
+
+            for (int i = begin; i < end; ++i) {
+                std::fill(refPrims.begin() + offsets[i], refPrims.begin() + offsets[i + 1], i);
+            }
+        });
+
+        // Plain SAH build over the pieces, the root keeps the bounds of the whole primitives
+        Bvh::BuildImpl(refBounds.data(), numrefs);
+
+        // Point the leaves back to the primitives, pieces of one primitive that share a leaf are tested once
+        std::vector<int> indices;
+        indices.reserve(m_PackedIndices.size());
+
+        for (Node& node : m_Nodes)
+        {
+            if (node.type != kLeaf) {
+                continue;
+            }
+
+            int start = (int)indices.size();
+            for (int i = node.startidx; i < node.startidx + node.numprims; ++i) {
+                indices.push_back(refPrims[m_PackedIndices[i]]);
+            }
+
+            std::sort(indices.begin() + start, indices.end());
+            indices.erase(std::unique(indices.begin() + start, indices.end()), indices.end());
+
+            node.startidx = start;
+            node.numprims = (int)indices.size() - start;
+        }
+
+        m_PackedIndices.swap(indices);
+    }
+}
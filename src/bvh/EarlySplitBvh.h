@@ -0,0 +1,114 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#pragma once
+
+#ifndef EARLY_SPLIT_BVH_H
+#define EARLY_SPLIT_BVH_H
+
+#include <vector>
+
+#include "Bvh.h"
+
+namespace RadeonRays
+{
+    /// Early split clipping (Ernst and Greiner 2007) in front of the binned SAH builder.
+    /// Primitives whose bounding box is oversized by the split heuristic are halved along the
+    /// longest axis of their box, recursively, and every piece enters the build as a reference
+    /// of its own that points back to the original primitive. Long diagonal triangles, which a
+    /// single box covers badly, end up in several tighter leaves at a fraction of the cost of
+    /// the spatial split search of SplitBvh.
+    /// With the triangle vertices given, every piece is the box of the triangle clipped to the
+    /// half box, otherwise the half boxes themselves.
+    class EarlySplitBvh : public Bvh
+    {
+    public:
+        // Measure deciding which references are split
+        enum SplitHeuristic
+        {
+            // Longest box extent above threshold times the mean over all primitives
+            kEdgeLength,
+            // Box volume above threshold times the mean over all primitives, boxes of
+            // axis aligned triangles are flat and never split
+            kVolumeRatio
+        };
+
+        EarlySplitBvh(float traversalCost, int numBins = 64, SplitHeuristic heuristic = kVolumeRatio, float threshold = 4.0f, float extraRefsBudget = 1.0f)
+            : Bvh(traversalCost, numBins, true)
+            , m_Heuristic(heuristic)
+            , m_Threshold(threshold)
+            , m_ExtraRefsBudget(extraRefsBudget)
+            , m_Positions(nullptr)
+            , m_Stride(0)
+            , m_NumSplitPrimitives(0)
+        {
+
+        }
+
+        ~EarlySplitBvh() = default;
+
+        // Vertex positions of the primitives passed to Build, three vertices per primitive with
+        // stride floats between them. They are only read while building, nullptr clips boxes.
+        void SetTriangles(const float* positions, int stride)
+        {
+            m_Positions = positions;
+            m_Stride    = stride;
+        }
+
+        // Primitives split by the last build
+        int GetNumSplitPrimitives() const
+        {
+            return m_NumSplitPrimitives;
+        }
+
+        void HashBuildParams(ContentHash& hash) const override;
+
+    protected:
+
+        void BuildImpl(const Bounds3D* bounds, int numbounds) override;
+
+        // Splits the primitive until the heuristic is below limit, the polygon is the primitive
+        // clipped to box and empty without triangles. Returns the number of pieces, writes
+        // their bounds to pieces when it is not nullptr.
+        int SplitPrimitive(const Bounds3D& box, const Vector3* polygon, int numVertices, int depth, float limit, Bounds3D* pieces) const;
+
+        // Size of the box by the split heuristic
+        float Measure(const Bounds3D& box) const;
+
+        SplitHeuristic m_Heuristic;
+        // Multiple of the mean measure past which references are split
+        float m_Threshold;
+        // Extra references allowed per primitive, the threshold is raised until they fit
+        float m_ExtraRefsBudget;
+        // Optional triangle vertices, alive during the build
+        const float* m_Positions;
+        int m_Stride;
+        int m_NumSplitPrimitives;
+
+    private:
+        EarlySplitBvh(const EarlySplitBvh& bvh) = delete;
+
+        EarlySplitBvh& operator = (const EarlySplitBvh& bvh) = delete;
+    };
+}
+
+#endif // EARLY_SPLIT_BVH_H
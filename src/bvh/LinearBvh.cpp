@@ -0,0 +1,154 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#include <memory>
+
+#include "LinearBvh.h"
+#include "Morton.h"
+#include "job/TaskGroup.h"
+
+namespace RadeonRays
+{
+    // Nodes handled by one task of the parallel passes
+    static const int kNodesPerTask = 16384;
+
+    void LinearBvh::BuildImpl(const Bounds3D* bounds, int numbounds)
+    {
+        InitNodeAllocator(2 * numbounds - 1);
+        m_Nodecnt = 2 * numbounds - 1;
+
+        // Sort primitives along the Morton curve
+        std::vector<uint64> codes;
+        SortByMortonCode(m_TaskPool, bounds, numbounds, codes, m_PackedIndices);
+
+        // Internal nodes live in [0, n - 1), leaf i sits at n - 1 + i
+        int firstLeaf = numbounds - 1;
+
+        TaskGroup::ParallelFor(m_TaskPool, numbounds, kNodesPerTask, [&](int32 begin, int32 end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                Node& leaf = m_Nodes[firstLeaf + i];
+                leaf.type     = kLeaf;
+                leaf.bounds   = bounds[m_PackedIndices[i]];
+                leaf.startidx = i;
+                leaf.numprims = 1;
+            }
+        });
+
+        if (numbounds == 1)
+        {
+            UpdateTreeInfo();
+            return;
+        }
+
+        // Length of the common prefix of codes i and j, ties broken by the index
+        auto delta = [&](int i, int j) -> int
+        {
+            if (j < 0 || j >= numbounds) {
+                return -1;
+            }
+
+            if (codes[i] == codes[j]) {
+                return 64 + CountLeadingZeros((uint64)(i ^ j));
+            }
+
+            return CountLeadingZeros(codes[i] ^ codes[j]);
+        };
+
+        std::vector<int> parents(2 * numbounds - 1, -1);
+
+        // Every internal node finds its key range and split on its own
+        TaskGroup::ParallelFor(m_TaskPool, numbounds - 1, kNodesPerTask, [&](int32 begin, int32 end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                // Direction of the range
+                int d = delta(i, i + 1) - delta(i, i - 1) > 0 ? 1 : -1;
+
+                // Upper bound of the range length, then binary search for the other end
+                int deltaMin = delta(i, i - d);
+                int lmax = 2;
+                while (delta(i, i + lmax * d) > deltaMin) {
+                    lmax <<= 1;
+                }
+
+                int l = 0;
+                for (int t = lmax >> 1; t >= 1; t >>= 1)
+                {
+                    if (delta(i, i + (l + t) * d) > deltaMin) {
+                        l += t;
+                    }
+                }
+
+                int j = i + l * d;
+
+                // Binary search for the split position
+                int deltaNode = delta(i, j);
+                int s = 0;
+                int t = l;
+                do
+                {
+                    t = (t + 1) >> 1;
+                    if (delta(i, i + (s + t) * d) > deltaNode) {
+                        s += t;
+                    }
+                } while (t > 1);
+
+                int gamma = i + s * d + std::min(d, 0);
+                int left  = std::min(i, j) == gamma ? firstLeaf + gamma : gamma;
+                int right = std::max(i, j) == gamma + 1 ? firstLeaf + gamma + 1 : gamma + 1;
+
+                Node& node = m_Nodes[i];
+                node.type = kInternal;
+                node.lc   = left;
+                node.rc   = right;
+
+                parents[left]  = i;
+                parents[right] = i;
+            }
+        });
+
+        // Bottom-up bounds: the second child to arrive at a node merges both
+        std::unique_ptr<std::atomic<int>[]> visits(new std::atomic<int>[numbounds - 1]);
+        for (int i = 0; i < numbounds - 1; ++i) {
+            visits[i] = 0;
+        }
+
+        TaskGroup::ParallelFor(m_TaskPool, numbounds, kNodesPerTask, [&](int32 begin, int32 end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                int parent = parents[firstLeaf + i];
+                while (parent != -1 && visits[parent].fetch_add(1) == 1)
+                {
+                    Node& node  = m_Nodes[parent];
+                    node.bounds = Bounds3D::Union(m_Nodes[node.lc].bounds, m_Nodes[node.rc].bounds);
+                    parent = parents[parent];
+                }
+            }
+        });
+
+        CollapseLeaves();
+        UpdateTreeInfo();
+    }
+}
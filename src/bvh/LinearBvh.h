@@ -0,0 +1,60 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#pragma once
+
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include <vector>
+
+#include "Bvh.h"
+
+namespace RadeonRays
+{
+    /// Linear BVH (Karras 2012): primitives are sorted along a Morton curve and the
+    /// hierarchy follows the highest differing bit of neighbouring codes.
+    /// Builds in O(n) after the radix sort with every step parallel over the task pool,
+    /// at the cost of a worse SAH than the binned builders.
+    class LinearBvh : public Bvh
+    {
+    public:
+        LinearBvh(float traversalCost = 2.0f)
+            : Bvh(traversalCost, 64, false)
+        {
+
+        }
+
+        ~LinearBvh() = default;
+
+    protected:
+
+        void BuildImpl(const Bounds3D* bounds, int numbounds) override;
+
+    private:
+        LinearBvh(const LinearBvh& bvh) = delete;
+
+        LinearBvh& operator = (const LinearBvh& bvh) = delete;
+    };
+}
+
+#endif // LINEAR_BVH_H
@@ -0,0 +1,111 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#if defined(_WIN32)
+    #include <windows.h>
+    #include <direct.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+#include "MappedFile.h"
+
+namespace RadeonRays
+{
+    MappedFile::MappedFile(const std::string& path)
+        : m_Data(nullptr)
+        , m_Size(0)
+    {
+#if defined(_WIN32)
+        m_File    = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        m_Mapping = nullptr;
+        if (m_File == INVALID_HANDLE_VALUE) {
+            return;
+        }
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_File, &size) || size.QuadPart == 0) {
+            return;
+        }
+
+        m_Mapping = CreateFileMappingA(m_File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_Mapping == nullptr) {
+            return;
+        }
+
+        m_Data = MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0);
+        m_Size = m_Data ? (size_t)size.QuadPart : 0;
+#else
+        m_File = open(path.c_str(), O_RDONLY);
+        if (m_File < 0) {
+            return;
+        }
+
+        struct stat info;
+        if (fstat(m_File, &info) != 0 || info.st_size == 0) {
+            return;
+        }
+
+        void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, m_File, 0);
+        if (data == MAP_FAILED) {
+            return;
+        }
+
+        m_Data = data;
+        m_Size = (size_t)info.st_size;
+#endif
+    }
+
+    MappedFile::~MappedFile()
+    {
+#if defined(_WIN32)
+        if (m_Data) {
+            UnmapViewOfFile(m_Data);
+        }
+        if (m_Mapping) {
+            CloseHandle(m_Mapping);
+        }
+        if (m_File != INVALID_HANDLE_VALUE) {
+            CloseHandle(m_File);
+        }
+#else
+        if (m_Data) {
+            munmap(m_Data, m_Size);
+        }
+        if (m_File >= 0) {
+            close(m_File);
+        }
+#endif
+    }
+
+    void MakeDirectory(const std::string& path)
+    {
+#if defined(_WIN32)
+        _mkdir(path.c_str());
+#else
+        mkdir(path.c_str(), 0755);
+#endif
+    }
+}
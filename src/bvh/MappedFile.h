@@ -0,0 +1,71 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#pragma once
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+
+#include "math/Math.h"
+
+namespace RadeonRays
+{
+    /// Read only mapping of a whole file, empty when the file can not be opened or is empty
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const std::string& path);
+
+        ~MappedFile();
+
+        const uint8* GetData() const
+        {
+            return (const uint8*)m_Data;
+        }
+
+        size_t GetSize() const
+        {
+            return m_Size;
+        }
+
+    private:
+#if defined(_WIN32)
+        // File and mapping HANDLEs
+        void* m_File;
+        void* m_Mapping;
+#else
+        int m_File;
+#endif
+        void* m_Data;
+        size_t m_Size;
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator = (const MappedFile&) = delete;
+    };
+
+    // Creates the last level of path, fails harmlessly when it exists
+    void MakeDirectory(const std::string& path);
+}
+
+#endif // MAPPED_FILE_H
@@ -0,0 +1,154 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#include <numeric>
+
+#include "Morton.h"
+#include "job/TaskGroup.h"
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+
+namespace RadeonRays
+{
+    // Primitives handled by one chunk of the parallel passes
+    static const int kMortonChunkSize = 32768;
+    // Radix sort digit
+    static const int kRadixBits = 8;
+    static const int kRadixSize = 1 << kRadixBits;
+    // Inputs above this size switch from 30 bit to 63 bit codes
+    static const int kMaxPrimitivesFor30BitCodes = 1 << 21;
+
+    void ComputeMortonCodes(TaskThreadPool* pool, const Bounds3D* bounds, int numbounds, const Bounds3D& centroidBounds, int bitsPerAxis, std::vector<uint64>& codes)
+    {
+        codes.resize(numbounds);
+
+        float cells = (float)((1 << bitsPerAxis) - 1);
+        Vector3 extents = centroidBounds.Extents();
+        Vector3 scale;
+        for (int axis = 0; axis < 3; ++axis) {
+            scale[axis] = extents[axis] > 0.f ? cells / extents[axis] : 0.f;
+        }
+
+        TaskGroup::ParallelFor(pool, numbounds, kMortonChunkSize, [&](int32 begin, int32 end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                Vector3 c = (bounds[i].Center() - centroidBounds.min) * scale;
+
+                uint64 x = (uint64)MMath::Clamp(c.x, 0.f, cells);
+                uint64 y = (uint64)MMath::Clamp(c.y, 0.f, cells);
+                uint64 z = (uint64)MMath::Clamp(c.z, 0.f, cells);
+
+                codes[i] = (MortonExpandBits(x) << 2) | (MortonExpandBits(y) << 1) | MortonExpandBits(z);
+            }
+        });
+    }
+
+    void SortMortonCodes(TaskThreadPool* pool, int bitsPerAxis, std::vector<uint64>& codes, std::vector<int>& indices)
+    {
+        int numcodes  = (int)codes.size();
+        int numchunks = (numcodes + kMortonChunkSize - 1) / kMortonChunkSize;
+        int numpasses = (3 * bitsPerAxis + kRadixBits - 1) / kRadixBits;
+
+        std::vector<uint64> tmpcodes(numcodes);
+        std::vector<int> tmpindices(numcodes);
+        std::vector<int> offsets(numchunks * kRadixSize);
+
+        for (int pass = 0; pass < numpasses; ++pass)
+        {
+            int shift = pass * kRadixBits;
+
+            // Digit histogram per chunk
+            TaskGroup::ParallelFor(pool, numchunks, 1, [&](int32 begin, int32 end)
+            {
+                for (int chunk = begin; chunk < end; ++chunk)
+                {
+                    int* histogram = &offsets[chunk * kRadixSize];
+                    std::fill(histogram, histogram + kRadixSize, 0);
+
+                    int last = MMath::Min(numcodes, (chunk + 1) * kMortonChunkSize);
+                    for (int i = chunk * kMortonChunkSize; i < last; ++i) {
+                        histogram[(codes[i] >> shift) & (kRadixSize - 1)]++;
+                    }
+                }
+            });
+
+            // Digit major, chunk minor exclusive scan keeps the sort stable
+            int sum = 0;
+            for (int digit = 0; digit < kRadixSize; ++digit)
+            {
+                for (int chunk = 0; chunk < numchunks; ++chunk)
+                {
+                    int count = offsets[chunk * kRadixSize + digit];
+                    offsets[chunk * kRadixSize + digit] = sum;
+                    sum += count;
+                }
+            }
+
+            TaskGroup::ParallelFor(pool, numchunks, 1, [&](int32 begin, int32 end)
+            {
+                for (int chunk = begin; chunk < end; ++chunk)
+                {
+                    int* offset = &offsets[chunk * kRadixSize];
+
+                    int last = MMath::Min(numcodes, (chunk + 1) * kMortonChunkSize);
+                    for (int i = chunk * kMortonChunkSize; i < last; ++i)
+                    {
+                        int dst = offset[(codes[i] >> shift) & (kRadixSize - 1)]++;
+                        tmpcodes[dst]   = codes[i];
+                        tmpindices[dst] = indices[i];
+                    }
+                }
+            });
+
+            codes.swap(tmpcodes);
+            indices.swap(tmpindices);
+        }
+    }
+
+    void SortByMortonCode(TaskThreadPool* pool, const Bounds3D* bounds, int numbounds, std::vector<uint64>& codes, std::vector<int>& indices)
+    {
+        // Centroid bounds, reduced per chunk
+        int numchunks = (numbounds + kMortonChunkSize - 1) / kMortonChunkSize;
+        std::vector<Bounds3D> chunkBounds(numchunks);
+        TaskGroup::ParallelFor(pool, numbounds, kMortonChunkSize, [&](int32 begin, int32 end)
+        {
+            for (int i = begin; i < end; ++i) {
+                chunkBounds[begin / kMortonChunkSize].Expand(bounds[i].Center());
+            }
+        });
+
+        Bounds3D centroidBounds;
+        for (int i = 0; i < numchunks; ++i) {
+            centroidBounds.Expand(chunkBounds[i]);
+        }
+
+        int bitsPerAxis = numbounds > kMaxPrimitivesFor30BitCodes ? kMortonBits63 : kMortonBits30;
+        ComputeMortonCodes(pool, bounds, numbounds, centroidBounds, bitsPerAxis, codes);
+
+        indices.resize(numbounds);
+        std::iota(indices.begin(), indices.end(), 0);
+        SortMortonCodes(pool, bitsPerAxis, codes, indices);
+    }
+}
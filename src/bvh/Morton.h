@@ -0,0 +1,79 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#pragma once
+
+#ifndef MORTON_H
+#define MORTON_H
+
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "math/Math.h"
+#include "math/Bounds3D.h"
+
+class TaskThreadPool;
+
+namespace RadeonRays
+{
+    // Bits per axis of the 30 bit and 63 bit codes
+    static const int kMortonBits30 = 10;
+    static const int kMortonBits63 = 21;
+
+    // Spreads the low bits of v so that two zero bits separate each of them
+    inline uint64 MortonExpandBits(uint64 v)
+    {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffffULL;
+        v = (v | v << 16) & 0x1f0000ff0000ffULL;
+        v = (v | v << 8)  & 0x100f00f00f00f00fULL;
+        v = (v | v << 4)  & 0x10c30c30c30c30c3ULL;
+        v = (v | v << 2)  & 0x1249249249249249ULL;
+        return v;
+    }
+
+    inline int CountLeadingZeros(uint64 v)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        return _BitScanReverse64(&index, v) ? 63 - (int)index : 64;
+#else
+        return v == 0 ? 64 : __builtin_clzll(v);
+#endif
+    }
+
+    // Morton codes of the primitive centroids quantized within centroidBounds.
+    // bitsPerAxis is kMortonBits30 or kMortonBits63.
+    void ComputeMortonCodes(TaskThreadPool* pool, const Bounds3D* bounds, int numbounds, const Bounds3D& centroidBounds, int bitsPerAxis, std::vector<uint64>& codes);
+
+    // Stable parallel LSD radix sort of codes, indices are permuted alongside
+    void SortMortonCodes(TaskThreadPool* pool, int bitsPerAxis, std::vector<uint64>& codes, std::vector<int>& indices);
+
+    // Primitive indices ordered along the Morton curve of their centroids with the sorted codes.
+    // Picks 30 bit codes for small inputs and 63 bit codes above a few million primitives.
+    void SortByMortonCode(TaskThreadPool* pool, const Bounds3D* bounds, int numbounds, std::vector<uint64>& codes, std::vector<int>& indices);
+}
+
+#endif // MORTON_H
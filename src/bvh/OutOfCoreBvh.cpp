@@ -0,0 +1,572 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+
+#include "OutOfCoreBvh.h"
+#include "BvhCache.h"
+#include "MappedFile.h"
+#include "job/TaskGroup.h"
+
+namespace RadeonRays
+{
+    namespace
+    {
+        // Triangles read from the source per chunk
+        const int kTrianglesPerChunk = 65536;
+        // Buckets per axis of the first pass, at most 8^3 bucket files are open at once
+        const int kMaxFirstPassGrid = 8;
+        // Buckets per axis when a bucket above the limit is partitioned again
+        const int kRefineGrid = 4;
+        // Records buffered per bucket before they are written
+        const int kRecordsPerWrite = 256;
+        // Records per task when the bounds of a mapped bucket are gathered
+        const int kRecordsPerTask = 65536;
+
+        // A triangle on its way through the bucket files
+        struct TriangleRecord
+        {
+            float positions[9];
+            int index;
+        };
+
+        Bounds3D TriangleBounds(const float* positions)
+        {
+            Bounds3D bounds;
+            for (int v = 0; v < 3; ++v) {
+                bounds.Expand(Vector3(positions[v * 3 + 0], positions[v * 3 + 1], positions[v * 3 + 2]));
+            }
+            return bounds;
+        }
+
+        bool SeekTo(FILE* file, uint64 offset)
+        {
+#if defined(_WIN32)
+            return _fseeki64(file, (long long)offset, SEEK_SET) == 0;
+#else
+            return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+        }
+
+        // Scatters records into a grid of buckets over the centroid bounds, or by arrival order
+        // when the centroids can not be told apart
+        class BucketWriter
+        {
+        public:
+            // numRecords is only needed for byOrder
+            BucketWriter(const std::string& prefix, int& fileCounter, const Bounds3D& centroidBounds, int grid, bool byOrder, int numRecords)
+                : m_Prefix(prefix)
+                , m_FileCounter(fileCounter)
+                , m_CentroidBounds(centroidBounds)
+                , m_Grid(grid)
+                , m_ByOrder(byOrder)
+                , m_NumRecords(numRecords)
+                , m_NumAdded(0)
+                , m_BytesWritten(0)
+                , m_Failed(false)
+                , m_Cells(grid * grid * grid)
+            {
+
+            }
+
+            ~BucketWriter()
+            {
+                // Only reached with open files when Finish was not called
+                for (Cell& cell : m_Cells)
+                {
+                    if (cell.file)
+                    {
+                        fclose(cell.file);
+                        remove(cell.path.c_str());
+                    }
+                }
+            }
+
+            void Add(const TriangleRecord& record)
+            {
+                Bounds3D bounds = TriangleBounds(record.positions);
+                Vector3 centroid = bounds.Center();
+                Cell& cell = m_Cells[CellIndex(centroid)];
+                m_NumAdded++;
+
+                if (m_Failed) {
+                    return;
+                }
+
+                if (!cell.file)
+                {
+                    char name[32];
+                    snprintf(name, sizeof(name), "%d.tri", m_FileCounter++);
+                    cell.path = m_Prefix + name;
+                    cell.file = fopen(cell.path.c_str(), "wb");
+                    cell.buffer.reserve(kRecordsPerWrite);
+
+                    if (!cell.file)
+                    {
+                        printf("Unable to write BVH bucket %s\n", cell.path.c_str());
+                        m_Failed = true;
+                        return;
+                    }
+                }
+
+                cell.buffer.push_back(record);
+                cell.numTriangles++;
+                cell.bounds.Expand(bounds);
+                cell.centroidBounds.Expand(centroid);
+
+                if (cell.buffer.size() == kRecordsPerWrite) {
+                    Flush(cell);
+                }
+            }
+
+            // Closes the files and appends the non-empty buckets, removes them all on failure
+            bool Finish(std::vector<OutOfCoreBvh::Bucket>& buckets)
+            {
+                for (Cell& cell : m_Cells)
+                {
+                    if (cell.file)
+                    {
+                        Flush(cell);
+                        m_Failed |= fclose(cell.file) != 0;
+                        cell.file = nullptr;
+                    }
+                }
+
+                for (Cell& cell : m_Cells)
+                {
+                    if (cell.numTriangles == 0) {
+                        continue;
+                    }
+
+                    if (m_Failed) {
+                        remove(cell.path.c_str());
+                    }
+                    else {
+                        buckets.push_back(OutOfCoreBvh::Bucket{ cell.path, cell.numTriangles, cell.bounds, cell.centroidBounds });
+                    }
+                }
+
+                return !m_Failed;
+            }
+
+            size_t GetBytesWritten() const
+            {
+                return m_BytesWritten;
+            }
+
+        private:
+            struct Cell
+            {
+                FILE* file = nullptr;
+                std::string path;
+                std::vector<TriangleRecord> buffer;
+                int numTriangles = 0;
+                Bounds3D bounds;
+                Bounds3D centroidBounds;
+            };
+
+            int CellIndex(const Vector3& centroid) const
+            {
+                if (m_ByOrder) {
+                    return (int)((long long)m_NumAdded * (long long)m_Cells.size() / std::max(m_NumRecords, 1));
+                }
+
+                Vector3 extents = m_CentroidBounds.Extents();
+                int coords[3];
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    float t = extents[axis] > 0.0f ? (centroid[axis] - m_CentroidBounds.min[axis]) / extents[axis] : 0.0f;
+                    coords[axis] = std::min(std::max((int)(t * m_Grid), 0), m_Grid - 1);
+                }
+
+                return coords[0] + m_Grid * (coords[1] + m_Grid * coords[2]);
+            }
+
+            void Flush(Cell& cell)
+            {
+                if (!cell.buffer.empty() && fwrite(&cell.buffer[0], sizeof(TriangleRecord), cell.buffer.size(), cell.file) != cell.buffer.size())
+                {
+                    printf("Unable to write BVH bucket %s\n", cell.path.c_str());
+                    m_Failed = true;
+                }
+
+                m_BytesWritten += cell.buffer.size() * sizeof(TriangleRecord);
+                cell.buffer.clear();
+            }
+
+            std::string m_Prefix;
+            int& m_FileCounter;
+            Bounds3D m_CentroidBounds;
+            int m_Grid;
+            bool m_ByOrder;
+            int m_NumRecords;
+            int m_NumAdded;
+            size_t m_BytesWritten;
+            bool m_Failed;
+            std::vector<Cell> m_Cells;
+        };
+    }
+
+    bool MemoryTriangleSource::Read(size_t first, size_t count, float* positions)
+    {
+        if (first + count > m_NumTriangles) {
+            return false;
+        }
+
+        for (size_t v = first * 3; v < (first + count) * 3; ++v)
+        {
+            const float* p = m_Positions + v * m_Stride;
+            *positions++ = p[0];
+            *positions++ = p[1];
+            *positions++ = p[2];
+        }
+
+        return true;
+    }
+
+    RawTriangleFile::RawTriangleFile(const std::string& path)
+        : m_File(fopen(path.c_str(), "rb"))
+        , m_NumTriangles(0)
+        , m_Next(0)
+    {
+        if (!m_File) {
+            return;
+        }
+
+#if defined(_WIN32)
+        long long size = _fseeki64(m_File, 0, SEEK_END) == 0 ? _ftelli64(m_File) : -1;
+#else
+        long long size = fseeko(m_File, 0, SEEK_END) == 0 ? (long long)ftello(m_File) : -1;
+#endif
+
+        if (size < 0 || !SeekTo(m_File, 0))
+        {
+            fclose(m_File);
+            m_File = nullptr;
+            return;
+        }
+
+        m_NumTriangles = (size_t)size / (9 * sizeof(float));
+    }
+
+    RawTriangleFile::~RawTriangleFile()
+    {
+        if (m_File) {
+            fclose(m_File);
+        }
+    }
+
+    bool RawTriangleFile::Read(size_t first, size_t count, float* positions)
+    {
+        if (!m_File || first + count > m_NumTriangles) {
+            return false;
+        }
+
+        // Chunks are usually read in order, then the file position is already right
+        if (first != m_Next && !SeekTo(m_File, (uint64)first * 9 * sizeof(float))) {
+            return false;
+        }
+
+        size_t read = fread(positions, 9 * sizeof(float), count, m_File);
+        m_Next = first + read;
+
+        return read == count;
+    }
+
+    void OutOfCoreBvh::HashBuildParams(ContentHash& hash) const
+    {
+        Bvh::HashBuildParams(hash);
+        hash.Add(m_MaxBucketTriangles);
+    }
+
+    bool OutOfCoreBvh::Build(TriangleSource& source)
+    {
+        memset(&m_Stats, 0, sizeof(BuildStats));
+        m_Nodes.clear();
+        m_PackedIndices.clear();
+        m_Nodecnt = 0;
+        m_Height  = 0;
+        m_Bounds  = Bounds3D();
+        ResetRefitState();
+
+        size_t numTriangles = source.GetNumTriangles();
+        if (numTriangles == 0 || numTriangles > INT_MAX)
+        {
+            printf("Out of core BVH build takes 1 to %d triangles, got %llu\n", INT_MAX, (uint64)numTriangles);
+            return false;
+        }
+
+        std::string directory = m_ScratchDirectory;
+        if (!directory.empty() && directory.back() != '/' && directory.back() != '\\') {
+            directory += '/';
+        }
+        if (!directory.empty()) {
+            MakeDirectory(directory.substr(0, directory.size() - 1));
+        }
+
+        char prefix[48];
+        snprintf(prefix, sizeof(prefix), "ooc-%llx-", (uint64)std::chrono::high_resolution_clock::now().time_since_epoch().count());
+        m_ScratchPrefix = directory + prefix;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        std::vector<Bucket> buckets;
+        bool built = Partition(source, buckets);
+        m_Stats.partitionMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        m_Stats.numBuckets = (int)buckets.size();
+
+        start = std::chrono::high_resolution_clock::now();
+
+        if (built)
+        {
+            // Top level over the bucket bounds with one bucket per leaf, the bucket trees replace the leaves
+            std::vector<Bounds3D> bucketBounds;
+            for (const Bucket& bucket : buckets) {
+                bucketBounds.push_back(bucket.bounds);
+            }
+
+            Bvh top(m_TraversalCost, m_NumBins, true);
+            top.Build(&bucketBounds[0], (int)bucketBounds.size());
+
+            m_Nodes.assign(top.GetNodes(), top.GetNodes() + top.GetNumNodes());
+            m_PackedIndices.reserve(numTriangles);
+            m_Bounds = top.Bounds();
+
+            for (int i = 0; i < top.GetNumNodes() && built; ++i)
+            {
+                const Node& node = top.GetNodes()[i];
+                if (node.type == kLeaf)
+                {
+                    assert(node.numprims == 1);
+                    built = BuildBucket(buckets[top.GetIndices()[node.startidx]], i);
+                }
+            }
+        }
+
+        for (const Bucket& bucket : buckets) {
+            remove(bucket.path.c_str());
+        }
+
+        if (!built)
+        {
+            m_Nodes.clear();
+            m_PackedIndices.clear();
+            m_Bounds = Bounds3D();
+            return false;
+        }
+
+        m_Nodecnt = (int)m_Nodes.size();
+        UpdateTreeInfo();
+        ResetRefitState();
+
+        m_Stats.buildMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+        return true;
+    }
+
+    bool OutOfCoreBvh::Partition(TriangleSource& source, std::vector<Bucket>& buckets)
+    {
+        int numTriangles = (int)source.GetNumTriangles();
+        std::vector<float> chunk((size_t)kTrianglesPerChunk * 9);
+        int fileCounter = 0;
+
+        // The first pass over the source only finds the centroid bounds
+        Bounds3D centroidBounds;
+        for (int first = 0; first < numTriangles; first += kTrianglesPerChunk)
+        {
+            int count = std::min(kTrianglesPerChunk, numTriangles - first);
+            if (!source.Read(first, count, &chunk[0]))
+            {
+                printf("Unable to read triangles %d to %d\n", first, first + count);
+                return false;
+            }
+
+            for (int t = 0; t < count; ++t) {
+                centroidBounds.Expand(TriangleBounds(&chunk[(size_t)t * 9]).Center());
+            }
+        }
+
+        // Enough buckets for about half the limit each if the triangles were spread evenly
+        int numCells = (int)std::min<long long>((2LL * numTriangles + m_MaxBucketTriangles - 1) / m_MaxBucketTriangles, kMaxFirstPassGrid * kMaxFirstPassGrid * kMaxFirstPassGrid);
+        int grid = std::min(std::max((int)std::ceil(std::cbrt((double)numCells)), 1), kMaxFirstPassGrid);
+
+        std::vector<Bucket> pending;
+        {
+            BucketWriter writer(m_ScratchPrefix, fileCounter, centroidBounds, grid, false, numTriangles);
+            TriangleRecord record;
+
+            for (int first = 0; first < numTriangles; first += kTrianglesPerChunk)
+            {
+                int count = std::min(kTrianglesPerChunk, numTriangles - first);
+                if (!source.Read(first, count, &chunk[0]))
+                {
+                    printf("Unable to read triangles %d to %d\n", first, first + count);
+                    return false;
+                }
+
+                for (int t = 0; t < count; ++t)
+                {
+                    memcpy(record.positions, &chunk[(size_t)t * 9], sizeof(record.positions));
+                    record.index = first + t;
+                    writer.Add(record);
+                }
+            }
+
+            bool written = writer.Finish(pending);
+            m_Stats.bytesWritten += writer.GetBytesWritten();
+            if (!written) {
+                return false;
+            }
+        }
+
+        // Buckets above the limit are partitioned again over their own centroid bounds
+        while (!pending.empty())
+        {
+            Bucket bucket = pending.back();
+            pending.pop_back();
+
+            if (bucket.numTriangles <= m_MaxBucketTriangles)
+            {
+                buckets.push_back(bucket);
+                continue;
+            }
+
+            bool mapped = false;
+            std::vector<Bucket> children;
+            {
+                MappedFile file(bucket.path);
+                const TriangleRecord* records = (const TriangleRecord*)file.GetData();
+                mapped = records && file.GetSize() == (size_t)bucket.numTriangles * sizeof(TriangleRecord);
+
+                // Coincident centroids all land in one cell, those go by order
+                for (int attempt = 0; attempt < 2 && mapped; ++attempt)
+                {
+                    BucketWriter writer(m_ScratchPrefix, fileCounter, bucket.centroidBounds, kRefineGrid, attempt == 1, bucket.numTriangles);
+                    for (int i = 0; i < bucket.numTriangles; ++i) {
+                        writer.Add(records[i]);
+                    }
+
+                    children.clear();
+                    bool written = writer.Finish(children);
+                    m_Stats.bytesWritten += writer.GetBytesWritten();
+
+                    if (!written)
+                    {
+                        remove(bucket.path.c_str());
+                        for (const Bucket& other : pending) {
+                            remove(other.path.c_str());
+                        }
+                        return false;
+                    }
+
+                    if (children.size() > 1) {
+                        break;
+                    }
+
+                    remove(children[0].path.c_str());
+                }
+            }
+
+            remove(bucket.path.c_str());
+
+            if (!mapped)
+            {
+                printf("Unable to map BVH bucket %s\n", bucket.path.c_str());
+                for (const Bucket& other : pending) {
+                    remove(other.path.c_str());
+                }
+                return false;
+            }
+
+            m_Stats.numRefinements++;
+            pending.insert(pending.end(), children.begin(), children.end());
+        }
+
+        return true;
+    }
+
+    bool OutOfCoreBvh::BuildBucket(const Bucket& bucket, int slot)
+    {
+        MappedFile file(bucket.path);
+        const TriangleRecord* records = (const TriangleRecord*)file.GetData();
+
+        if (!records || file.GetSize() != (size_t)bucket.numTriangles * sizeof(TriangleRecord))
+        {
+            printf("Unable to map BVH bucket %s\n", bucket.path.c_str());
+            return false;
+        }
+
+        std::vector<Bounds3D> bounds(bucket.numTriangles);
+        TaskGroup::ParallelFor(m_TaskPool, bucket.numTriangles, kRecordsPerTask, [&](int32 begin, int32 end)
+        {
+            for (int i = begin; i < end; ++i) {
+                bounds[i] = TriangleBounds(records[i].positions);
+            }
+        });
+
+        Bvh bvh(m_TraversalCost, m_NumBins, m_Usesah);
+        bvh.SetMaxLeafSize(m_MaxPrimitivesPerLeaf);
+        bvh.SetIntersectionCost(m_IntersectionCost);
+        bvh.SetTaskPool(m_TaskPool);
+        bvh.Build(&bounds[0], bucket.numTriangles);
+
+        // The bucket root takes the slot of the top level leaf, the other nodes are appended in arena order
+        const Node* nodes = bvh.GetNodes();
+        int numNodes  = bvh.GetNumNodes();
+        int base      = (int)m_Nodes.size() - 1;
+        int indexBase = (int)m_PackedIndices.size();
+
+        for (int i = 0; i < numNodes; ++i)
+        {
+            Node node = nodes[i];
+            if (node.type == kLeaf) {
+                node.startidx += indexBase;
+            }
+            else
+            {
+                node.lc = node.lc == 0 ? slot : base + node.lc;
+                node.rc = node.rc == 0 ? slot : base + node.rc;
+            }
+
+            if (i == 0) {
+                m_Nodes[slot] = node;
+            }
+            else {
+                m_Nodes.push_back(node);
+            }
+        }
+
+        // Leaves point to the triangles of the source
+        const int* indices = bvh.GetIndices();
+        for (size_t i = 0; i < bvh.GetNumIndices(); ++i) {
+            m_PackedIndices.push_back(records[indices[i]].index);
+        }
+
+        m_Stats.largestBucket = std::max(m_Stats.largestBucket, bucket.numTriangles);
+
+        return true;
+    }
+}
@@ -0,0 +1,179 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#pragma once
+
+#ifndef OUT_OF_CORE_BVH_H
+#define OUT_OF_CORE_BVH_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "Bvh.h"
+
+namespace RadeonRays
+{
+    /// Triangles read in chunks, so a mesh does not have to be resident to build its BVH
+    class TriangleSource
+    {
+    public:
+        virtual ~TriangleSource() = default;
+
+        virtual size_t GetNumTriangles() const = 0;
+
+        // Reads count triangles starting at first to positions, 9 floats per triangle
+        virtual bool Read(size_t first, size_t count, float* positions) = 0;
+    };
+
+    /// Triangles in memory, three vertices per triangle with stride floats between them
+    class MemoryTriangleSource : public TriangleSource
+    {
+    public:
+        MemoryTriangleSource(const float* positions, int stride, size_t numTriangles)
+            : m_Positions(positions)
+            , m_Stride(stride)
+            , m_NumTriangles(numTriangles)
+        {
+
+        }
+
+        size_t GetNumTriangles() const override
+        {
+            return m_NumTriangles;
+        }
+
+        bool Read(size_t first, size_t count, float* positions) override;
+
+    private:
+        const float* m_Positions;
+        int m_Stride;
+        size_t m_NumTriangles;
+    };
+
+    /// File of 9 native floats per triangle, read sequentially with buffered I/O
+    class RawTriangleFile : public TriangleSource
+    {
+    public:
+        explicit RawTriangleFile(const std::string& path);
+
+        ~RawTriangleFile();
+
+        bool IsOpen() const
+        {
+            return m_File != nullptr;
+        }
+
+        size_t GetNumTriangles() const override
+        {
+            return m_NumTriangles;
+        }
+
+        bool Read(size_t first, size_t count, float* positions) override;
+
+    private:
+        FILE* m_File;
+        size_t m_NumTriangles;
+        // Triangle the file position is at
+        size_t m_Next;
+
+        RawTriangleFile(const RawTriangleFile&) = delete;
+        RawTriangleFile& operator = (const RawTriangleFile&) = delete;
+    };
+
+    /// Builds the BVH of a mesh larger than memory from a TriangleSource.
+    /// Triangles are streamed into spatial buckets of their centroids, files in a scratch
+    /// directory, and buckets above maxBucketTriangles are partitioned again until they fit.
+    /// Every bucket is then memory mapped and built with the binned SAH builder, and the bucket
+    /// trees are stitched under a SAH tree over the bucket bounds. Only one bucket and the
+    /// finished node arena and indices are resident at a time.
+    class OutOfCoreBvh : public Bvh
+    {
+    public:
+        OutOfCoreBvh(float traversalCost, const std::string& scratchDirectory, int maxBucketTriangles = 1 << 22)
+            : Bvh(traversalCost, 64, true)
+            , m_ScratchDirectory(scratchDirectory)
+            , m_MaxBucketTriangles(maxBucketTriangles > 1 ? maxBucketTriangles : 1)
+            , m_Stats()
+        {
+
+        }
+
+        ~OutOfCoreBvh() = default;
+
+        // In memory builds from bounds build like Bvh
+        using Bvh::Build;
+
+        // Builds from the source through the scratch directory. Returns false when the source
+        // or a bucket file fails, the tree is empty then. Scratch files are always removed.
+        bool Build(TriangleSource& source);
+
+        // Counters of the last Build
+        struct BuildStats
+        {
+            int numBuckets;
+            int largestBucket;
+            // Partition passes over buckets above the limit
+            int numRefinements;
+            // Bytes written to bucket files, all passes
+            size_t bytesWritten;
+            double partitionMilliseconds;
+            double buildMilliseconds;
+        };
+
+        const BuildStats& GetBuildStats() const
+        {
+            return m_Stats;
+        }
+
+        void HashBuildParams(ContentHash& hash) const override;
+
+        // Triangles of one spatial bucket in a scratch file
+        struct Bucket
+        {
+            std::string path;
+            int numTriangles;
+            Bounds3D bounds;
+            Bounds3D centroidBounds;
+        };
+
+    protected:
+        // Streams the source into buckets, then partitions buckets above the limit again
+        bool Partition(TriangleSource& source, std::vector<Bucket>& buckets);
+
+        // Builds the tree of a bucket and links it into the arena at the slot of its top level leaf
+        bool BuildBucket(const Bucket& bucket, int slot);
+
+        std::string m_ScratchDirectory;
+        int m_MaxBucketTriangles;
+        // Distinguishes the scratch files of concurrent builds
+        std::string m_ScratchPrefix;
+        BuildStats m_Stats;
+
+    private:
+        OutOfCoreBvh(const OutOfCoreBvh& bvh) = delete;
+
+        OutOfCoreBvh& operator = (const OutOfCoreBvh& bvh) = delete;
+    };
+}
+
+#endif // OUT_OF_CORE_BVH_H
@@ -0,0 +1,193 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#include <limits>
+
+#include "PlocBvh.h"
+#include "BvhCache.h"
+#include "Morton.h"
+#include "job/TaskGroup.h"
+
+namespace RadeonRays
+{
+    // Clusters handled by one task of the parallel passes
+    static const int kClustersPerTask = 4096;
+
+    void PlocBvh::HashBuildParams(ContentHash& hash) const
+    {
+        Bvh::HashBuildParams(hash);
+        hash.Add(m_SearchRadius);
+    }
+
+    void PlocBvh::BuildImpl(const Bounds3D* bounds, int numbounds)
+    {
+        InitNodeAllocator(2 * numbounds - 1);
+        m_Nodecnt = 2 * numbounds - 1;
+
+        std::vector<uint64> codes;
+        SortByMortonCode(m_TaskPool, bounds, numbounds, codes, m_PackedIndices);
+
+        // Leaves live in [n - 1, 2n - 1) in Morton order, internal nodes are handed out
+        // downwards from n - 2 so that the last merge creates the root at index 0
+        int firstLeaf = numbounds - 1;
+        int numclusters = numbounds;
+
+        std::vector<int> clusters(numclusters);
+        std::vector<Bounds3D> clusterBounds(numclusters);
+
+        TaskGroup::ParallelFor(m_TaskPool, numbounds, kClustersPerTask, [&](int32 begin, int32 end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                Node& leaf = m_Nodes[firstLeaf + i];
+                leaf.type     = kLeaf;
+                leaf.bounds   = bounds[m_PackedIndices[i]];
+                leaf.startidx = i;
+                leaf.numprims = 1;
+
+                clusters[i]      = firstLeaf + i;
+                clusterBounds[i] = leaf.bounds;
+            }
+        });
+
+        std::vector<int> neighbours(numclusters);
+        std::vector<int> nextClusters(numclusters);
+        std::vector<Bounds3D> nextBounds(numclusters);
+        std::vector<int> chunkMerges;
+        std::vector<int> chunkKept;
+
+        int nextNode = numbounds - 1;
+
+        while (numclusters > 1)
+        {
+            // Nearest neighbour by the area of the merged cluster. Ties go to the lowest index,
+            // which makes the globally closest pair mutual and guarantees progress.
+            TaskGroup::ParallelFor(m_TaskPool, numclusters, kClustersPerTask, [&](int32 begin, int32 end)
+            {
+                for (int i = begin; i < end; ++i)
+                {
+                    int first = MMath::Max(i - m_SearchRadius, 0);
+                    int last  = MMath::Min(i + m_SearchRadius, numclusters - 1);
+
+                    float best = std::numeric_limits<float>::max();
+                    int neighbour = -1;
+
+                    for (int j = first; j <= last; ++j)
+                    {
+                        if (j == i) {
+                            continue;
+                        }
+
+                        float area = Bounds3D::Union(clusterBounds[i], clusterBounds[j]).Area();
+                        if (area < best)
+                        {
+                            best = area;
+                            neighbour = j;
+                        }
+                    }
+
+                    neighbours[i] = neighbour;
+                }
+            });
+
+            // Count merges and surviving clusters per chunk so nodes and slots can be assigned in order
+            int numchunks = (numclusters + kClustersPerTask - 1) / kClustersPerTask;
+            chunkMerges.assign(numchunks, 0);
+            chunkKept.assign(numchunks, 0);
+
+            TaskGroup::ParallelFor(m_TaskPool, numchunks, 1, [&](int32 begin, int32 end)
+            {
+                for (int chunk = begin; chunk < end; ++chunk)
+                {
+                    int last = MMath::Min(numclusters, (chunk + 1) * kClustersPerTask);
+                    for (int i = chunk * kClustersPerTask; i < last; ++i)
+                    {
+                        int j = neighbours[i];
+                        bool mutual = neighbours[j] == i;
+
+                        chunkMerges[chunk] += mutual && i < j ? 1 : 0;
+                        chunkKept[chunk]   += mutual && i > j ? 0 : 1;
+                    }
+                }
+            });
+
+            int numMerges = 0;
+            int numKept   = 0;
+            for (int chunk = 0; chunk < numchunks; ++chunk)
+            {
+                int merges = chunkMerges[chunk];
+                int kept   = chunkKept[chunk];
+                chunkMerges[chunk] = numMerges;
+                chunkKept[chunk]   = numKept;
+                numMerges += merges;
+                numKept   += kept;
+            }
+
+            int firstNode = nextNode - numMerges;
+
+            // Merge mutual pairs into the slot of the lower cluster and compact
+            TaskGroup::ParallelFor(m_TaskPool, numchunks, 1, [&](int32 begin, int32 end)
+            {
+                for (int chunk = begin; chunk < end; ++chunk)
+                {
+                    int merge = firstNode + chunkMerges[chunk];
+                    int slot  = chunkKept[chunk];
+
+                    int last = MMath::Min(numclusters, (chunk + 1) * kClustersPerTask);
+                    for (int i = chunk * kClustersPerTask; i < last; ++i)
+                    {
+                        int j = neighbours[i];
+                        bool mutual = neighbours[j] == i;
+
+                        if (!mutual)
+                        {
+                            nextClusters[slot] = clusters[i];
+                            nextBounds[slot]   = clusterBounds[i];
+                            ++slot;
+                        }
+                        else if (i < j)
+                        {
+                            Node& node = m_Nodes[merge];
+                            node.type   = kInternal;
+                            node.bounds = Bounds3D::Union(clusterBounds[i], clusterBounds[j]);
+                            node.lc     = clusters[i];
+                            node.rc     = clusters[j];
+
+                            nextClusters[slot] = merge;
+                            nextBounds[slot]   = node.bounds;
+                            ++slot;
+                            ++merge;
+                        }
+                    }
+                }
+            });
+
+            clusters.swap(nextClusters);
+            clusterBounds.swap(nextBounds);
+            numclusters = numKept;
+            nextNode    = firstNode;
+        }
+
+        CollapseLeaves();
+        UpdateTreeInfo();
+    }
+}
@@ -0,0 +1,68 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#pragma once
+
+#ifndef PLOC_BVH_H
+#define PLOC_BVH_H
+
+#include <vector>
+
+#include "Bvh.h"
+
+namespace RadeonRays
+{
+    /// Parallel locally-ordered clustering (Meister and Bittner 2018).
+    /// Primitives start as clusters in Morton order, every cluster looks for the neighbour
+    /// within searchRadius positions whose union has the smallest surface area, and mutual
+    /// nearest neighbours are merged until a single cluster is left.
+    /// Builds bottom-up with every pass parallel over the task pool and usually reaches
+    /// a lower SAH cost than the top-down binned builders.
+    class PlocBvh : public Bvh
+    {
+    public:
+        PlocBvh(float traversalCost = 2.0f, int searchRadius = 16)
+            : Bvh(traversalCost, 64, false)
+            , m_SearchRadius(searchRadius)
+        {
+
+        }
+
+        ~PlocBvh() = default;
+
+        void HashBuildParams(ContentHash& hash) const override;
+
+    protected:
+
+        void BuildImpl(const Bounds3D* bounds, int numbounds) override;
+
+        // Neighbours searched on each side of a cluster
+        int m_SearchRadius;
+
+    private:
+        PlocBvh(const PlocBvh& bvh) = delete;
+
+        PlocBvh& operator = (const PlocBvh& bvh) = delete;
+    };
+}
+
+#endif // PLOC_BVH_H
@@ -0,0 +1,143 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#include <algorithm>
+#include <queue>
+#include <cmath>
+
+#include "Rebraid.h"
+#include "Bvh.h"
+
+namespace RadeonRays
+{
+    Bounds3D TransformBounds(const Bounds3D& bounds, const Matrix4x4& transform)
+    {
+        Vector3 right       = Vector3(transform.m[0][0], transform.m[0][1], transform.m[0][2]);
+        Vector3 up          = Vector3(transform.m[1][0], transform.m[1][1], transform.m[1][2]);
+        Vector3 forward     = Vector3(transform.m[2][0], transform.m[2][1], transform.m[2][2]);
+        Vector3 translation = Vector3(transform.m[3][0], transform.m[3][1], transform.m[3][2]);
+
+        Vector3 xa = right * bounds.min.x;
+        Vector3 xb = right * bounds.max.x;
+
+        Vector3 ya = up * bounds.min.y;
+        Vector3 yb = up * bounds.max.y;
+
+        Vector3 za = forward * bounds.min.z;
+        Vector3 zb = forward * bounds.max.z;
+
+        Bounds3D result;
+        result.min = Vector3::Min(xa, xb) + Vector3::Min(ya, yb) + Vector3::Min(za, zb) + translation;
+        result.max = Vector3::Max(xa, xb) + Vector3::Max(ya, yb) + Vector3::Max(za, zb) + translation;
+
+        return result;
+    }
+
+    Bounds3D InstanceRefBounds(const std::vector<GLSLPT::Mesh*>& meshes, const std::vector<GLSLPT::MeshInstance>& instances, const InstanceRef& ref)
+    {
+        const GLSLPT::MeshInstance& instance = instances[ref.instanceIndex];
+        const Bvh::Node& node = meshes[instance.meshID]->bvh->GetNodes()[ref.blasNode];
+        return TransformBounds(node.bounds, instance.transform);
+    }
+
+    void RebraidInstances(const std::vector<GLSLPT::Mesh*>& meshes, const std::vector<GLSLPT::MeshInstance>& instances, int maxRefs,
+                          std::vector<InstanceRef>& refs, std::vector<Bounds3D>& bounds)
+    {
+        int numInstances = (int)instances.size();
+
+        refs.resize(numInstances);
+        bounds.resize(numInstances);
+
+        // Geometric mean, so a few huge instances such as a ground plane do not hide the large ones
+        double meanLogArea = 0.0;
+        for (int i = 0; i < numInstances; ++i)
+        {
+            refs[i].instanceIndex = i;
+            refs[i].blasNode = 0;
+            bounds[i] = InstanceRefBounds(meshes, instances, refs[i]);
+            meanLogArea += log(std::max((double)bounds[i].Area(), 1e-30));
+        }
+        float meanArea = (float)exp(meanLogArea / (numInstances > 0 ? numInstances : 1));
+
+        // Largest refs first, only the ones above the average instance are worth opening
+        typedef std::pair<float, int> Candidate;
+        std::priority_queue<Candidate> candidates;
+        for (int i = 0; i < numInstances; ++i)
+        {
+            if (bounds[i].Area() > meanArea) {
+                candidates.push(Candidate(bounds[i].Area(), i));
+            }
+        }
+
+        while (!candidates.empty() && (int)refs.size() < maxRefs)
+        {
+            int refIndex = candidates.top().second;
+            candidates.pop();
+
+            InstanceRef ref = refs[refIndex];
+            const Bvh* bvh = meshes[instances[ref.instanceIndex].meshID]->bvh;
+            const Bvh::Node& node = bvh->GetNodes()[ref.blasNode];
+
+            if (node.type == Bvh::NodeType::kLeaf) {
+                continue;
+            }
+
+            // The left child takes the slot of its parent, the right one is appended
+            InstanceRef left  = { ref.instanceIndex, node.lc };
+            InstanceRef right = { ref.instanceIndex, node.rc };
+
+            refs[refIndex] = left;
+            bounds[refIndex] = InstanceRefBounds(meshes, instances, left);
+            refs.push_back(right);
+            bounds.push_back(InstanceRefBounds(meshes, instances, right));
+
+            int rightIndex = (int)refs.size() - 1;
+            if (bounds[refIndex].Area() > meanArea) {
+                candidates.push(Candidate(bounds[refIndex].Area(), refIndex));
+            }
+            if (bounds[rightIndex].Area() > meanArea) {
+                candidates.push(Candidate(bounds[rightIndex].Area(), rightIndex));
+            }
+        }
+
+        // Group by instance so the refs of an instance can be found from its first one
+        std::vector<int> order(refs.size());
+        for (int i = 0; i < (int)order.size(); ++i) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+        {
+            return refs[a].instanceIndex < refs[b].instanceIndex;
+        });
+
+        std::vector<InstanceRef> sortedRefs(refs.size());
+        std::vector<Bounds3D> sortedBounds(refs.size());
+        for (int i = 0; i < (int)order.size(); ++i)
+        {
+            sortedRefs[i]   = refs[order[i]];
+            sortedBounds[i] = bounds[order[i]];
+        }
+
+        refs.swap(sortedRefs);
+        bounds.swap(sortedBounds);
+    }
+}
@@ -0,0 +1,58 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#pragma once
+
+#ifndef REBRAID_H
+#define REBRAID_H
+
+#include <vector>
+
+#include "math/Matrix4x4.h"
+#include "math/Bounds3D.h"
+#include "core/Mesh.h"
+
+namespace RadeonRays
+{
+    // A top level primitive: one subtree of the BVH of an instanced mesh
+    struct InstanceRef
+    {
+        int instanceIndex;
+        // Arena index in the mesh BVH, 0 for the whole mesh
+        int blasNode;
+    };
+
+    // World space box of bounds placed by a row vector transform
+    Bounds3D TransformBounds(const Bounds3D& bounds, const Matrix4x4& transform);
+
+    // World space box of a ref
+    Bounds3D InstanceRefBounds(const std::vector<GLSLPT::Mesh*>& meshes, const std::vector<GLSLPT::MeshInstance>& instances, const InstanceRef& ref);
+
+    // Splits the instances into at most maxRefs top level primitives (re-braiding).
+    // Instances larger than the (geometric) mean one are opened largest first and replaced by
+    // the children of their BVH root, so big overlapping instances no longer force
+    // every ray through their whole BVH. Refs come out grouped by instance.
+    void RebraidInstances(const std::vector<GLSLPT::Mesh*>& meshes, const std::vector<GLSLPT::MeshInstance>& instances, int maxRefs,
+                          std::vector<InstanceRef>& refs, std::vector<Bounds3D>& bounds);
+}
+
+#endif // REBRAID_H
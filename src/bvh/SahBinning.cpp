@@ -0,0 +1,319 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#include <limits>
+#include <algorithm>
+
+#include "SahBinning.h"
+
+#if defined(__AVX__)
+    #include <immintrin.h>
+    #define SAH_BINNING_AVX 1
+    #define SAH_BINNING_SSE 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define SAH_BINNING_SSE 1
+#endif
+
+namespace RadeonRays
+{
+    // Same sentinel as an empty Bounds3D, stored as min and negated max
+    static const float kEmptyBin = +INT16_MAX;
+
+    // Floats per bin and per primitive: min.xyz, pad, -max.xyz, pad
+    static const int kBinStride = 8;
+
+    static inline void CopyBin(float* dst, const float* src)
+    {
+#if SAH_BINNING_AVX
+        _mm256_storeu_ps(dst, _mm256_loadu_ps(src));
+#elif SAH_BINNING_SSE
+        _mm_storeu_ps(dst + 0, _mm_loadu_ps(src + 0));
+        _mm_storeu_ps(dst + 4, _mm_loadu_ps(src + 4));
+#else
+        for (int i = 0; i < kBinStride; ++i) {
+            dst[i] = src[i];
+        }
+#endif
+    }
+
+    static inline void MinBin(float* dst, const float* src)
+    {
+#if SAH_BINNING_AVX
+        _mm256_storeu_ps(dst, _mm256_min_ps(_mm256_loadu_ps(src), _mm256_loadu_ps(dst)));
+#elif SAH_BINNING_SSE
+        _mm_storeu_ps(dst + 0, _mm_min_ps(_mm_loadu_ps(src + 0), _mm_loadu_ps(dst + 0)));
+        _mm_storeu_ps(dst + 4, _mm_min_ps(_mm_loadu_ps(src + 4), _mm_loadu_ps(dst + 4)));
+#else
+        for (int i = 0; i < kBinStride; ++i) {
+            dst[i] = src[i] < dst[i] ? src[i] : dst[i];
+        }
+#endif
+    }
+
+    // Matches Bounds3D::Area bit for bit so splits do not change
+    static inline float BinArea(const float* bin)
+    {
+        float ex = -bin[4] - bin[0];
+        float ey = -bin[5] - bin[1];
+        float ez = -bin[6] - bin[2];
+        return 2.f * (ex * ey + ex * ez + ey * ez);
+    }
+
+    void BinningPrimitives::Init(const Bounds3D* bounds, int numbounds)
+    {
+        minNegMax.resize((size_t)numbounds * kBinStride);
+        centroids[0].resize(numbounds);
+        centroids[1].resize(numbounds);
+        centroids[2].resize(numbounds);
+
+        for (int i = 0; i < numbounds; ++i)
+        {
+            const Bounds3D& box = bounds[i];
+            float* prim = &minNegMax[(size_t)i * kBinStride];
+
+            prim[0] = box.min.x;
+            prim[1] = box.min.y;
+            prim[2] = box.min.z;
+            prim[3] = 0.f;
+            prim[4] = -box.max.x;
+            prim[5] = -box.max.y;
+            prim[6] = -box.max.z;
+            prim[7] = 0.f;
+
+            Vector3 c = box.Center();
+            centroids[0][i] = c.x;
+            centroids[1][i] = c.y;
+            centroids[2][i] = c.z;
+        }
+    }
+
+    void BinningPrimitives::Clear()
+    {
+        std::vector<float>().swap(minNegMax);
+        std::vector<float>().swap(centroids[0]);
+        std::vector<float>().swap(centroids[1]);
+        std::vector<float>().swap(centroids[2]);
+    }
+
+    SahHistogram& SahHistogram::ThreadLocal()
+    {
+        static thread_local SahHistogram histogram;
+        return histogram;
+    }
+
+    void SahHistogram::Reset(int inNumBins)
+    {
+        numBins = inNumBins;
+
+        // Only grows, so steady state building does not allocate
+        if (counts.size() < (size_t)(3 * numBins))
+        {
+            bins.resize(3 * numBins * kBinStride);
+            counts.resize(3 * numBins);
+            rightAreas.resize(3 * numBins);
+        }
+
+        // Bounds of a bin are only valid once its count is non zero,
+        // so the counts are all that needs clearing
+        std::fill(counts.begin(), counts.begin() + 3 * numBins, 0);
+    }
+
+    void SahHistogram::Bin(const BinningPrimitives& prims, const int* primindices, int begin, int end, const Bounds3D& centroidBounds)
+    {
+        Vector3 extents = centroidBounds.Extents();
+        Vector3 rootmin = centroidBounds.min;
+
+        // Degenerate axes all land in bin 0 and are skipped by FindSplit
+        float invcentroidRNG[3];
+        for (int axis = 0; axis < 3; ++axis) {
+            invcentroidRNG[axis] = extents[axis] == 0.f ? 0.f : 1.f / extents[axis];
+        }
+
+        const float* primdata = &prims.minNegMax[0];
+        float* bindata = &bins[0];
+        int* bincounts = &counts[0];
+
+#if SAH_BINNING_SSE
+        const __m128 rmin  = _mm_setr_ps(rootmin.x, rootmin.y, rootmin.z, 0.f);
+        const __m128 rinv  = _mm_setr_ps(invcentroidRNG[0], invcentroidRNG[1], invcentroidRNG[2], 0.f);
+        const __m128 nb    = _mm_set1_ps(static_cast<float>(numBins));
+        const __m128 nbm1  = _mm_set1_ps(static_cast<float>(numBins - 1));
+        const __m128 half  = _mm_set1_ps(0.5f);
+        const __m128 zero  = _mm_setzero_ps();
+
+        for (int i = begin; i < end; ++i)
+        {
+            const float* prim = primdata + (size_t)primindices[i] * kBinStride;
+
+            // Centroid is (min + max) * 0.5, the bin index of all three axes in one go
+            __m128 c = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(prim), _mm_loadu_ps(prim + 4)), half);
+            __m128 t = _mm_min_ps(_mm_mul_ps(nb, _mm_mul_ps(_mm_sub_ps(c, rmin), rinv)), nbm1);
+
+            int binidx[4];
+            _mm_storeu_si128((__m128i*)binidx, _mm_cvttps_epi32(_mm_max_ps(t, zero)));
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                int bin = axis * numBins + binidx[axis];
+                if (bincounts[bin]++ == 0) {
+                    CopyBin(bindata + bin * kBinStride, prim);
+                }
+                else {
+                    MinBin(bindata + bin * kBinStride, prim);
+                }
+            }
+        }
+#else
+        for (int i = begin; i < end; ++i)
+        {
+            int idx = primindices[i];
+            const float* prim = primdata + (size_t)idx * kBinStride;
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                float c = prims.centroids[axis][idx];
+                int binidx = (int)std::min<float>(static_cast<float>(numBins) * ((c - rootmin[axis]) * invcentroidRNG[axis]), static_cast<float>(numBins - 1));
+                int bin = axis * numBins + std::max(binidx, 0);
+
+                if (bincounts[bin]++ == 0) {
+                    CopyBin(bindata + bin * kBinStride, prim);
+                }
+                else {
+                    MinBin(bindata + bin * kBinStride, prim);
+                }
+            }
+        }
+#endif
+    }
+
+    void SahHistogram::Merge(const SahHistogram& other)
+    {
+        for (int i = 0; i < 3 * numBins; ++i)
+        {
+            if (other.counts[i] == 0) {
+                continue;
+            }
+
+            if (counts[i] == 0) {
+                CopyBin(&bins[i * kBinStride], &other.bins[i * kBinStride]);
+            }
+            else {
+                MinBin(&bins[i * kBinStride], &other.bins[i * kBinStride]);
+            }
+
+            counts[i] += other.counts[i];
+        }
+    }
+
+    bool SahHistogram::FindSplit(const Bounds3D& centroidBounds, float invarea, float traversalCost, int& dim, int& binidx, float& sah)
+    {
+        Vector3 extents = centroidBounds.Extents();
+
+        float rightbox[3][kBinStride];
+        float leftbox[3][kBinStride];
+        float rightArea[3];
+        int numprims[3] = { 0, 0, 0 };
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            std::fill(rightbox[axis], rightbox[axis] + kBinStride, kEmptyBin);
+            std::fill(leftbox[axis], leftbox[axis] + kBinStride, kEmptyBin);
+            rightArea[axis] = BinArea(rightbox[axis]);
+        }
+
+        // Right to left: area of everything right of each candidate plane.
+        // An empty bin leaves the box as it is, so its area is carried over.
+        for (int i = numBins - 1; i > 0; --i)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                int bin = axis * numBins + i;
+                if (counts[bin] != 0)
+                {
+                    MinBin(rightbox[axis], &bins[bin * kBinStride]);
+                    rightArea[axis] = BinArea(rightbox[axis]);
+                    numprims[axis] += counts[bin];
+                }
+                rightAreas[bin - 1] = rightArea[axis];
+            }
+        }
+
+        // Left to right: evaluate the three axes side by side.
+        // Each axis keeps its first minimum, axes are then compared in order,
+        // which is exactly what an axis by axis search picks.
+        // A plane after an empty bin gives the same SAH as the plane after the
+        // last occupied one, which comes first and wins, so it is skipped.
+        float bestsah[3];
+        int bestbin[3] = { -1, -1, -1 };
+        int leftcount[3] = { 0, 0, 0 };
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            bestsah[axis] = std::numeric_limits<float>::max();
+            numprims[axis] += counts[axis * numBins];
+        }
+
+        for (int i = 0; i < numBins - 1; ++i)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                int bin = axis * numBins + i;
+                if (counts[bin] == 0) {
+                    continue;
+                }
+
+                MinBin(leftbox[axis], &bins[bin * kBinStride]);
+                leftcount[axis] += counts[bin];
+
+                int rightcount = numprims[axis] - leftcount[axis];
+                float sahtmp = traversalCost + (leftcount[axis] * BinArea(leftbox[axis]) + rightcount * rightAreas[bin]) * invarea;
+
+                if (sahtmp < bestsah[axis])
+                {
+                    bestsah[axis] = sahtmp;
+                    bestbin[axis] = i;
+                }
+            }
+        }
+
+        binidx = -1;
+        sah = std::numeric_limits<float>::max();
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            // If the box is degenerate in that dimension skip it
+            if (extents[axis] == 0.f || bestbin[axis] == -1) {
+                continue;
+            }
+
+            if (bestsah[axis] < sah)
+            {
+                dim = axis;
+                binidx = bestbin[axis];
+                sah = bestsah[axis];
+            }
+        }
+
+        return binidx != -1;
+    }
+}
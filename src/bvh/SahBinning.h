@@ -0,0 +1,86 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#pragma once
+
+#ifndef SAH_BINNING_H
+#define SAH_BINNING_H
+
+#include <vector>
+
+#include "math/Bounds3D.h"
+
+namespace RadeonRays
+{
+    /// Primitive bounds and centroids laid out for the SAH binning kernel.
+    /// Bounds are one float4 min and one float4 negated max per primitive, so a single
+    /// min instruction accumulates both ends; centroids are one stream per axis.
+    class BinningPrimitives
+    {
+    public:
+        void Init(const Bounds3D* bounds, int numbounds);
+
+        void Clear();
+
+        float Centroid(int idx, int axis) const
+        {
+            return centroids[axis][idx];
+        }
+
+        Vector3 Centroid(int idx) const
+        {
+            return Vector3(centroids[0][idx], centroids[1][idx], centroids[2][idx]);
+        }
+
+    public:
+        std::vector<float> minNegMax;
+        std::vector<float> centroids[3];
+    };
+
+    /// Centroid histogram of one node over all three axes.
+    /// Every bin keeps the same min/negated max pair as the primitives plus a count.
+    class SahHistogram
+    {
+    public:
+        // Histogram owned by the calling thread, reused from node to node
+        static SahHistogram& ThreadLocal();
+
+        void Reset(int numBins);
+
+        // Bins primindices[begin, end) against the node centroid bounds
+        void Bin(const BinningPrimitives& prims, const int* primindices, int begin, int end, const Bounds3D& centroidBounds);
+
+        void Merge(const SahHistogram& other);
+
+        // Sweeps all three axes at once. Returns false if every axis is degenerate,
+        // otherwise the best axis, the bin the split lies after and its SAH.
+        bool FindSplit(const Bounds3D& centroidBounds, float invarea, float traversalCost, int& dim, int& binidx, float& sah);
+
+    public:
+        int numBins = 0;
+        std::vector<float> bins;
+        std::vector<int> counts;
+        std::vector<float> rightAreas;
+    };
+}
+
+#endif // SAH_BINNING_H
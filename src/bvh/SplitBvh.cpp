@@ -1,69 +1,174 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <limits>
 
 #include "SplitBvh.h"
+#include "BvhCache.h"
+#include "job/TaskGroup.h"
 
 namespace RadeonRays
 {
+    // Subtrees with fewer references are built on the thread that reached them
+    static const int kMinRefsPerTask = 4096;
+    // Nodes with at least this many references bin and partition in parallel chunks
+    static const int kMinRefsForParallelSplit = 65536;
+    // References per chunk of the parallel binning and partition
+    static const int kRefsPerChunk = 16384;
+    // Marks a request for the root of its context
+    static const int kContextRoot = -1;
+
+    void SplitBvh::HashBuildParams(ContentHash& hash) const
+    {
+        Bvh::HashBuildParams(hash);
+        hash.Add(m_MaxSplitDepth);
+        hash.Add(m_MinOverlap);
+        hash.Add(m_ExtraRefsBudget);
+    }
+
     void SplitBvh::BuildImpl(const Bounds3D* bounds, int numbounds)
     {
-        // Initialize prim refs structures
-        PrimRefArray primrefs(numbounds);
+        BuildContext root;
 
-        // Keep centroids to speed up partitioning
-        std::vector<Vector3> centroids(numbounds);
+        // Initialize prim refs structures
+        root.refs.resize(numbounds);
 		Bounds3D centroidBounds;
 
         for (auto i = 0; i < numbounds; ++i)
         {
-            primrefs[i] = PrimRef { bounds[i], bounds[i].Center(), i };
-
-            auto c = bounds[i].Center();
-            centroidBounds.Expand(c);
+            root.refs[i] = PrimRef { bounds[i], bounds[i].Center(), i };
+            centroidBounds.Expand(root.refs[i].center);
         }
 
-        m_NumNodesForRegular = (2 * numbounds - 1);
-        m_NumNodesRequired   = (int)(m_NumNodesForRegular * (1.f + m_ExtraRefsBudget));
+        m_MaxExtraRefs = (int)(numbounds * m_ExtraRefsBudget);
+        m_NumExtraRefs = 0;
+        root.extraRefs = m_MaxExtraRefs;
 
-        InitNodeAllocator(m_NumNodesRequired);
+        // Regular tree size, grows with extra references
+        root.nodes.reserve(2 * numbounds);
 
-        SplitRequest init = { 0, numbounds, nullptr, m_Bounds, centroidBounds, 0 };
+        SplitRequest init = { 0, numbounds, kContextRoot, m_Bounds, centroidBounds, 0, 1 };
 
         // Start from the top
-        BuildNode(init, primrefs);
+        BuildSubtree(init, root);
+
+        StitchContexts(root);
     }
 
-    void SplitBvh::BuildNode(SplitRequest& req, PrimRefArray& primrefs)
+    void SplitBvh::BuildSubtree(const SplitRequest& root, BuildContext& rootcontext)
     {
-        // Update current height
-        m_Height = std::max(m_Height, req.level);
+        TaskGroup group(m_TaskPool);
 
-        // Allocate new node
-        Node* node   = AllocateNode();
-        node->bounds = req.bounds;
+        // Contexts waiting to be built on this thread
+        std::vector<std::pair<SplitRequest, BuildContext*>> subtrees;
+        subtrees.push_back(std::make_pair(root, &rootcontext));
 
-        // Create leaf node if we have enough prims
-        if (req.numprims < 2)
+        std::vector<SplitRequest> stack;
+
+        while (!subtrees.empty())
+        {
+            BuildContext& context = *subtrees.back().second;
+            stack.push_back(subtrees.back().first);
+            subtrees.pop_back();
+
+            while (!stack.empty())
+            {
+                SplitRequest req = stack.back();
+                stack.pop_back();
+
+                SplitRequest leftrequest;
+                SplitRequest rightrequest;
+                if (!BuildNode(req, context, leftrequest, rightrequest)) {
+                    continue;
+                }
+
+                // Large right subtrees move their references into a context of their own. This happens
+                // with or without a pool so the tree does not depend on it.
+                if (leftrequest.numprims >= kMinRefsPerTask && rightrequest.numprims >= kMinRefsPerTask)
+                {
+                    context.children.emplace_back(new BuildContext());
+                    BuildContext* rightcontext = context.children.back().get();
+
+                    rightcontext->refs.assign(context.refs.begin() + rightrequest.startidx, context.refs.begin() + rightrequest.startidx + rightrequest.numprims);
+                    rightcontext->nodes.reserve(2 * rightrequest.numprims);
+                    rightcontext->slot = rightrequest.nodeidx;
+
+                    // The budget left is split by reference count at a point that only depends on
+                    // the work of this context, so which subtree wins the last references does not
+                    // depend on the order the pool runs them
+                    long long numrefs = (long long)leftrequest.numprims + rightrequest.numprims;
+                    rightcontext->extraRefs = (int)(context.extraRefs * (long long)rightrequest.numprims / numrefs);
+                    context.extraRefs -= rightcontext->extraRefs;
+
+                    rightrequest.startidx = 0;
+                    rightrequest.nodeidx  = kContextRoot;
+
+                    if (m_TaskPool) {
+                        group.Run([this, rightrequest, rightcontext]() { BuildSubtree(rightrequest, *rightcontext); });
+                    }
+                    else {
+                        subtrees.push_back(std::make_pair(rightrequest, rightcontext));
+                    }
+
+                    // Left side only grows into the range the right side no longer uses
+                    stack.push_back(leftrequest);
+                }
+                else
+                {
+                    // The order is very important here since right node uses the space at the end of the array to partition,
+                    // the right subtree is popped and finished before the left one starts
+                    stack.push_back(leftrequest);
+                    stack.push_back(rightrequest);
+                }
+            }
+        }
+
+        group.Wait();
+    }
+
+    bool SplitBvh::BuildNode(SplitRequest& req, BuildContext& context, SplitRequest& leftrequest, SplitRequest& rightrequest)
+    {
+        PrimRefArray& primrefs = context.refs;
+
+        // Update current height
+        UpdateHeight(req.level);
+
+        auto makeLeaf = [&]()
         {
-            node->type     = kLeaf;
-            node->startidx = (int)m_PackedIndices.size();
-            node->numprims = req.numprims;
+            Node& node    = req.nodeidx == kContextRoot ? context.root : context.nodes[req.nodeidx];
+            node.bounds   = req.bounds;
+            node.index    = req.index;
+            node.type     = kLeaf;
+            node.startidx = (int)context.indices.size();
+            node.numprims = req.numprims;
 
             for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
             {
-                m_PackedIndices.push_back(primrefs[i].idx);
+                context.indices.push_back(primrefs[i].idx);
             }
+        };
+
+        // Create leaf node if we have enough prims
+        if (req.numprims < 2)
+        {
+            makeLeaf();
+            return false;
         }
         else
         {
-            node->type = kInternal;
-
             // Choose the maximum extent
             int axis = req.centroidBounds.Maxdim();
             float border = req.centroidBounds.Center()[axis];
 
             SahSplit os = FindObjectSahSplit(req, primrefs);
+
+            // Leaf cost is numprims intersections, os.sah is in the same units.
+            // Decided before the spatial search so small leaves never draw from the reference budget.
+            if (req.numprims <= m_MaxPrimitivesPerLeaf && (std::isnan(os.split) || req.numprims <= os.sah))
+            {
+                makeLeaf();
+                return false;
+            }
             SahSplit ss;
             auto splitType = SplitType::kObject;
 
@@ -72,14 +177,24 @@ namespace RadeonRays
             // 2. We found spatial split
             // 3. It is better than object split
             // 4. Object split is not good enought (too much overlap)
-            // 5. Our node budget still allows us to split references
-            if (req.level < m_MaxSplitDepth && m_Nodecnt < m_NumNodesRequired && os.overlap > m_MinOverlap)
+            // 5. Our reference budget still allows us to split references
+            if (req.level < m_MaxSplitDepth && context.extraRefs > 0 && os.overlap > m_MinOverlap)
             {
                 ss = FindSpatialSahSplit(req, primrefs);
 
                 if (!std::isnan(ss.split) && ss.sah < os.sah)
                 {
-                    splitType = SplitType::kSpatial;
+                    // Take the references from the budget before splitting
+                    int numstraddling = 0;
+                    for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
+                    {
+                        const Bounds3D& b = primrefs[i].bounds;
+                        numstraddling += ss.split > b.min[ss.dim] && ss.split < b.max[ss.dim] ? 1 : 0;
+                    }
+
+                    if (ReserveExtraRefs(context, numstraddling)) {
+                        splitType = SplitType::kSpatial;
+                    }
                 }
             }
 
@@ -120,7 +235,11 @@ namespace RadeonRays
             auto cmp1 = near2far ? cmpl  : cmpge;
             auto cmp2 = near2far ? cmpge : cmpl;
 
-            if (req.centroidBounds.Extents()[axis] > 0.f)
+            if (req.centroidBounds.Extents()[axis] > 0.f && req.numprims >= kMinRefsForParallelSplit)
+            {
+                splitidx = PartitionParallel(req, axis, border, near2far, primrefs, leftbounds, rightbounds, leftcentroidBounds, rightcentroidBounds);
+            }
+            else if (req.centroidBounds.Extents()[axis] > 0.f)
             {
                 auto first = req.startidx;
                 auto last = req.startidx + req.numprims;
@@ -178,22 +297,133 @@ namespace RadeonRays
                 }
             }
 
+            // Children are allocated as a pair, the context arena may grow so the node is looked up after
+            int lc = (int)context.nodes.size();
+            context.nodes.resize(lc + 2);
+
+            Node& node  = req.nodeidx == kContextRoot ? context.root : context.nodes[req.nodeidx];
+            node.bounds = req.bounds;
+            node.index  = req.index;
+            node.type   = kInternal;
+            node.lc     = lc;
+            node.rc     = lc + 1;
+
             // Left request
-            SplitRequest leftrequest  = { req.startidx, splitidx - req.startidx, &node->lc, leftbounds, leftcentroidBounds, req.level + 1 };
+            leftrequest  = { req.startidx, splitidx - req.startidx, node.lc, leftbounds, leftcentroidBounds, req.level + 1, (req.index << 1) };
             // Right request
-            SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroidBounds, req.level + 1 };
+            rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), node.rc, rightbounds, rightcentroidBounds, req.level + 1, (req.index << 1) + 1 };
+
+            return true;
+        }
+    }
+
+    int SplitBvh::PartitionParallel(const SplitRequest& req, int axis, float border, bool near2far, PrimRefArray& refs,
+                                    Bounds3D& leftbounds, Bounds3D& rightbounds, Bounds3D& leftCentroidBounds, Bounds3D& rightCentroidBounds)
+    {
+        // Stable partition, same layout whatever number of threads runs it
+        struct Chunk
+        {
+            int numleft;
+            int leftoffset;
+            int rightoffset;
+            Bounds3D leftbounds;
+            Bounds3D rightbounds;
+            Bounds3D leftCentroidBounds;
+            Bounds3D rightCentroidBounds;
+        };
+
+        int numchunks = (req.numprims + kRefsPerChunk - 1) / kRefsPerChunk;
+        std::vector<Chunk> chunks(numchunks);
+
+        auto isLeft = [&](const PrimRef& ref) -> bool
+        {
+            return near2far ? ref.center[axis] < border : ref.center[axis] >= border;
+        };
+
+        // Count and bound both sides per chunk
+        TaskGroup::ParallelFor(m_TaskPool, numchunks, 1, [&](int begin, int end)
+        {
+            for (int c = begin; c < end; ++c)
+            {
+                Chunk& chunk = chunks[c];
+                chunk.numleft = 0;
 
-            // The order is very important here since right node uses the space at the end of the array to partition
-			BuildNode(rightrequest, primrefs);
+                int first = req.startidx + c * kRefsPerChunk;
+                int last  = std::min(first + kRefsPerChunk, req.startidx + req.numprims);
 
-			// Put those to stack
-			BuildNode(leftrequest, primrefs);
+                for (int i = first; i < last; ++i)
+                {
+                    if (isLeft(refs[i]))
+                    {
+                        chunk.leftbounds.Expand(refs[i].bounds);
+                        chunk.leftCentroidBounds.Expand(refs[i].center);
+                        ++chunk.numleft;
+                    }
+                    else
+                    {
+                        chunk.rightbounds.Expand(refs[i].bounds);
+                        chunk.rightCentroidBounds.Expand(refs[i].center);
+                    }
+                }
+            }
+        });
+
+        // Prefix sums give every chunk its output slots
+        int numleft = 0;
+        for (int c = 0; c < numchunks; ++c) {
+            numleft += chunks[c].numleft;
+        }
+
+        int leftoffset  = 0;
+        int rightoffset = numleft;
+        for (int c = 0; c < numchunks; ++c)
+        {
+            Chunk& chunk = chunks[c];
+            int numrefs = std::min(kRefsPerChunk, req.numprims - c * kRefsPerChunk);
+
+            chunk.leftoffset  = leftoffset;
+            chunk.rightoffset = rightoffset;
+            leftoffset  += chunk.numleft;
+            rightoffset += numrefs - chunk.numleft;
+
+            leftbounds.Expand(chunk.leftbounds);
+            rightbounds.Expand(chunk.rightbounds);
+            leftCentroidBounds.Expand(chunk.leftCentroidBounds);
+            rightCentroidBounds.Expand(chunk.rightCentroidBounds);
         }
 
-        // Set parent ptr if any
-		if (req.ptr) {
-			*req.ptr = node;
-		}
+        // Scatter to a scratch array and copy back
+        PrimRefArray scratch(req.numprims);
+        TaskGroup::ParallelFor(m_TaskPool, numchunks, 1, [&](int begin, int end)
+        {
+            for (int c = begin; c < end; ++c)
+            {
+                int left  = chunks[c].leftoffset;
+                int right = chunks[c].rightoffset;
+
+                int first = req.startidx + c * kRefsPerChunk;
+                int last  = std::min(first + kRefsPerChunk, req.startidx + req.numprims);
+
+                for (int i = first; i < last; ++i)
+                {
+                    if (isLeft(refs[i])) {
+                        scratch[left++] = refs[i];
+                    }
+                    else {
+                        scratch[right++] = refs[i];
+                    }
+                }
+            }
+        });
+
+        TaskGroup::ParallelFor(m_TaskPool, numchunks, 1, [&](int begin, int end)
+        {
+            int first = begin * kRefsPerChunk;
+            int last  = std::min(end * kRefsPerChunk, req.numprims);
+            std::copy(scratch.begin() + first, scratch.begin() + last, refs.begin() + req.startidx + first);
+        });
+
+        return req.startidx + numleft;
     }
 
     SplitBvh::SahSplit SplitBvh::FindObjectSahSplit(const SplitRequest& req, const PrimRefArray& refs) const
@@ -207,8 +437,9 @@ namespace RadeonRays
 
         SahSplit split;
         split.dim   = 0;
-        split.split = std::numeric_limits<float>::quiet_NaN();
-        split.sah   = sah;
+        split.split   = std::numeric_limits<float>::quiet_NaN();
+        split.sah     = sah;
+        split.overlap = 0.f;
 
         // if we cannot apply histogram algorithm
         // put NAN sentinel as split border
@@ -224,57 +455,91 @@ namespace RadeonRays
         struct Bin
         {
 			Bounds3D bounds;
-            int count;
+            int count = 0;
         };
 
-        // Keep bins for each dimension
-        std::vector<Bin> bins[3];
-        bins[0].resize(m_NumBins);
-        bins[1].resize(m_NumBins);
-        bins[2].resize(m_NumBins);
-
         // Precompute inverse parent area
         auto invarea = 1.f / req.bounds.Area();
+        float traversalCost = NormalizedTraversalCost();
         // Precompute min point
         auto rootmin = req.centroidBounds.min;
 
-        // Evaluate all dimensions
-        for (int axis = 0; axis < 3; ++axis)
+        // Histogram of a range of references, m_NumBins bins per axis
+        auto binRefs = [&](int first, int last, Bin* bins)
         {
-            float rootminc = rootmin[axis];
-            // Range for histogram
-            auto centroidRNG = centroidExtents[axis];
-            auto invcentroidRNG = 1.f / centroidRNG;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                float rootminc = rootmin[axis];
+                // Range for histogram
+                auto centroidRNG = centroidExtents[axis];
+                auto invcentroidRNG = 1.f / centroidRNG;
+
+                // If the box is degenerate in that dimension skip it
+                if (centroidRNG == 0.f) {
+                    continue;
+                }
 
-            // If the box is degenerate in that dimension skip it
-			if (centroidRNG == 0.f) {
-				continue;
-			}
+                Bin* axisbins = bins + axis * m_NumBins;
+                for (int idx = first; idx < last; ++idx)
+                {
+                    auto binidx = (int)std::min<float>(static_cast<float>(m_NumBins) * ((refs[idx].center[axis] - rootminc) * invcentroidRNG), static_cast<float>(m_NumBins - 1));
 
-            // Initialize bins
-            for (int i = 0; i < m_NumBins; ++i)
-            {
-                bins[axis][i].count = 0;
-                bins[axis][i].bounds = Bounds3D();
+                    ++axisbins[binidx].count;
+                    axisbins[binidx].bounds.Expand(refs[idx].bounds);
+                }
             }
+        };
 
-            // Calc primitive refs histogram
-            for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
+        // Keep bins for each dimension
+        std::vector<Bin> bins(3 * m_NumBins);
+
+        if (req.numprims >= kMinRefsForParallelSplit)
+        {
+            // Chunk histograms merge exactly, so the result matches the serial one
+            int numchunks = (req.numprims + kRefsPerChunk - 1) / kRefsPerChunk;
+            std::vector<Bin> chunkbins(numchunks * 3 * m_NumBins);
+
+            TaskGroup::ParallelFor(m_TaskPool, numchunks, 1, [&](int begin, int end)
             {
-                auto idx = i;
-                auto binidx = (int)std::min<float>(static_cast<float>(m_NumBins) * ((refs[idx].center[axis] - rootminc) * invcentroidRNG), static_cast<float>(m_NumBins - 1));
+                for (int c = begin; c < end; ++c)
+                {
+                    int first = req.startidx + c * kRefsPerChunk;
+                    int last  = std::min(first + kRefsPerChunk, req.startidx + req.numprims);
+                    binRefs(first, last, &chunkbins[c * 3 * m_NumBins]);
+                }
+            });
 
-                ++bins[axis][binidx].count;
-                bins[axis][binidx].bounds.Expand(refs[idx].bounds);
+            for (int c = 0; c < numchunks; ++c)
+            {
+                for (int i = 0; i < 3 * m_NumBins; ++i)
+                {
+                    bins[i].count += chunkbins[c * 3 * m_NumBins + i].count;
+                    bins[i].bounds.Expand(chunkbins[c * 3 * m_NumBins + i].bounds);
+                }
             }
+        }
+        else
+        {
+            binRefs(req.startidx, req.startidx + req.numprims, &bins[0]);
+        }
+
+        std::vector<Bounds3D> rightbounds(m_NumBins - 1);
 
-            std::vector<Bounds3D> rightbounds(m_NumBins - 1);
+        // Evaluate all dimensions
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            // If the box is degenerate in that dimension skip it
+			if (centroidExtents[axis] == 0.f) {
+				continue;
+			}
+
+            const Bin* axisbins = &bins[axis * m_NumBins];
 
             // Start with 1-bin right box
 			Bounds3D rightbox;
             for (int i = m_NumBins - 1; i > 0; --i)
             {
-                rightbox.Expand(bins[axis][i].bounds);
+                rightbox.Expand(axisbins[i].bounds);
                 rightbounds[i - 1] = rightbox;
             }
 
@@ -287,12 +552,12 @@ namespace RadeonRays
             float sahtmp = 0.f;
             for (int i = 0; i < m_NumBins - 1; ++i)
             {
-                leftbox.Expand(bins[axis][i].bounds);
-                leftcount += bins[axis][i].count;
-                rightcount -= bins[axis][i].count;
+                leftbox.Expand(axisbins[i].bounds);
+                leftcount += axisbins[i].count;
+                rightcount -= axisbins[i].count;
 
                 // Compute SAH
-                sahtmp = m_TraversalCost + (leftcount * leftbox.Area() + rightcount * rightbounds[i].Area()) * invarea;
+                sahtmp = traversalCost + (leftcount * leftbox.Area() + rightcount * rightbounds[i].Area()) * invarea;
 
                 // Check if it is better than what we found so far
                 if (sahtmp < sah)
@@ -327,12 +592,14 @@ namespace RadeonRays
 
         SahSplit split;
         split.dim   = 0;
-        split.split = std::numeric_limits<float>::quiet_NaN();
-        split.sah   = sah;
+        split.split   = std::numeric_limits<float>::quiet_NaN();
+        split.sah     = sah;
+        split.overlap = 0.f;
 
         // Extents
         Vector3 extents = req.bounds.Extents();
         auto invarea = 1.f / req.bounds.Area();
+        float traversalCost = NormalizedTraversalCost();
 
         // If there are too few primitives don't split them
         
@@ -345,68 +612,94 @@ namespace RadeonRays
         struct Bin
         {
 			Bounds3D bounds;
-            int enter;
-            int exit;
+            int enter = 0;
+            int exit = 0;
         };
 
-        Bin bins[3][kNumBins];
-
         // Prepcompute some useful stuff
         Vector3 origin     = req.bounds.min;
         Vector3 binsize    = req.bounds.Extents() * (1.f / kNumBins);
         Vector3 invbinsize = Vector3(1.f / binsize.x, 1.f / binsize.y, 1.f / binsize.z);
 
-        // Initialize bins
-        for (int axis = 0; axis < 3; ++axis)
+        // Clips a range of references into kNumBins bins per axis
+        auto binRefs = [&](int first, int last, Bin* bins)
         {
-            for (int i = 0; i < kNumBins; ++i)
+            for (int i = first; i < last; ++i)
             {
-                bins[axis][i].bounds = Bounds3D();
-                bins[axis][i].enter = 0;
-                bins[axis][i].exit = 0;
-            }
-        }
+                PrimRef const& primref(refs[i]);
+                // Determine starting bin for this primitive
+                Vector3 firstbin = Vector3::Clamp((primref.bounds.min - origin) * invbinsize, Vector3(0, 0, 0), Vector3(kNumBins - 1, kNumBins - 1, kNumBins - 1));
+                // Determine finishing bin
+                Vector3 lastbin  = Vector3::Clamp((primref.bounds.max - origin) * invbinsize, firstbin, Vector3(kNumBins - 1, kNumBins - 1, kNumBins - 1));
+                // Iterate over axis
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    // Skip in case of a degenerate dimension
+                    if (extents[axis] == 0.f) {
+                        continue;
+                    }
 
-        // Iterate thru all primitive refs
-        for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
-        {
-            PrimRef const& primref(refs[i]);
-            // Determine starting bin for this primitive
-            Vector3 firstbin = Vector3::Clamp((primref.bounds.min - origin) * invbinsize, Vector3(0, 0, 0), Vector3(kNumBins - 1, kNumBins - 1, kNumBins - 1));
-            // Determine finishing bin
-            Vector3 lastbin  = Vector3::Clamp((primref.bounds.max - origin) * invbinsize, firstbin, Vector3(kNumBins - 1, kNumBins - 1, kNumBins - 1));
-            // Iterate over axis
-            for (int axis = 0; axis < 3; ++axis)
-            {
-                // Skip in case of a degenerate dimension
-				if (extents[axis] == 0.f) {
-					continue;
-				}
+                    Bin* axisbins = bins + axis * kNumBins;
 
-                // Break the prim into bins
-                auto tempref = primref;
+                    // Break the prim into bins
+                    auto tempref = primref;
 
-                for (int j = (int)firstbin[axis]; j < (int)lastbin[axis]; ++j)
-                {
-                    PrimRef leftref, rightref;
-                    // Split primitive ref into left and right
-                    float splitval = origin[axis] + binsize[axis] * (j + 1);
-                    if (SplitPrimRef(tempref, axis, splitval, leftref, rightref))
+                    for (int j = (int)firstbin[axis]; j < (int)lastbin[axis]; ++j)
                     {
-                        // Add left one
-                        bins[axis][j].bounds.Expand(leftref.bounds);
-                        // Save right to add part of it into the next bin
-                        tempref = rightref;
+                        PrimRef leftref, rightref;
+                        // Split primitive ref into left and right
+                        float splitval = origin[axis] + binsize[axis] * (j + 1);
+                        if (SplitPrimRef(tempref, axis, splitval, leftref, rightref))
+                        {
+                            // Add left one
+                            axisbins[j].bounds.Expand(leftref.bounds);
+                            // Save right to add part of it into the next bin
+                            tempref = rightref;
+                        }
                     }
+
+                    // Add the last piece into the last bin
+                    axisbins[(int)lastbin[axis]].bounds.Expand(tempref.bounds);
+                    // Adjust enter & exit counters
+                    axisbins[(int)firstbin[axis]].enter++;
+                    axisbins[(int)lastbin[axis]].exit++;
+                }
+            }
+        };
+
+        std::vector<Bin> bins(3 * kNumBins);
+
+        // Clipping dominates the top levels, chunks are clipped in parallel and merged in order
+        if (req.numprims >= kMinRefsForParallelSplit)
+        {
+            int numchunks = (req.numprims + kRefsPerChunk - 1) / kRefsPerChunk;
+            std::vector<Bin> chunkbins(numchunks * 3 * kNumBins);
+
+            TaskGroup::ParallelFor(m_TaskPool, numchunks, 1, [&](int begin, int end)
+            {
+                for (int c = begin; c < end; ++c)
+                {
+                    int first = req.startidx + c * kRefsPerChunk;
+                    int last  = std::min(first + kRefsPerChunk, req.startidx + req.numprims);
+                    binRefs(first, last, &chunkbins[c * 3 * kNumBins]);
                 }
+            });
 
-                // Add the last piece into the last bin
-                bins[axis][(int)lastbin[axis]].bounds.Expand(tempref.bounds);
-                // Adjust enter & exit counters
-                bins[axis][(int)firstbin[axis]].enter++;
-                bins[axis][(int)lastbin[axis]].exit++;
+            for (int c = 0; c < numchunks; ++c)
+            {
+                for (int i = 0; i < 3 * kNumBins; ++i)
+                {
+                    const Bin& bin = chunkbins[c * 3 * kNumBins + i];
+                    bins[i].bounds.Expand(bin.bounds);
+                    bins[i].enter += bin.enter;
+                    bins[i].exit  += bin.exit;
+                }
             }
         }
+        else
+        {
+            binRefs(req.startidx, req.startidx + req.numprims, &bins[0]);
+        }
 
         // Prepare moving window data
 		Bounds3D rightbounds[kNumBins - 1];
@@ -419,12 +712,14 @@ namespace RadeonRays
 			if (extents[axis] == 0.f) {
 				continue;
 			}
+
+            const Bin* axisbins = &bins[axis * kNumBins];
             
             // Start with 1-bin right box
 			Bounds3D rightbox = Bounds3D();
             for (int i = kNumBins - 1; i > 0; --i)
             {
-                rightbox = Bounds3D::Union(rightbox, bins[axis][i].bounds);
+                rightbox = Bounds3D::Union(rightbox, axisbins[i].bounds);
                 rightbounds[i - 1] = rightbox;
             }
 
@@ -436,13 +731,13 @@ namespace RadeonRays
             for (int i = 1; i < kNumBins; ++i)
             {
                 // New left box
-                leftbox.Expand(bins[axis][i - 1].bounds);
+                leftbox.Expand(axisbins[i - 1].bounds);
                 // New left box count
-                leftcount += bins[axis][i - 1].enter;
+                leftcount += axisbins[i - 1].enter;
                 // Adjust right box
-                rightcount -= bins[axis][i - 1].exit;
+                rightcount -= axisbins[i - 1].exit;
                 // Calc SAH
-                float sah = m_TraversalCost + (leftbox.Area() * rightbounds[i - 1].Area() * rightcount)  * invarea;
+                float sah = traversalCost + (leftcount * leftbox.Area() + rightcount * rightbounds[i - 1].Area()) * invarea;
 
                 // Update SAH if it is needed
                 if (sah < split.sah)
@@ -465,6 +760,7 @@ namespace RadeonRays
         // Start with left and right refs equal to original ref
         leftref.idx    = rightref.idx = ref.idx;
         leftref.bounds = rightref.bounds = ref.bounds;
+        leftref.center = rightref.center = ref.center;
 
         // Only split if split value is within our bounds range
         if (split > ref.bounds.min[axis] && split < ref.bounds.max[axis])
@@ -473,6 +769,9 @@ namespace RadeonRays
             leftref.bounds.max[axis]  = split;
             // Trim right box on the left
             rightref.bounds.min[axis] = split;
+            // Partitioning goes by the centers of the clipped boxes
+            leftref.center  = leftref.bounds.Center();
+            rightref.center = rightref.bounds.Center();
             return true;
         }
 
@@ -501,27 +800,88 @@ namespace RadeonRays
         extra_refs = appendprims - req.numprims;
     }
 
-    SplitBvh::Node* SplitBvh::AllocateNode()
+    bool SplitBvh::ReserveExtraRefs(BuildContext& context, int count)
     {
-        if (m_Nodecnt - m_NumNodesArchived >= m_NumNodesForRegular)
-        {
-			m_NodeArchive.push_back(std::move(m_Nodes));
-            m_NumNodesArchived += m_NumNodesForRegular;
-			m_Nodes = std::vector<Node>(m_NumNodesForRegular);
+        if (count > context.extraRefs) {
+            return false;
         }
 
-        return &m_Nodes[m_Nodecnt++ - m_NumNodesArchived];
+        context.extraRefs -= count;
+        m_NumExtraRefs    += count;
+        assert(m_NumExtraRefs <= m_MaxExtraRefs);
+
+        return true;
     }
 
-    void SplitBvh::InitNodeAllocator(size_t maxnum)
+    void SplitBvh::StitchContexts(BuildContext& root)
     {
-        m_NodeArchive.clear();
-        m_Nodecnt = 0;
-		m_Nodes.resize(maxnum);
+        // Flatten the context tree, parents before children
+        std::vector<BuildContext*> contexts;
+        contexts.push_back(&root);
+        for (size_t i = 0; i < contexts.size(); ++i)
+        {
+            for (auto& child : contexts[i]->children) {
+                contexts.push_back(child.get());
+            }
+        }
 
-        // Set root_ pointer
-        m_Root = &m_Nodes[0];
+        // The root goes first, each context's nodes follow as one block
+        std::vector<int> nodeoffsets(contexts.size());
+        std::vector<int> indexoffsets(contexts.size());
+        int numnodes   = 1;
+        int numindices = 0;
+        for (size_t i = 0; i < contexts.size(); ++i)
+        {
+            nodeoffsets[i]  = numnodes;
+            indexoffsets[i] = numindices;
+            numnodes   += (int)contexts[i]->nodes.size();
+            numindices += (int)contexts[i]->indices.size();
+        }
+
+        m_Nodes.resize(numnodes);
+        m_Nodecnt = numnodes;
+        m_PackedIndices.resize(numindices);
+
+        auto rebase = [](Node& node, int nodeoffset, int indexoffset)
+        {
+            if (node.type == kLeaf) {
+                node.startidx += indexoffset;
+            }
+            else
+            {
+                node.lc += nodeoffset;
+                node.rc += nodeoffset;
+            }
+        };
+
+        TaskGroup::ParallelFor(m_TaskPool, (int)contexts.size(), 1, [&](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                BuildContext& context = *contexts[i];
+                std::copy(context.indices.begin(), context.indices.end(), m_PackedIndices.begin() + indexoffsets[i]);
+
+                for (size_t n = 0; n < context.nodes.size(); ++n)
+                {
+                    Node& node = m_Nodes[nodeoffsets[i] + n];
+                    node = context.nodes[n];
+                    rebase(node, nodeoffsets[i], indexoffsets[i]);
+                }
+
+                rebase(context.root, nodeoffsets[i], indexoffsets[i]);
+                context.nodes.clear();
+                context.nodes.shrink_to_fit();
+            }
+        });
+
+        // Context roots go into the slots reserved by their parents once those are copied
+        m_Nodes[0] = root.root;
+        for (size_t i = 0; i < contexts.size(); ++i)
+        {
+            for (auto& child : contexts[i]->children) {
+                m_Nodes[nodeoffsets[i] + child->slot] = child->root;
+            }
+        }
     }
 
 }
-
@@ -21,7 +21,8 @@
  ********************************************************************/
 #pragma once
 
-#include <list>
+#include <memory>
+#include <atomic>
 
 #include "Bvh.h"
 
@@ -35,15 +36,16 @@ namespace RadeonRays
 			, m_MaxSplitDepth(maxSplitDepth)
 			, m_MinOverlap(minOverlap)
 			, m_ExtraRefsBudget(extraRefsBudget)
-			, m_NumNodesRequired(0)
-			, m_NumNodesForRegular(0)
-			, m_NumNodesArchived(0)
+			, m_MaxExtraRefs(0)
+			, m_NumExtraRefs(0)
         {
 
         }
 
         ~SplitBvh() = default;
 
+        void HashBuildParams(ContentHash& hash) const override;
+
     protected:
 
 		struct PrimRef
@@ -62,9 +64,35 @@ namespace RadeonRays
             kSpatial
         };
 
+        // State of one subtree build. Large subtrees get their own context and are built
+        // as tasks, so nothing in here is shared between threads.
+        struct BuildContext
+        {
+            // References of the subtree, grows at the end when spatial splits add refs
+            PrimRefArray refs;
+            // Primitive indices of the subtree leaves, leaf startidx is relative to it until stitched
+            std::vector<int> indices;
+            // Subtree root, it goes to the slot reserved in the parent context
+            Node root;
+            // Node arena of the subtree below the root, child indices are local until stitched
+            std::vector<Node> nodes;
+            // Slot of the root in the parent context nodes
+            int slot = -1;
+            // Extra references the subtree may still add with spatial splits
+            int extraRefs = 0;
+            // Subtrees moved to contexts of their own
+            std::vector<std::unique_ptr<BuildContext>> children;
+        };
+
         // Build function
         void BuildImpl(const Bounds3D* bounds, int numbounds) override;
-        void BuildNode(SplitRequest& req, PrimRefArray& primrefs);
+
+        // Builds the subtree of a context with an explicit stack, contexts split off on the way
+        // are handed to the pool or queued when there is none
+        void BuildSubtree(const SplitRequest& root, BuildContext& context);
+
+        // Fills the node of req, returns true and the child requests when it was split
+        bool BuildNode(SplitRequest& req, BuildContext& context, SplitRequest& leftrequest, SplitRequest& rightrequest);
         
         SahSplit FindObjectSahSplit(const SplitRequest& req, const PrimRefArray& refs) const;
         SahSplit FindSpatialSahSplit(const SplitRequest& req, const PrimRefArray& refs) const;
@@ -72,28 +100,25 @@ namespace RadeonRays
         void SplitPrimRefs(const SahSplit& split, const SplitRequest& req, PrimRefArray& refs, int& extra_refs);
         bool SplitPrimRef(const PrimRef& ref, int axis, float split, PrimRef& leftref, PrimRef& rightref) const;
 
-    protected:
+        int PartitionParallel(const SplitRequest& req, int axis, float border, bool near2far, PrimRefArray& refs,
+                              Bounds3D& leftbounds, Bounds3D& rightbounds, Bounds3D& leftCentroidBounds, Bounds3D& rightCentroidBounds);
 
-        Node* AllocateNode() override;
+        // Takes count extra references from the budget of the context, fails if it is exhausted
+        bool ReserveExtraRefs(BuildContext& context, int count);
 
-        void InitNodeAllocator(size_t maxnum) override;
+        // Lays out nodes and leaf indices of all contexts in the arena and m_PackedIndices
+        void StitchContexts(BuildContext& root);
 
     private:
 
         int m_MaxSplitDepth;
         float m_MinOverlap;
         float m_ExtraRefsBudget;
-        int m_NumNodesRequired;
-        int m_NumNodesForRegular;
-
-        // Node archive for memory management
-        // As m_nodes fills up we archive it into m_node_archive
-        // allocate new chunk and work there.
-
-        // How many nodes have been archived so far
-        int m_NumNodesArchived;
-        // Container for archived chunks
-        std::list<std::vector<Node>> m_NodeArchive;
+        // Extra references allowed for the whole tree
+        int m_MaxExtraRefs;
+        // Extra references taken so far by all subtrees, never more than m_MaxExtraRefs since
+        // every context only spends its own share of it
+        std::atomic<int> m_NumExtraRefs;
 
 	private:
         SplitBvh(const SplitBvh& bvh) = delete;
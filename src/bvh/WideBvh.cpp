@@ -0,0 +1,207 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#include <algorithm>
+#include <limits>
+
+#include "WideBvh.h"
+
+namespace RadeonRays
+{
+    template <int Width>
+    void WideBvh<Width>::Build(const Bvh& bvh, std::vector<Entry>* entries)
+    {
+        const Bvh::Node* binary = bvh.GetNodes();
+
+        m_Indices.assign(bvh.GetIndices(), bvh.GetIndices() + bvh.GetNumIndices());
+        m_Bounds = binary[0].bounds;
+        m_Nodes.clear();
+        m_Nodes.reserve(bvh.GetNumNodes() / (Width - 1) + 1);
+
+        struct Pending
+        {
+            // Binary node collapsed into the wide node
+            int src;
+            int dst;
+        };
+
+        std::vector<Pending> stack;
+        stack.push_back({ 0, 0 });
+        m_Nodes.push_back(Node());
+
+        if (entries) {
+            entries->resize(bvh.GetNumNodes());
+        }
+
+        std::vector<int> children;
+        std::vector<int> opened;
+        const float inf = std::numeric_limits<float>::infinity();
+
+        while (!stack.empty())
+        {
+            Pending entry = stack.back();
+            stack.pop_back();
+
+            // A leaf root becomes a single lane node
+            children.clear();
+            opened.clear();
+            if (binary[entry.src].type == Bvh::kLeaf) {
+                children.push_back(entry.src);
+            }
+            else
+            {
+                children.push_back(binary[entry.src].lc);
+                children.push_back(binary[entry.src].rc);
+            }
+
+            while ((int)children.size() < Width)
+            {
+                int largest = -1;
+                float largestArea = -1.0f;
+
+                for (int i = 0; i < (int)children.size(); ++i)
+                {
+                    const Bvh::Node& child = binary[children[i]];
+                    if (child.type == Bvh::kInternal && child.bounds.Area() > largestArea)
+                    {
+                        largest = i;
+                        largestArea = child.bounds.Area();
+                    }
+                }
+
+                if (largest == -1) {
+                    break;
+                }
+
+                int parent = children[largest];
+                children[largest] = binary[parent].lc;
+                children.push_back(binary[parent].rc);
+                opened.push_back(parent);
+            }
+
+            for (int lane = 0; lane < Width; ++lane)
+            {
+                int child = lane < (int)children.size() ? children[lane] : -1;
+                int numprims = -1;
+                int index = -1;
+                Bounds3D bounds(Vector3(inf, inf, inf), Vector3(inf, inf, inf));
+
+                if (child != -1)
+                {
+                    const Bvh::Node& src = binary[child];
+                    bounds = src.bounds;
+
+                    if (src.type == Bvh::kLeaf)
+                    {
+                        numprims = src.numprims;
+                        index = src.startidx;
+                    }
+                    else
+                    {
+                        numprims = 0;
+                        index = (int)m_Nodes.size();
+                        m_Nodes.push_back(Node());
+                        stack.push_back({ child, index });
+                    }
+                }
+
+                // m_Nodes may have grown, so the node is looked up for every lane
+                Node& node = m_Nodes[entry.dst];
+                node.minx[lane] = bounds.min.x;
+                node.miny[lane] = bounds.min.y;
+                node.minz[lane] = bounds.min.z;
+                node.maxx[lane] = bounds.max.x;
+                node.maxy[lane] = bounds.max.y;
+                node.maxz[lane] = bounds.max.z;
+                node.child[lane] = index;
+                node.numprims[lane] = numprims;
+            }
+
+            if (entries)
+            {
+                // Children take their lane, until an internal one is collapsed itself and
+                // overwrites its entry with its own node. Opened nodes are made of the lanes
+                // of their two children, and were opened before them.
+                std::vector<Entry>& table = *entries;
+                int allLanes = 0;
+
+                for (int lane = 0; lane < (int)children.size(); ++lane)
+                {
+                    table[children[lane]] = { entry.dst, 1 << lane };
+                    allLanes |= 1 << lane;
+                }
+
+                for (int i = (int)opened.size() - 1; i >= 0; --i)
+                {
+                    const Bvh::Node& src = binary[opened[i]];
+                    table[opened[i]] = { entry.dst, table[src.lc].lanes | table[src.rc].lanes };
+                }
+
+                table[entry.src] = { entry.dst, allLanes };
+            }
+        }
+    }
+
+    template <int Width>
+    float WideBvh<Width>::GetLaneOccupancy() const
+    {
+        int used = 0;
+        for (const Node& node : m_Nodes)
+        {
+            for (int lane = 0; lane < Width; ++lane) {
+                used += node.numprims[lane] >= 0 ? 1 : 0;
+            }
+        }
+
+        return m_Nodes.empty() ? 0.0f : (float)used / m_Nodes.size();
+    }
+
+    template <int Width>
+    float WideBvh<Width>::GetSahCost(float traversalCost) const
+    {
+        float rootarea = m_Bounds.Area();
+        if (m_Nodes.empty() || rootarea <= 0.0f) {
+            return 0.0f;
+        }
+
+        // The root is visited by every ray, every other node once its lane in the parent is hit
+        float cost = traversalCost * rootarea;
+
+        for (const Node& node : m_Nodes)
+        {
+            for (int lane = 0; lane < Width; ++lane)
+            {
+                if (node.numprims[lane] < 0) {
+                    continue;
+                }
+
+                Bounds3D bounds(Vector3(node.minx[lane], node.miny[lane], node.minz[lane]), Vector3(node.maxx[lane], node.maxy[lane], node.maxz[lane]));
+                cost += bounds.Area() * (node.numprims[lane] > 0 ? node.numprims[lane] : traversalCost);
+            }
+        }
+
+        return cost / rootarea;
+    }
+
+    template class WideBvh<4>;
+    template class WideBvh<8>;
+}
@@ -0,0 +1,209 @@
+/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#pragma once
+
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include <vector>
+#include <algorithm>
+
+#include "Bvh.h"
+#include "math/Bounds3D.h"
+
+#if defined(__AVX__)
+    #include <immintrin.h>
+    #define WIDE_BVH_AVX 1
+    #define WIDE_BVH_SSE 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define WIDE_BVH_SSE 1
+#endif
+
+namespace RadeonRays
+{
+    /// Flattening target for CPU traversal: the binary Bvh collapsed into nodes of up to
+    /// Width children. Child bounds are stored as one float lane per child and axis, so a
+    /// single SIMD slab test checks every child of a node.
+    template <int Width>
+    class WideBvh
+    {
+    public:
+        static_assert(Width == 4 || Width == 8, "WideBvh supports 4 and 8 wide nodes");
+
+        struct Node
+        {
+            // Child bounds, empty lanes hold a box at infinity that no ray hits
+            float minx[Width];
+            float miny[Width];
+            float minz[Width];
+            float maxx[Width];
+            float maxy[Width];
+            float maxz[Width];
+            // Node index of internal children, first entry in the indices of leaves
+            int child[Width];
+            // Primitives of leaf children, 0 for internal children and -1 for empty lanes
+            int numprims[Width];
+        };
+
+        // Where a binary node ended up: the wide node holding its subtree and one bit for every
+        // lane of that node below it
+        struct Entry
+        {
+            int node;
+            int lanes;
+        };
+
+        // Collapses bvh top-down. Every node starts from the two children of a binary node and
+        // keeps opening its largest internal child, which removes the biggest traversal term
+        // from the SAH, until all lanes are used. Leaves are kept as they are. When entries is
+        // given it receives the Entry of every binary node, indexed like its arena.
+        void Build(const Bvh& bvh, std::vector<Entry>* entries = nullptr);
+
+        // Slab tests the ray against every child of node. Returns a mask with one bit per lane
+        // hit within [0, tmax] and writes the entry distances of all lanes to tnear.
+        static int IntersectChildren(const Node& node, const Vector3& origin, const Vector3& invDir, float tmax, float* tnear);
+
+        const Node* GetNodes() const
+        {
+            return &m_Nodes[0];
+        }
+
+        int GetNumNodes() const
+        {
+            return (int)m_Nodes.size();
+        }
+
+        // Same primitive indices as the binary tree
+        const int* GetIndices() const
+        {
+            return &m_Indices[0];
+        }
+
+        size_t GetNumIndices() const
+        {
+            return m_Indices.size();
+        }
+
+        const Bounds3D& Bounds() const
+        {
+            return m_Bounds;
+        }
+
+        // Bytes used by the nodes and the primitive indices
+        size_t GetMemorySize() const
+        {
+            return m_Nodes.size() * sizeof(Node) + m_Indices.size() * sizeof(int);
+        }
+
+        // Average number of used lanes per node
+        float GetLaneOccupancy() const;
+
+        // SAH cost relative to the root area, traversalCost is paid once per wide node
+        float GetSahCost(float traversalCost) const;
+
+    private:
+        std::vector<Node> m_Nodes;
+        std::vector<int> m_Indices;
+        Bounds3D m_Bounds;
+    };
+
+    typedef WideBvh<4> Bvh4;
+    typedef WideBvh<8> Bvh8;
+
+    template <int Width>
+    inline int WideBvh<Width>::IntersectChildren(const Node& node, const Vector3& origin, const Vector3& invDir, float tmax, float* tnear)
+    {
+        int mask = 0;
+
+#if WIDE_BVH_AVX
+        if (Width == 8)
+        {
+            __m256 ox = _mm256_set1_ps(origin.x);
+            __m256 oy = _mm256_set1_ps(origin.y);
+            __m256 oz = _mm256_set1_ps(origin.z);
+            __m256 ix = _mm256_set1_ps(invDir.x);
+            __m256 iy = _mm256_set1_ps(invDir.y);
+            __m256 iz = _mm256_set1_ps(invDir.z);
+
+            __m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.minx), ox), ix);
+            __m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.maxx), ox), ix);
+            __m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.miny), oy), iy);
+            __m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.maxy), oy), iy);
+            __m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.minz), oz), iz);
+            __m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.maxz), oz), iz);
+
+            __m256 tmin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)), _mm256_max_ps(_mm256_min_ps(t0z, t1z), _mm256_setzero_ps()));
+            __m256 tfar = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)), _mm256_min_ps(_mm256_max_ps(t0z, t1z), _mm256_set1_ps(tmax)));
+
+            _mm256_storeu_ps(tnear, tmin);
+            return _mm256_movemask_ps(_mm256_cmp_ps(tmin, tfar, _CMP_LE_OQ));
+        }
+#endif
+
+#if WIDE_BVH_SSE
+        __m128 ox = _mm_set1_ps(origin.x);
+        __m128 oy = _mm_set1_ps(origin.y);
+        __m128 oz = _mm_set1_ps(origin.z);
+        __m128 ix = _mm_set1_ps(invDir.x);
+        __m128 iy = _mm_set1_ps(invDir.y);
+        __m128 iz = _mm_set1_ps(invDir.z);
+
+        for (int lane = 0; lane < Width; lane += 4)
+        {
+            __m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minx + lane), ox), ix);
+            __m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxx + lane), ox), ix);
+            __m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.miny + lane), oy), iy);
+            __m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxy + lane), oy), iy);
+            __m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minz + lane), oz), iz);
+            __m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxz + lane), oz), iz);
+
+            __m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)), _mm_max_ps(_mm_min_ps(t0z, t1z), _mm_setzero_ps()));
+            __m128 tfar = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)), _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_set1_ps(tmax)));
+
+            _mm_storeu_ps(tnear + lane, tmin);
+            mask |= _mm_movemask_ps(_mm_cmple_ps(tmin, tfar)) << lane;
+        }
+#else
+        for (int lane = 0; lane < Width; ++lane)
+        {
+            float t0x = (node.minx[lane] - origin.x) * invDir.x;
+            float t1x = (node.maxx[lane] - origin.x) * invDir.x;
+            float t0y = (node.miny[lane] - origin.y) * invDir.y;
+            float t1y = (node.maxy[lane] - origin.y) * invDir.y;
+            float t0z = (node.minz[lane] - origin.z) * invDir.z;
+            float t1z = (node.maxz[lane] - origin.z) * invDir.z;
+
+            float tmin = std::max(std::max(std::min(t0x, t1x), std::min(t0y, t1y)), std::max(std::min(t0z, t1z), 0.0f));
+            float tfar = std::min(std::min(std::max(t0x, t1x), std::max(t0y, t1y)), std::min(std::max(t0z, t1z), tmax));
+
+            tnear[lane] = tmin;
+            mask |= (tmin <= tfar ? 1 : 0) << lane;
+        }
+#endif
+
+        return mask;
+    }
+}
+
+#endif // WIDE_BVH_H
@@ -0,0 +1,1173 @@
+#include <math.h>
+#include <algorithm>
+
+#include <atomic>
+
+#include "BvhTraverser.h"
+#include "Scene.h"
+#include "job/TaskGroup.h"
+
+#if defined(__AVX__)
+	#include <immintrin.h>
+	#define BVH_TRAVERSER_AVX 1
+	#define BVH_TRAVERSER_SSE 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define BVH_TRAVERSER_SSE 1
+#endif
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+#endif
+
+namespace GLSLPT
+{
+	namespace
+	{
+		// The shaders keep 64 entries, deep trees of the linear builders can need more
+		const int kStackSize = 128;
+
+		// A quantized node pops one entry and pushes up to four
+		const int kWideStackSize = 3 * kStackSize;
+
+		// Queries per task of the top level walk, and per task and packet of the instance passes
+		const int kBatchChunkSize = 1024;
+		const int kBatchGrain = 256;
+		const int kBatchPacketSize = 8;
+
+		inline int PopCount(uint32 v)
+		{
+#if defined(_MSC_VER)
+			return (int)__popcnt(v);
+#else
+			return __builtin_popcount(v);
+#endif
+		}
+
+		inline int LowestLane(uint32 v)
+		{
+#if defined(_MSC_VER)
+			unsigned long index;
+			_BitScanForward(&index, v);
+			return (int)index;
+#else
+			return __builtin_ctz(v);
+#endif
+		}
+
+		inline Vector3 TransformPoint(const Matrix4x4& m, const Vector3& p)
+		{
+			return Vector3(
+				p.x * m.m[0][0] + p.y * m.m[1][0] + p.z * m.m[2][0] + m.m[3][0],
+				p.x * m.m[0][1] + p.y * m.m[1][1] + p.z * m.m[2][1] + m.m[3][1],
+				p.x * m.m[0][2] + p.y * m.m[1][2] + p.z * m.m[2][2] + m.m[3][2]
+			);
+		}
+
+		inline Vector3 TransformDirection(const Matrix4x4& m, const Vector3& d)
+		{
+			return Vector3(
+				d.x * m.m[0][0] + d.y * m.m[1][0] + d.z * m.m[2][0],
+				d.x * m.m[0][1] + d.y * m.m[1][1] + d.z * m.m[2][1],
+				d.x * m.m[0][2] + d.y * m.m[1][2] + d.z * m.m[2][2]
+			);
+		}
+
+		inline Vector3 XYZ(const Vector4& v)
+		{
+			return Vector3(v.x, v.y, v.z);
+		}
+
+		// Slab test clipped to [0, tmax]. Unlike AABBIntersect of the shaders a box that holds
+		// the origin enters at 0, so culling against the closest hit keeps it.
+		inline bool IntersectBox(const Vector3& bmin, const Vector3& bmax, const Vector3& origin, const Vector3& invDir, float tmax, float& tnear)
+		{
+			Vector3 t0 = (bmin - origin) * invDir;
+			Vector3 t1 = (bmax - origin) * invDir;
+
+			tnear = std::max(std::max(std::min(t0.x, t1.x), std::min(t0.y, t1.y)), std::max(std::min(t0.z, t1.z), 0.0f));
+			float tfar = std::min(std::min(std::max(t0.x, t1.x), std::max(t0.y, t1.y)), std::min(std::max(t0.z, t1.z), tmax));
+
+			return tnear <= tfar;
+		}
+
+		// Moller-Trumbore as in the shaders, u and v weight the second and third vertex
+		inline bool IntersectTriangle(const Vector3& v0, const Vector3& e0, const Vector3& e1, const Vector3& origin, const Vector3& direction, float tmax, float& t, float& u, float& v)
+		{
+			Vector3 pv = Vector3::CrossProduct(direction, e1);
+			float det  = Vector3::DotProduct(e0, pv);
+
+			Vector3 tv = origin - v0;
+			Vector3 qv = Vector3::CrossProduct(tv, e0);
+
+			u = Vector3::DotProduct(tv, pv) / det;
+			v = Vector3::DotProduct(direction, qv) / det;
+			t = Vector3::DotProduct(e1, qv) / det;
+
+			return u >= 0.0f && v >= 0.0f && 1.0f - u - v >= 0.0f && t >= 0.0f && t < tmax;
+		}
+
+		// Lanes of mask whose triangle in block the ray hits below tmax. Divides by the determinant
+		// like the single triangle test, so both layouts find the same hits.
+		inline uint32 IntersectTriangles(const TriangleBlock& b, const Vector3& origin, const Vector3& direction, float tmax, uint32 mask, float* t, float* u, float* v)
+		{
+#if BVH_TRAVERSER_SSE
+			__m128 dx = _mm_set1_ps(direction.x);
+			__m128 dy = _mm_set1_ps(direction.y);
+			__m128 dz = _mm_set1_ps(direction.z);
+
+			__m128 e0x = _mm_loadu_ps(b.e0x);
+			__m128 e0y = _mm_loadu_ps(b.e0y);
+			__m128 e0z = _mm_loadu_ps(b.e0z);
+			__m128 e1x = _mm_loadu_ps(b.e1x);
+			__m128 e1y = _mm_loadu_ps(b.e1y);
+			__m128 e1z = _mm_loadu_ps(b.e1z);
+
+			// pv = cross(direction, e1)
+			__m128 pvx = _mm_sub_ps(_mm_mul_ps(dy, e1z), _mm_mul_ps(dz, e1y));
+			__m128 pvy = _mm_sub_ps(_mm_mul_ps(dz, e1x), _mm_mul_ps(dx, e1z));
+			__m128 pvz = _mm_sub_ps(_mm_mul_ps(dx, e1y), _mm_mul_ps(dy, e1x));
+
+			__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0x, pvx), _mm_mul_ps(e0y, pvy)), _mm_mul_ps(e0z, pvz));
+
+			__m128 tvx = _mm_sub_ps(_mm_set1_ps(origin.x), _mm_loadu_ps(b.v0x));
+			__m128 tvy = _mm_sub_ps(_mm_set1_ps(origin.y), _mm_loadu_ps(b.v0y));
+			__m128 tvz = _mm_sub_ps(_mm_set1_ps(origin.z), _mm_loadu_ps(b.v0z));
+
+			// qv = cross(tv, e0)
+			__m128 qvx = _mm_sub_ps(_mm_mul_ps(tvy, e0z), _mm_mul_ps(tvz, e0y));
+			__m128 qvy = _mm_sub_ps(_mm_mul_ps(tvz, e0x), _mm_mul_ps(tvx, e0z));
+			__m128 qvz = _mm_sub_ps(_mm_mul_ps(tvx, e0y), _mm_mul_ps(tvy, e0x));
+
+			__m128 uu = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tvx, pvx), _mm_mul_ps(tvy, pvy)), _mm_mul_ps(tvz, pvz)), det);
+			__m128 vv = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qvx), _mm_mul_ps(dy, qvy)), _mm_mul_ps(dz, qvz)), det);
+			__m128 tt = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, qvx), _mm_mul_ps(e1y, qvy)), _mm_mul_ps(e1z, qvz)), det);
+
+			__m128 zero = _mm_setzero_ps();
+			__m128 inside = _mm_and_ps(_mm_cmpge_ps(uu, zero), _mm_cmpge_ps(vv, zero));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_sub_ps(_mm_sub_ps(_mm_set1_ps(1.0f), uu), vv), zero));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(tt, zero));
+			inside = _mm_and_ps(inside, _mm_cmplt_ps(tt, _mm_set1_ps(tmax)));
+
+			_mm_storeu_ps(t, tt);
+			_mm_storeu_ps(u, uu);
+			_mm_storeu_ps(v, vv);
+
+			return (uint32)_mm_movemask_ps(inside) & mask;
+#else
+			uint32 hits = 0;
+			for (uint32 bits = mask; bits != 0; bits &= bits - 1)
+			{
+				int lane = LowestLane(bits);
+
+				Vector3 v0(b.v0x[lane], b.v0y[lane], b.v0z[lane]);
+				Vector3 e0(b.e0x[lane], b.e0y[lane], b.e0z[lane]);
+				Vector3 e1(b.e1x[lane], b.e1y[lane], b.e1z[lane]);
+				if (IntersectTriangle(v0, e0, e1, origin, direction, tmax, t[lane], u[lane], v[lane])) {
+					hits |= 1u << lane;
+				}
+			}
+
+			return hits;
+#endif
+		}
+
+		// Lanes of mask whose ray enters the box below its tmax, nearest gets the smallest entry distance among them
+		template <int Size, class Frame>
+		uint32 IntersectBox(const Frame& f, const float* tmax, const Vector3& bmin, const Vector3& bmax, uint32 mask, float& nearest)
+		{
+			float tnear[Size];
+			uint32 hits = 0;
+			int lane = 0;
+
+#if BVH_TRAVERSER_AVX
+			for (; lane + 8 <= Size; lane += 8)
+			{
+				if (((mask >> lane) & 0xff) == 0) {
+					continue;
+				}
+
+				__m256 ix = _mm256_loadu_ps(f.ix + lane);
+				__m256 iy = _mm256_loadu_ps(f.iy + lane);
+				__m256 iz = _mm256_loadu_ps(f.iz + lane);
+
+				__m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bmin.x), _mm256_loadu_ps(f.ox + lane)), ix);
+				__m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bmax.x), _mm256_loadu_ps(f.ox + lane)), ix);
+				__m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bmin.y), _mm256_loadu_ps(f.oy + lane)), iy);
+				__m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bmax.y), _mm256_loadu_ps(f.oy + lane)), iy);
+				__m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bmin.z), _mm256_loadu_ps(f.oz + lane)), iz);
+				__m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bmax.z), _mm256_loadu_ps(f.oz + lane)), iz);
+
+				__m256 tmin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)), _mm256_max_ps(_mm256_min_ps(t0z, t1z), _mm256_setzero_ps()));
+				__m256 tfar = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)), _mm256_min_ps(_mm256_max_ps(t0z, t1z), _mm256_loadu_ps(tmax + lane)));
+
+				_mm256_storeu_ps(tnear + lane, tmin);
+				hits |= (uint32)_mm256_movemask_ps(_mm256_cmp_ps(tmin, tfar, _CMP_LE_OQ)) << lane;
+			}
+#endif
+
+#if BVH_TRAVERSER_SSE
+			for (; lane + 4 <= Size; lane += 4)
+			{
+				if (((mask >> lane) & 0xf) == 0) {
+					continue;
+				}
+
+				__m128 ix = _mm_loadu_ps(f.ix + lane);
+				__m128 iy = _mm_loadu_ps(f.iy + lane);
+				__m128 iz = _mm_loadu_ps(f.iz + lane);
+
+				__m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmin.x), _mm_loadu_ps(f.ox + lane)), ix);
+				__m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmax.x), _mm_loadu_ps(f.ox + lane)), ix);
+				__m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmin.y), _mm_loadu_ps(f.oy + lane)), iy);
+				__m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmax.y), _mm_loadu_ps(f.oy + lane)), iy);
+				__m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmin.z), _mm_loadu_ps(f.oz + lane)), iz);
+				__m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmax.z), _mm_loadu_ps(f.oz + lane)), iz);
+
+				__m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)), _mm_max_ps(_mm_min_ps(t0z, t1z), _mm_setzero_ps()));
+				__m128 tfar = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)), _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_loadu_ps(tmax + lane)));
+
+				_mm_storeu_ps(tnear + lane, tmin);
+				hits |= (uint32)_mm_movemask_ps(_mm_cmple_ps(tmin, tfar)) << lane;
+			}
+#endif
+
+			for (; lane < Size; ++lane)
+			{
+				if ((mask & (1u << lane)) == 0) {
+					continue;
+				}
+
+				Vector3 origin(f.ox[lane], f.oy[lane], f.oz[lane]);
+				Vector3 invDir(f.ix[lane], f.iy[lane], f.iz[lane]);
+				if (IntersectBox(bmin, bmax, origin, invDir, tmax[lane], tnear[lane])) {
+					hits |= 1u << lane;
+				}
+			}
+
+			hits &= mask;
+
+			nearest = 1e30f;
+			for (uint32 bits = hits; bits != 0; bits &= bits - 1) {
+				nearest = std::min(nearest, tnear[LowestLane(bits)]);
+			}
+
+			return hits;
+		}
+
+		// Lanes of mask that hit the triangle below their tmax, with the distance and barycentrics of the hit
+		template <int Size, class Frame>
+		uint32 IntersectTriangle(const Frame& f, const float* tmax, const Vector3& v0, const Vector3& e0, const Vector3& e1, uint32 mask, float* t, float* u, float* v)
+		{
+			uint32 hits = 0;
+			int lane = 0;
+
+#if BVH_TRAVERSER_AVX
+			for (; lane + 8 <= Size; lane += 8)
+			{
+				if (((mask >> lane) & 0xff) == 0) {
+					continue;
+				}
+
+				__m256 dx = _mm256_loadu_ps(f.dx + lane);
+				__m256 dy = _mm256_loadu_ps(f.dy + lane);
+				__m256 dz = _mm256_loadu_ps(f.dz + lane);
+
+				// pv = cross(direction, e1)
+				__m256 pvx = _mm256_sub_ps(_mm256_mul_ps(dy, _mm256_set1_ps(e1.z)), _mm256_mul_ps(dz, _mm256_set1_ps(e1.y)));
+				__m256 pvy = _mm256_sub_ps(_mm256_mul_ps(dz, _mm256_set1_ps(e1.x)), _mm256_mul_ps(dx, _mm256_set1_ps(e1.z)));
+				__m256 pvz = _mm256_sub_ps(_mm256_mul_ps(dx, _mm256_set1_ps(e1.y)), _mm256_mul_ps(dy, _mm256_set1_ps(e1.x)));
+
+				__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(e0.x), pvx), _mm256_mul_ps(_mm256_set1_ps(e0.y), pvy)), _mm256_mul_ps(_mm256_set1_ps(e0.z), pvz));
+				__m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+
+				__m256 tvx = _mm256_sub_ps(_mm256_loadu_ps(f.ox + lane), _mm256_set1_ps(v0.x));
+				__m256 tvy = _mm256_sub_ps(_mm256_loadu_ps(f.oy + lane), _mm256_set1_ps(v0.y));
+				__m256 tvz = _mm256_sub_ps(_mm256_loadu_ps(f.oz + lane), _mm256_set1_ps(v0.z));
+
+				// qv = cross(tv, e0)
+				__m256 qvx = _mm256_sub_ps(_mm256_mul_ps(tvy, _mm256_set1_ps(e0.z)), _mm256_mul_ps(tvz, _mm256_set1_ps(e0.y)));
+				__m256 qvy = _mm256_sub_ps(_mm256_mul_ps(tvz, _mm256_set1_ps(e0.x)), _mm256_mul_ps(tvx, _mm256_set1_ps(e0.z)));
+				__m256 qvz = _mm256_sub_ps(_mm256_mul_ps(tvx, _mm256_set1_ps(e0.y)), _mm256_mul_ps(tvy, _mm256_set1_ps(e0.x)));
+
+				__m256 uu = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tvx, pvx), _mm256_mul_ps(tvy, pvy)), _mm256_mul_ps(tvz, pvz)), invDet);
+				__m256 vv = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qvx), _mm256_mul_ps(dy, qvy)), _mm256_mul_ps(dz, qvz)), invDet);
+				__m256 tt = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(e1.x), qvx), _mm256_mul_ps(_mm256_set1_ps(e1.y), qvy)), _mm256_mul_ps(_mm256_set1_ps(e1.z), qvz)), invDet);
+
+				__m256 zero = _mm256_setzero_ps();
+				__m256 inside = _mm256_and_ps(_mm256_cmp_ps(uu, zero, _CMP_GE_OQ), _mm256_cmp_ps(vv, zero, _CMP_GE_OQ));
+				inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(uu, vv), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+				inside = _mm256_and_ps(inside, _mm256_cmp_ps(tt, zero, _CMP_GE_OQ));
+				inside = _mm256_and_ps(inside, _mm256_cmp_ps(tt, _mm256_loadu_ps(tmax + lane), _CMP_LT_OQ));
+
+				_mm256_storeu_ps(t + lane, tt);
+				_mm256_storeu_ps(u + lane, uu);
+				_mm256_storeu_ps(v + lane, vv);
+				hits |= (uint32)_mm256_movemask_ps(inside) << lane;
+			}
+#endif
+
+#if BVH_TRAVERSER_SSE
+			for (; lane + 4 <= Size; lane += 4)
+			{
+				if (((mask >> lane) & 0xf) == 0) {
+					continue;
+				}
+
+				__m128 dx = _mm_loadu_ps(f.dx + lane);
+				__m128 dy = _mm_loadu_ps(f.dy + lane);
+				__m128 dz = _mm_loadu_ps(f.dz + lane);
+
+				// pv = cross(direction, e1)
+				__m128 pvx = _mm_sub_ps(_mm_mul_ps(dy, _mm_set1_ps(e1.z)), _mm_mul_ps(dz, _mm_set1_ps(e1.y)));
+				__m128 pvy = _mm_sub_ps(_mm_mul_ps(dz, _mm_set1_ps(e1.x)), _mm_mul_ps(dx, _mm_set1_ps(e1.z)));
+				__m128 pvz = _mm_sub_ps(_mm_mul_ps(dx, _mm_set1_ps(e1.y)), _mm_mul_ps(dy, _mm_set1_ps(e1.x)));
+
+				__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(e0.x), pvx), _mm_mul_ps(_mm_set1_ps(e0.y), pvy)), _mm_mul_ps(_mm_set1_ps(e0.z), pvz));
+				__m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+				__m128 tvx = _mm_sub_ps(_mm_loadu_ps(f.ox + lane), _mm_set1_ps(v0.x));
+				__m128 tvy = _mm_sub_ps(_mm_loadu_ps(f.oy + lane), _mm_set1_ps(v0.y));
+				__m128 tvz = _mm_sub_ps(_mm_loadu_ps(f.oz + lane), _mm_set1_ps(v0.z));
+
+				// qv = cross(tv, e0)
+				__m128 qvx = _mm_sub_ps(_mm_mul_ps(tvy, _mm_set1_ps(e0.z)), _mm_mul_ps(tvz, _mm_set1_ps(e0.y)));
+				__m128 qvy = _mm_sub_ps(_mm_mul_ps(tvz, _mm_set1_ps(e0.x)), _mm_mul_ps(tvx, _mm_set1_ps(e0.z)));
+				__m128 qvz = _mm_sub_ps(_mm_mul_ps(tvx, _mm_set1_ps(e0.y)), _mm_mul_ps(tvy, _mm_set1_ps(e0.x)));
+
+				__m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tvx, pvx), _mm_mul_ps(tvy, pvy)), _mm_mul_ps(tvz, pvz)), invDet);
+				__m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qvx), _mm_mul_ps(dy, qvy)), _mm_mul_ps(dz, qvz)), invDet);
+				__m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(e1.x), qvx), _mm_mul_ps(_mm_set1_ps(e1.y), qvy)), _mm_mul_ps(_mm_set1_ps(e1.z), qvz)), invDet);
+
+				__m128 zero = _mm_setzero_ps();
+				__m128 inside = _mm_and_ps(_mm_cmpge_ps(uu, zero), _mm_cmpge_ps(vv, zero));
+				inside = _mm_and_ps(inside, _mm_cmple_ps(_mm_add_ps(uu, vv), _mm_set1_ps(1.0f)));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(tt, zero));
+				inside = _mm_and_ps(inside, _mm_cmplt_ps(tt, _mm_loadu_ps(tmax + lane)));
+
+				_mm_storeu_ps(t + lane, tt);
+				_mm_storeu_ps(u + lane, uu);
+				_mm_storeu_ps(v + lane, vv);
+				hits |= (uint32)_mm_movemask_ps(inside) << lane;
+			}
+#endif
+
+			for (; lane < Size; ++lane)
+			{
+				if ((mask & (1u << lane)) == 0) {
+					continue;
+				}
+
+				Vector3 origin(f.ox[lane], f.oy[lane], f.oz[lane]);
+				Vector3 direction(f.dx[lane], f.dy[lane], f.dz[lane]);
+				if (IntersectTriangle(v0, e0, e1, origin, direction, tmax[lane], t[lane], u[lane], v[lane])) {
+					hits |= 1u << lane;
+				}
+			}
+
+			return hits & mask;
+		}
+
+		// Lanes of mask whose tmax reaches dist
+		template <int Size>
+		uint32 LanesReaching(const float* tmax, float dist, uint32 mask)
+		{
+			uint32 lanes = 0;
+			for (uint32 bits = mask; bits != 0; bits &= bits - 1)
+			{
+				int lane = LowestLane(bits);
+				if (tmax[lane] >= dist) {
+					lanes |= 1u << lane;
+				}
+			}
+
+			return lanes;
+		}
+	}
+
+	// Rays of a packet in the space of the BVH being traversed, world space in the top level
+	// and instance space below an instance leaf
+	template <int Size>
+	struct BvhTraverser::Frame
+	{
+		float ox[Size], oy[Size], oz[Size];
+		float dx[Size], dy[Size], dz[Size];
+		float ix[Size], iy[Size], iz[Size];
+
+		Frame(const RayPacket<Size>& packet, const Matrix4x4* transform)
+		{
+			for (int lane = 0; lane < Size; ++lane)
+			{
+				// Lanes without a ray are never tested, zeros keep them from reading uninitialized floats
+				Vector3 origin(0.0f, 0.0f, 0.0f);
+				Vector3 direction(0.0f, 0.0f, 0.0f);
+
+				if (packet.active & (1u << lane))
+				{
+					origin    = Vector3(packet.ox[lane], packet.oy[lane], packet.oz[lane]);
+					direction = Vector3(packet.dx[lane], packet.dy[lane], packet.dz[lane]);
+				}
+
+				if (transform)
+				{
+					origin    = TransformPoint(*transform, origin);
+					direction = TransformDirection(*transform, direction);
+				}
+
+				ox[lane] = origin.x;
+				oy[lane] = origin.y;
+				oz[lane] = origin.z;
+				dx[lane] = direction.x;
+				dy[lane] = direction.y;
+				dz[lane] = direction.z;
+				ix[lane] = 1.0f / direction.x;
+				iy[lane] = 1.0f / direction.y;
+				iz[lane] = 1.0f / direction.z;
+			}
+		}
+	};
+
+	BvhTraverser::BvhTraverser(const Scene* scene)
+		: scene(scene)
+		, fallbackLanes(1)
+	{
+
+	}
+
+	void BvhTraverser::UpdateTransforms()
+	{
+		inverseTransforms.resize(scene->transforms.size());
+
+		for (int i = 0; i < scene->transforms.size(); ++i) {
+			inverseTransforms[i] = scene->transforms[i].Inverse();
+		}
+	}
+
+	void BvhTraverser::UpdateTriangleBlocks()
+	{
+		// Compressed leaves test the indexed triangles
+		if (!scene->compressedBvhTranslator.nodes.empty())
+		{
+			ClearTriangleBlocks();
+			return;
+		}
+
+		scene->CreateTriangleBlocks(triangleBlocks, leafBlocks);
+	}
+
+	void BvhTraverser::ClearTriangleBlocks()
+	{
+		std::vector<TriangleBlock>().swap(triangleBlocks);
+		std::vector<int>().swap(leafBlocks);
+	}
+
+	bool BvhTraverser::Intersect(const Vector3& origin, const Vector3& direction, float tmax, Hit& hit) const
+	{
+		if (!scene->compressedBvhTranslator.nodes.empty()) {
+			return TraceCompressed<false>(scene->compressedBvhTranslator.topLevelIndex, 0xF, -1, 0, origin, direction, tmax, hit);
+		}
+
+		return TraceSingle<false>(scene->bvhTranslator.topLevelIndex, -1, 0, origin, direction, tmax, hit);
+	}
+
+	bool BvhTraverser::Occluded(const Vector3& origin, const Vector3& direction, float tmax) const
+	{
+		Hit hit;
+		if (!scene->compressedBvhTranslator.nodes.empty()) {
+			return TraceCompressed<true>(scene->compressedBvhTranslator.topLevelIndex, 0xF, -1, 0, origin, direction, tmax, hit);
+		}
+
+		return TraceSingle<true>(scene->bvhTranslator.topLevelIndex, -1, 0, origin, direction, tmax, hit);
+	}
+
+	template <int Size>
+	void BvhTraverser::Intersect(RayPacket<Size>& packet) const
+	{
+		uint32 occluded = 0;
+		if (!scene->compressedBvhTranslator.nodes.empty())
+		{
+			TraceLanes<Size, false>(packet, scene->compressedBvhTranslator.topLevelIndex, -1, 0, packet.active, occluded);
+			return;
+		}
+
+		Frame<Size> frame(packet, nullptr);
+
+		TracePacket<Size, false>(packet, frame, scene->bvhTranslator.topLevelIndex, -1, 0, packet.active, occluded);
+	}
+
+	template <int Size>
+	uint32 BvhTraverser::Occluded(RayPacket<Size>& packet) const
+	{
+		uint32 occluded = 0;
+		if (!scene->compressedBvhTranslator.nodes.empty())
+		{
+			TraceLanes<Size, true>(packet, scene->compressedBvhTranslator.topLevelIndex, -1, 0, packet.active, occluded);
+			return occluded;
+		}
+
+		Frame<Size> frame(packet, nullptr);
+
+		TracePacket<Size, true>(packet, frame, scene->bvhTranslator.topLevelIndex, -1, 0, packet.active, occluded);
+
+		return occluded;
+	}
+
+	void BvhTraverser::Occluded(OcclusionBatch& batch, TaskThreadPool* pool) const
+	{
+		const RadeonRays::BvhTranslator& translator = scene->bvhTranslator;
+
+		int numQueries   = batch.GetSize();
+		int numChunks    = (numQueries + kBatchChunkSize - 1) / kBatchChunkSize;
+
+		// Compressed scenes trace every query on its own, chunks cover whole words of the result
+		if (!scene->compressedBvhTranslator.nodes.empty())
+		{
+			batch.entryOffsets.clear();
+			batch.entryQueries.clear();
+			batch.occluded.assign((numQueries + 31) / 32, 0);
+
+			TaskGroup::ParallelFor(pool, numChunks, 1, [&](int32 begin, int32 end)
+			{
+				for (int c = begin; c < end; ++c)
+				{
+					int last = std::min(numQueries, (c + 1) * kBatchChunkSize);
+
+					for (int query = c * kBatchChunkSize; query < last; ++query)
+					{
+						if (Occluded(batch.origins[query], batch.directions[query], batch.tmax[query])) {
+							batch.occluded[query >> 5] |= 1u << (query & 31);
+						}
+					}
+				}
+			});
+			return;
+		}
+
+		// Top level leaves every query reaches, kept per chunk of queries
+		struct Chunk
+		{
+			std::vector<int> queries;
+			std::vector<int> leaves;
+		};
+		std::vector<Chunk> chunks(numChunks);
+
+		TaskGroup::ParallelFor(pool, numChunks, 1, [&](int32 begin, int32 end)
+		{
+			for (int c = begin; c < end; ++c)
+			{
+				Chunk& chunk = chunks[c];
+				int last = std::min(numQueries, (c + 1) * kBatchChunkSize);
+
+				for (int query = c * kBatchChunkSize; query < last; ++query)
+				{
+					CollectInstances(batch.origins[query], batch.directions[query], batch.tmax[query], chunk.leaves);
+					chunk.queries.resize(chunk.leaves.size(), query);
+				}
+			}
+		});
+
+		// Counting sort of the queries by the top level leaf they enter. With rebraiding an
+		// instance has a leaf for every mesh BVH subtree it was opened into.
+		int numTopLevelNodes = (int)translator.nodes.size() - translator.topLevelIndex;
+
+		batch.entryOffsets.assign(numTopLevelNodes + 1, 0);
+		for (int c = 0; c < numChunks; ++c)
+		{
+			for (int leaf : chunks[c].leaves) {
+				batch.entryOffsets[leaf - translator.topLevelIndex + 1]++;
+			}
+		}
+		for (int i = 0; i < numTopLevelNodes; ++i) {
+			batch.entryOffsets[i + 1] += batch.entryOffsets[i];
+		}
+
+		std::vector<int> cursors(batch.entryOffsets.begin(), batch.entryOffsets.end() - 1);
+		batch.entryQueries.resize(batch.entryOffsets[numTopLevelNodes]);
+		for (int c = 0; c < numChunks; ++c)
+		{
+			const Chunk& chunk = chunks[c];
+			for (int i = 0; i < chunk.leaves.size(); ++i) {
+				batch.entryQueries[cursors[chunk.leaves[i] - translator.topLevelIndex]++] = chunk.queries[i];
+			}
+		}
+
+		// Ranges of at most kBatchGrain queries of one leaf
+		struct Range
+		{
+			int leaf;
+			int begin;
+			int end;
+		};
+		std::vector<Range> ranges;
+		for (int i = 0; i < numTopLevelNodes; ++i)
+		{
+			for (int first = batch.entryOffsets[i]; first < batch.entryOffsets[i + 1]; first += kBatchGrain)
+			{
+				Range range = { translator.topLevelIndex + i, first, std::min(first + kBatchGrain, batch.entryOffsets[i + 1]) };
+				ranges.push_back(range);
+			}
+		}
+
+		// A query can enter several leaves whose ranges run at the same time
+		std::vector<std::atomic<uint32>> occluded((numQueries + 31) / 32);
+
+		TaskGroup::ParallelFor(pool, (int)ranges.size(), 1, [&](int32 begin, int32 end)
+		{
+			for (int r = begin; r < end; ++r)
+			{
+				const Range& range = ranges[r];
+				const RadeonRays::BvhTranslator::Node& node = translator.nodes[range.leaf];
+				int instance = -node.leaf - 1;
+
+				for (int first = range.begin; first < range.end; first += kBatchPacketSize)
+				{
+					RayPacket<kBatchPacketSize> packet;
+					int queries[kBatchPacketSize];
+
+					int numLanes = std::min(kBatchPacketSize, range.end - first);
+					for (int lane = 0; lane < numLanes; ++lane)
+					{
+						int query = batch.entryQueries[first + lane];
+						queries[lane] = query;
+
+						// Blocked in a leaf traced before
+						if ((occluded[query >> 5].load(std::memory_order_relaxed) >> (query & 31)) & 1) {
+							continue;
+						}
+						packet.SetRay(lane, batch.origins[query], batch.directions[query], batch.tmax[query]);
+					}
+
+					if (packet.active == 0) {
+						continue;
+					}
+
+					uint32 hits = 0;
+					Frame<kBatchPacketSize> local(packet, &inverseTransforms[instance]);
+					TracePacket<kBatchPacketSize, true>(packet, local, node.leftIndex, instance, node.rightIndex, packet.active, hits);
+
+					for (; hits != 0; hits &= hits - 1)
+					{
+						int query = queries[LowestLane(hits)];
+						occluded[query >> 5].fetch_or(1u << (query & 31), std::memory_order_relaxed);
+					}
+				}
+			}
+		});
+
+		batch.occluded.resize(occluded.size());
+		for (int i = 0; i < occluded.size(); ++i) {
+			batch.occluded[i] = occluded[i].load(std::memory_order_relaxed);
+		}
+	}
+
+	void BvhTraverser::CollectInstances(const Vector3& origin, const Vector3& direction, float tmax, std::vector<int>& leaves) const
+	{
+		const RadeonRays::BvhTranslator& translator = scene->bvhTranslator;
+
+		Vector3 invDir = Vector3(1.0f) / direction;
+
+		int stack[kStackSize];
+		int ptr = 0;
+		stack[ptr++] = -1;
+
+		int idx = translator.topLevelIndex;
+		while (idx > -1)
+		{
+			const RadeonRays::BvhTranslator::Node& node = translator.nodes[idx];
+
+			if (node.leaf < 0)
+			{
+				leaves.push_back(idx);
+			}
+			else
+			{
+				int lc = node.leftIndex;
+				int rc = node.rightIndex;
+
+				float leftNear, rightNear;
+				bool leftHit  = IntersectBox(translator.bboxmin[lc], translator.bboxmax[lc], origin, invDir, tmax, leftNear);
+				bool rightHit = IntersectBox(translator.bboxmin[rc], translator.bboxmax[rc], origin, invDir, tmax, rightNear);
+
+				if (leftHit && rightHit)
+				{
+					idx = lc;
+					stack[ptr++] = rc;
+					continue;
+				}
+				else if (leftHit)
+				{
+					idx = lc;
+					continue;
+				}
+				else if (rightHit)
+				{
+					idx = rc;
+					continue;
+				}
+			}
+			idx = stack[--ptr];
+		}
+	}
+
+	template <bool AnyHit>
+	bool BvhTraverser::IntersectLeaf(int leaf, int instance, int matID, const Vector3& origin, const Vector3& direction, float& tmax, Hit& hit) const
+	{
+		const RadeonRays::BvhTranslator::Node& node = scene->bvhTranslator.nodes[leaf];
+		int first = node.leftIndex;
+		int count = node.rightIndex;
+
+		bool found = false;
+
+		if (!triangleBlocks.empty())
+		{
+			const TriangleBlock* blocks = &triangleBlocks[leafBlocks[leaf]];
+			for (int i = 0; i < count; i += 4)
+			{
+				// Lanes of the last block past the leaf are padding
+				uint32 lanes = count - i >= 4 ? 0xF : (1u << (count - i)) - 1;
+
+				float t[4], u[4], v[4];
+				uint32 hits = IntersectTriangles(blocks[i / 4], origin, direction, tmax, lanes, t, u, v);
+
+				if (AnyHit && hits != 0) {
+					return true;
+				}
+
+				for (; hits != 0; hits &= hits - 1)
+				{
+					int lane = LowestLane(hits);
+					if (t[lane] >= tmax) {
+						continue;
+					}
+
+					tmax         = t[lane];
+					hit.u        = u[lane];
+					hit.v        = v[lane];
+					hit.triangle = first + i + lane;
+					hit.instance = instance;
+					hit.matID    = matID;
+					found        = true;
+				}
+			}
+
+			return found;
+		}
+
+		return IntersectIndexed<AnyHit>(first, count, instance, matID, origin, direction, tmax, hit);
+	}
+
+	template <bool AnyHit>
+	bool BvhTraverser::IntersectIndexed(int first, int count, int instance, int matID, const Vector3& origin, const Vector3& direction, float& tmax, Hit& hit) const
+	{
+		bool found = false;
+
+		for (int i = 0; i < count; i++)
+		{
+			const Indices& vertIndices = scene->vertIndices[first + i];
+
+			Vector3 v0 = XYZ(scene->verticesUVX[vertIndices.x]);
+			Vector3 v1 = XYZ(scene->verticesUVX[vertIndices.y]);
+			Vector3 v2 = XYZ(scene->verticesUVX[vertIndices.z]);
+
+			float t, u, v;
+			if (IntersectTriangle(v0, v1 - v0, v2 - v0, origin, direction, tmax, t, u, v))
+			{
+				if (AnyHit) {
+					return true;
+				}
+
+				tmax         = t;
+				hit.u        = u;
+				hit.v        = v;
+				hit.triangle = first + i;
+				hit.instance = instance;
+				hit.matID    = matID;
+				found        = true;
+			}
+		}
+
+		return found;
+	}
+
+	// The loop of ClosestHit.glsl from root, in world space when instance is -1 and in the space
+	// of instance with its material otherwise
+	template <bool AnyHit>
+	bool BvhTraverser::TraceSingle(int root, int instance, int matID, const Vector3& rayOrigin, const Vector3& rayDirection, float tmax, Hit& hit) const
+	{
+		const RadeonRays::BvhTranslator& translator = scene->bvhTranslator;
+
+		int stack[kStackSize];
+		int ptr = 0;
+		stack[ptr++] = -1;
+
+		int idx = root;
+		int currInstance = instance;
+		int currMatID = matID;
+		bool meshBVH = false;
+		bool found = false;
+
+		Vector3 origin    = instance < 0 ? rayOrigin : TransformPoint(inverseTransforms[instance], rayOrigin);
+		Vector3 direction = instance < 0 ? rayDirection : TransformDirection(inverseTransforms[instance], rayDirection);
+		Vector3 invDir    = Vector3(1.0f) / direction;
+
+		while (idx > -1 || meshBVH)
+		{
+			if (meshBVH && idx < 0)
+			{
+				meshBVH = false;
+
+				idx = stack[--ptr];
+
+				origin    = rayOrigin;
+				direction = rayDirection;
+				invDir    = Vector3(1.0f) / direction;
+				continue;
+			}
+
+			const RadeonRays::BvhTranslator::Node& node = translator.nodes[idx];
+
+			if (node.leaf > 0)
+			{
+				if (IntersectLeaf<AnyHit>(idx, currInstance, currMatID, origin, direction, tmax, hit))
+				{
+					if (AnyHit) {
+						return true;
+					}
+					found = true;
+				}
+			}
+			else if (node.leaf < 0)
+			{
+				idx = node.leftIndex;
+
+				currInstance = -node.leaf - 1;
+				origin    = TransformPoint(inverseTransforms[currInstance], rayOrigin);
+				direction = TransformDirection(inverseTransforms[currInstance], rayDirection);
+				invDir    = Vector3(1.0f) / direction;
+
+				stack[ptr++] = -1;
+				meshBVH   = true;
+				currMatID = node.rightIndex;
+				continue;
+			}
+			else
+			{
+				int lc = node.leftIndex;
+				int rc = node.rightIndex;
+
+				float leftNear, rightNear;
+				bool leftHit  = IntersectBox(translator.bboxmin[lc], translator.bboxmax[lc], origin, invDir, tmax, leftNear);
+				bool rightHit = IntersectBox(translator.bboxmin[rc], translator.bboxmax[rc], origin, invDir, tmax, rightNear);
+
+				if (leftHit && rightHit)
+				{
+					int deferred = -1;
+					if (leftNear > rightNear)
+					{
+						idx = rc;
+						deferred = lc;
+					}
+					else
+					{
+						idx = lc;
+						deferred = rc;
+					}
+
+					stack[ptr++] = deferred;
+					continue;
+				}
+				else if (leftHit)
+				{
+					idx = lc;
+					continue;
+				}
+				else if (rightHit)
+				{
+					idx = rc;
+					continue;
+				}
+			}
+			idx = stack[--ptr];
+		}
+
+		hit.t = tmax;
+		return found;
+	}
+
+	// The same search through the quantized 4-wide nodes. Every lane the ray enters is pushed
+	// far to near, leaf lanes included, so the nearest leaves are tested first whatever lane
+	// they are in. Leaf lanes of top level nodes hold instances, which are traced from the
+	// lanes of the mesh node their ref starts at.
+	template <bool AnyHit>
+	bool BvhTraverser::TraceCompressed(int root, int rootLanes, int instance, int matID, const Vector3& rayOrigin, const Vector3& rayDirection, float tmax, Hit& hit) const
+	{
+		const RadeonRays::CompressedBvhTranslator& translator = scene->compressedBvhTranslator;
+
+		struct Entry
+		{
+			// Node of internal lanes, first triangle or instance of leaves
+			int index;
+			// 0 for internal lanes, the triangles of mesh leaves and minus the instances of top level leaves
+			int count;
+			int lanes;
+			float tnear;
+		};
+
+		Entry stack[kWideStackSize];
+		int ptr = 0;
+		stack[ptr++] = { root, 0, rootLanes, 0.0f };
+
+		bool found = false;
+
+		Vector3 origin    = instance < 0 ? rayOrigin : TransformPoint(inverseTransforms[instance], rayOrigin);
+		Vector3 direction = instance < 0 ? rayDirection : TransformDirection(inverseTransforms[instance], rayDirection);
+		Vector3 invDir    = Vector3(1.0f) / direction;
+
+		while (ptr > 0)
+		{
+			const Entry curr = stack[--ptr];
+
+			// Entered behind the closest hit found since it was pushed
+			if (curr.tnear > tmax) {
+				continue;
+			}
+
+			if (curr.count > 0)
+			{
+				if (IntersectIndexed<AnyHit>(curr.index, curr.count, instance, matID, origin, direction, tmax, hit))
+				{
+					if (AnyHit) {
+						return true;
+					}
+					found = true;
+				}
+				continue;
+			}
+
+			if (curr.count < 0)
+			{
+				for (int i = 0; i < -curr.count; i++)
+				{
+					const RadeonRays::CompressedBvhTranslator::Instance& entry = translator.instances[curr.index + i];
+
+					Hit instanceHit;
+					if (TraceCompressed<AnyHit>(entry.node, entry.lanes, entry.instance, entry.materialID, rayOrigin, rayDirection, tmax, instanceHit))
+					{
+						if (AnyHit) {
+							return true;
+						}
+
+						hit   = instanceHit;
+						tmax  = instanceHit.t;
+						found = true;
+					}
+				}
+				continue;
+			}
+
+			const RadeonRays::CompressedBvh::Node& node = translator.nodes[curr.index];
+			int sign = curr.index >= translator.topLevelIndex ? -1 : 1;
+
+			float tnear[4];
+			uint32 hits = RadeonRays::CompressedBvh::IntersectChildren(node, origin, invDir, tmax, tnear) & curr.lanes;
+
+			// Farthest first, so the nearest lane is popped next
+			int first = ptr;
+			for (; hits != 0; hits &= hits - 1)
+			{
+				int lane = LowestLane(hits);
+				Entry entry = { node.child[lane], sign * node.numprims[lane], 0xF, tnear[lane] };
+
+				int i = ptr++;
+				for (; i > first && stack[i - 1].tnear < entry.tnear; i--) {
+					stack[i] = stack[i - 1];
+				}
+				stack[i] = entry;
+			}
+		}
+
+		hit.t = tmax;
+		return found;
+	}
+
+	// Traverses the subtree at root with the lanes of mask sharing one stack. Occluded lanes are
+	// added to occluded and leave the packet, closest hits lower the tmax of their lane.
+	template <int Size, bool AnyHit>
+	void BvhTraverser::TracePacket(RayPacket<Size>& packet, const Frame<Size>& frame, int root, int instance, int matID, uint32 mask, uint32& occluded) const
+	{
+		const RadeonRays::BvhTranslator& translator = scene->bvhTranslator;
+
+		struct Entry
+		{
+			int node;
+			uint32 mask;
+			// Smallest entry distance of the lanes, lanes whose closest hit is nearer skip the node
+			float tnear;
+		};
+
+		Entry stack[kStackSize];
+		int ptr = 0;
+
+		Entry curr = { root, mask, 0.0f };
+
+		float t[Size];
+		float u[Size];
+		float v[Size];
+
+		for (;;)
+		{
+			uint32 lanes = AnyHit ? curr.mask & ~occluded : LanesReaching<Size>(packet.tmax, curr.tnear, curr.mask);
+
+			if (lanes != 0 && PopCount(lanes) <= fallbackLanes)
+			{
+				// Too few rays left to fill the lanes
+				TraceLanes<Size, AnyHit>(packet, curr.node, instance, matID, lanes, occluded);
+			}
+			else if (lanes != 0)
+			{
+				const RadeonRays::BvhTranslator::Node& node = translator.nodes[curr.node];
+
+				if (node.leaf > 0)
+				{
+					for (int i = 0; i < node.rightIndex && lanes != 0; i++)
+					{
+						int triangle = node.leftIndex + i;
+
+						Vector3 v0, e0, e1;
+						if (!triangleBlocks.empty())
+						{
+							const TriangleBlock& block = triangleBlocks[leafBlocks[curr.node] + i / 4];
+							int lane = i % 4;
+
+							v0 = Vector3(block.v0x[lane], block.v0y[lane], block.v0z[lane]);
+							e0 = Vector3(block.e0x[lane], block.e0y[lane], block.e0z[lane]);
+							e1 = Vector3(block.e1x[lane], block.e1y[lane], block.e1z[lane]);
+						}
+						else
+						{
+							const Indices& vertIndices = scene->vertIndices[triangle];
+
+							v0 = XYZ(scene->verticesUVX[vertIndices.x]);
+							e0 = XYZ(scene->verticesUVX[vertIndices.y]) - v0;
+							e1 = XYZ(scene->verticesUVX[vertIndices.z]) - v0;
+						}
+
+						uint32 hits = IntersectTriangle<Size>(frame, packet.tmax, v0, e0, e1, lanes, t, u, v);
+
+						if (AnyHit)
+						{
+							occluded |= hits;
+							lanes &= ~hits;
+							continue;
+						}
+
+						for (; hits != 0; hits &= hits - 1)
+						{
+							int lane = LowestLane(hits);
+							packet.tmax[lane]     = t[lane];
+							packet.u[lane]        = u[lane];
+							packet.v[lane]        = v[lane];
+							packet.triangle[lane] = triangle;
+							packet.instance[lane] = instance;
+							packet.matID[lane]    = matID;
+						}
+					}
+				}
+				else if (node.leaf < 0)
+				{
+					int child = -node.leaf - 1;
+					Frame<Size> local(packet, &inverseTransforms[child]);
+
+					TracePacket<Size, AnyHit>(packet, local, node.leftIndex, child, node.rightIndex, lanes, occluded);
+				}
+				else
+				{
+					int lc = node.leftIndex;
+					int rc = node.rightIndex;
+
+					float leftNear, rightNear;
+					uint32 left  = IntersectBox<Size>(frame, packet.tmax, translator.bboxmin[lc], translator.bboxmax[lc], lanes, leftNear);
+					uint32 right = IntersectBox<Size>(frame, packet.tmax, translator.bboxmin[rc], translator.bboxmax[rc], lanes, rightNear);
+
+					if (left != 0 && right != 0)
+					{
+						Entry leftEntry  = { lc, left, leftNear };
+						Entry rightEntry = { rc, right, rightNear };
+
+						if (leftNear > rightNear)
+						{
+							curr = rightEntry;
+							stack[ptr++] = leftEntry;
+						}
+						else
+						{
+							curr = leftEntry;
+							stack[ptr++] = rightEntry;
+						}
+						continue;
+					}
+					else if (left != 0)
+					{
+						curr = { lc, left, leftNear };
+						continue;
+					}
+					else if (right != 0)
+					{
+						curr = { rc, right, rightNear };
+						continue;
+					}
+				}
+			}
+
+			if (AnyHit && (mask & ~occluded) == 0) {
+				return;
+			}
+
+			if (ptr == 0) {
+				return;
+			}
+			curr = stack[--ptr];
+		}
+	}
+
+	template <int Size, bool AnyHit>
+	void BvhTraverser::TraceLanes(RayPacket<Size>& packet, int root, int instance, int matID, uint32 mask, uint32& occluded) const
+	{
+		for (; mask != 0; mask &= mask - 1)
+		{
+			int lane = LowestLane(mask);
+
+			Vector3 origin(packet.ox[lane], packet.oy[lane], packet.oz[lane]);
+			Vector3 direction(packet.dx[lane], packet.dy[lane], packet.dz[lane]);
+
+			// Compressed scenes come here from the top level only
+			Hit hit;
+			bool traced = scene->compressedBvhTranslator.nodes.empty() ? TraceSingle<AnyHit>(root, instance, matID, origin, direction, packet.tmax[lane], hit)
+			                                                           : TraceCompressed<AnyHit>(root, 0xF, instance, matID, origin, direction, packet.tmax[lane], hit);
+			if (!traced) {
+				continue;
+			}
+
+			if (AnyHit)
+			{
+				occluded |= 1u << lane;
+				continue;
+			}
+
+			packet.tmax[lane]     = hit.t;
+			packet.u[lane]        = hit.u;
+			packet.v[lane]        = hit.v;
+			packet.triangle[lane] = hit.triangle;
+			packet.instance[lane] = hit.instance;
+			packet.matID[lane]    = hit.matID;
+		}
+	}
+
+	template void BvhTraverser::Intersect<4>(RayPacket<4>& packet) const;
+	template void BvhTraverser::Intersect<8>(RayPacket<8>& packet) const;
+	template void BvhTraverser::Intersect<16>(RayPacket<16>& packet) const;
+
+	template uint32 BvhTraverser::Occluded<4>(RayPacket<4>& packet) const;
+	template uint32 BvhTraverser::Occluded<8>(RayPacket<8>& packet) const;
+	template uint32 BvhTraverser::Occluded<16>(RayPacket<16>& packet) const;
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <vector>
+
+#include "Scene.h"
+#include "math/Math.h"
+#include "math/Vector3.h"
+#include "math/Matrix4x4.h"
+
+namespace GLSLPT
+{
+	// Rays traced together in SoA layout, lane i of every array is one ray. Size is 4, 8 or 16.
+	template <int Size>
+	struct RayPacket
+	{
+		float ox[Size], oy[Size], oz[Size];
+		float dx[Size], dy[Size], dz[Size];
+
+		// Hits are accepted below tmax, which is lowered to the closest hit distance
+		float tmax[Size];
+
+		// Closest hit of every lane, triangle is -1 until a triangle was hit
+		float u[Size];
+		float v[Size];
+		int triangle[Size];
+		int instance[Size];
+		int matID[Size];
+
+		// Lanes that hold a ray
+		uint32 active;
+
+		RayPacket()
+			: active(0)
+		{
+
+		}
+
+		void SetRay(int lane, const Vector3& origin, const Vector3& direction, float maxDist)
+		{
+			ox[lane] = origin.x;
+			oy[lane] = origin.y;
+			oz[lane] = origin.z;
+			dx[lane] = direction.x;
+			dy[lane] = direction.y;
+			dz[lane] = direction.z;
+			tmax[lane] = maxDist;
+			triangle[lane] = -1;
+			active |= 1u << lane;
+		}
+	};
+
+	// Occlusion queries answered together, like light samples, ambient occlusion or baking rays.
+	// BvhTraverser::Occluded walks every query through the top level BVH once and groups the
+	// queries by the instance leaves they enter. The queries of a leaf are then traced in packets
+	// from its mesh BVH node instead of each restarting at the top level.
+	class OcclusionBatch
+	{
+	public:
+		void Clear()
+		{
+			origins.clear();
+			directions.clear();
+			tmax.clear();
+			occluded.clear();
+		}
+
+		// Index of the query, its result is bit index of GetOccluded
+		int Add(const Vector3& origin, const Vector3& direction, float maxDist)
+		{
+			origins.push_back(origin);
+			directions.push_back(direction);
+			tmax.push_back(maxDist);
+			return (int)tmax.size() - 1;
+		}
+
+		int GetSize() const
+		{
+			return (int)tmax.size();
+		}
+
+		// One bit per query, set when it hits a triangle below its tmax
+		const std::vector<uint32>& GetOccluded() const
+		{
+			return occluded;
+		}
+
+		bool IsOccluded(int query) const
+		{
+			return (occluded[query >> 5] >> (query & 31)) & 1;
+		}
+
+	private:
+		friend class BvhTraverser;
+
+		std::vector<Vector3> origins;
+		std::vector<Vector3> directions;
+		std::vector<float> tmax;
+		std::vector<uint32> occluded;
+
+		// Queries grouped by the top level leaf they enter, those of node topLevelIndex + i
+		// start at entryOffsets[i]
+		std::vector<int> entryOffsets;
+		std::vector<int> entryQueries;
+	};
+
+	// Closest hit and occlusion queries on the CPU against the flattened BVH of a Scene, the
+	// traversal of shaders/common/ClosestHit.glsl. Packets test a node for all their rays with
+	// SSE/AVX slab tests and share one stack; rays leave the packet mask when they miss a node
+	// or, for occlusion, once they are blocked. When fewer than the fallback lanes remain, the
+	// rest of the subtree is traced one ray at a time. A scene laid out in
+	// Scene::compressedBvhTranslator is traced one ray at a time through its quantized nodes.
+	class BvhTraverser
+	{
+	public:
+		struct Hit
+		{
+			float t;
+			float u;
+			float v;
+			// Index into Scene::vertIndices
+			int triangle;
+			int instance;
+			int matID;
+		};
+
+		BvhTraverser(const Scene* scene);
+
+		// Inverse instance transforms, after Scene::transforms changed
+		void UpdateTransforms();
+
+		// Copies the scene triangles to the blocks of Scene::CreateTriangleBlocks, which leaves
+		// then test four at a time from their first block instead of fetching their vertices
+		// through vertIndices. Compressed scenes keep the indexed triangles.
+		// Call again after the vertices or the BVH changed.
+		void UpdateTriangleBlocks();
+
+		// Back to the indexed triangles of the scene
+		void ClearTriangleBlocks();
+
+		const std::vector<TriangleBlock>& GetTriangleBlocks() const
+		{
+			return triangleBlocks;
+		}
+
+		const std::vector<int>& GetLeafBlocks() const
+		{
+			return leafBlocks;
+		}
+
+		const std::vector<Matrix4x4>& GetInverseTransforms() const
+		{
+			return inverseTransforms;
+		}
+
+		// Lanes at or below which a packet falls back to single rays, 0 keeps every packet together
+		void SetFallbackLanes(int lanes)
+		{
+			fallbackLanes = lanes;
+		}
+
+		int GetFallbackLanes() const
+		{
+			return fallbackLanes;
+		}
+
+		// Closest triangle hit below tmax
+		bool Intersect(const Vector3& origin, const Vector3& direction, float tmax, Hit& hit) const;
+
+		// Any triangle hit below tmax
+		bool Occluded(const Vector3& origin, const Vector3& direction, float tmax) const;
+
+		// Closest hits of the active lanes, written to the hit arrays of the packet
+		template <int Size>
+		void Intersect(RayPacket<Size>& packet) const;
+
+		// Mask of the active lanes that hit any triangle below their tmax
+		template <int Size>
+		uint32 Occluded(RayPacket<Size>& packet) const;
+
+		// Answers every query of batch, in parallel on pool unless it is null
+		void Occluded(OcclusionBatch& batch, TaskThreadPool* pool) const;
+
+	private:
+		template <int Size>
+		struct Frame;
+
+		// Appends the top level leaves whose bounds the ray overlaps below tmax
+		void CollectInstances(const Vector3& origin, const Vector3& direction, float tmax, std::vector<int>& leaves) const;
+
+		// Triangles of the mesh BVH leaf at node leaf against one ray, a hit lowers tmax
+		template <bool AnyHit>
+		bool IntersectLeaf(int leaf, int instance, int matID, const Vector3& origin, const Vector3& direction, float& tmax, Hit& hit) const;
+
+		// Triangles first to first + count - 1 of Scene::vertIndices against one ray, a hit lowers tmax
+		template <bool AnyHit>
+		bool IntersectIndexed(int first, int count, int instance, int matID, const Vector3& origin, const Vector3& direction, float& tmax, Hit& hit) const;
+
+		template <bool AnyHit>
+		bool TraceSingle(int root, int instance, int matID, const Vector3& origin, const Vector3& direction, float tmax, Hit& hit) const;
+
+		// TraceSingle through the nodes of Scene::compressedBvhTranslator, starting at the lanes of root
+		template <bool AnyHit>
+		bool TraceCompressed(int root, int rootLanes, int instance, int matID, const Vector3& origin, const Vector3& direction, float tmax, Hit& hit) const;
+
+		template <int Size, bool AnyHit>
+		void TracePacket(RayPacket<Size>& packet, const Frame<Size>& frame, int root, int instance, int matID, uint32 mask, uint32& occluded) const;
+
+		template <int Size, bool AnyHit>
+		void TraceLanes(RayPacket<Size>& packet, int root, int instance, int matID, uint32 mask, uint32& occluded) const;
+
+		const Scene* scene;
+		std::vector<Matrix4x4> inverseTransforms;
+		std::vector<TriangleBlock> triangleBlocks;
+		std::vector<int> leafBlocks;
+		int fallbackLanes;
+	};
+}
@@ -0,0 +1,1361 @@
+#include <math.h>
+#include <algorithm>
+
+#include "CpuRenderer.h"
+#include "Camera.h"
+#include "Scene.h"
+#include "job/TaskGroup.h"
+#include "bvh/Morton.h"
+
+#define STB_IMAGE_WRITE_STATIC
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "parser/stb_image_write.h"
+
+namespace GLSLPT
+{
+	namespace
+	{
+		// Constants of shaders/common/Globals.glsl
+		const float kPi       = 3.14159265358979323f;
+		const float kTwoPi    = 6.28318530717958648f;
+		const float kInfinity = 1000000.0f;
+		const float kEps      = 0.001f;
+
+		// Pixels per tile side, tiles are the unit of work of the task pool
+		const int kTileSize = 32;
+		// Camera rays are traced in packets of kPacketSide x kPacketSide pixels
+		const int kPacketSide = 4;
+		const int kPacketSize = kPacketSide * kPacketSide;
+
+		// Paths the wavefront integrator keeps in flight, the queues are sorted per bounce
+		const int kWaveSize = 1 << 18;
+		// Queue entries per task and rays per packet of the wavefront passes
+		const int kWaveGrain = 1024;
+		const int kWavePacketSize = 8;
+		// Bits per axis of the origin cell in the ray sort keys, the direction octant adds three
+		const int kOriginCellBits = 9;
+
+		inline float Dot(const Vector3& a, const Vector3& b)
+		{
+			return a.x * b.x + a.y * b.y + a.z * b.z;
+		}
+
+		inline Vector3 Cross(const Vector3& a, const Vector3& b)
+		{
+			return Vector3::CrossProduct(a, b);
+		}
+
+		inline Vector3 Normalize(const Vector3& v)
+		{
+			return v / v.Size();
+		}
+
+		inline Vector3 Mix(const Vector3& a, const Vector3& b, float t)
+		{
+			return a * (1.0f - t) + b * t;
+		}
+
+		inline Vector3 Pow(const Vector3& v, float e)
+		{
+			return Vector3(powf(v.x, e), powf(v.y, e), powf(v.z, e));
+		}
+
+		inline Vector3 XYZ(const Vector4& v)
+		{
+			return Vector3(v.x, v.y, v.z);
+		}
+
+		// Row vectors times the matrix, the convention of the transforms the shaders read
+		inline Vector3 TransformPoint(const Matrix4x4& m, const Vector3& p)
+		{
+			return Vector3(
+				p.x * m.m[0][0] + p.y * m.m[1][0] + p.z * m.m[2][0] + m.m[3][0],
+				p.x * m.m[0][1] + p.y * m.m[1][1] + p.z * m.m[2][1] + m.m[3][1],
+				p.x * m.m[0][2] + p.y * m.m[1][2] + p.z * m.m[2][2] + m.m[3][2]
+			);
+		}
+
+		inline Vector3 TransformDirection(const Matrix4x4& m, const Vector3& d)
+		{
+			return Vector3(
+				d.x * m.m[0][0] + d.y * m.m[1][0] + d.z * m.m[2][0],
+				d.x * m.m[0][1] + d.y * m.m[1][1] + d.z * m.m[2][1],
+				d.x * m.m[0][2] + d.y * m.m[1][2] + d.z * m.m[2][2]
+			);
+		}
+
+		inline Vector3 Reflect(const Vector3& i, const Vector3& n)
+		{
+			return i - n * (2.0f * Dot(n, i));
+		}
+
+		inline Vector3 Refract(const Vector3& i, const Vector3& n, float eta)
+		{
+			float ni = Dot(n, i);
+			float k  = 1.0f - eta * eta * (1.0f - ni * ni);
+			if (k < 0.0f) {
+				return Vector3(0.0f, 0.0f, 0.0f);
+			}
+			return i * eta - n * (eta * ni + sqrtf(k));
+		}
+
+		// Sampling.glsl and UE4BRDF.glsl
+		inline float SchlickFresnel(float u)
+		{
+			float m  = std::min(std::max(1.0f - u, 0.0f), 1.0f);
+			float m2 = m * m;
+			return m2 * m2 * m;
+		}
+
+		inline float GTR2(float NDotH, float a)
+		{
+			float a2 = a * a;
+			float t  = 1.0f + (a2 - 1.0f) * NDotH * NDotH;
+			return a2 / (kPi * t * t);
+		}
+
+		inline float SmithG_GGX(float NDotv, float alphaG)
+		{
+			float a = alphaG * alphaG;
+			float b = NDotv * NDotv;
+			return 1.0f / (NDotv + sqrtf(a + b - a * b));
+		}
+
+		inline Vector3 CosineSampleHemisphere(float u1, float u2)
+		{
+			float r   = sqrtf(u1);
+			float phi = 2.0f * kPi * u2;
+			float x   = r * cosf(phi);
+			float y   = r * sinf(phi);
+			return Vector3(x, y, sqrtf(std::max(0.0f, 1.0f - x * x - y * y)));
+		}
+
+		inline Vector3 UniformSampleSphere(float u1, float u2)
+		{
+			float z   = 1.0f - 2.0f * u1;
+			float r   = sqrtf(std::max(0.0f, 1.0f - z * z));
+			float phi = 2.0f * kPi * u2;
+			return Vector3(r * cosf(phi), r * sinf(phi), z);
+		}
+
+		inline float PowerHeuristic(float a, float b)
+		{
+			float t = a * a;
+			return t / (b * b + t);
+		}
+
+		inline float UE4Pdf(const Vector3& rayDir, const Vector3& n, const Material& mat, const Vector3& L)
+		{
+			Vector3 V = -rayDir;
+
+			float specularAlpha = std::max(0.001f, mat.roughness);
+
+			float diffuseRatio  = 0.5f * (1.0f - mat.metallic);
+			float specularRatio = 1.0f - diffuseRatio;
+
+			Vector3 halfVec = Normalize(L + V);
+
+			float cosTheta = fabsf(Dot(halfVec, n));
+			float pdfGTR2  = GTR2(cosTheta, specularAlpha) * cosTheta;
+
+			float pdfSpec = pdfGTR2 / (4.0f * fabsf(Dot(L, halfVec)));
+			float pdfDiff = fabsf(Dot(L, n)) * (1.0f / kPi);
+
+			return diffuseRatio * pdfDiff + specularRatio * pdfSpec;
+		}
+
+		inline Vector3 UE4Eval(const Vector3& rayDir, const Vector3& N, const Material& mat, const Vector3& L)
+		{
+			Vector3 V = -rayDir;
+
+			float NDotL = Dot(N, L);
+			float NDotV = Dot(N, V);
+
+			if (NDotL <= 0.0f || NDotV <= 0.0f) {
+				return Vector3(0.0f, 0.0f, 0.0f);
+			}
+
+			Vector3 H = Normalize(L + V);
+			float NDotH = Dot(N, H);
+			float LDotH = Dot(L, H);
+
+			float specular = 0.5f;
+			Vector3 specularCol = Mix(Vector3(0.08f * specular), mat.albedo, mat.metallic);
+			float a  = std::max(0.001f, mat.roughness);
+			float Ds = GTR2(NDotH, a);
+			float FH = SchlickFresnel(LDotH);
+			Vector3 Fs = Mix(specularCol, Vector3(1.0f), FH);
+			float roughg = mat.roughness * 0.5f + 0.5f;
+			roughg = roughg * roughg;
+			float Gs = SmithG_GGX(NDotL, roughg) * SmithG_GGX(NDotV, roughg);
+
+			return mat.albedo * ((1.0f - mat.metallic) / kPi) + Fs * (Gs * Ds);
+		}
+
+		// Intersection.glsl
+		inline float SphereIntersect(float rad, const Vector3& pos, const Vector3& origin, const Vector3& direction)
+		{
+			Vector3 op = pos - origin;
+			float b    = Dot(op, direction);
+			float det  = b * b - Dot(op, op) + rad * rad;
+			if (det < 0.0f) {
+				return kInfinity;
+			}
+
+			det = sqrtf(det);
+			float t1 = b - det;
+			if (t1 > kEps) {
+				return t1;
+			}
+
+			float t2 = b + det;
+			if (t2 > kEps) {
+				return t2;
+			}
+
+			return kInfinity;
+		}
+
+		inline float RectIntersect(const Vector3& pos, const Vector3& u, const Vector3& v, const Vector3& n, float planeW, const Vector3& origin, const Vector3& direction)
+		{
+			float dt = Dot(direction, n);
+			float t  = (planeW - Dot(n, origin)) / dt;
+			if (t > kEps)
+			{
+				Vector3 vi = origin + direction * t - pos;
+				float a1 = Dot(u, vi);
+				if (a1 >= 0.0f && a1 <= 1.0f)
+				{
+					float a2 = Dot(v, vi);
+					if (a2 >= 0.0f && a2 <= 1.0f) {
+						return t;
+					}
+				}
+			}
+
+			return kInfinity;
+		}
+
+		// Texel of a repeating texture
+		inline int Wrap(int x, int size)
+		{
+			x %= size;
+			return x < 0 ? x + size : x;
+		}
+	}
+
+	struct CpuRenderer::Ray
+	{
+		Vector3 origin;
+		Vector3 direction;
+	};
+
+	struct CpuRenderer::State
+	{
+		Vector3 normal;
+		Vector3 ffnormal;
+		Vector3 fhp;
+		bool isEmitter = false;
+		int depth = 0;
+		float hitDist = 0.0f;
+		float texCoord[2];
+		Vector3 bary;
+		Indices triID;
+		int matID = 0;
+		// Instance of the hit triangle, the shaders keep its transform in a global
+		int instance = 0;
+		// Vertex u coordinates of the hit triangle, tempTexCoords in the shaders
+		Vector3 texCoordsU;
+		Material mat;
+		bool specularBounce = false;
+	};
+
+	struct CpuRenderer::LightSampleRec
+	{
+		Vector3 surfacePos;
+		Vector3 normal;
+		Vector3 emission;
+		float pdf = 0.0f;
+	};
+
+	struct CpuRenderer::BsdfSampleRec
+	{
+		Vector3 bsdfDir;
+		float pdf = 0.0f;
+	};
+
+	// Random numbers of one path. The shaders hash the fragment coordinate, a PCG hash of the
+	// pixel and sample index gives independent sequences without any shared state.
+	class CpuRenderer::Sampler
+	{
+	public:
+		Sampler()
+			: m_State(0)
+		{
+
+		}
+
+		Sampler(uint32 pixel, uint32 sample)
+			: m_State(Hash(pixel ^ Hash(sample)))
+		{
+
+		}
+
+		float Next()
+		{
+			m_State = Hash(m_State);
+			return (m_State >> 8) * (1.0f / 16777216.0f);
+		}
+
+	private:
+		static uint32 Hash(uint32 x)
+		{
+			uint32 state = x * 747796405u + 2891336453u;
+			uint32 word  = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+			return (word >> 22u) ^ word;
+		}
+
+		uint32 m_State;
+	};
+
+	// A path between bounces, the local variables of the shader loop
+	struct CpuRenderer::Path
+	{
+		Ray ray;
+		// Distance to the hit of ray, kInfinity for a miss
+		float t;
+		State state;
+		LightSampleRec lightSampleRec;
+		BsdfSampleRec bsdfSampleRec;
+		Vector3 radiance;
+		Vector3 throughput;
+		Sampler sampler;
+		int pixel;
+	};
+
+	// Light sample of DirectLight, radiance reaches the path when nothing blocks the ray before maxDist
+	struct CpuRenderer::ShadowRay
+	{
+		Ray ray;
+		float maxDist;
+		Vector3 radiance;
+	};
+
+	// A ray of the wavefront queues and the path it continues
+	struct CpuRenderer::QueuedRay
+	{
+		Ray ray;
+		int path;
+	};
+
+	struct CpuRenderer::Wavefront
+	{
+		std::vector<Path> paths;
+		// Rays of the current bounce, sorted for the extend pass, and their closest triangle hits
+		std::vector<QueuedRay> rays;
+		std::vector<QueuedRay> nextRays;
+		std::vector<BvhTraverser::Hit> hits;
+		std::vector<uint64> keys;
+		std::vector<int> order;
+		// Two light samples per entry of the shade pass
+		std::vector<ShadowRay> shadowRays;
+		std::vector<int> numShadowRays;
+		std::vector<char> extend;
+		OcclusionBatch occlusion;
+	};
+
+	CpuRenderer::CpuRenderer(Scene* scene)
+		: Renderer(scene, "")
+		, width(0)
+		, height(0)
+		, numTilesX(0)
+		, numTilesY(0)
+		, maxDepth(0)
+		, useEnvMap(false)
+		, integrator(kPerPixel)
+		, sampleCounter(0)
+		, tilesDone(0)
+		, rayCount(0)
+		, traverser(scene)
+		, wavefront(new Wavefront())
+	{
+
+	}
+
+	CpuRenderer::~CpuRenderer()
+	{
+
+	}
+
+	bool CpuRenderer::Init()
+	{
+		if (initialized) {
+			return true;
+		}
+
+		if (scene == nullptr)
+		{
+			printf("Error: No Scene Found\n");
+			return false;
+		}
+
+		// The scene arrays are read in place, nothing is uploaded
+		width     = std::max((int)scene->renderOptions.frameSize.x, 1);
+		height    = std::max((int)scene->renderOptions.frameSize.y, 1);
+		numTilesX = (width + kTileSize - 1) / kTileSize;
+		numTilesY = (height + kTileSize - 1) / kTileSize;
+
+		accumulation.assign((size_t)width * height, Vector3(0.0f, 0.0f, 0.0f));
+		sampleCounter = 0;
+		tilesDone     = 0;
+		rayCount      = 0;
+
+		UpdateTransforms();
+		traverser.UpdateTriangleBlocks();
+
+		// Everything was just read
+		scene->bvhTranslator.dirtyNodes.clear();
+		scene->bvhTranslator.dirtyBounds.clear();
+		scene->hdrModified          = false;
+		scene->instancesModified    = false;
+		scene->meshesModified       = false;
+		scene->meshTopologyModified = false;
+
+		UpdateParameters();
+
+		initialized = true;
+
+		return true;
+	}
+
+	void CpuRenderer::Dispose()
+	{
+		if (!initialized) {
+			return;
+		}
+
+		accumulation.clear();
+		normalTransforms.clear();
+		wavefront.reset(new Wavefront());
+
+		Renderer::Dispose();
+	}
+
+	void CpuRenderer::UpdateTransforms()
+	{
+		traverser.UpdateTransforms();
+
+		const std::vector<Matrix4x4>& inverseTransforms = traverser.GetInverseTransforms();
+		normalTransforms.resize(inverseTransforms.size());
+
+		// transpose(inverse(mat3(transform))) of the shaders, applied to row vectors
+		for (int i = 0; i < inverseTransforms.size(); ++i) {
+			normalTransforms[i] = inverseTransforms[i].GetTransposed();
+		}
+	}
+
+	void CpuRenderer::UpdateParameters()
+	{
+		Camera* camera = scene->camera;
+
+		// The shaders get the left vector as camera.right
+		cameraPosition  = camera->GetPosition();
+		cameraRight     = camera->GetLeft();
+		cameraUp        = camera->GetUp();
+		cameraForward   = camera->GetForward();
+		cameraFov       = camera->GetFov();
+		cameraFocalDist = camera->focalDist;
+		cameraAperture  = camera->aperture;
+
+		useEnvMap = scene->hdrData != nullptr && scene->renderOptions.useEnvMap;
+		maxDepth  = camera->isMoving || scene->instancesModified ? 2 : scene->renderOptions.maxDepth;
+	}
+
+	void CpuRenderer::Update(float secondsElapsed)
+	{
+		if (!initialized) {
+			return;
+		}
+
+		bool resized = (int)scene->renderOptions.frameSize.x != width || (int)scene->renderOptions.frameSize.y != height;
+		if (resized)
+		{
+			width     = std::max((int)scene->renderOptions.frameSize.x, 1);
+			height    = std::max((int)scene->renderOptions.frameSize.y, 1);
+			numTilesX = (width + kTileSize - 1) / kTileSize;
+			numTilesY = (height + kTileSize - 1) / kTileSize;
+		}
+
+		if (scene->instancesModified || scene->meshTopologyModified) {
+			UpdateTransforms();
+		}
+
+		// Refitted or rebuilt meshes moved their triangles
+		if (scene->meshesModified || scene->meshTopologyModified) {
+			traverser.UpdateTriangleBlocks();
+		}
+
+		// Nothing to upload, the node ranges only matter to the GL textures
+		scene->bvhTranslator.dirtyNodes.clear();
+		scene->bvhTranslator.dirtyBounds.clear();
+
+		if (resized || scene->camera->isMoving || scene->instancesModified || scene->meshesModified || scene->hdrModified)
+		{
+			accumulation.assign((size_t)width * height, Vector3(0.0f, 0.0f, 0.0f));
+			sampleCounter = 0;
+		}
+
+		UpdateParameters();
+	}
+
+	void CpuRenderer::Render()
+	{
+		if (!initialized)
+		{
+			printf("CPU Renderer is not initialized\n");
+			return;
+		}
+
+		tilesDone = 0;
+
+		if (integrator == kWavefront)
+		{
+			RenderWavefront();
+		}
+		else
+		{
+			TaskGroup::ParallelFor(scene->taskPool, numTilesX * numTilesY, 1, [this](int32 begin, int32 end)
+			{
+				for (int tile = begin; tile < end; ++tile)
+				{
+					RenderTile(tile);
+					tilesDone++;
+				}
+			});
+		}
+
+		sampleCounter++;
+
+		scene->hdrModified          = false;
+		scene->instancesModified    = false;
+		scene->meshesModified       = false;
+		scene->meshTopologyModified = false;
+		scene->camera->isMoving     = false;
+	}
+
+	float CpuRenderer::GetProgress() const
+	{
+		return numTilesX * numTilesY > 0 ? float(tilesDone) / float(numTilesX * numTilesY) : 0.0f;
+	}
+
+	int CpuRenderer::GetSampleCount() const
+	{
+		return sampleCounter;
+	}
+
+	void CpuRenderer::RenderTile(int tile)
+	{
+		int x0 = (tile % numTilesX) * kTileSize;
+		int y0 = (tile / numTilesX) * kTileSize;
+		int x1 = std::min(x0 + kTileSize, width);
+		int y1 = std::min(y0 + kTileSize, height);
+
+		Path paths[kPacketSize];
+		int numRays = 0;
+
+		for (int py = y0; py < y1; py += kPacketSide)
+		{
+			for (int px = x0; px < x1; px += kPacketSide)
+			{
+				// Neighbouring camera rays take the same way through the BVH, they are traced together
+				RayPacket<kPacketSize> packet;
+
+				for (int lane = 0; lane < kPacketSize; ++lane)
+				{
+					int x = px + lane % kPacketSide;
+					int y = py + lane / kPacketSide;
+					if (x >= x1 || y >= y1) {
+						continue;
+					}
+
+					Path& path = paths[lane];
+					GeneratePath(x, y, path);
+
+					// Triangles have to be closer than the emitter the ray hits
+					float t = IntersectEmitters(path.ray, path.state, path.lightSampleRec);
+					packet.SetRay(lane, path.ray.origin, path.ray.direction, t);
+				}
+
+				traverser.Intersect(packet);
+
+				for (int lane = 0; lane < kPacketSize; ++lane)
+				{
+					if ((packet.active & (1u << lane)) == 0) {
+						continue;
+					}
+
+					Path& path = paths[lane];
+					if (packet.triangle[lane] >= 0)
+					{
+						BvhTraverser::Hit hit = { packet.tmax[lane], packet.u[lane], packet.v[lane], packet.triangle[lane], packet.instance[lane], packet.matID[lane] };
+						SetTriangleHit(path.ray, hit, path.state);
+					}
+					path.t = packet.tmax[lane];
+					path.state.hitDist = path.t;
+
+					numRays += PathTrace(path);
+					accumulation[path.pixel] += path.radiance;
+				}
+			}
+		}
+
+		rayCount += numRays;
+	}
+
+	void CpuRenderer::RenderWavefront()
+	{
+		Wavefront& wf = *wavefront;
+		TaskThreadPool* pool = scene->taskPool;
+
+		// Ray origins are binned in the bounds of the top level BVH, kept by the scene for both layouts
+		Vector3 sceneMin    = scene->sceneBounds.min;
+		Vector3 sceneExtent = scene->sceneBounds.max - sceneMin;
+		float cells = (float)(1 << kOriginCellBits);
+		Vector3 cellScale(sceneExtent.x > 0.0f ? cells / sceneExtent.x : 0.0f,
+		                  sceneExtent.y > 0.0f ? cells / sceneExtent.y : 0.0f,
+		                  sceneExtent.z > 0.0f ? cells / sceneExtent.z : 0.0f);
+
+		int numPixels    = width * height;
+		int numTiles     = numTilesX * numTilesY;
+		int numMaterials = (int)scene->materials.size();
+
+		std::vector<int> materialOffsets;
+
+		for (int first = 0; first < numPixels; first += kWaveSize)
+		{
+			int numPaths = std::min(kWaveSize, numPixels - first);
+			long long numRays = 0;
+
+			wf.paths.resize(numPaths);
+			wf.rays.resize(numPaths);
+			wf.nextRays.resize(numPaths);
+			wf.hits.resize(numPaths);
+			wf.shadowRays.resize(2 * numPaths);
+			wf.numShadowRays.resize(numPaths);
+			wf.extend.resize(numPaths);
+
+			// Generate: camera rays of the wave
+			TaskGroup::ParallelFor(pool, numPaths, kWaveGrain, [&](int32 begin, int32 end)
+			{
+				for (int i = begin; i < end; ++i)
+				{
+					int pixel = first + i;
+					GeneratePath(pixel % width, pixel / width, wf.paths[i]);
+					wf.rays[i].ray  = wf.paths[i].ray;
+					wf.rays[i].path = i;
+				}
+			});
+
+			for (int depth = 0; depth < maxDepth && !wf.rays.empty(); depth++)
+			{
+				int numQueued = (int)wf.rays.size();
+
+				// Sort the rays by the Morton cell of their origin, then by direction octant, so that
+				// neighbouring rays visit the same BVH nodes
+				wf.keys.resize(numQueued);
+				wf.order.resize(numQueued);
+				TaskGroup::ParallelFor(pool, numQueued, kWaveGrain, [&](int32 begin, int32 end)
+				{
+					for (int i = begin; i < end; ++i)
+					{
+						const Ray& r = wf.rays[i].ray;
+						Vector3 cell = (r.origin - sceneMin) * cellScale;
+
+						uint64 x = (uint64)std::min(std::max(cell.x, 0.0f), cells - 1.0f);
+						uint64 y = (uint64)std::min(std::max(cell.y, 0.0f), cells - 1.0f);
+						uint64 z = (uint64)std::min(std::max(cell.z, 0.0f), cells - 1.0f);
+						uint64 octant = (r.direction.x < 0.0f ? 1 : 0) | (r.direction.y < 0.0f ? 2 : 0) | (r.direction.z < 0.0f ? 4 : 0);
+
+						uint64 morton = (RadeonRays::MortonExpandBits(x) << 2) | (RadeonRays::MortonExpandBits(y) << 1) | RadeonRays::MortonExpandBits(z);
+						wf.keys[i]  = (morton << 3) | octant;
+						wf.order[i] = i;
+					}
+				});
+				RadeonRays::SortMortonCodes(pool, RadeonRays::kMortonBits30, wf.keys, wf.order);
+
+				wf.nextRays.resize(numQueued);
+				TaskGroup::ParallelFor(pool, numQueued, kWaveGrain, [&](int32 begin, int32 end)
+				{
+					for (int i = begin; i < end; ++i) {
+						wf.nextRays[i] = wf.rays[wf.order[i]];
+					}
+				});
+				wf.rays.swap(wf.nextRays);
+
+				// Extend: closest triangle hits of the sorted rays in packets, emitters are
+				// intersected when shading
+				TaskGroup::ParallelFor(pool, (numQueued + kWavePacketSize - 1) / kWavePacketSize, kWaveGrain / kWavePacketSize, [&](int32 begin, int32 end)
+				{
+					for (int chunk = begin; chunk < end; ++chunk)
+					{
+						int ray0 = chunk * kWavePacketSize;
+						int numLanes = std::min(kWavePacketSize, numQueued - ray0);
+
+						RayPacket<kWavePacketSize> packet;
+						for (int lane = 0; lane < numLanes; ++lane)
+						{
+							const Ray& r = wf.rays[ray0 + lane].ray;
+							packet.SetRay(lane, r.origin, r.direction, kInfinity);
+						}
+
+						traverser.Intersect(packet);
+
+						for (int lane = 0; lane < numLanes; ++lane)
+						{
+							BvhTraverser::Hit& hit = wf.hits[ray0 + lane];
+							hit.t        = packet.tmax[lane];
+							hit.u        = packet.u[lane];
+							hit.v        = packet.v[lane];
+							hit.triangle = packet.triangle[lane];
+							hit.instance = packet.instance[lane];
+							hit.matID    = packet.matID[lane];
+						}
+					}
+				});
+				numRays += numQueued;
+
+				// Counting sort of the hits by material, misses come first
+				materialOffsets.assign(numMaterials + 2, 0);
+				for (int i = 0; i < numQueued; ++i) {
+					materialOffsets[wf.hits[i].triangle >= 0 ? wf.hits[i].matID + 2 : 1]++;
+				}
+				for (int i = 1; i < numMaterials + 2; ++i) {
+					materialOffsets[i] += materialOffsets[i - 1];
+				}
+				for (int i = 0; i < numQueued; ++i) {
+					wf.order[materialOffsets[wf.hits[i].triangle >= 0 ? wf.hits[i].matID + 1 : 0]++] = i;
+				}
+
+				// Shade: one bounce of every path, light samples go to two shadow ray slots per entry
+				// and continuing rays to nextRays
+				TaskGroup::ParallelFor(pool, numQueued, kWaveGrain, [&](int32 begin, int32 end)
+				{
+					for (int i = begin; i < end; ++i)
+					{
+						int index = wf.order[i];
+						const BvhTraverser::Hit& hit = wf.hits[index];
+						Path& path = wf.paths[wf.rays[index].path];
+
+						// ClosestHit with the triangle traced first, emitters in front of it win
+						path.t = IntersectEmitters(path.ray, path.state, path.lightSampleRec);
+						if (hit.triangle >= 0 && hit.t < path.t)
+						{
+							path.t = hit.t;
+							SetTriangleHit(path.ray, hit, path.state);
+						}
+						path.state.hitDist = path.t;
+						path.state.depth   = depth;
+
+						wf.extend[i] = ShadeHit(path, &wf.shadowRays[2 * i], wf.numShadowRays[i]);
+						wf.nextRays[i].ray  = path.ray;
+						wf.nextRays[i].path = wf.rays[index].path;
+					}
+				});
+
+				// Connect: all shadow rays of the bounce in one occlusion batch
+				wf.occlusion.Clear();
+				for (int i = 0; i < numQueued; ++i)
+				{
+					for (int j = 0; j < wf.numShadowRays[i]; ++j)
+					{
+						const ShadowRay& shadowRay = wf.shadowRays[2 * i + j];
+						wf.occlusion.Add(shadowRay.ray.origin, shadowRay.ray.direction, shadowRay.maxDist);
+					}
+				}
+				traverser.Occluded(wf.occlusion, pool);
+
+				// Unoccluded samples reach their path, the rays of the paths that continue form the
+				// queue of the next bounce
+				int numAlive = 0;
+				int query = 0;
+				for (int i = 0; i < numQueued; ++i)
+				{
+					for (int j = 0; j < wf.numShadowRays[i]; ++j)
+					{
+						if (!wf.occlusion.IsOccluded(query++)) {
+							wf.paths[wf.nextRays[i].path].radiance += wf.shadowRays[2 * i + j].radiance;
+						}
+					}
+
+					if (wf.extend[i]) {
+						wf.rays[numAlive++] = wf.nextRays[i];
+					}
+				}
+				wf.rays.resize(numAlive);
+				numRays += query;
+			}
+
+			TaskGroup::ParallelFor(pool, numPaths, kWaveGrain, [&](int32 begin, int32 end)
+			{
+				for (int i = begin; i < end; ++i) {
+					accumulation[wf.paths[i].pixel] += wf.paths[i].radiance;
+				}
+			});
+
+			rayCount  += numRays;
+			tilesDone  = (int)((long long)numTiles * (first + numPaths) / numPixels);
+		}
+	}
+
+	void CpuRenderer::GeneratePath(int x, int y, Path& path) const
+	{
+		// Progressive.glsl, y counts from the bottom like gl_FragCoord
+		path.pixel   = y * width + x;
+		path.sampler = Sampler((uint32)path.pixel, (uint32)sampleCounter);
+
+		Sampler& sampler = path.sampler;
+
+		float r1 = 2.0f * sampler.Next();
+		float r2 = 2.0f * sampler.Next();
+
+		float jitterX = r1 < 1.0f ? sqrtf(r1) - 1.0f : 1.0f - sqrtf(2.0f - r1);
+		float jitterY = r2 < 1.0f ? sqrtf(r2) - 1.0f : 1.0f - sqrtf(2.0f - r2);
+
+		float scale = tanf(cameraFov * 0.5f);
+		float dx = 2.0f * (x + 0.5f) / width - 1.0f + jitterX / (width * 0.5f);
+		float dy = 2.0f * (y + 0.5f) / height - 1.0f + jitterY / (height * 0.5f);
+		dy *= (float)height / (float)width * scale;
+		dx *= scale;
+
+		Vector3 rayDir = Normalize(cameraRight * dx + cameraUp * dy + cameraForward);
+
+		Vector3 focalPoint = rayDir * cameraFocalDist;
+		float camR1 = sampler.Next() * kTwoPi;
+		float camR2 = sampler.Next() * cameraAperture;
+		Vector3 randomAperturePos = (cameraRight * cosf(camR1) + cameraUp * sinf(camR1)) * sqrtf(camR2);
+
+		path.ray.origin    = cameraPosition + randomAperturePos;
+		path.ray.direction = Normalize(focalPoint - randomAperturePos);
+
+		path.t          = kInfinity;
+		path.state      = State();
+		path.radiance   = Vector3(0.0f, 0.0f, 0.0f);
+		path.throughput = Vector3(1.0f, 1.0f, 1.0f);
+	}
+
+	int CpuRenderer::PathTrace(Path& path) const
+	{
+		int numRays = 1;
+
+		for (int depth = 0; depth < maxDepth; depth++)
+		{
+			path.state.depth = depth;
+			if (depth > 0)
+			{
+				path.t = ClosestHit(path.ray, path.state, path.lightSampleRec);
+				numRays++;
+			}
+
+			ShadowRay shadowRays[2];
+			int numShadowRays = 0;
+			bool extend = ShadeHit(path, shadowRays, numShadowRays);
+
+			for (int i = 0; i < numShadowRays; ++i)
+			{
+				if (!AnyHit(shadowRays[i].ray, shadowRays[i].maxDist)) {
+					path.radiance += shadowRays[i].radiance;
+				}
+			}
+			numRays += numShadowRays;
+
+			if (!extend) {
+				break;
+			}
+		}
+
+		return numRays;
+	}
+
+	bool CpuRenderer::ShadeHit(Path& path, ShadowRay* shadowRays, int& numShadowRays) const
+	{
+		// The names of the shader loop
+		Ray& r                       = path.ray;
+		State& state                 = path.state;
+		BsdfSampleRec& bsdfSampleRec = path.bsdfSampleRec;
+		Vector3& radiance            = path.radiance;
+		Vector3& throughput          = path.throughput;
+		Sampler& sampler             = path.sampler;
+
+		const LightSampleRec& lightSampleRec = path.lightSampleRec;
+
+		numShadowRays = 0;
+
+		if (path.t == kInfinity)
+		{
+			if (useEnvMap)
+			{
+				float misWeight = 1.0f;
+				float u = (kPi + atan2f(r.direction.z, r.direction.x)) * (1.0f / kTwoPi);
+				float v = acosf(r.direction.y) * (1.0f / kPi);
+
+				if (state.depth > 0 && !state.specularBounce) {
+					misWeight = PowerHeuristic(bsdfSampleRec.pdf, EnvPdf(r));
+				}
+				radiance += SampleEnvMap(u, v) * throughput * (misWeight * scene->renderOptions.intensity);
+			}
+			return false;
+		}
+
+		// The shaders still fetch the material of the last triangle for lights, which
+		// has no triangle on the first hit here
+		if (state.isEmitter)
+		{
+			if (state.depth == 0 || state.specularBounce) {
+				radiance += lightSampleRec.emission * throughput;
+			}
+			else {
+				radiance += lightSampleRec.emission * throughput * PowerHeuristic(bsdfSampleRec.pdf, lightSampleRec.pdf);
+			}
+			return false;
+		}
+
+		GetNormalsAndTexCoord(state, r);
+		GetMaterialsAndTextures(state, r);
+
+		radiance += state.mat.emission * throughput;
+
+		if (state.mat.type == 0.0f) // UE4 Brdf
+		{
+			state.specularBounce = false;
+			numShadowRays = SampleLights(r, state, sampler, shadowRays);
+			for (int i = 0; i < numShadowRays; ++i) {
+				shadowRays[i].radiance *= throughput;
+			}
+
+			// UE4Sample
+			Vector3 N = state.ffnormal;
+			Vector3 V = -r.direction;
+
+			float probability  = sampler.Next();
+			float diffuseRatio = 0.5f * (1.0f - state.mat.metallic);
+
+			float r1 = sampler.Next();
+			float r2 = sampler.Next();
+
+			Vector3 upVector = fabsf(N.z) < 0.999f ? Vector3(0.0f, 0.0f, 1.0f) : Vector3(1.0f, 0.0f, 0.0f);
+			Vector3 tangentX = Normalize(Cross(upVector, N));
+			Vector3 tangentY = Cross(N, tangentX);
+
+			if (probability < diffuseRatio)
+			{
+				Vector3 dir = CosineSampleHemisphere(r1, r2);
+				bsdfSampleRec.bsdfDir = tangentX * dir.x + tangentY * dir.y + N * dir.z;
+			}
+			else
+			{
+				float a = std::max(0.001f, state.mat.roughness);
+				float phi = r1 * 2.0f * kPi;
+
+				float cosTheta = sqrtf((1.0f - r2) / (1.0f + (a * a - 1.0f) * r2));
+				float sinTheta = std::min(std::max(sqrtf(1.0f - cosTheta * cosTheta), 0.0f), 1.0f);
+
+				Vector3 halfVec = tangentX * (sinTheta * cosf(phi)) + tangentY * (sinTheta * sinf(phi)) + N * cosTheta;
+				bsdfSampleRec.bsdfDir = halfVec * (2.0f * Dot(V, halfVec)) - V;
+			}
+
+			bsdfSampleRec.pdf = UE4Pdf(r.direction, state.ffnormal, state.mat, bsdfSampleRec.bsdfDir);
+
+			if (bsdfSampleRec.pdf > 0.0f) {
+				throughput *= UE4Eval(r.direction, state.ffnormal, state.mat, bsdfSampleRec.bsdfDir) * (fabsf(Dot(state.ffnormal, bsdfSampleRec.bsdfDir)) / bsdfSampleRec.pdf);
+			}
+			else {
+				return false;
+			}
+		}
+		else // Glass
+		{
+			state.specularBounce = true;
+
+			// GlassSample
+			float n1 = 1.0f;
+			float n2 = state.mat.ior;
+			float R0 = (n1 - n2) / (n1 + n2);
+			R0 *= R0;
+			float theta = Dot(-r.direction, state.ffnormal);
+			float prob  = R0 + (1.0f - R0) * SchlickFresnel(theta);
+
+			float eta = Dot(state.normal, state.ffnormal) > 0.0f ? (n1 / n2) : (n2 / n1);
+			float cos2t = 1.0f - eta * eta * (1.0f - theta * theta);
+
+			if (cos2t < 0.0f || sampler.Next() < prob) {
+				bsdfSampleRec.bsdfDir = Normalize(Reflect(r.direction, state.ffnormal));
+			}
+			else {
+				bsdfSampleRec.bsdfDir = Normalize(Refract(r.direction, state.ffnormal, eta));
+			}
+			bsdfSampleRec.pdf = 1.0f;
+
+			throughput *= state.mat.albedo;
+		}
+
+		r.direction = bsdfSampleRec.bsdfDir;
+		r.origin    = state.fhp + r.direction * kEps;
+
+		return true;
+	}
+
+	float CpuRenderer::ClosestHit(const Ray& r, State& state, LightSampleRec& lightSampleRec) const
+	{
+		float t = IntersectEmitters(r, state, lightSampleRec);
+
+		BvhTraverser::Hit hit;
+		if (traverser.Intersect(r.origin, r.direction, t, hit))
+		{
+			t = hit.t;
+			SetTriangleHit(r, hit, state);
+		}
+
+		state.hitDist = t;
+		return t;
+	}
+
+	float CpuRenderer::IntersectEmitters(const Ray& r, State& state, LightSampleRec& lightSampleRec) const
+	{
+		float t = kInfinity;
+
+		// Intersect Emitters
+		for (int i = 0; i < scene->lights.size(); i++)
+		{
+			const Light& light = scene->lights[i];
+
+			if (light.type == 0.0f) // Rectangular Area Light
+			{
+				Vector3 normal = Normalize(Cross(light.u, light.v));
+				Vector3 u = light.u * (1.0f / Dot(light.u, light.u));
+				Vector3 v = light.v * (1.0f / Dot(light.v, light.v));
+
+				float d = RectIntersect(light.position, u, v, normal, Dot(normal, light.position), r.origin, r.direction);
+				if (d < 0.0f) {
+					d = kInfinity;
+				}
+				if (d < t)
+				{
+					t = d;
+					float cosTheta = Dot(-r.direction, normal);
+					lightSampleRec.emission = light.emission;
+					lightSampleRec.pdf      = (t * t) / (light.area * cosTheta);
+					state.isEmitter         = true;
+				}
+			}
+			if (light.type == 1.0f) // Spherical Area Light
+			{
+				float d = SphereIntersect(light.radius, light.position, r.origin, r.direction);
+				if (d < 0.0f) {
+					d = kInfinity;
+				}
+				if (d < t)
+				{
+					t = d;
+					lightSampleRec.emission = light.emission;
+					lightSampleRec.pdf      = (t * t) / light.area;
+					state.isEmitter         = true;
+				}
+			}
+		}
+
+		return t;
+	}
+
+	void CpuRenderer::SetTriangleHit(const Ray& r, const BvhTraverser::Hit& hit, State& state) const
+	{
+		const Indices& vertIndices = scene->vertIndices[hit.triangle];
+
+		state.isEmitter  = false;
+		state.triID      = vertIndices;
+		state.matID      = hit.matID;
+		state.instance   = hit.instance;
+		state.bary       = Vector3(1.0f - hit.u - hit.v, hit.u, hit.v);
+		state.texCoordsU = Vector3(scene->verticesUVX[vertIndices.x].w, scene->verticesUVX[vertIndices.y].w, scene->verticesUVX[vertIndices.z].w);
+		state.fhp        = r.origin + r.direction * hit.t;
+	}
+
+	bool CpuRenderer::AnyHit(const Ray& r, float maxDist) const
+	{
+		return traverser.Occluded(r.origin, r.direction, maxDist);
+	}
+
+	void CpuRenderer::GetNormalsAndTexCoord(State& state, const Ray& r) const
+	{
+		const Vector4& n1 = scene->normalsUVY[state.triID.x];
+		const Vector4& n2 = scene->normalsUVY[state.triID.y];
+		const Vector4& n3 = scene->normalsUVY[state.triID.z];
+
+		state.texCoord[0] = state.texCoordsU.x * state.bary.x + state.texCoordsU.y * state.bary.y + state.texCoordsU.z * state.bary.z;
+		state.texCoord[1] = n1.w * state.bary.x + n2.w * state.bary.y + n3.w * state.bary.z;
+
+		Vector3 normal = Normalize(XYZ(n1) * state.bary.x + XYZ(n2) * state.bary.y + XYZ(n3) * state.bary.z);
+		normal = Normalize(TransformDirection(normalTransforms[state.instance], normal));
+
+		state.normal   = normal;
+		state.ffnormal = Dot(normal, r.direction) <= 0.0f ? normal : -normal;
+	}
+
+	void CpuRenderer::GetMaterialsAndTextures(State& state, const Ray& r) const
+	{
+		Material mat = scene->materials[state.matID];
+
+		float u = state.texCoord[0];
+		float v = 1.0f - state.texCoord[1];
+
+		if ((int)mat.albedoTexID >= 0) {
+			mat.albedo *= Pow(SampleTexture((int)mat.albedoTexID, u, v), 2.2f);
+		}
+
+		if ((int)mat.paramsTexID >= 0)
+		{
+			Vector3 params = SampleTexture((int)mat.paramsTexID, u, v);
+			mat.metallic  = powf(params.z, 2.2f);
+			mat.roughness = powf(params.y, 2.2f);
+		}
+
+		if ((int)mat.normalmapTexID >= 0)
+		{
+			Vector3 nrm = Normalize(SampleTexture((int)mat.normalmapTexID, u, v) * 2.0f - 1.0f);
+
+			// Orthonormal Basis
+			Vector3 upVector = fabsf(state.ffnormal.z) < 0.999f ? Vector3(0.0f, 0.0f, 1.0f) : Vector3(1.0f, 0.0f, 0.0f);
+			Vector3 tangentX = Normalize(Cross(upVector, state.ffnormal));
+			Vector3 tangentY = Cross(state.ffnormal, tangentX);
+
+			nrm = tangentX * nrm.x + tangentY * nrm.y + state.ffnormal * nrm.z;
+			state.normal   = Normalize(nrm);
+			state.ffnormal = Dot(state.normal, r.direction) <= 0.0f ? state.normal : -state.normal;
+		}
+
+		if ((int)mat.emissionTexID >= 0) {
+			mat.emission *= Pow(SampleTexture((int)mat.emissionTexID, u, v), 2.2f);
+		}
+
+		state.mat = mat;
+	}
+
+	int CpuRenderer::SampleLights(const Ray& r, const State& state, Sampler& sampler, ShadowRay* shadowRays) const
+	{
+		int numShadowRays = 0;
+
+		Vector3 surfacePos = state.fhp + state.ffnormal * kEps;
+
+		/* Environment Light */
+		if (useEnvMap)
+		{
+			Vector3 color;
+			float lightPdf;
+			Vector3 lightDir = EnvSample(color, lightPdf, sampler);
+
+			float bsdfPdf = UE4Pdf(r.direction, state.ffnormal, state.mat, lightDir);
+			Vector3 f = UE4Eval(r.direction, state.ffnormal, state.mat, lightDir);
+
+			float misWeight = PowerHeuristic(lightPdf, bsdfPdf);
+			if (misWeight > 0.0f)
+			{
+				ShadowRay& shadowRay = shadowRays[numShadowRays++];
+				shadowRay.ray.origin    = surfacePos;
+				shadowRay.ray.direction = lightDir;
+				shadowRay.maxDist       = kInfinity - kEps;
+				shadowRay.radiance      = f * color * (misWeight * fabsf(Dot(lightDir, state.ffnormal)) / lightPdf);
+			}
+		}
+
+		/* Sample Analytic Lights */
+		int numOfLights = (int)scene->lights.size();
+		if (numOfLights > 0)
+		{
+			// Pick a light to sample
+			int index = std::min((int)(sampler.Next() * numOfLights), numOfLights - 1);
+			const Light& light = scene->lights[index];
+
+			float r1 = sampler.Next();
+			float r2 = sampler.Next();
+
+			LightSampleRec lightSampleRec;
+			if ((int)light.type == 0) // Quad Light
+			{
+				lightSampleRec.surfacePos = light.position + light.u * r1 + light.v * r2;
+				lightSampleRec.normal     = Normalize(Cross(light.u, light.v));
+			}
+			else
+			{
+				lightSampleRec.surfacePos = light.position + UniformSampleSphere(r1, r2) * light.radius;
+				lightSampleRec.normal     = Normalize(lightSampleRec.surfacePos - light.position);
+			}
+			lightSampleRec.emission = light.emission * (float)numOfLights;
+
+			Vector3 lightDir  = lightSampleRec.surfacePos - surfacePos;
+			float lightDist   = lightDir.Size();
+			float lightDistSq = lightDist * lightDist;
+			lightDir /= lightDist;
+
+			if (Dot(lightDir, state.ffnormal) <= 0.0f || Dot(lightDir, lightSampleRec.normal) >= 0.0f) {
+				return numShadowRays;
+			}
+
+			float bsdfPdf  = UE4Pdf(r.direction, state.ffnormal, state.mat, lightDir);
+			Vector3 f      = UE4Eval(r.direction, state.ffnormal, state.mat, lightDir);
+			float lightPdf = lightDistSq / (light.area * fabsf(Dot(lightSampleRec.normal, lightDir)));
+
+			ShadowRay& shadowRay = shadowRays[numShadowRays++];
+			shadowRay.ray.origin    = surfacePos;
+			shadowRay.ray.direction = lightDir;
+			shadowRay.maxDist       = lightDist - kEps;
+			shadowRay.radiance      = f * lightSampleRec.emission * (PowerHeuristic(lightPdf, bsdfPdf) * fabsf(Dot(state.ffnormal, lightDir)) / lightPdf);
+		}
+
+		return numShadowRays;
+	}
+
+	Vector3 CpuRenderer::EnvSample(Vector3& color, float& pdf, Sampler& sampler) const
+	{
+		const HDRData* hdr = scene->hdrData;
+
+		float r1 = sampler.Next();
+		float r2 = sampler.Next();
+
+		// The distribution textures are sampled with nearest filtering
+		int marginalX = Wrap((int)floorf(r1 * hdr->height), hdr->height);
+		float v = hdr->marginalDistData[marginalX].x;
+
+		int row = Wrap((int)floorf(v * hdr->height), hdr->height);
+		int condX = Wrap((int)floorf(r2 * hdr->width), hdr->width);
+		float u = hdr->conditionalDistData[row * hdr->width + condX].x;
+
+		color = SampleEnvMap(u, v) * scene->renderOptions.intensity;
+
+		int column = Wrap((int)floorf(u * hdr->width), hdr->width);
+		pdf = hdr->conditionalDistData[row * hdr->width + column].y * hdr->marginalDistData[row].y;
+
+		float phi   = u * kTwoPi;
+		float theta = v * kPi;
+
+		if (sinf(theta) == 0.0f) {
+			pdf = 0.0f;
+		}
+
+		pdf = (pdf * (float)hdr->width * (float)hdr->height) / (2.0f * kPi * kPi * sinf(theta));
+
+		return Vector3(-sinf(theta) * cosf(phi), cosf(theta), -sinf(theta) * sinf(phi));
+	}
+
+	float CpuRenderer::EnvPdf(const Ray& r) const
+	{
+		const HDRData* hdr = scene->hdrData;
+
+		float theta = acosf(std::min(std::max(r.direction.y, -1.0f), 1.0f));
+		float u = (kPi + atan2f(r.direction.z, r.direction.x)) * (1.0f / kTwoPi);
+		float v = theta * (1.0f / kPi);
+
+		int row    = Wrap((int)floorf(v * hdr->height), hdr->height);
+		int column = Wrap((int)floorf(u * hdr->width), hdr->width);
+		float pdf  = hdr->conditionalDistData[row * hdr->width + column].y * hdr->marginalDistData[row].y;
+
+		return (pdf * (float)hdr->width * (float)hdr->height) / (2.0f * kPi * kPi * sinf(theta));
+	}
+
+	Vector3 CpuRenderer::SampleTexture(int texID, float u, float v) const
+	{
+		// Bilinear and repeating like the texture array, rows start at v = 0
+		int w = scene->texWidth;
+		int h = scene->texHeight;
+		const uint8* texels = &scene->textureMapsArray[(size_t)texID * w * h * 3];
+
+		float x = u * w - 0.5f;
+		float y = v * h - 0.5f;
+		int x0 = (int)floorf(x);
+		int y0 = (int)floorf(y);
+		float fx = x - x0;
+		float fy = y - y0;
+
+		Vector3 result(0.0f, 0.0f, 0.0f);
+		for (int j = 0; j < 2; ++j)
+		{
+			for (int i = 0; i < 2; ++i)
+			{
+				const uint8* texel = texels + ((size_t)Wrap(y0 + j, h) * w + Wrap(x0 + i, w)) * 3;
+				float weight = (i ? fx : 1.0f - fx) * (j ? fy : 1.0f - fy);
+				result += Vector3(texel[0], texel[1], texel[2]) * (weight / 255.0f);
+			}
+		}
+
+		return result;
+	}
+
+	Vector3 CpuRenderer::SampleEnvMap(float u, float v) const
+	{
+		const HDRData* hdr = scene->hdrData;
+
+		float x = u * hdr->width - 0.5f;
+		float y = v * hdr->height - 0.5f;
+		int x0 = (int)floorf(x);
+		int y0 = (int)floorf(y);
+		float fx = x - x0;
+		float fy = y - y0;
+
+		Vector3 result(0.0f, 0.0f, 0.0f);
+		for (int j = 0; j < 2; ++j)
+		{
+			for (int i = 0; i < 2; ++i)
+			{
+				const float* texel = hdr->cols + ((size_t)Wrap(y0 + j, hdr->height) * hdr->width + Wrap(x0 + i, hdr->width)) * 3;
+				float weight = (i ? fx : 1.0f - fx) * (j ? fy : 1.0f - fy);
+				result += Vector3(texel[0], texel[1], texel[2]) * weight;
+			}
+		}
+
+		return result;
+	}
+
+	void CpuRenderer::ReadRadiance(std::vector<Vector3>& pixels) const
+	{
+		float invSampleCounter = 1.0f / std::max(sampleCounter, 1);
+
+		pixels.resize(accumulation.size());
+		for (int y = 0; y < height; ++y)
+		{
+			for (int x = 0; x < width; ++x) {
+				pixels[(height - 1 - y) * width + x] = accumulation[y * width + x] * invSampleCounter;
+			}
+		}
+	}
+
+	void CpuRenderer::ReadPixels(std::vector<uint8>& pixels) const
+	{
+		std::vector<Vector3> radiance;
+		ReadRadiance(radiance);
+
+		pixels.resize(radiance.size() * 3);
+		for (size_t i = 0; i < radiance.size(); ++i)
+		{
+			// ToneMap(color, 1.5) and gamma of Output.glsl
+			Vector3 c = radiance[i];
+			float luminance = 0.3f * c.x + 0.6f * c.y + 0.1f * c.z;
+			c = Pow(c * (1.0f / (1.0f + luminance / 1.5f)), 1.0f / 2.2f);
+
+			for (int k = 0; k < 3; ++k) {
+				pixels[i * 3 + k] = (uint8)(std::min(std::max(c[k], 0.0f), 1.0f) * 255.0f + 0.5f);
+			}
+		}
+	}
+
+	bool CpuRenderer::SaveImage(const std::string& filename) const
+	{
+		std::vector<uint8> pixels;
+		ReadPixels(pixels);
+
+		if (pixels.empty() || !stbi_write_png(filename.c_str(), width, height, 3, &pixels[0], width * 3))
+		{
+			printf("Unable to write %s\n", filename.c_str());
+			return false;
+		}
+
+		return true;
+	}
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+#include "Renderer.h"
+#include "BvhTraverser.h"
+#include "math/Vector3.h"
+#include "math/Matrix4x4.h"
+
+namespace GLSLPT
+{
+    class Scene;
+
+    // Path traces the scene on the CPU without an OpenGL context. Runs the logic of
+    // shaders/common/Pathtrace.glsl on the arrays the Scene flattens for the GPU,
+    // one sample per pixel and Render, in tiles across the scene task pool. Camera rays are
+    // traced through the BVH in packets of 4x4 pixels.
+    class CpuRenderer : public Renderer
+    {
+    public:
+        enum Integrator
+        {
+            // Every path is traced to its end before the next pixel starts, like the shaders
+            kPerPixel,
+            // All paths of a wave advance one bounce at a time in separate passes: camera rays,
+            // closest hits sorted by origin cell and direction octant, shading sorted by material
+            // and shadow rays. Gives the same image as kPerPixel.
+            kWavefront
+        };
+
+        CpuRenderer(Scene* scene);
+        ~CpuRenderer();
+
+        bool Init();
+        void Dispose();
+
+        void Render();
+        void Update(float secondsElapsed);
+        float GetProgress() const;
+        int GetSampleCount() const;
+
+        // Averaged linear radiance, width * height pixels from the top row down
+        void ReadRadiance(std::vector<Vector3>& pixels) const;
+
+        // Tone mapped and gamma corrected like shaders/Output.glsl, 8 bit RGB from the top row down
+        void ReadPixels(std::vector<uint8>& pixels) const;
+
+        // Writes ReadPixels to a png file
+        bool SaveImage(const std::string& filename) const;
+
+        void SetIntegrator(Integrator integrator)
+        {
+            this->integrator = integrator;
+        }
+
+        Integrator GetIntegrator() const
+        {
+            return integrator;
+        }
+
+        // Closest hit and shadow rays traced since Init
+        long long GetRayCount() const
+        {
+            return rayCount;
+        }
+
+        int GetWidth() const
+        {
+            return width;
+        }
+
+        int GetHeight() const
+        {
+            return height;
+        }
+
+	private:
+		struct Ray;
+		struct State;
+		struct LightSampleRec;
+		struct BsdfSampleRec;
+		class Sampler;
+		struct Path;
+		struct ShadowRay;
+		struct QueuedRay;
+		struct Wavefront;
+
+		// Inverse and normal matrices of the instance transforms
+		void UpdateTransforms();
+
+		// Camera and options the next samples are traced with
+		void UpdateParameters();
+
+		void RenderTile(int tile);
+
+		void RenderWavefront();
+
+		// Camera ray of pixel x, y for the current sample
+		void GeneratePath(int x, int y, Path& path) const;
+
+		// Continues path from the hit of its ray, returns the rays traced
+		int PathTrace(Path& path) const;
+
+		// One bounce of Pathtrace.glsl at the hit of the path ray. Adds what the path sees to its
+		// radiance, samples the lights into shadowRays whose radiance counts where they are
+		// unoccluded and continues the ray along a BSDF sample. False when the path ends.
+		bool ShadeHit(Path& path, ShadowRay* shadowRays, int& numShadowRays) const;
+
+		float ClosestHit(const Ray& r, State& state, LightSampleRec& lightSampleRec) const;
+
+		float IntersectEmitters(const Ray& r, State& state, LightSampleRec& lightSampleRec) const;
+
+		void SetTriangleHit(const Ray& r, const BvhTraverser::Hit& hit, State& state) const;
+
+		bool AnyHit(const Ray& r, float maxDist) const;
+
+		void GetNormalsAndTexCoord(State& state, const Ray& r) const;
+
+		void GetMaterialsAndTextures(State& state, const Ray& r) const;
+
+		// Environment and light samples of DirectLight, up to two shadow rays
+		int SampleLights(const Ray& r, const State& state, Sampler& sampler, ShadowRay* shadowRays) const;
+
+		Vector3 EnvSample(Vector3& color, float& pdf, Sampler& sampler) const;
+
+		float EnvPdf(const Ray& r) const;
+
+		Vector3 SampleTexture(int texID, float u, float v) const;
+
+		Vector3 SampleEnvMap(float u, float v) const;
+
+		int width;
+		int height;
+		int numTilesX;
+		int numTilesY;
+		int maxDepth;
+		bool useEnvMap;
+
+		Integrator integrator;
+
+		int sampleCounter;
+		std::atomic<int> tilesDone;
+		std::atomic<long long> rayCount;
+
+		// Sum of all samples per pixel, bottom row first like the GL framebuffers
+		std::vector<Vector3> accumulation;
+		std::vector<Matrix4x4> normalTransforms;
+
+		BvhTraverser traverser;
+
+		// Queues of the wavefront integrator, kept between samples
+		std::unique_ptr<Wavefront> wavefront;
+
+		Vector3 cameraPosition;
+		Vector3 cameraRight;
+		Vector3 cameraUp;
+		Vector3 cameraForward;
+		float cameraFov;
+		float cameraFocalDist;
+		float cameraAperture;
+    };
+}
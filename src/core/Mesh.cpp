@@ -1,6 +1,10 @@
 #include <iostream>
 
 #include "Mesh.h"
+#include "bvh/LinearBvh.h"
+#include "bvh/PlocBvh.h"
+#include "bvh/EarlySplitBvh.h"
+#include "job/TaskGroup.h"
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "parser/tiny_obj_loader.h"
@@ -70,22 +74,159 @@ namespace GLSLPT
 		return true;
 	}
 
-	void Mesh::BuildBVH()
+	void Mesh::SetBvhType(BvhType type)
+	{
+		if (bvhType == type) {
+			return;
+		}
+
+		delete bvh;
+
+		switch (type)
+		{
+		case SAH_BVH:
+			bvh = new RadeonRays::Bvh(2.0f, 64, true);
+			break;
+		case LINEAR_BVH:
+			bvh = new RadeonRays::LinearBvh(2.0f);
+			break;
+		case PLOC_BVH:
+			bvh = new RadeonRays::PlocBvh(2.0f);
+			break;
+		case EARLY_SPLIT_BVH:
+			bvh = new RadeonRays::EarlySplitBvh(2.0f);
+			break;
+		default:
+			bvh = new RadeonRays::SplitBvh(2.0f, 64, 0, 0.001f, 2.5f);
+			break;
+		}
+
+		bvhType = type;
+	}
+
+	void Mesh::SetLeafParams(int maxLeafSize, float intersectionCost)
+	{
+		this->maxLeafSize      = maxLeafSize;
+		this->intersectionCost = intersectionCost;
+	}
+
+	void Mesh::SetTreeletOptimization(int treeletSize)
+	{
+		this->treeletSize = treeletSize;
+	}
+
+	void Mesh::SetNodeLayout(RadeonRays::Bvh::NodeLayout layout)
+	{
+		this->nodeLayout = layout;
+	}
+
+	void Mesh::ComputeTriangleBounds(std::vector<Bounds3D>& bounds) const
 	{
 		const int numTris = verticesUVX.size() / 3;
-		std::vector<Bounds3D> bounds(numTris);
+		bounds.resize(numTris);
+
+		TaskGroup::ParallelFor(bvh->GetTaskPool(), numTris, 16384, [&](int32 begin, int32 end)
+		{
+			for (int i = begin; i < end; ++i)
+			{
+				const Vector3 v1 = Vector3(verticesUVX[i * 3 + 0]);
+				const Vector3 v2 = Vector3(verticesUVX[i * 3 + 1]);
+				const Vector3 v3 = Vector3(verticesUVX[i * 3 + 2]);
+
+				bounds[i] = Bounds3D();
+				bounds[i].Expand(v1);
+				bounds[i].Expand(v2);
+				bounds[i].Expand(v3);
+			}
+		});
+	}
 
-		for (int i = 0; i < numTris; ++i)
+	void Mesh::BindTriangles(bool bind)
+	{
+		if (bvhType == EARLY_SPLIT_BVH)
 		{
-			const Vector3 v1 = Vector3(verticesUVX[i * 3 + 0]);
-			const Vector3 v2 = Vector3(verticesUVX[i * 3 + 1]);
-			const Vector3 v3 = Vector3(verticesUVX[i * 3 + 2]);
+			const float* positions = bind && !verticesUVX.empty() ? &verticesUVX[0].x : nullptr;
+			static_cast<RadeonRays::EarlySplitBvh*>(bvh)->SetTriangles(positions, 4);
+		}
+	}
+
+	void Mesh::BuildBVH(const RadeonRays::BvhCache* cache)
+	{
+		bvh->SetMaxLeafSize(maxLeafSize);
+		bvh->SetIntersectionCost(intersectionCost);
+		BindTriangles(true);
 
-			bounds[i].Expand(v1);
-			bounds[i].Expand(v2);
-			bounds[i].Expand(v3);
+		const int numTris = verticesUVX.size() / 3;
+		uint64 key = 0;
+
+		if (cache)
+		{
+			key = ComputeCacheKey();
+			if (cache->Load(key, numTris, *bvh))
+			{
+				printf("Mesh %s bvh loaded from %s\n", name.c_str(), cache->GetEntryPath(key).c_str());
+				BindTriangles(false);
+				return;
+			}
+		}
+
+		std::vector<Bounds3D> bounds;
+		ComputeTriangleBounds(bounds);
+
+		bvh->Build(&bounds[0], (int)bounds.size());
+		BindTriangles(false);
+
+		OptimizeBVH();
+
+		if (cache) {
+			cache->Store(key, numTris, *bvh);
+		}
+	}
+
+	bool Mesh::RefitBVH()
+	{
+		std::vector<Bounds3D> bounds;
+		ComputeTriangleBounds(bounds);
+
+		// A refit that degraded too far builds again from the triangles
+		BindTriangles(true);
+		bool refitted = bvh->Refit(&bounds[0], (int)bounds.size());
+		BindTriangles(false);
+
+		if (refitted) {
+			return true;
+		}
+
+		OptimizeBVH();
+		return false;
+	}
+
+	uint64 Mesh::ComputeCacheKey() const
+	{
+		RadeonRays::ContentHash hash;
+		hash.Add((int)RadeonRays::BvhCache::kVersion);
+		hash.Add((int)bvhType);
+		hash.Add(treeletSize);
+		hash.Add((int)nodeLayout);
+		bvh->HashBuildParams(hash);
+
+		// Texture coordinates in w do not affect the tree
+		for (size_t i = 0; i < verticesUVX.size(); ++i) {
+			hash.Add(&verticesUVX[i], sizeof(float) * 3);
+		}
+
+		return hash.Get();
+	}
+
+	void Mesh::OptimizeBVH()
+	{
+		if (treeletSize > 0)
+		{
+			RadeonRays::Bvh::OptimizeStats stats = bvh->OptimizeTreelets(treeletSize);
+			printf("Mesh %s treelet optimization: SAH %.2f -> %.2f, %d treelets in %.1f ms\n",
+				name.c_str(), stats.sahBefore, stats.sahAfter, stats.numRestructured, stats.milliseconds);
 		}
 
-		bvh->Build(&bounds[0], numTris);
+		bvh->ReorderNodes(nodeLayout);
 	}
 }
@@ -6,14 +6,29 @@
 #include "math/Vector4.h"
 #include "math/Matrix4x4.h"
 #include "bvh/SplitBvh.h"
+#include "bvh/BvhCache.h"
 
 namespace GLSLPT
 {	
+	enum BvhType
+	{
+		SPLIT_BVH,
+		SAH_BVH,
+		LINEAR_BVH,
+		PLOC_BVH,
+		EARLY_SPLIT_BVH
+	};
+
 	class Mesh
 	{
 	public:
 		Mesh()
-			: loaded(false)
+			: bvhType(SPLIT_BVH)
+			, maxLeafSize(4)
+			, intersectionCost(1.0f)
+			, treeletSize(0)
+			, nodeLayout(RadeonRays::Bvh::kBuildOrder)
+			, loaded(false)
 		{ 
 			bvh = new RadeonRays::SplitBvh(2.0f, 64, 0, 0.001f, 2.5f); 
 		}
@@ -27,16 +42,50 @@ namespace GLSLPT
 			}
 		}
 		
-		void BuildBVH();
+		// Builds the BVH, or restores it from cache when that holds a tree of the same
+		// vertex positions and builder parameters. Built trees are stored in the cache.
+		void BuildBVH(const RadeonRays::BvhCache* cache = nullptr);
+
+		// Updates the BVH after verticesUVX moved, returns false when it had to be rebuilt
+		bool RefitBVH();
+
+		// Replaces the builder used by BuildBVH, must be called before the scene is built
+		void SetBvhType(BvhType type);
+
+		// Leaf parameters applied by BuildBVH, leaves take up to maxLeafSize triangles
+		// when the SAH with this intersection cost favours them over splitting
+		void SetLeafParams(int maxLeafSize, float intersectionCost);
+
+		// Runs the treelet optimizer with treelets of up to treeletSize leaves after
+		// every build of the BVH, 0 disables it
+		void SetTreeletOptimization(int treeletSize);
+
+		// Node order applied after every build of the BVH
+		void SetNodeLayout(RadeonRays::Bvh::NodeLayout layout);
 
 		bool LoadFromFile(const std::string& filename);
 
+	private:
+		void ComputeTriangleBounds(std::vector<Bounds3D>& bounds) const;
+
+		// Lends verticesUVX to builders that clip triangles for the next build or refit
+		void BindTriangles(bool bind);
+		void OptimizeBVH();
+
+		// Hash of the vertex positions and everything that shapes the built BVH
+		uint64 ComputeCacheKey() const;
+
 	public:
 		// Mesh Data
 		std::vector<Vector4> verticesUVX;
 		std::vector<Vector4> normalsUVY;
 
 		RadeonRays::Bvh* bvh;
+		BvhType bvhType;
+		int maxLeafSize;
+		float intersectionCost;
+		int treeletSize;
+		RadeonRays::Bvh::NodeLayout nodeLayout;
 		std::string name;
 		bool loaded;
 	};
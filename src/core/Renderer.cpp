@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "glad/glad.h"
 
 #include "Renderer.h"
@@ -5,6 +7,30 @@
 
 namespace GLSLPT
 {
+    // Merged [first, second) texture rows covering the node ranges
+    static std::vector<std::pair<int, int>> DirtyRows(const std::vector<RadeonRays::BvhTranslator::NodeRange>& ranges, int width)
+    {
+        std::vector<std::pair<int, int>> rows;
+        for (int i = 0; i < ranges.size(); ++i) {
+            rows.push_back(std::make_pair(ranges[i].begin / width, (ranges[i].end + width - 1) / width));
+        }
+
+        std::sort(rows.begin(), rows.end());
+
+        std::vector<std::pair<int, int>> merged;
+        for (int i = 0; i < rows.size(); ++i)
+        {
+            if (!merged.empty() && rows[i].first <= merged.back().second) {
+                merged.back().second = std::max(merged.back().second, rows[i].second);
+            }
+            else {
+                merged.push_back(rows[i]);
+            }
+        }
+
+        return merged;
+    }
+
     Program* LoadShaders(const std::string& vertFileName, const std::string& fragFileName)
     {
         std::vector<Shader> shaders;
@@ -69,33 +95,50 @@ namespace GLSLPT
 		printf("Renderer disposed!\n");
     }
 
-    void Renderer::Init()
+    bool Renderer::Init()
     {
 		if (initialized) {
-			return;
+			return true;
 		}
         
         if (scene == nullptr)
         {
 			printf("Error: No Scene Found\n");
-            return ;
+            return false;
         }
 
+		// The shaders walk the binary nodes of bvhTranslator
+		if (scene->renderOptions.compressedBvh)
+		{
+			printf("Error: The compressed BVH is only traced by the CPU renderer\n");
+			return false;
+		}
+
+		// Data textures are at most as high as they are wide, so the widths decide whether they fit
+		GLint maxTextureSize = 0;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+		int maxWidth = std::max(scene->bvhTranslator.nodeTexLayout.width, std::max(scene->indicesTexLayout.width, scene->triDataTexLayout.width));
+		if (maxWidth > maxTextureSize)
+		{
+			printf("Error: Scene data needs %dx%d textures, the device supports up to %d\n", maxWidth, maxWidth, maxTextureSize);
+			return false;
+		}
+
         quad = new Quad();
 
 		// Create texture for BVH Tree
-        bvhTex = new GfxTexture(GL_TEXTURE_2D, GL_RGB32I, GL_RGB_INTEGER, GL_INT, scene->bvhTranslator.nodeTexWidth, scene->bvhTranslator.nodeTexWidth, 1, &scene->bvhTranslator.nodes[0]);
+        bvhTex = new GfxTexture(GL_TEXTURE_2D, GL_RGB32I, GL_RGB_INTEGER, GL_INT, scene->bvhTranslator.nodeTexLayout.width, scene->bvhTranslator.nodeTexLayout.height, 1, &scene->bvhTranslator.nodes[0]);
 		
 		// Create texture for Bounding boxes
-        aabbMinTex = new GfxTexture(GL_TEXTURE_2D, GL_RGB32F, GL_RGB, GL_FLOAT, scene->bvhTranslator.nodeTexWidth, scene->bvhTranslator.nodeTexWidth, 1, &scene->bvhTranslator.bboxmin[0]);
-        aabbMaxTex = new GfxTexture(GL_TEXTURE_2D, GL_RGB32F, GL_RGB, GL_FLOAT, scene->bvhTranslator.nodeTexWidth, scene->bvhTranslator.nodeTexWidth, 1, &scene->bvhTranslator.bboxmax[0]);
+        aabbMinTex = new GfxTexture(GL_TEXTURE_2D, GL_RGB32F, GL_RGB, GL_FLOAT, scene->bvhTranslator.nodeTexLayout.width, scene->bvhTranslator.nodeTexLayout.height, 1, &scene->bvhTranslator.bboxmin[0]);
+        aabbMaxTex = new GfxTexture(GL_TEXTURE_2D, GL_RGB32F, GL_RGB, GL_FLOAT, scene->bvhTranslator.nodeTexLayout.width, scene->bvhTranslator.nodeTexLayout.height, 1, &scene->bvhTranslator.bboxmax[0]);
 		
 		// Create texture for VertexIndices
-        vertexIndicesTex = new GfxTexture(GL_TEXTURE_2D, GL_RGB32I, GL_RGB_INTEGER, GL_INT, scene->indicesTexWidth, scene->indicesTexWidth, 1, &scene->vertIndices[0]);
+        vertexIndicesTex = new GfxTexture(GL_TEXTURE_2D, GL_RGB32I, GL_RGB_INTEGER, GL_INT, scene->indicesTexLayout.width, scene->indicesTexLayout.height, 1, &scene->vertIndices[0]);
 		
 		// Create texture for Vertices
-        verticesTex = new GfxTexture(GL_TEXTURE_2D, GL_RGBA32F, GL_RGBA, GL_FLOAT, scene->triDataTexWidth, scene->triDataTexWidth, 1, &scene->verticesUVX[0]);
-        normalsTex = new GfxTexture(GL_TEXTURE_2D, GL_RGBA32F, GL_RGBA, GL_FLOAT, scene->triDataTexWidth, scene->triDataTexWidth, 1, &scene->normalsUVY[0]);
+        verticesTex = new GfxTexture(GL_TEXTURE_2D, GL_RGBA32F, GL_RGBA, GL_FLOAT, scene->triDataTexLayout.width, scene->triDataTexLayout.height, 1, &scene->verticesUVX[0]);
+        normalsTex = new GfxTexture(GL_TEXTURE_2D, GL_RGBA32F, GL_RGBA, GL_FLOAT, scene->triDataTexLayout.width, scene->triDataTexLayout.height, 1, &scene->normalsUVY[0]);
 
 		// Create texture for Materials
         materialsTex = new GfxTexture(GL_TEXTURE_2D, GL_RGBA32F, GL_RGBA, GL_FLOAT, (sizeof(Material) / sizeof(Vector4)) * scene->materials.size(), 1, 1, &scene->materials[0]);
@@ -127,27 +170,76 @@ namespace GLSLPT
             hdrConditionalDistTex = new GfxTexture(GL_TEXTURE_2D, GL_RG32F, GL_RG, GL_FLOAT, scene->hdrData->width, scene->hdrData->height, 1, scene->hdrData->conditionalDistData);
 		}
 
+		// Everything was just uploaded
+		scene->bvhTranslator.dirtyNodes.clear();
+		scene->bvhTranslator.dirtyBounds.clear();
+
         initialized = true;
+
+        return true;
     }
 	
 	void Renderer::Update(float secondsElapsed)
 	{
+		RadeonRays::BvhTranslator& translator = scene->bvhTranslator;
+		int width  = translator.nodeTexLayout.width;
+		int height = translator.nodeTexLayout.height;
+
+		if (scene->meshesModified)
+		{
+            verticesTex->SubImage2D(0, 0, 0, scene->triDataTexLayout.width, scene->triDataTexLayout.height, &scene->verticesUVX[0]);
+            normalsTex->SubImage2D(0, 0, 0, scene->triDataTexLayout.width, scene->triDataTexLayout.height, &scene->normalsUVY[0]);
+
+			if (scene->meshTopologyModified)
+			{
+				// The layout can change size after a rebuild, the renderer rebinds the new textures
+				if (bvhTex->GetWidth() != width || bvhTex->GetHeight() != height)
+				{
+					delete bvhTex;
+					delete aabbMinTex;
+					delete aabbMaxTex;
+
+					bvhTex = new GfxTexture(GL_TEXTURE_2D, GL_RGB32I, GL_RGB_INTEGER, GL_INT, width, height, 1, &translator.nodes[0]);
+					aabbMinTex = new GfxTexture(GL_TEXTURE_2D, GL_RGB32F, GL_RGB, GL_FLOAT, width, height, 1, &translator.bboxmin[0]);
+					aabbMaxTex = new GfxTexture(GL_TEXTURE_2D, GL_RGB32F, GL_RGB, GL_FLOAT, width, height, 1, &translator.bboxmax[0]);
+					translator.dirtyNodes.clear();
+					translator.dirtyBounds.clear();
+				}
+
+				if (vertexIndicesTex->GetWidth() != scene->indicesTexLayout.width || vertexIndicesTex->GetHeight() != scene->indicesTexLayout.height)
+				{
+					delete vertexIndicesTex;
+					vertexIndicesTex = new GfxTexture(GL_TEXTURE_2D, GL_RGB32I, GL_RGB_INTEGER, GL_INT, scene->indicesTexLayout.width, scene->indicesTexLayout.height, 1, &scene->vertIndices[0]);
+				}
+				else {
+					vertexIndicesTex->SubImage2D(0, 0, 0, scene->indicesTexLayout.width, scene->indicesTexLayout.height, &scene->vertIndices[0]);
+				}
+			}
+		}
+
 		if (scene->instancesModified)
 		{
             transformsTex->SubImage2D(0, 0, 0, (sizeof(Matrix4x4) / sizeof(Vector4)) * scene->transforms.size(), 1, &scene->transforms[0]);
             
             materialsTex->SubImage2D(0, 0, 0, (sizeof(Material) / sizeof(Vector4)) * scene->materials.size(), 1, &scene->materials[0]);
-            
-			int yPos  = scene->bvhTranslator.topLevelIndexPackedXY & 0x00000FFF;
-			int index = yPos * scene->bvhTranslator.nodeTexWidth;
+		}
 
-            bvhTex->SubImage2D(0, 0, yPos, scene->bvhTranslator.nodeTexWidth, scene->bvhTranslator.nodeTexWidth - yPos, &scene->bvhTranslator.nodes[index]);
-            
-            aabbMinTex->SubImage2D(0, 0, yPos, scene->bvhTranslator.nodeTexWidth, scene->bvhTranslator.nodeTexWidth - yPos, &scene->bvhTranslator.bboxmin[index]);
-            
-            aabbMaxTex->SubImage2D(0, 0, yPos, scene->bvhTranslator.nodeTexWidth, scene->bvhTranslator.nodeTexWidth - yPos, &scene->bvhTranslator.bboxmax[index]);
+		// Only the texture rows holding changed nodes are uploaded
+		std::vector<std::pair<int, int>> rows = DirtyRows(translator.dirtyNodes, width);
+		for (int i = 0; i < rows.size(); ++i) {
+			bvhTex->SubImage2D(0, 0, rows[i].first, width, rows[i].second - rows[i].first, &translator.nodes[rows[i].first * width]);
 		}
 
+		rows = DirtyRows(translator.dirtyBounds, width);
+		for (int i = 0; i < rows.size(); ++i)
+		{
+			aabbMinTex->SubImage2D(0, 0, rows[i].first, width, rows[i].second - rows[i].first, &translator.bboxmin[rows[i].first * width]);
+			aabbMaxTex->SubImage2D(0, 0, rows[i].first, width, rows[i].second - rows[i].first, &translator.bboxmax[rows[i].first * width]);
+		}
+
+		translator.dirtyNodes.clear();
+		translator.dirtyBounds.clear();
+
 		if (scene->hdrModified && hdrTex)
 		{
 			hdrTex->SubImage2D(0, 0, 0, scene->hdrData->width, scene->hdrData->height, scene->hdrData->cols);
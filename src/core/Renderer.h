@@ -1,6 +1,7 @@
 #pragma once
 
 #include <vector>
+#include <string>
 
 #include "math/Vector2.h"
 #include "gfx/GfxTexture.h"
@@ -25,6 +26,8 @@ namespace GLSLPT
             windowSize = Vector2(1280, 720);
             frameSize  = windowSize;
 			intensity  = 1.0f;
+			rebraidBudget = 2.0f;
+			compressedBvh = false;
         }
 
         Vector2 windowSize;
@@ -35,6 +38,12 @@ namespace GLSLPT
         int numTilesY;
         bool useEnvMap;
         float intensity;
+        // Top level primitives per instance when opening large instances, 1 disables re-braiding
+        float rebraidBudget;
+        // Directory of cached bottom level trees, empty always builds them
+        std::string bvhCacheDir;
+        // Lay the scene out as quantized 4-wide nodes, only the CPU renderer traces them
+        bool compressedBvh;
     };
 
     class Scene;
@@ -46,7 +55,8 @@ namespace GLSLPT
 
         virtual ~Renderer();
         
-        virtual void Init();
+        // False when the scene cannot be uploaded, the renderer stays uninitialized then
+        virtual bool Init();
         virtual void Dispose();
 
         virtual void Render() = 0;
@@ -1,6 +1,9 @@
 #include <iostream>
 #include <algorithm>
 #include <thread>
+#include <chrono>
+#include <memory>
+#include <climits>
 
 #include "Scene.h"
 #include "Camera.h"
@@ -14,6 +17,8 @@ namespace GLSLPT
 	{
 		taskPool = new TaskThreadPool();
 		taskPool->Create(std::max((int)std::thread::hardware_concurrency(), 8));
+		bvhTranslator.SetTaskPool(taskPool);
+		compressedBvhTranslator.SetTaskPool(taskPool);
 	}
 
 	Scene::~Scene() 
@@ -260,40 +265,17 @@ namespace GLSLPT
 
 	void Scene::CreateTLAS()
 	{
-		// Loop through all the mesh Instances and build a Top Level BVH
-		std::vector<Bounds3D> bounds;
-		bounds.resize(meshInstances.size());
+		// Open the large mesh Instances into BLAS subtrees and build an SAH Top Level BVH over them
+		RadeonRays::RebraidInstances(meshes, meshInstances, maxInstanceRefs, instanceRefs, instanceRefBounds);
 
+		instanceRefStart.assign(meshInstances.size() + 1, 0);
+		for (int i = 0; i < instanceRefs.size(); i++)
+		{
+			instanceRefStart[instanceRefs[i].instanceIndex + 1]++;
+		}
 		for (int i = 0; i < meshInstances.size(); i++)
 		{
-			Bounds3D bbox = meshes[meshInstances[i].meshID]->bvh->Bounds();
-			Matrix4x4 matrix = meshInstances[i].transform;
-
-			Vector3 minBound = bbox.min;
-			Vector3 maxBound = bbox.max;
-
-			Vector3 right       = Vector3(matrix.m[0][0], matrix.m[0][1], matrix.m[0][2]);
-			Vector3 up          = Vector3(matrix.m[1][0], matrix.m[1][1], matrix.m[1][2]);
-			Vector3 forward     = Vector3(matrix.m[2][0], matrix.m[2][1], matrix.m[2][2]);
-			Vector3 translation = Vector3(matrix.m[3][0], matrix.m[3][1], matrix.m[3][2]);
-
-			Vector3 xa = right * minBound.x;
-			Vector3 xb = right * maxBound.x;
-
-			Vector3 ya = up * minBound.y;
-			Vector3 yb = up * maxBound.y;
-
-			Vector3 za = forward * minBound.z;
-			Vector3 zb = forward * maxBound.z;
-
-            minBound = Vector3::Min(xa, xb) + Vector3::Min(ya, yb) + Vector3::Min(za, zb) + translation;
-            maxBound = Vector3::Max(xa, xb) + Vector3::Max(ya, yb) + Vector3::Max(za, zb) + translation;
-
-			Bounds3D bound;
-			bound.min = minBound;
-			bound.max = maxBound;
-
-			bounds[i] = bound;
+			instanceRefStart[i + 1] += instanceRefStart[i];
 		}
 
 		if (sceneBvh)
@@ -301,8 +283,9 @@ namespace GLSLPT
 			delete sceneBvh;
 			sceneBvh = nullptr;
 		}
-		sceneBvh = new RadeonRays::Bvh(10.0f, 64, false);
-		sceneBvh->Build(&bounds[0], bounds.size());
+		sceneBvh = new RadeonRays::Bvh(10.0f, 64, true);
+		sceneBvh->SetTaskPool(taskPool);
+		sceneBvh->Build(&instanceRefBounds[0], instanceRefBounds.size());
 
 		sceneBounds = sceneBvh->Bounds();
 	}
@@ -312,8 +295,9 @@ namespace GLSLPT
 		class BuildBVHJob : public ThreadTask
 		{
 		public:
-			BuildBVHJob(Mesh* inMesh)
+			BuildBVHJob(Mesh* inMesh, const RadeonRays::BvhCache* inCache)
 				: mesh(inMesh)
+				, cache(inCache)
 				, done(false)
 			{
 
@@ -321,7 +305,7 @@ namespace GLSLPT
 
 			virtual void DoThreadedWork() override
 			{
-				mesh->BuildBVH();
+				mesh->BuildBVH(cache);
 				done = true;
 			}
 
@@ -331,15 +315,22 @@ namespace GLSLPT
 			}
 
             Mesh* mesh;
+			const RadeonRays::BvhCache* cache;
 			bool done;
 		};
 
 		printf("Building bottom level bvh...\n");
 
+		std::unique_ptr<RadeonRays::BvhCache> cache;
+		if (!renderOptions.bvhCacheDir.empty()) {
+			cache.reset(new RadeonRays::BvhCache(renderOptions.bvhCacheDir));
+		}
+
 		// Loop through all meshes and build BVHs
 		std::vector<BuildBVHJob*> jobs(meshes.size());
 		for (int i = 0; i < meshes.size(); i++) {
-			jobs[i] = new BuildBVHJob(meshes[i]);
+			meshes[i]->bvh->SetTaskPool(taskPool);
+			jobs[i] = new BuildBVHJob(meshes[i], cache.get());
 			taskPool->AddTask(jobs[i]);
 		}
 
@@ -382,7 +373,12 @@ namespace GLSLPT
 		
 		CreateTLAS();
 
-		bvhTranslator.UpdateTLAS(sceneBvh, meshInstances);
+		if (renderOptions.compressedBvh) {
+			compressedBvhTranslator.UpdateTLAS(sceneBvh, meshInstances, instanceRefs);
+		}
+		else {
+			bvhTranslator.UpdateTLAS(sceneBvh, meshInstances, instanceRefs);
+		}
 		
 		// Copy transforms
 		for (int i = 0; i < meshInstances.size(); i++) 
@@ -393,6 +389,44 @@ namespace GLSLPT
 		instancesModified = true;
 	}
 
+	void Scene::UpdateInstances(const std::vector<int>& instanceIDs)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+
+		std::vector<int> refIDs;
+		for (int i = 0; i < instanceIDs.size(); i++)
+		{
+			for (int j = instanceRefStart[instanceIDs[i]]; j < instanceRefStart[instanceIDs[i] + 1]; j++)
+			{
+				instanceRefBounds[j] = RadeonRays::InstanceRefBounds(meshes, meshInstances, instanceRefs[j]);
+				refIDs.push_back(j);
+			}
+			transforms[instanceIDs[i]] = meshInstances[instanceIDs[i]].transform;
+		}
+
+		// Refit the paths above the moved instances and write back only the nodes that changed
+		std::vector<int> dirtyNodes;
+		RadeonRays::Bvh::UpdateStats stats = sceneBvh->UpdatePrimitives(&instanceRefBounds[0], instanceRefBounds.size(), refIDs, dirtyNodes);
+		// Quantized nodes are laid out as a whole, the refitted top level is collapsed again
+		if (renderOptions.compressedBvh) {
+			compressedBvhTranslator.UpdateTLAS(sceneBvh, meshInstances, instanceRefs);
+		}
+		else {
+			bvhTranslator.UpdateTLASNodes(dirtyNodes);
+		}
+
+		sceneBounds = sceneBvh->Bounds();
+
+		tlasUpdateStats.milliseconds  = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		tlasUpdateStats.numInstances  = (int)instanceIDs.size();
+		tlasUpdateStats.numDirtyNodes = (int)dirtyNodes.size();
+		tlasUpdateStats.numRotations  = stats.numRotations;
+		tlasUpdateStats.sahRatio      = sceneBvh->GetRefitSahRatio();
+		tlasUpdateStats.rebuilt       = stats.rebuilt;
+
+		instancesModified = true;
+	}
+
 	void Scene::ValidateTextures()
 	{
 		if (textures.size() == 0) {
@@ -418,7 +452,7 @@ namespace GLSLPT
 		texHeight = height;
 	}
 
-	void Scene::CreateAccelerationStructures()
+	bool Scene::CreateAccelerationStructures()
 	{
 		LoadAssets();
 
@@ -427,12 +461,70 @@ namespace GLSLPT
 		CreateBLAS();
 
 		printf("Building scene BVH\n");
+		maxInstanceRefs = std::max((int)meshInstances.size(), (int)(meshInstances.size() * renderOptions.rebraidBudget));
 		CreateTLAS();
 
+		if (!FlattenGeometry()) {
+			return false;
+		}
+
+		// Copy transforms
+		transforms.resize(meshInstances.size());
+		for (int i = 0; i < meshInstances.size(); i++) 
+		{
+			transforms[i] = meshInstances[i].transform;
+		}
+		
+		// Copy Textures
+		for (int i = 0; i < textures.size(); i++)
+		{
+			textureMapsArray.insert(textureMapsArray.end(), textures[i]->texData.begin(), textures[i]->texData.end());
+		}
+
+		return true;
+	}
+
+	bool Scene::FlattenGeometry()
+	{
+		vertIndices.clear();
+		verticesUVX.clear();
+		normalsUVY.clear();
+
 		// Flatten BVH
-		bvhTranslator.Process(sceneBvh, meshes, meshInstances);
+		auto start = std::chrono::high_resolution_clock::now();
+		if (renderOptions.compressedBvh)
+		{
+			if (!compressedBvhTranslator.Process(sceneBvh, meshes, meshInstances, instanceRefs)) {
+				return false;
+			}
+			printf("Compressed BVH uses %.2f MB, %.2f MB as binary nodes\n", compressedBvhTranslator.GetMemorySize() / (1024.0 * 1024.0),
+				compressedBvhTranslator.GetBinaryMemorySize() / (1024.0 * 1024.0));
+		}
+		else if (!bvhTranslator.Process(sceneBvh, meshes, meshInstances, instanceRefs, maxInstanceRefs)) {
+			return false;
+		}
+		printf("Flattened %d mesh bvhs in %.1f ms\n", (int)meshes.size(), std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
 
-		int verticesCnt = 0;
+		size_t verticesCnt = 0;
+		size_t indicesCnt  = 0;
+		for (int i = 0; i < meshes.size(); i++)
+		{
+			verticesCnt += meshes[i]->verticesUVX.size();
+			indicesCnt  += meshes[i]->bvh->GetNumIndices();
+		}
+
+		// Vertex indices are 32 bit texel values
+		if (verticesCnt > INT_MAX)
+		{
+			printf("Error: Scene has %zu vertices, at most %d can be addressed\n", verticesCnt, INT_MAX);
+			return false;
+		}
+
+		vertIndices.reserve(RadeonRays::TextureLayout::ForCount(indicesCnt).GetSize());
+		verticesUVX.reserve(RadeonRays::TextureLayout::ForCount(verticesCnt).GetSize());
+		normalsUVY.reserve(RadeonRays::TextureLayout::ForCount(verticesCnt).GetSize());
+
+		verticesCnt = 0;
 
 		// Copy mesh data
 		for (int i = 0; i < meshes.size(); i++)
@@ -443,10 +535,10 @@ namespace GLSLPT
 
 			for (int j = 0; j < numIndices; j++)
 			{
-				int index = triIndices[j];
-				int v1 = (index * 3 + 0) + verticesCnt;
-				int v2 = (index * 3 + 1) + verticesCnt;
-				int v3 = (index * 3 + 2) + verticesCnt;
+				size_t index = (size_t)triIndices[j] * 3 + verticesCnt;
+				int v1 = (int)(index + 0);
+				int v2 = (int)(index + 1);
+				int v3 = (int)(index + 2);
 
 				vertIndices.push_back(Indices{ v1, v2, v3 });
 			}
@@ -457,32 +549,122 @@ namespace GLSLPT
 			verticesCnt += meshes[i]->verticesUVX.size();
 		}
 
-		// Resize to power of 2
-		indicesTexWidth = (int)(sqrt(vertIndices.size()) + 1); 
-		triDataTexWidth = (int)(sqrt(verticesUVX.size())+ 1); 
+		indicesTexLayout = RadeonRays::TextureLayout::ForCount(vertIndices.size());
+		triDataTexLayout = RadeonRays::TextureLayout::ForCount(verticesUVX.size());
+
+		vertIndices.resize(indicesTexLayout.GetSize());
+		verticesUVX.resize(triDataTexLayout.GetSize());
+		normalsUVY.resize(triDataTexLayout.GetSize());
 
-		vertIndices.resize(indicesTexWidth * indicesTexWidth);
-		verticesUVX.resize(triDataTexWidth * triDataTexWidth);
-		normalsUVY.resize(triDataTexWidth * triDataTexWidth);
+		return true;
+	}
 
-		for (int i = 0; i < vertIndices.size(); i++)
+	void Scene::CreateTriangleBlocks(std::vector<TriangleBlock>& blocks, std::vector<int>& leafBlocks) const
+	{
+		const std::vector<RadeonRays::BvhTranslator::Node>& nodes = bvhTranslator.nodes;
+		int numNodes = bvhTranslator.topLevelIndex;
+
+		leafBlocks.assign(numNodes, -1);
+
+		int numBlocks = 0;
+		for (int i = 0; i < numNodes; i++)
 		{
-			vertIndices[i].x = ((vertIndices[i].x % triDataTexWidth) << 12) | (vertIndices[i].x / triDataTexWidth);
-			vertIndices[i].y = ((vertIndices[i].y % triDataTexWidth) << 12) | (vertIndices[i].y / triDataTexWidth);
-			vertIndices[i].z = ((vertIndices[i].z % triDataTexWidth) << 12) | (vertIndices[i].z / triDataTexWidth);
+			if (nodes[i].leaf > 0)
+			{
+				leafBlocks[i] = numBlocks;
+				numBlocks += (nodes[i].rightIndex + 3) / 4;
+			}
 		}
 
-		// Copy transforms
-		transforms.resize(meshInstances.size());
-		for (int i = 0; i < meshInstances.size(); i++) 
+		// Zeroed lanes are degenerate and never hit
+		blocks.assign(numBlocks, TriangleBlock());
+
+		for (int i = 0; i < numNodes; i++)
 		{
-			transforms[i] = meshInstances[i].transform;
+			if (nodes[i].leaf <= 0)
+				continue;
+
+			int first = nodes[i].leftIndex;
+			int count = nodes[i].rightIndex;
+
+			for (int j = 0; j < count; j++)
+			{
+				const Indices& indices = vertIndices[first + j];
+
+				const Vector4& v0 = verticesUVX[indices.x];
+				const Vector4& v1 = verticesUVX[indices.y];
+				const Vector4& v2 = verticesUVX[indices.z];
+
+				TriangleBlock& block = blocks[leafBlocks[i] + j / 4];
+				int lane = j % 4;
+
+				block.v0x[lane] = v0.x;
+				block.v0y[lane] = v0.y;
+				block.v0z[lane] = v0.z;
+				block.e0x[lane] = v1.x - v0.x;
+				block.e0y[lane] = v1.y - v0.y;
+				block.e0z[lane] = v1.z - v0.z;
+				block.e1x[lane] = v2.x - v0.x;
+				block.e1y[lane] = v2.y - v0.y;
+				block.e1z[lane] = v2.z - v0.z;
+			}
 		}
-		
-		// Copy Textures
-		for (int i = 0; i < textures.size(); i++)
+	}
+
+	bool Scene::RefitMeshes(const std::vector<int>& meshIDs)
+	{
+		bool rebuilt = false;
+
+		for (int i = 0; i < meshIDs.size(); i++) 
 		{
-			textureMapsArray.insert(textureMapsArray.end(), textures[i]->texData.begin(), textures[i]->texData.end());
+			if (!meshes[meshIDs[i]]->RefitBVH()) {
+				rebuilt = true;
+			}
+		}
+
+		if (rebuilt || renderOptions.compressedBvh)
+		{
+			// A rebuilt BVH can change size and no longer matches the subtrees the
+			// instances were opened into, so the top level and every mesh are laid out again.
+			// Quantized nodes cannot be refitted in place and are always laid out again.
+			CreateTLAS();
+			if (!FlattenGeometry()) {
+				return false;
+			}
+			meshTopologyModified = true;
+			instancesModified = true;
+		}
+		else
+		{
+			std::vector<int> vertexOffsets(meshes.size(), 0);
+			for (int i = 1; i < meshes.size(); i++) {
+				vertexOffsets[i] = vertexOffsets[i - 1] + meshes[i - 1]->verticesUVX.size();
+			}
+
+			for (int i = 0; i < meshIDs.size(); i++)
+			{
+				Mesh* mesh = meshes[meshIDs[i]];
+
+				bvhTranslator.RefitBLAS(meshIDs[i]);
+
+				std::copy(mesh->verticesUVX.begin(), mesh->verticesUVX.end(), verticesUVX.begin() + vertexOffsets[meshIDs[i]]);
+				std::copy(mesh->normalsUVY.begin(), mesh->normalsUVY.end(), normalsUVY.begin() + vertexOffsets[meshIDs[i]]);
+			}
+
+			// Instance bounds moved with the meshes
+			std::vector<int> instanceIDs;
+			for (int i = 0; i < meshInstances.size(); i++)
+			{
+				if (std::find(meshIDs.begin(), meshIDs.end(), meshInstances[i].meshID) != meshIDs.end()) {
+					instanceIDs.push_back(i);
+				}
+			}
+
+			UpdateInstances(instanceIDs);
 		}
+
+		meshesModified = true;
+
+		return true;
 	}
 }
@@ -13,6 +13,9 @@
 
 #include "bvh/Bvh.h"
 #include "bvh/BvhTranslator.h"
+#include "bvh/CompressedBvhTranslator.h"
+#include "bvh/BvhCache.h"
+#include "bvh/Rebraid.h"
 #include "parser/HDRLoader.h"
 #include "math/Math.h"
 #include "math/Vector4.h"
@@ -28,6 +31,26 @@ namespace GLSLPT
 		int x, y, z;
 	};
 
+	// Up to four consecutive triangles of a BVH leaf in SoA, the first vertex and the edges from
+	// it to the second and third vertex
+	struct TriangleBlock
+	{
+		float v0x[4], v0y[4], v0z[4];
+		float e0x[4], e0y[4], e0z[4];
+		float e1x[4], e1y[4], e1z[4];
+	};
+
+	// Cost of the last incremental top level update
+	struct TLASUpdateStats
+	{
+		double milliseconds = 0.0;
+		int numInstances = 0;
+		int numDirtyNodes = 0;
+		int numRotations = 0;
+		float sahRatio = 1.0f;
+		bool rebuilt = false;
+	};
+
 	class Scene
 	{
 	public:
@@ -53,10 +76,27 @@ namespace GLSLPT
 
 		void AddHDR(const std::string& filename);
 
-		void CreateAccelerationStructures();
+		// False when the scene is too large to be flattened, it cannot be rendered then
+		bool CreateAccelerationStructures();
 
 		void RebuildInstancesData();
 
+		// Call after changing the transforms of the given instances. Refits the top level BVH
+		// along their paths instead of rebuilding it, the cost is kept in tlasUpdateStats.
+		void UpdateInstances(const std::vector<int>& instanceIDs);
+
+		// Call after changing verticesUVX / normalsUVY of the given meshes without changing
+		// their triangle count. Refits their BVHs and the scene data in place, falls back
+		// to a full layout when a BVH degraded enough to be rebuilt. False when the rebuilt
+		// layout is too large, the scene cannot be rendered then.
+		bool RefitMeshes(const std::vector<int>& meshIDs);
+
+		// Every mesh BVH leaf starts a new block, triangle i of the leaf is lane i % 4 of its block
+		// i / 4 and the lanes past its last triangle are degenerate. leafBlocks holds the first
+		// block of each leaf of bvhTranslator.nodes and -1 for the other mesh BVH nodes.
+		// Rebuild after RefitMeshes.
+		void CreateTriangleBlocks(std::vector<TriangleBlock>& blocks, std::vector<int>& leafBlocks) const;
+
 		void Resize(int wWidth, int wHeight, int fWidth, int fHeight);
 
 		void Update(float deltaTime);
@@ -66,6 +106,7 @@ namespace GLSLPT
 		void CreateTLAS();
 		void LoadAssets();
 		void ValidateTextures();
+		bool FlattenGeometry();
 
 	public:
 		// Options
@@ -88,11 +129,13 @@ namespace GLSLPT
 		std::vector<Vector4>		verticesUVX;
 		std::vector<Vector4>		normalsUVY;
 		std::vector<Matrix4x4>		transforms;
-		// texture size
-		int							indicesTexWidth;
-		int							triDataTexWidth;
+		// texture size, vertIndices hold linear indices into the vertex textures
+		RadeonRays::TextureLayout	indicesTexLayout;
+		RadeonRays::TextureLayout	triDataTexLayout;
 		// Bvh
 		RadeonRays::BvhTranslator	bvhTranslator;
+		// Used instead of bvhTranslator when renderOptions.compressedBvh is set
+		RadeonRays::CompressedBvhTranslator compressedBvhTranslator;
 		// Texture Data
 		std::vector<Texture*>		textures;
 		std::vector<uint8>			textureMapsArray;
@@ -100,10 +143,18 @@ namespace GLSLPT
 		int							texHeight;
 		Bounds3D					sceneBounds;
 		bool						instancesModified = false;
+		bool						meshesModified = false;
+		bool						meshTopologyModified = false;
+		TLASUpdateStats				tlasUpdateStats;
 		// thread pool
 		TaskThreadPool*				taskPool = nullptr;
 
 	private:
 		RadeonRays::Bvh*			sceneBvh;
+		// Top level primitives, grouped by instance starting at instanceRefStart
+		std::vector<RadeonRays::InstanceRef> instanceRefs;
+		std::vector<Bounds3D>		instanceRefBounds;
+		std::vector<int>			instanceRefStart;
+		int							maxInstanceRefs = 0;
 	};
 }
@@ -22,13 +22,15 @@ namespace GLSLPT
 
     }
 
-    void TiledRenderer::Init()
+    bool TiledRenderer::Init()
     {
 		if (initialized) {
-			return;
+			return true;
 		}
         
-        Renderer::Init();
+        if (!Renderer::Init()) {
+			return false;
+		}
 
 		sampleCounter = 1;
 		currentBuffer = 0;
@@ -128,8 +130,10 @@ namespace GLSLPT
 			shaderObject = pathTraceShader->Object();
 
 			glUniform1f(glGetUniformLocation(shaderObject, "hdrResolution"), scene->hdrData == nullptr ? 0 : float(scene->hdrData->width * scene->hdrData->height));
-			glUniform1i(glGetUniformLocation(shaderObject, "topBVHIndex"), scene->bvhTranslator.topLevelIndexPackedXY);
-			glUniform1i(glGetUniformLocation(shaderObject, "vertIndicesSize"), scene->indicesTexWidth);
+			glUniform1i(glGetUniformLocation(shaderObject, "topBVHIndex"), scene->bvhTranslator.topLevelIndex);
+			glUniform1i(glGetUniformLocation(shaderObject, "nodeTexWidthLog2"), scene->bvhTranslator.nodeTexLayout.widthLog2);
+			glUniform1i(glGetUniformLocation(shaderObject, "indicesTexWidthLog2"), scene->indicesTexLayout.widthLog2);
+			glUniform1i(glGetUniformLocation(shaderObject, "triDataTexWidthLog2"), scene->triDataTexLayout.widthLog2);
 			glUniform2f(glGetUniformLocation(shaderObject, "screenResolution"), frameSize.x, frameSize.y);
 			glUniform1i(glGetUniformLocation(shaderObject, "numOfLights"), numOfLights);
 			glUniform1f(glGetUniformLocation(shaderObject, "invTileWidth"), 1.0f / numTilesX);
@@ -157,8 +161,10 @@ namespace GLSLPT
 			shaderObject = pathTraceShaderLowRes->Object();
 
 			glUniform1f(glGetUniformLocation(shaderObject, "hdrResolution"), scene->hdrData == nullptr ? 0 : float(scene->hdrData->width * scene->hdrData->height));
-			glUniform1i(glGetUniformLocation(shaderObject, "topBVHIndex"), scene->bvhTranslator.topLevelIndexPackedXY);
-			glUniform1i(glGetUniformLocation(shaderObject, "vertIndicesSize"), scene->indicesTexWidth);
+			glUniform1i(glGetUniformLocation(shaderObject, "topBVHIndex"), scene->bvhTranslator.topLevelIndex);
+			glUniform1i(glGetUniformLocation(shaderObject, "nodeTexWidthLog2"), scene->bvhTranslator.nodeTexLayout.widthLog2);
+			glUniform1i(glGetUniformLocation(shaderObject, "indicesTexWidthLog2"), scene->indicesTexLayout.widthLog2);
+			glUniform1i(glGetUniformLocation(shaderObject, "triDataTexWidthLog2"), scene->triDataTexLayout.widthLog2);
 			glUniform2f(glGetUniformLocation(shaderObject, "screenResolution"), frameSize.x, frameSize.y);
 			glUniform1i(glGetUniformLocation(shaderObject, "numOfLights"), numOfLights);
 			glUniform1i(glGetUniformLocation(shaderObject, "accumTexture"), 0);
@@ -179,6 +185,13 @@ namespace GLSLPT
 			pathTraceShaderLowRes->Deactive();
 		}
 
+		BindTextures();
+
+		return true;
+    }
+
+    void TiledRenderer::BindTextures()
+    {
 		glActiveTexture(GL_TEXTURE1);
         bvhTex->Active();
 		glActiveTexture(GL_TEXTURE2);
@@ -215,6 +228,8 @@ namespace GLSLPT
         if (hdrConditionalDistTex) {
             hdrConditionalDistTex->Active();
         }
+
+		glActiveTexture(GL_TEXTURE0);
     }
 
     void TiledRenderer::Dispose()
@@ -293,9 +308,11 @@ namespace GLSLPT
 			quad->Draw(outputShader);
 		}
 
-		scene->hdrModified       = false;
-		scene->instancesModified = false;
-		scene->camera->isMoving  = false;
+		scene->hdrModified          = false;
+		scene->instancesModified    = false;
+		scene->meshesModified       = false;
+		scene->meshTopologyModified = false;
+		scene->camera->isMoving     = false;
     }
 
     float TiledRenderer::GetProgress() const
@@ -310,8 +327,29 @@ namespace GLSLPT
 
     void TiledRenderer::Update(float secondsElapsed)
     {
+		if (!initialized) {
+			return;
+		}
+
 		Renderer::Update(secondsElapsed);
 
+		// A rebuilt BVH can move the top level and resize the textures
+		if (scene->meshTopologyModified)
+		{
+			BindTextures();
+
+			Program* shaders[] = { pathTraceShader, pathTraceShaderLowRes };
+			for (Program* shader : shaders)
+			{
+				shader->Active();
+				glUniform1i(glGetUniformLocation(shader->Object(), "topBVHIndex"), scene->bvhTranslator.topLevelIndex);
+				glUniform1i(glGetUniformLocation(shader->Object(), "nodeTexWidthLog2"), scene->bvhTranslator.nodeTexLayout.widthLog2);
+				glUniform1i(glGetUniformLocation(shader->Object(), "indicesTexWidthLog2"), scene->indicesTexLayout.widthLog2);
+				glUniform1i(glGetUniformLocation(shader->Object(), "triDataTexWidthLog2"), scene->triDataTexLayout.widthLog2);
+				shader->Deactive();
+			}
+		}
+
 		float r1;
 		float r2;
 		float r3;
@@ -12,7 +12,7 @@ namespace GLSLPT
         TiledRenderer(Scene* scene, const std::string& shadersDirectory);
         ~TiledRenderer();
         
-        void Init();
+        bool Init();
         void Dispose();
 
         void Render();
@@ -21,6 +21,9 @@ namespace GLSLPT
         int GetSampleCount() const;
 
 	private:
+		// Binds the scene textures to the units the shaders sample them from
+		void BindTextures();
+
 		GLuint pathTraceFBO;
 		GLuint pathTraceFBOLowRes;
 		GLuint accumFBO;
@@ -0,0 +1,123 @@
+﻿/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#include <thread>
+
+#include "TaskGroup.h"
+#include "TaskThreadPool.h"
+#include "ThreadTask.h"
+
+class TaskGroup::GroupTask : public ThreadTask
+{
+public:
+
+	GroupTask(const std::function<void()>& inFunc)
+		: func(inFunc)
+		, done(false)
+	{
+
+	}
+
+	virtual void DoThreadedWork() override
+	{
+		func();
+		done = true;
+	}
+
+	virtual void Abandon() override
+	{
+		done = true;
+	}
+
+	std::function<void()>	func;
+	std::atomic<bool>		done;
+};
+
+TaskGroup::TaskGroup(TaskThreadPool* pool)
+	: m_Pool(pool)
+{
+
+}
+
+TaskGroup::~TaskGroup()
+{
+	Wait();
+}
+
+void TaskGroup::Run(const std::function<void()>& func)
+{
+	if (m_Pool == nullptr)
+	{
+		func();
+		return;
+	}
+
+	GroupTask* task = new GroupTask(func);
+	m_Tasks.push_back(task);
+	m_Pool->AddTask(task);
+}
+
+void TaskGroup::Wait()
+{
+	// Tasks still sitting in the queue are pulled back and executed here,
+	// so a worker waiting on its own children never starves the pool.
+	for (int32 i = (int32)m_Tasks.size() - 1; i >= 0; --i)
+	{
+		GroupTask* task = m_Tasks[i];
+
+		if (m_Pool->RetractTask(task)) 
+		{
+			task->DoThreadedWork();
+		}
+
+		while (!task->done) {
+			std::this_thread::yield();
+		}
+
+		delete task;
+	}
+
+	m_Tasks.clear();
+}
+
+void TaskGroup::ParallelFor(TaskThreadPool* pool, int32 count, int32 grainSize, const std::function<void(int32, int32)>& func)
+{
+	if (count <= 0) {
+		return;
+	}
+
+	grainSize = MMath::Max(grainSize, 1);
+
+	TaskGroup group(pool);
+
+	int32 start = 0;
+	while (count - start > grainSize)
+	{
+		int32 end = start + grainSize;
+		group.Run([&func, start, end]() { func(start, end); });
+		start = end;
+	}
+
+	func(start, count);
+
+	group.Wait();
+}
@@ -0,0 +1,54 @@
+﻿/**********************************************************************
+Copyright (c) 2020 BobLChen
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+********************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <functional>
+
+#include "math/Math.h"
+
+class TaskThreadPool;
+
+class TaskGroup
+{
+public:
+
+	TaskGroup(TaskThreadPool* pool);
+
+	virtual ~TaskGroup();
+
+	void Run(const std::function<void()>& func);
+
+	void Wait();
+
+	static void ParallelFor(TaskThreadPool* pool, int32 count, int32 grainSize, const std::function<void(int32, int32)>& func);
+
+protected:
+
+	class GroupTask;
+
+	TaskThreadPool*				m_Pool;
+	std::vector<GroupTask*>		m_Tasks;
+
+};
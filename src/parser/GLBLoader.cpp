@@ -167,7 +167,11 @@ namespace GLSLPT
 		std::string error;
 		std::string warning;
 
-		gltfContext.LoadBinaryFromFile(&gltfModel, &error, &warning, filename);
+		if (!gltfContext.LoadBinaryFromFile(&gltfModel, &error, &warning, filename))
+		{
+			printf("Couldn't load %s: %s\n", filename.c_str(), error.c_str());
+			return false;
+		}
 
 		// load textures
 		std::vector<int> textures;
@@ -436,8 +440,6 @@ namespace GLSLPT
 		Vector3 at     = center;
 		scene->AddCamera(eye, at, 60.0f);
 
-		scene->CreateAccelerationStructures();
-
-		return true;
+		return scene->CreateAccelerationStructures();
 	}
 }
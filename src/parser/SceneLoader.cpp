@@ -212,6 +212,7 @@ namespace GLSLPT
             if (strstr(line, "Renderer"))
             {
                 char envMap[200] = "None";
+                char bvhCache[200] = "None";
 
                 while (fgets(line, s_MAX_LINE_LENGTH, file))
                 {
@@ -226,6 +227,12 @@ namespace GLSLPT
                     sscanf(line, " maxDepth %i", &renderOptions.maxDepth);
                     sscanf(line, " numTilesX %i", &renderOptions.numTilesX);
                     sscanf(line, " numTilesY %i", &renderOptions.numTilesY);
+                    sscanf(line, " rebraidBudget %f", &renderOptions.rebraidBudget);
+                    sscanf(line, " bvhCache %s", bvhCache);
+                }
+
+                if (strcmp(bvhCache, "None") != 0) {
+                    renderOptions.bvhCacheDir = rootPath + bvhCache;
                 }
 
                 if (strcmp(envMap, "None") != 0)
@@ -244,6 +251,12 @@ namespace GLSLPT
                 Vector3 scale;
                 Matrix4x4 xform;
                 int materialID = 0; // Default Material ID
+                BvhType bvhType = SPLIT_BVH;
+                int leafSize = 4;
+                float intersectionCost = 1.0f;
+                int treeletSize = 0;
+                RadeonRays::Bvh::NodeLayout nodeLayout = RadeonRays::Bvh::kBuildOrder;
+                bool bvhOptions = false;
 
                 while (fgets(line, s_MAX_LINE_LENGTH, file))
                 {
@@ -254,6 +267,8 @@ namespace GLSLPT
                     
                     char file[2048];
                     char matName[100];
+                    char bvhName[100];
+                    char layoutName[100];
 
                     if (sscanf(line, " file %s", file) == 1) {
                         filename = file;
@@ -272,15 +287,84 @@ namespace GLSLPT
                         }
                     }
 
+                    if (sscanf(line, " bvh %s", bvhName) == 1)
+                    {
+                        bvhOptions = true;
+                        if (strcmp(bvhName, "split") == 0) {
+                            bvhType = SPLIT_BVH;
+                        }
+                        else if (strcmp(bvhName, "sah") == 0) {
+                            bvhType = SAH_BVH;
+                        }
+                        else if (strcmp(bvhName, "lbvh") == 0) {
+                            bvhType = LINEAR_BVH;
+                        }
+                        else if (strcmp(bvhName, "ploc") == 0) {
+                            bvhType = PLOC_BVH;
+                        }
+                        else if (strcmp(bvhName, "esc") == 0) {
+                            bvhType = EARLY_SPLIT_BVH;
+                        }
+                        else {
+                            printf("Unknown bvh type %s\n", bvhName);
+                        }
+                    }
+
+                    if (sscanf(line, " layout %s", layoutName) == 1)
+                    {
+                        bvhOptions = true;
+                        if (strcmp(layoutName, "build") == 0) {
+                            nodeLayout = RadeonRays::Bvh::kBuildOrder;
+                        }
+                        else if (strcmp(layoutName, "dfs") == 0) {
+                            nodeLayout = RadeonRays::Bvh::kDepthFirst;
+                        }
+                        else if (strcmp(layoutName, "hot") == 0) {
+                            nodeLayout = RadeonRays::Bvh::kHotChildFirst;
+                        }
+                        else if (strcmp(layoutName, "bfs") == 0) {
+                            nodeLayout = RadeonRays::Bvh::kBreadthFirstTop;
+                        }
+                        else if (strcmp(layoutName, "veb") == 0) {
+                            nodeLayout = RadeonRays::Bvh::kVanEmdeBoas;
+                        }
+                        else {
+                            printf("Unknown node layout %s\n", layoutName);
+                        }
+                    }
+
+                    if (sscanf(line, " leafsize %i", &leafSize) == 1 ||
+                        sscanf(line, " intersectioncost %f", &intersectionCost) == 1 ||
+                        sscanf(line, " treelets %i", &treeletSize) == 1) {
+                        bvhOptions = true;
+                    }
+
                     sscanf(line, " position %f %f %f", &xform.m[3][0], &xform.m[3][1], &xform.m[3][2]);
                     sscanf(line, " scale %f %f %f", &xform.m[0][0], &xform.m[1][1], &xform.m[2][2]);
                 }
 
                 if (!filename.empty())
                 {
+                    int numMeshes = (int)scene->meshes.size();
                     int meshID = scene->AddMesh(rootPath + filename);
                     if (meshID != -1)
                     {
+                        // Blocks of the same file share one mesh, its BVH is built with the
+                        // options of the block that added it
+                        Mesh* mesh = scene->meshes[meshID];
+                        if (meshID == numMeshes)
+                        {
+                            mesh->SetBvhType(bvhType);
+                            mesh->SetLeafParams(leafSize, intersectionCost);
+                            mesh->SetTreeletOptimization(treeletSize);
+                            mesh->SetNodeLayout(nodeLayout);
+                        }
+                        else if (bvhOptions && (mesh->bvhType != bvhType || mesh->maxLeafSize != leafSize ||
+                            mesh->intersectionCost != intersectionCost || mesh->treeletSize != treeletSize ||
+                            mesh->nodeLayout != nodeLayout))
+                        {
+                            printf("Ignoring the bvh options of another instance of %s, it keeps those of its first mesh block\n", filename.c_str());
+                        }
 						std::string baseName = filename.substr(filename.find_last_of("/\\") + 1);
                         scene->AddMeshInstance(MeshInstance(meshID, xform, materialID, baseName));
                     }
@@ -297,8 +381,9 @@ namespace GLSLPT
         
 		renderOptions.frameSize = renderOptions.windowSize;
 
-        scene->CreateAccelerationStructures();
+        // The BVH options of the Renderer block apply to the build
+        scene->renderOptions = renderOptions;
 
-        return true;
+        return scene->CreateAccelerationStructures();
     }
 }
@@ -9,7 +9,7 @@
 
 namespace GLSLPT
 {
-	void LoadBoyTestScene(const std::string& rootPath, Scene* scene, RenderOptions &renderOptions)
+	bool LoadBoyTestScene(const std::string& rootPath, Scene* scene, RenderOptions &renderOptions)
 	{
 		renderOptions.maxDepth  = 6;
 		renderOptions.numTilesY = 4;
@@ -136,6 +136,6 @@ namespace GLSLPT
 		scene->AddMeshInstance(instance12);
 		scene->AddMeshInstance(instance13);
 
-		scene->CreateAccelerationStructures();
+		return scene->CreateAccelerationStructures();
 	}
 }
@@ -9,7 +9,7 @@
 
 namespace GLSLPT
 {
-	void LoadCornellTestScene(const std::string& rootPath, Scene* scene, RenderOptions &renderOptions)
+	bool LoadCornellTestScene(const std::string& rootPath, Scene* scene, RenderOptions &renderOptions)
 	{
 		renderOptions.maxDepth  = 6;
 		renderOptions.numTilesY = 4;
@@ -69,6 +69,6 @@ namespace GLSLPT
 		scene->AddMeshInstance(instance6);
 		scene->AddMeshInstance(instance7);
 
-		scene->CreateAccelerationStructures();
+		return scene->CreateAccelerationStructures();
 	}
 }